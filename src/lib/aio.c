@@ -0,0 +1,197 @@
+/*
+ * aio.c
+ *
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#include "aio.h"
+#include "file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct s_aio_task {
+    aio_ring *r;
+    aio_sqe sqe;
+};
+
+// Run one request with the blocking call behind it
+static void aio_run(aio_ring *r, const aio_sqe *sqe, aio_cqe *cqe) {
+    filesystem *fs = r->fs;
+    file_handle *fh;
+
+    cqe->user_data = sqe->user_data;
+    cqe->rc = OK;
+    cqe->res = 0;
+    switch (sqe->op) {
+    case AioOpen:
+        if ((cqe->res = file_open_fd(fs, sqe->path, sqe->flags)) < 0)
+            cqe->rc = ErrPath;
+        break;
+    case AioClose:
+        cqe->rc = file_close_fd(sqe->fd);
+        break;
+    case AioRead:
+    case AioWrite:
+        if ((fh = file_from_fd(sqe->fd)) == NULL || !sqe->buf) {
+            file_put(fh);
+            cqe->rc = ErrArg;
+            break;
+        }
+        cqe->res = (int32_t)(sqe->op == AioRead ? file_read(fh, sqe->buf, sqe->len)
+                                                : file_write(fh, sqe->buf, sqe->len));
+        file_put(fh);
+        break;
+    case AioStat:
+        cqe->rc = sqe->st ? fs_stat(fs, sqe->path, sqe->st) : ErrArg;
+        break;
+    case AioTouch:
+        cqe->rc = fs_touch(fs, sqe->path);
+        break;
+    case AioUnlink:
+        cqe->rc = fs_unlink(fs, sqe->path);
+        break;
+    case AioMkdir:
+        cqe->rc = fs_mkdir(fs, sqe->path);
+        break;
+    case AioCall:
+        cqe->rc = sqe->call ? sqe->call(sqe->arg, &cqe->res) : ErrArg;
+        break;
+    default:
+        fprintf(stderr, "aio_run error: unknown op [%d]\n", sqe->op);
+        cqe->rc = ErrArg;
+        break;
+    }
+}
+
+// Post a completion, there is always room since inflight never passes depth
+static void aio_complete(aio_ring *r, const aio_cqe *cqe) {
+    pthread_mutex_lock(&r->lock);
+    r->cq[(r->cq_head + r->cq_count) % r->depth] = *cqe;
+    r->cq_count++;
+    uint64_t one = 1;
+    if (write(r->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "aio_complete error: failed to signal event fd\n");
+    }
+    pthread_cond_broadcast(&r->cq_cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void aio_task(void *varg) {
+    struct s_aio_task *task = (struct s_aio_task *)varg;
+    aio_cqe cqe;
+    aio_run(task->r, &task->sqe, &cqe);
+    aio_complete(task->r, &cqe);
+    free(task);
+}
+
+aio_ring *aio_create(filesystem *fs, uint32_t workers, uint32_t depth) {
+    if (!fs || depth == 0 || depth > AIO_MAX_DEPTH) {
+        fprintf(stderr, "aio_create error: wrong args...\n");
+        return NULL;
+    }
+
+    aio_ring *r = (aio_ring *)calloc(1, sizeof(aio_ring));
+    if (!r) {
+        fprintf(stderr, "aio_create error: failed to allocate ring\n");
+        return NULL;
+    }
+    r->fs = fs;
+    r->depth = depth;
+    r->cq = (aio_cqe *)malloc(depth * sizeof(aio_cqe));
+    r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!r->cq || r->event_fd < 0 || (r->p = pool_create(workers)) == NULL) {
+        fprintf(stderr, "aio_create error: failed to set up ring\n");
+        if (r->event_fd >= 0)
+            close(r->event_fd);
+        free(r->cq);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cq_cond, NULL);
+
+    return r;
+}
+
+RC aio_submit(aio_ring *r, const aio_sqe *sqes, uint32_t count, uint32_t *submitted) {
+    if (!r || (!sqes && count) || !submitted) {
+        fprintf(stderr, "aio_submit error: wrong args...\n");
+        return ErrArg;
+    }
+
+    // Reserve completion slots first, the queue is full when every slot is taken
+    pthread_mutex_lock(&r->lock);
+    uint32_t take = r->depth - r->inflight;
+    if (take > count)
+        take = count;
+    r->inflight += take;
+    pthread_mutex_unlock(&r->lock);
+
+    for (uint32_t i=0; i<take; i++) {
+        struct s_aio_task *task = (struct s_aio_task *)malloc(sizeof(struct s_aio_task));
+        if (task) {
+            task->r = r;
+            task->sqe = sqes[i];
+            if (pool_submit(r->p, aio_task, task) == OK)
+                continue;
+            free(task);
+        }
+        // The slot is reserved, the failure comes back as a completion
+        aio_cqe cqe = { .user_data = sqes[i].user_data, .rc = ErrNoMem, .res = 0 };
+        aio_complete(r, &cqe);
+    }
+
+    *submitted = take;
+    return OK;
+}
+
+uint32_t aio_reap(aio_ring *r, aio_cqe *out, uint32_t max, uint32_t min_complete) {
+    if (!r || !out || max == 0) {
+        fprintf(stderr, "aio_reap error: wrong args...\n");
+        return 0;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    while (r->cq_count < min_complete && r->cq_count < r->inflight)
+        pthread_cond_wait(&r->cq_cond, &r->lock);
+
+    uint32_t n = r->cq_count < max ? r->cq_count : max;
+    for (uint32_t i=0; i<n; i++)
+        out[i] = r->cq[(r->cq_head + i) % r->depth];
+    r->cq_head = (r->cq_head + n) % r->depth;
+    r->cq_count -= n;
+    r->inflight -= n;
+
+    // Completions post under the lock, so an empty queue means nothing is pending on the fd
+    if (r->cq_count == 0) {
+        uint64_t drained;
+        ssize_t got = read(r->event_fd, &drained, sizeof(drained)); // EAGAIN if already clear
+        (void)got;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return n;
+}
+
+int aio_event_fd(aio_ring *r) {
+    return r ? r->event_fd : -1;
+}
+
+void aio_destroy(aio_ring *r) {
+    if (!r) {
+        return;
+    }
+
+    pool_destroy(r->p);
+    close(r->event_fd);
+    pthread_cond_destroy(&r->cq_cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r->cq);
+    free(r);
+}
@@ -0,0 +1,112 @@
+/*
+ * aio.h
+ * Asynchronous front end, submission and completion queues over fs_api and file
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#ifndef MY_AIO_H_
+#define MY_AIO_H_
+
+#include "error.h"
+#include "fs.h"
+#include "fs_api.h"
+#include "pool.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AIO_MAX_DEPTH 65536 // Requests in flight, submitted but not reaped
+
+typedef enum {
+    AioOpen,   // path, flags         -> res is the descriptor
+    AioClose,  // fd
+    AioRead,   // fd, buf, len        -> res is bytes read
+    AioWrite,  // fd, buf, len        -> res is bytes written
+    AioStat,   // path, st
+    AioTouch,  // path
+    AioUnlink, // path
+    AioMkdir,  // path
+    AioCall    // call(arg, &res) on a worker, rc is what it returns
+} aio_op;
+
+typedef RC (*aio_call_fn)(void *arg, int32_t *res);
+
+/*
+ * One request, path, buf and st belong to the caller until its completion is reaped
+ *  read and write use and move the descriptor offset like read(2)/write(2),
+ *  requests on one descriptor may run in any order, open a descriptor per stream
+ * */
+typedef struct {
+    aio_op op;
+    uint64_t user_data; // Copied to the completion untouched
+    const char *path;
+    int32_t fd;
+    uint32_t flags;
+    uint8_t *buf;
+    uint32_t len;
+    f_stat *st;
+    aio_call_fn call;   // Any other blocking call, see AioCall
+    void *arg;
+} aio_sqe;
+
+typedef struct {
+    uint64_t user_data;
+    RC rc;
+    int32_t res;
+} aio_cqe;
+
+struct s_aio_ring {
+    filesystem *fs;
+    pool *p;           // Runs the requests, its deques are the submission queue
+
+    pthread_mutex_t lock;
+    pthread_cond_t cq_cond; // Signalled on every completion
+    aio_cqe *cq;       // Ring buffer of depth entries
+    uint32_t cq_head;
+    uint32_t cq_count;
+    uint32_t depth;
+    uint32_t inflight; // Submitted and not reaped yet, never above depth
+    int event_fd;      // eventfd(2) bumped on every completion, for epoll
+};
+typedef struct s_aio_ring aio_ring;
+
+/*
+ * Create a ring running requests on workers threads, at most depth requests in flight
+ *  NULL on failure
+ * */
+aio_ring *aio_create(filesystem *fs, uint32_t workers, uint32_t depth);
+
+/*
+ * Queue count requests, *submitted says how many were taken
+ *  fewer than count are taken when the ring is full, reap and submit the rest
+ * */
+RC aio_submit(aio_ring *r, const aio_sqe *sqes, uint32_t count, uint32_t *submitted);
+
+/*
+ * Move up to max completions to out, return how many
+ *  waits until min_complete are ready, or until nothing is in flight, 0 never waits
+ * */
+uint32_t aio_reap(aio_ring *r, aio_cqe *out, uint32_t max, uint32_t min_complete);
+
+/*
+ * Readable whenever completions may be ready, add it to epoll/poll
+ *  aio_reap resets it once the completion queue is empty
+ * */
+int aio_event_fd(aio_ring *r);
+
+/*
+ * Wait for every request in flight, then free the ring, unreaped completions are dropped
+ * */
+void aio_destroy(aio_ring *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
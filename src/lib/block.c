@@ -92,26 +92,121 @@ void *bl_get_data(block* bl) {
 }
 
 uint32_t bl_alloc(filesystem *fs) {
+    return bl_alloc_goal(fs, 0);
+}
+
+// Take bitmap index idx, with alloc_lock held, returns the 1-based block number
+static uint32_t bl_take_locked(filesystem *fs, uint32_t idx) {
+    if (bm_setbit(fs->block_bitmap, idx)) { // bm_setbit return 0 means success
+        return 0;
+    }
+    fs_mark_bitmap_dirty(fs, fs->block_bitmap, idx);
+    return idx + 1; // convert to 1-based
+}
+
+// First aligned window of BL_GOAL_WINDOW free blocks from start on, wrapping, with alloc_lock held
+// returns the index of its first block, fs->blocks when there is none
+static uint32_t bl_find_window_locked(filesystem *fs, uint32_t start) {
+    uint32_t windows = fs->blocks / BL_GOAL_WINDOW;
+    for (uint32_t i=0; i<windows; i++) {
+        uint32_t first = ((start / BL_GOAL_WINDOW + 1 + i) % windows) * BL_GOAL_WINDOW;
+        uint32_t n = 0;
+        while (n < BL_GOAL_WINDOW && !bm_getbit(fs->block_bitmap, first+n))
+            n++;
+        if (n == BL_GOAL_WINDOW)
+            return first;
+    }
+    return fs->blocks;
+}
+
+uint32_t bl_alloc_goal(filesystem *fs, uint32_t goal) {
     if (!fs) {
         fprintf(stderr, "bl_alloc error: a non null pointer is needed...\n");
         return 0;
     }
 
-    uint32_t block_number;
-    for (block_number=0; block_number < fs->blocks; block_number++) {
-        if (!bm_getbit(fs->block_bitmap, block_number)) {
-            if (!bm_setbit(fs->block_bitmap, block_number)) // bm_setbit return 0 means success
-                return block_number + 1; // convert to 1-based
-            else
-                return 0;
+    uint32_t block_number = 0;
+    uint32_t start = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (goal > 0 && goal <= fs->blocks) {
+        start = goal-1; // 1-based goal to 0-based bitmap index
+        if (!bm_getbit(fs->block_bitmap, start)) {
+            block_number = bl_take_locked(fs, start);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            return block_number;
+        }
+
+        // Someone else took the goal, start a fresh window rather than the next free
+        // block, or two files growing side by side would interleave block by block
+        uint32_t idx = bl_find_window_locked(fs, start);
+        if (idx < fs->blocks) {
+            block_number = bl_take_locked(fs, idx);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            return block_number;
+        }
+    }
+
+    // First free block from start on, wrapping around
+    for (uint32_t i=0; i<fs->blocks; i++) {
+        uint32_t idx = (start + i) % fs->blocks;
+        if (!bm_getbit(fs->block_bitmap, idx)) {
+            block_number = bl_take_locked(fs, idx);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            return block_number;
         }
     }
+    pthread_mutex_unlock(&fs->alloc_lock);
 
     fprintf(stderr, "bl_alloc error: could not find a available block...\n");
 
     return 0;
 }
 
+uint32_t bl_alloc_run(filesystem *fs, uint32_t want, uint32_t *got) {
+    if (!fs || !got || want == 0) {
+        fprintf(stderr, "bl_alloc_run error: wrong args...\n");
+        return 0;
+    }
+    *got = 0;
+
+    // First fit, but prefer a free run long enough for the whole request
+    uint32_t best_start = 0, best_len = 0;
+    uint32_t idx = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (idx < fs->blocks) {
+        if (bm_getbit(fs->block_bitmap, idx)) {
+            idx++;
+            continue;
+        }
+
+        uint32_t start = idx, len = 0;
+        while (idx < fs->blocks && len < want && !bm_getbit(fs->block_bitmap, idx)) {
+            idx++;
+            len++;
+        }
+        if (len > best_len) {
+            best_start = start;
+            best_len = len;
+        }
+        if (best_len == want)
+            break;
+    }
+
+    for (uint32_t n=0; n<best_len; n++) {
+        bm_setbit(fs->block_bitmap, best_start+n);
+        fs_mark_bitmap_dirty(fs, fs->block_bitmap, best_start+n);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if (best_len == 0) {
+        fprintf(stderr, "bl_alloc_run error: could not find a available block...\n");
+        return 0;
+    }
+
+    *got = best_len;
+    return best_start + 1; // convert to 1-based
+}
+
 RC bl_free(filesystem *fs, uint32_t block_number) {
     if (!fs || block_number <= 0 || block_number > fs->blocks) {
         fprintf(stderr, "bl_free error: wrong args, block_number [%d]...\n", block_number);
@@ -119,15 +214,127 @@ RC bl_free(filesystem *fs, uint32_t block_number) {
     }
 
     // convert to 0-based
-    if (bm_unsetbit(fs->block_bitmap, block_number-1) < 0) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (fs->block_refs && fs->block_refs[block_number-1] > 0) {
+        // Still owned by a clone, only drop this reference
+        fs->block_refs[block_number-1]--;
+        fs_mark_refs_dirty(fs, block_number-1);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return OK;
+    }
+    if (bm_unsetbit(fs->block_bitmap, block_number-1) != 0) {
+        pthread_mutex_unlock(&fs->alloc_lock);
         fprintf(stderr, "bl_free error: could not unset bitmap index at [%d]",
                 (int)block_number);
         return ErrBmOpe;
     }
+    fs_mark_bitmap_dirty(fs, fs->block_bitmap, block_number-1);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return OK;
+}
+
+static int bl_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+RC bl_free_batch(filesystem *fs, const uint32_t *block_numbers, uint32_t count) {
+    if (!fs || (!block_numbers && count)) {
+        fprintf(stderr, "bl_free_batch error: wrong args...\n");
+        return ErrArg;
+    }
+
+    if (count == 0) {
+        return OK;
+    }
+
+    // Blocks whose bit really goes to 0, for discard
+    uint32_t released[count];
+    uint32_t released_count = 0;
+    RC ret = OK;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (uint32_t n=0; n<count; n++) {
+        uint32_t block_number = block_numbers[n];
+        if (block_number == 0)
+            continue;
+
+        if (block_number > fs->blocks) {
+            fprintf(stderr, "bl_free_batch error: wrong block_number [%d]...\n", block_number);
+            ret = ErrArg;
+            continue;
+        }
+
+        if (fs->block_refs && fs->block_refs[block_number-1] > 0) {
+            fs->block_refs[block_number-1]--;
+            fs_mark_refs_dirty(fs, block_number-1);
+            continue;
+        }
+
+        bm_unsetbit(fs->block_bitmap, block_number-1);
+        fs_mark_bitmap_dirty(fs, fs->block_bitmap, block_number-1);
+        released[released_count++] = block_number;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if (!fs->discard || released_count == 0) {
+        return ret;
+    }
+
+    qsort(released, released_count, sizeof(uint32_t), bl_cmp);
+    for (uint32_t n=0; n<released_count; ) {
+        uint32_t len = 1;
+        while (n+len < released_count && released[n+len] == released[n]+len)
+            len++;
+        ddiscard(fs->dd, released[n], len);
+        n += len;
+    }
+
+    return ret;
+}
+
+RC bl_ref(filesystem *fs, uint32_t block_number) {
+    if (!fs || block_number <= 0 || block_number > fs->blocks) {
+        fprintf(stderr, "bl_ref error: wrong args, block_number [%d]...\n", block_number);
+        return ErrArg;
+    }
+
+    if (!fs->block_refs) {
+        fprintf(stderr, "bl_ref error: disk has no refcount table, format it again\n");
+        return ErrInternal;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (!bm_getbit(fs->block_bitmap, block_number-1)) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        fprintf(stderr, "bl_ref error: block [%d] is not allocated\n", block_number);
+        return ErrArg;
+    }
+    if (fs->block_refs[block_number-1] == UINT16_MAX) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        fprintf(stderr, "bl_ref error: block [%d] has too many owners\n", block_number);
+        return ErrNoSpace;
+    }
+    fs->block_refs[block_number-1]++;
+    fs_mark_refs_dirty(fs, block_number-1);
+    pthread_mutex_unlock(&fs->alloc_lock);
 
     return OK;
 }
 
+uint8_t bl_is_shared(filesystem *fs, uint32_t block_number) {
+    if (!fs || !fs->block_refs || block_number <= 0 || block_number > fs->blocks) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    uint8_t shared = fs->block_refs[block_number-1] > 0;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return shared;
+}
+
 RC bl_clean(filesystem *fs, uint32_t block_number) {
     if (!fs || block_number <= 0 || block_number > fs->blocks) {
         fprintf(stderr, "bl_clean error: wrong args...\n");
@@ -19,6 +19,8 @@
 extern "C" {
 #endif
 
+#define BL_GOAL_WINDOW 16 // bl_alloc_goal moves to an aligned run this long when its goal is taken
+
 typedef enum {
     BlockTypeSuper,
     BlockTypeInode,
@@ -54,6 +56,11 @@ struct s_superblock_data {
     
     uint32_t free_blocks;         // 空闲块数（用于快速检查）
     uint32_t free_inodes;         // 空闲 inode 数
+
+    uint32_t refcount_start;      // block 共享计数表起始块号, 0 表示没有
+    uint32_t refcount_bl_count;
+
+    uint32_t version;             // 磁盘布局版本, FsVersion, 旧镜像为 0
 };
 typedef struct s_superblock_data superblock_data;
 
@@ -72,10 +79,31 @@ void *bl_get_data(block* bl);
 // This will edit block bitmap
 uint32_t bl_alloc(filesystem *fs);
 
-// Free a block
+// Allocate the block goal (1-based), or when it is taken the first block of the next
+// BL_GOAL_WINDOW aligned free blocks, or failing both the first free block after goal
+// goal 0 (or past the end) behaves like bl_alloc
+// This will edit block bitmap
+uint32_t bl_alloc_goal(filesystem *fs, uint32_t goal);
+
+// Allocate up to WANT physically contiguous blocks, return the first block number
+// *got is set to the run length, which may be shorter than WANT
+// This will edit block bitmap
+uint32_t bl_alloc_run(filesystem *fs, uint32_t want, uint32_t *got);
+
+// Free a block, a shared block only drops one reference
 // This will edit block bitmap
 RC bl_free(filesystem *fs, uint32_t block_number);
 
+// Free many blocks with one bitmap lock round trip, zeros in the list are skipped
+// with fs->discard set, runs really released are punched out of the disk image
+RC bl_free_batch(filesystem *fs, const uint32_t *block_numbers, uint32_t count);
+
+// Add one owner to an allocated block, used by clone
+RC bl_ref(filesystem *fs, uint32_t block_number);
+
+// Whether a block has more than one owner, write to it must copy first
+uint8_t bl_is_shared(filesystem *fs, uint32_t block_number);
+
 // Write 0 to disk
 RC bl_clean(filesystem *fs, uint32_t block_number);
 
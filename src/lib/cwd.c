@@ -15,6 +15,9 @@
 
 cwd_context_t g_cwd = {0};
 
+// Per thread cwd, 0 means the thread follows g_cwd
+static __thread uint32_t t_cwd_inode_num = 0;
+
 RC cwd_init(filesystem *fs, uint32_t root_inode_num) {
     if (!fs) {
         fprintf(stderr, "cwd_init error: wrong args...\n");
@@ -22,7 +25,7 @@ RC cwd_init(filesystem *fs, uint32_t root_inode_num) {
     }
 
     g_cwd.fs = fs;
-    g_cwd.cwd_inode_num = root_inode_num;
+    __atomic_store_n(&g_cwd.cwd_inode_num, root_inode_num, __ATOMIC_RELEASE);
     if (ino_read(fs, root_inode_num, &g_cwd.cached_cwd_inode) != OK) {
         fprintf(stderr, "cwd_init error: failed to read root inode: %d\n",
                 root_inode_num);
@@ -43,10 +46,51 @@ RC cwd_init(filesystem *fs, uint32_t root_inode_num) {
 }
 
 uint32_t cwd_get_inode() {
-    pthread_rwlock_rdlock(&g_cwd.rwlock);
-    uint32_t inode_num = g_cwd.cwd_inode_num;
-    pthread_rwlock_unlock(&g_cwd.rwlock);
-    return inode_num;
+    if (t_cwd_inode_num != 0) {
+        return t_cwd_inode_num;
+    }
+    // Writers publish with a release store, no lock on the lookup path
+    return __atomic_load_n(&g_cwd.cwd_inode_num, __ATOMIC_ACQUIRE);
+}
+
+RC cwd_thread_chdir_inode(filesystem *fs, uint32_t inode_num) {
+    if (!fs || inode_num == 0) {
+        fprintf(stderr, "cwd_thread_chdir_inode error: wrong args\n");
+        return ErrArg;
+    }
+
+    inode ino;
+    if (ino_read(fs, inode_num, &ino) != OK || ino.file_type != FTypeDirectory) {
+        fprintf(stderr, "cwd_thread_chdir_inode error: inode [%d] is not a directory\n",
+                inode_num);
+        return ErrInode;
+    }
+
+    t_cwd_inode_num = inode_num;
+    return OK;
+}
+
+RC cwd_thread_chdir_path(filesystem *fs, const char *path_str) {
+    if (!fs || !path_str) {
+        fprintf(stderr, "cwd_thread_chdir_path error: wrong args\n");
+        return ErrArg;
+    }
+
+    // Relative paths start from this thread's cwd
+    inode ino;
+    uint32_t inode_num = path_resolve(fs, path_str, &ino);
+    if (inode_num == 0 || ino.file_type != FTypeDirectory) {
+        fprintf(stderr, "cwd_thread_chdir_path error: [%s] is not a directory\n",
+                path_str);
+        return ErrPath;
+    }
+
+    t_cwd_inode_num = inode_num;
+    return OK;
+}
+
+void cwd_thread_reset() {
+    t_cwd_inode_num = 0;
 }
 
 void cwd_get_path(path *p) {
@@ -118,7 +162,7 @@ RC cwd_chdir_inode(uint32_t new_inode_num) {
         memcpy(new_p.components[depth-i-1], reverse_components[i], MAX_FILENAME_LEN);
 
     pthread_rwlock_wrlock(&g_cwd.rwlock);
-    g_cwd.cwd_inode_num = new_inode_num;
+    __atomic_store_n(&g_cwd.cwd_inode_num, new_inode_num, __ATOMIC_RELEASE);
     g_cwd.cache_valid = 0;
 
     memcpy(&g_cwd.p, &new_p, sizeof(struct s_path));
@@ -137,6 +181,7 @@ RC cwd_chdir_path(const char *path_str) {
     if (path_parse(path_str, &p) != OK) {
         fprintf(stderr, "cwd_chdir_path error: failed to parse path_str [%s] to path structure\n",
                 path_str);
+        return ErrName;
     }
 
     pthread_rwlock_wrlock(&g_cwd.rwlock);
@@ -144,6 +189,7 @@ RC cwd_chdir_path(const char *path_str) {
         if (ino_read(g_cwd.fs, g_cwd.cwd_inode_num, &g_cwd.cached_cwd_inode) != OK) {
             fprintf(stderr, "cwd_chdir_path error: failed to cache g_cwd inode [%d]\n",
                     g_cwd.cwd_inode_num);
+            pthread_rwlock_unlock(&g_cwd.rwlock);
             return ErrInode;
         }
         g_cwd.cache_valid = 1;
@@ -170,16 +216,23 @@ RC cwd_chdir_path(const char *path_str) {
         return ErrPath;
     }
 
+    // Cache the target, not the directory the lookup started from
+    if (ino_read(&fs, inode_num, &ino) != OK || ino.file_type != FTypeDirectory) {
+        fprintf(stderr, "cwd_chdir_path error: [%s] is not a directory\n", path_str);
+        return ErrPath;
+    }
+
     pthread_rwlock_wrlock(&g_cwd.rwlock);
     if (p.is_absolute) {
         memcpy(&g_cwd.p, &p, sizeof(struct s_path));
     } else {
         if (path_merge(&g_cwd.p, &p) != OK) {
             fprintf(stderr, "cwd_chdir_path error: failed to merge path\n");
+            pthread_rwlock_unlock(&g_cwd.rwlock);
             return ErrInternal;
         }
     }
-    g_cwd.cwd_inode_num = inode_num;
+    __atomic_store_n(&g_cwd.cwd_inode_num, inode_num, __ATOMIC_RELEASE);
     memcpy(&g_cwd.cached_cwd_inode, &ino, sizeof(struct s_inode));
     g_cwd.cache_valid = 1;
     pthread_rwlock_unlock(&g_cwd.rwlock);
@@ -22,7 +22,7 @@ extern "C" {
 struct s_cwd_context {
     filesystem *fs;
 
-    uint32_t cwd_inode_num;
+    uint32_t cwd_inode_num; // Loaded and stored atomically, the rest is under rwlock
     inode cached_cwd_inode;
     uint8_t cache_valid;
 
@@ -39,10 +39,26 @@ extern cwd_context_t g_cwd;
 RC cwd_init(filesystem *fs, uint32_t root_inode_num);
 
 /*
- * Get current cwd inode number
+ * Get current cwd inode number, the calling thread's own cwd if it set one
+ * never takes a lock, relative lookups call it on every path
  * */
 uint32_t cwd_get_inode();
 
+/*
+ * Change the calling thread's cwd only, other threads keep theirs or the global one
+ * */
+RC cwd_thread_chdir_inode(filesystem *fs, uint32_t inode_num);
+
+/*
+ * Like cwd_thread_chdir_inode, relative path_str starts from this thread's cwd
+ * */
+RC cwd_thread_chdir_path(filesystem *fs, const char *path_str);
+
+/*
+ * Drop the calling thread's cwd, it follows the global cwd again
+ * */
+void cwd_thread_reset();
+
 /*
  * Get current cwd path
  * */
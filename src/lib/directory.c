@@ -13,6 +13,7 @@
 #include "block.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 uint32_t dir_lookup(filesystem *fs, inode *dir_ino, const uint8_t *name) {
@@ -20,11 +21,19 @@ uint32_t dir_lookup(filesystem *fs, inode *dir_ino, const uint8_t *name) {
         return 0;
     }
 
-    if (dir_ino->file_type != FTypeDirectory) { // Must be a directory inode
+    if (dirent_check_valid_name(name) == ErrName) { // Is a valid name
         return 0;
     }
 
-    if (dirent_check_valid_name(name) == ErrName) { // Is a valid name
+    return dir_lookup_n(fs, dir_ino, (const char *)name, strlen((const char *)name));
+}
+
+uint32_t dir_lookup_n(filesystem *fs, inode *dir_ino, const char *name, uint32_t len) {
+    if (!fs || !dir_ino || !name || len == 0 || len >= MAX_FILENAME_LEN) {
+        return 0;
+    }
+
+    if (dir_ino->file_type != FTypeDirectory) { // Must be a directory inode
         return 0;
     }
 
@@ -35,27 +44,35 @@ uint32_t dir_lookup(filesystem *fs, inode *dir_ino, const uint8_t *name) {
         fprintf(stderr, "dir_lookup error: could not get dirent_per_block...\n");
         return 0;
     }
-    dirent dirent_list[dirent_per_block];
-    uint32_t block_number, ino_block_offset = 0, max_ino_block_offset = ino_get_max_block_offset(fs);
+    uint32_t max_ino_block_offset = ino_get_max_block_offset(fs);
+
+    // One read of the indirect block instead of one per offset
+    uint32_t map[max_ino_block_offset];
+    if (ino_get_block_map(fs, dir_ino, map) != OK) {
+        fprintf(stderr, "dir_lookup error: could not read block map of inode [%d]\n",
+                dir_ino->inode_number);
+        return 0;
+    }
 
     // Check direntry in blocks
     for (uint32_t n=0; n<max_ino_block_offset; n++) {
-        block_number = ino_get_block_at(fs, dir_ino, ino_block_offset++);
+        uint32_t block_number = map[n] & INO_BLOCK_MASK;
         if (block_number == 0)
             continue;
-            
+
         if (dread(fs->dd, block_buf, block_number) != OK) {
             fprintf(stderr, "dir_lookup error: could not read block from block_number: %d\n",
                     block_number);
             return 0;
         }
-        memcpy(dirent_list, block_buf, block_size);
+        dirent *dirent_list = (dirent *)block_buf;
         for (uint32_t j=0; j<dirent_per_block; j++) {
             if (dirent_list[j].inode_num == 0) { // Not allocated
                 continue;
             }
-            if (strcmp((char*)dirent_list[j].name, (char*)name) == 0) {
-                return dirent_list[j].inode_num;
+            if (dirent_list[j].name[len] == '\0' &&
+                memcmp(dirent_list[j].name, name, len) == 0) {
+                return dirent_inode(&dirent_list[j]);
             }
         }
     }
@@ -89,7 +106,7 @@ RC dir_lookup_by_id(filesystem *fs, inode *dir_ino, uint8_t *buf, uint32_t inode
         }
         dirent *dirent_list = (dirent *)block_buf;
         for (uint32_t j=0; j<dirent_per_block; j++) {
-            if (dirent_list[j].inode_num == inode_num) {
+            if (dirent_list[j].inode_num != 0 && dirent_inode(&dirent_list[j]) == inode_num) {
                 memset(buf, 0, MAX_FILENAME_LEN);
                 memcpy(buf, dirent_list[j].name, MAX_FILENAME_LEN);
                 return OK;
@@ -100,92 +117,115 @@ RC dir_lookup_by_id(filesystem *fs, inode *dir_ino, uint8_t *buf, uint32_t inode
     return ErrNotFound;
 }
 
-RC dir_add(filesystem *fs, inode *dir_ino, const uint8_t *name, uint32_t inode_num) {
+static pthread_mutex_t *dir_lock_of(filesystem *fs, uint32_t dir_inode_num) {
+    return &fs->dir_locks[dir_inode_num % DIR_LOCK_STRIPES];
+}
+
+static RC dir_add_nolock(filesystem *fs, inode *dir_ino, const uint8_t *name, uint32_t inode_num,
+                         filetype type) {
     if (!fs || !dir_ino || !name || dirent_check_valid_name(name) != OK
             || inode_num <= 0 || inode_num > fs->inodes) {
         fprintf(stderr, "dir_add error: wrong args...\n");
         return ErrArg;
     }
 
-    // Lock directory operations to prevent race conditions
-    pthread_mutex_lock(&fs->dir_lock);
-
     if (dir_lookup(fs, dir_ino, name) != 0) {// Check whether this name already added
         fprintf(stderr, "dir_add error: entry '%s' already exists\n", name);
-        pthread_mutex_unlock(&fs->dir_lock);
         return ErrDirentExists;
     }
 
-    // Check free space
+    // Find a free slot, reuse holes left by dir_remove first
     uint32_t dirent_size = sizeof(struct s_dirent);
+    uint32_t dirent_per_block = get_dirent_per_block(fs);
     uint32_t max_block_offset = ino_get_max_block_offset(fs);
-    uint32_t block_number;
-    uint32_t block_used_space = dir_ino->file_size % fs->dd->block_size; 
     uint32_t block_size = fs->dd->block_size;
     uint8_t  block_buf[block_size];
-    uint32_t dir_store_pos;
-    if (block_used_space == 0) { // No free space, allocate a new one
-        for (uint32_t n=0; n<max_block_offset; n++) {
-            if ((block_number = ino_alloc_block_at(fs, dir_ino, n)) != 0) { // Suc to allocate
-                if (bl_clean(fs, block_number) != OK) {
-                    fprintf(stderr, "dir_add error: failed to clean block\n");
-                    pthread_mutex_unlock(&fs->dir_lock);
-                    return ErrDwrite;
-                }
-                break;
-            }
+    uint32_t block_number = 0;
+    uint32_t dir_store_pos = 0;
+    uint32_t free_offset = max_block_offset; // First unallocated block offset
+    uint32_t map[max_block_offset];
+    if (ino_get_block_map(fs, dir_ino, map) != OK) {
+        fprintf(stderr, "dir_add error: could not read block map of inode [%d]\n",
+                dir_ino->inode_number);
+        return ErrInode;
+    }
+
+    for (uint32_t n=0; n<max_block_offset && block_number == 0; n++) {
+        uint32_t candidate = map[n] & INO_BLOCK_MASK;
+        if (candidate == 0) {
+            if (free_offset == max_block_offset)
+                free_offset = n;
+            continue;
         }
-        dir_store_pos = 0;
 
-    } else { // Have space, find that block
-        for (uint32_t n=0; n<max_block_offset; n++) {
-            block_number = ino_get_block_at(fs, dir_ino, n);
-            if (block_number == 0) {
-                continue;
-            } else {
-                // Use hole first
-                dirent *dirent_list;
-                uint32_t dirent_per_block = get_dirent_per_block(fs);
-                if (dread(fs->dd, block_buf, block_number) != OK) {
-                    fprintf(stderr, "dir_add error, failed to dread from block_number: %d\n",
-                            (int)block_number);
-                    pthread_mutex_unlock(&fs->dir_lock);
-                    return ErrDread;
-                }
-                dirent_list = (dirent*)block_buf;
-                for (uint32_t j=0; j<dirent_per_block; j++) {
-                    if (dirent_list[j].inode_num == 0) {
-                        dir_store_pos = dirent_size*j;
-                        break;
-                    }
-                }
+        if (dread(fs->dd, block_buf, candidate) != OK) {
+            fprintf(stderr, "dir_add error, failed to dread from block_number: %d\n",
+                    (int)candidate);
+            return ErrDread;
+        }
+        dirent *dirent_list = (dirent*)block_buf;
+        for (uint32_t j=0; j<dirent_per_block; j++) {
+            if (dirent_list[j].inode_num == 0) {
+                block_number = candidate;
+                dir_store_pos = dirent_size*j;
                 break;
             }
         }
     }
-    if (dread(fs->dd, block_buf, block_number) != OK) {
-        fprintf(stderr, "dir_add error, failed to dread from block_number: %d\n",
-                (int)block_number);
-        pthread_mutex_unlock(&fs->dir_lock);
-        return ErrDread;
+
+    if (block_number == 0) { // Every block is full, allocate a new one, it comes back zeroed
+        if (free_offset == max_block_offset ||
+            (block_number = ino_alloc_block_at(fs, dir_ino, free_offset)) == 0) {
+            fprintf(stderr, "dir_add error: directory inode [%d] is full\n",
+                    dir_ino->inode_number);
+            return ErrNoSpace;
+        }
+        memset(block_buf, 0, block_size);
+        dir_store_pos = 0;
     }
-    dirent new_dirent = {.inode_num = inode_num};
+
+    dirent new_dirent = {.inode_num = dirent_pack(inode_num, type)};
     memcpy(new_dirent.name, name, strlen((char*)name));
 
     memcpy(block_buf+dir_store_pos, &new_dirent, dirent_size);
     if (dwrite(fs->dd, block_buf, block_number) != OK) {
         fprintf(stderr, "dir_add error, failed to dwrite from block_number: %d\n",
                 (int)block_number);
-        pthread_mutex_unlock(&fs->dir_lock);
         return ErrDwrite;
     }
     dir_ino->file_size += dirent_size;
 
-    pthread_mutex_unlock(&fs->dir_lock);
     return OK;
 }
 
-RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name) {
+// Bring a caller's copy of a directory inode up to date, another thread may have
+// grown the directory since it was read
+static RC dir_refresh(filesystem *fs, inode *dir_ino) {
+    if (ino_read(fs, dir_ino->inode_number, dir_ino) != OK) {
+        fprintf(stderr, "dir_refresh error: failed to read directory inode [%d]\n",
+                dir_ino->inode_number);
+        return ErrInode;
+    }
+    return OK;
+}
+
+RC dir_add(filesystem *fs, inode *dir_ino, const uint8_t *name, uint32_t inode_num, filetype type) {
+    if (!fs || !dir_ino) {
+        fprintf(stderr, "dir_add error: wrong args...\n");
+        return ErrArg;
+    }
+
+    // Lock this directory to prevent race conditions, the inode is read and written under it
+    pthread_mutex_t *lock = dir_lock_of(fs, dir_ino->inode_number);
+    pthread_mutex_lock(lock);
+    RC rc = dir_refresh(fs, dir_ino);
+    if (rc == OK && (rc = dir_add_nolock(fs, dir_ino, name, inode_num, type)) == OK)
+        rc = ino_write(fs, dir_ino->inode_number, dir_ino);
+    pthread_mutex_unlock(lock);
+    return rc;
+}
+
+static RC dir_remove_nolock(filesystem *fs, inode *dir_ino, const uint8_t *name) {
     if (!fs || !dir_ino || !name || dirent_check_valid_name(name) != OK) {
         fprintf(stderr, "dir_remove error: wrong args...\n");
         return ErrArg;
@@ -196,14 +236,10 @@ RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name) {
         return ErrArg;
     }
 
-    // Lock directory operations to prevent race conditions
-    pthread_mutex_lock(&fs->dir_lock);
-
     uint32_t inode_num;
     // 查找条目
     if ((inode_num = dir_lookup(fs, dir_ino, name)) == 0) {
         fprintf(stderr, "dir_remove error: entry '%s' not found\n", name);
-        pthread_mutex_unlock(&fs->dir_lock);
         return ErrNotFound;
     }
 
@@ -225,7 +261,6 @@ RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name) {
         // 读取块
         if (dread(fs->dd, block_buf, block_number) != OK) {
             fprintf(stderr, "dir_remove error: failed to read block %u\n", block_number);
-            pthread_mutex_unlock(&fs->dir_lock);
             return ErrDread;
         }
 
@@ -246,7 +281,6 @@ RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name) {
                 // 写回磁盘
                 if (dwrite(fs->dd, block_buf, block_number) != OK) {
                     fprintf(stderr, "dir_remove error: failed to write block %u\n", block_number);
-                    pthread_mutex_unlock(&fs->dir_lock);
                     return ErrDwrite;
                 }
 
@@ -259,7 +293,6 @@ RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name) {
                 // 这里我们保持 file_size 不变，允许空洞
                 // dir_ino->file_size -= dirent_size;
 
-                pthread_mutex_unlock(&fs->dir_lock);
                 return OK;
             }
         }
@@ -267,10 +300,594 @@ RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name) {
 
     // 理论上不应该到这里（dir_lookup 已经确认存在）
     fprintf(stderr, "dir_remove error: inconsistent state\n");
-    pthread_mutex_unlock(&fs->dir_lock);
     return ErrInternal;
 }
 
+RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name) {
+    if (!fs || !dir_ino) {
+        fprintf(stderr, "dir_remove error: wrong args...\n");
+        return ErrArg;
+    }
+
+    // Lock this directory to prevent race conditions
+    pthread_mutex_t *lock = dir_lock_of(fs, dir_ino->inode_number);
+    pthread_mutex_lock(lock);
+    RC rc = dir_refresh(fs, dir_ino);
+    if (rc == OK)
+        rc = dir_remove_nolock(fs, dir_ino, name);
+    pthread_mutex_unlock(lock);
+    return rc;
+}
+
+// Point an existing entry at another inode of the same type in place, the entry never disappears
+static RC dir_set_entry_nolock(filesystem *fs, inode *dir_ino, const uint8_t *name, uint32_t inode_num) {
+    uint32_t block_size = fs->dd->block_size;
+    uint8_t block_buf[block_size];
+    uint32_t dirent_per_block = get_dirent_per_block(fs);
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    uint32_t map[max_offset];
+    if (ino_get_block_map(fs, dir_ino, map) != OK) {
+        fprintf(stderr, "dir_set_entry error: could not read block map of inode [%d]\n",
+                dir_ino->inode_number);
+        return ErrInode;
+    }
+
+    for (uint32_t offset = 0; offset < max_offset; offset++) {
+        uint32_t block_number = map[offset] & INO_BLOCK_MASK;
+        if (block_number == 0) {
+            continue;
+        }
+        if (dread(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_set_entry error: failed to read block %u\n", block_number);
+            return ErrDread;
+        }
+
+        dirent *dirent_list = (dirent *)block_buf;
+        for (uint32_t j = 0; j < dirent_per_block; j++) {
+            if (dirent_list[j].inode_num != 0 &&
+                strcmp((char*)dirent_list[j].name, (char*)name) == 0) {
+                dirent_list[j].inode_num = dirent_pack(inode_num, dirent_type(&dirent_list[j]));
+                if (dwrite(fs->dd, block_buf, block_number) != OK) {
+                    fprintf(stderr, "dir_set_entry error: failed to write block %u\n", block_number);
+                    return ErrDwrite;
+                }
+                return OK;
+            }
+        }
+    }
+
+    fprintf(stderr, "dir_set_entry error: entry '%s' not found\n", name);
+    return ErrNotFound;
+}
+
+static uint8_t dir_is_dot_name(const uint8_t *name) {
+    return strcmp((const char*)name, ".") == 0 || strcmp((const char*)name, "..") == 0;
+}
+
+// Whether directory inode_num is dir_num itself or one of its ancestors
+static uint8_t dir_is_ancestor(filesystem *fs, uint32_t inode_num, uint32_t dir_num) {
+    inode ino;
+    uint32_t cur = dir_num;
+    for (uint32_t depth = 0; depth < fs->inodes; depth++) {
+        if (cur == inode_num) {
+            return 1;
+        }
+        if (ino_read(fs, cur, &ino) != OK) {
+            return 1; // Can not tell, refuse the move
+        }
+        uint32_t parent = dir_lookup(fs, &ino, (const uint8_t*)"..");
+        if (parent == 0 || parent == cur) { // Root
+            return 0;
+        }
+        cur = parent;
+    }
+    return 1;
+}
+
+// Sort the stripe locks by address and take each distinct one once
+static void dir_lock_sorted(pthread_mutex_t **locks, uint32_t n) {
+    for (uint32_t i=1; i<n; i++) {
+        for (uint32_t j=i; j>0 && locks[j-1] > locks[j]; j--) {
+            pthread_mutex_t *tmp = locks[j-1];
+            locks[j-1] = locks[j];
+            locks[j] = tmp;
+        }
+    }
+    for (uint32_t i=0; i<n; i++) {
+        if (i == 0 || locks[i] != locks[i-1])
+            pthread_mutex_lock(locks[i]);
+    }
+}
+
+// Release what dir_lock_sorted took, the array is still sorted
+static void dir_unlock_sorted(pthread_mutex_t **locks, uint32_t n) {
+    for (uint32_t i=n; i>0; i--) {
+        if (i == 1 || locks[i-1] != locks[i-2])
+            pthread_mutex_unlock(locks[i-1]);
+    }
+}
+
+// Body of dir_rename, the directory locks (and a moved directory's lock) are held
+static RC dir_rename_nolock(filesystem *fs, inode *old_dir, const uint8_t *old_name,
+                            inode *new_dir, const uint8_t *new_name, uint32_t *replaced) {
+    uint32_t new_num = new_dir->inode_number;
+    uint8_t cross = old_dir->inode_number != new_num;
+    inode src_ino, dst_ino;
+    uint32_t src_num = dir_lookup(fs, old_dir, old_name);
+    uint32_t dst_num = dir_lookup(fs, new_dir, new_name);
+    if (src_num == 0) {
+        fprintf(stderr, "dir_rename error: entry '%s' not found\n", old_name);
+        return ErrNotFound;
+    }
+    if (src_num == dst_num) { // Same file, nothing to do
+        return OK;
+    }
+    if (ino_read(fs, src_num, &src_ino) != OK) {
+        return ErrInode;
+    }
+
+    // A directory can not move below itself
+    if (cross && src_ino.file_type == FTypeDirectory && dir_is_ancestor(fs, src_num, new_num)) {
+        fprintf(stderr, "dir_rename error: can not move '%s' into itself\n", old_name);
+        return ErrArg;
+    }
+
+    RC rc;
+    if (dst_num != 0) {
+        // Only a file replaces a file, the new name never stops resolving
+        if (ino_read(fs, dst_num, &dst_ino) != OK) {
+            return ErrInode;
+        }
+        if (src_ino.file_type != FTypeFile || dst_ino.file_type != FTypeFile) {
+            fprintf(stderr, "dir_rename error: entry '%s' already exists\n", new_name);
+            return ErrDirentExists;
+        }
+        if ((rc = dir_set_entry_nolock(fs, new_dir, new_name, src_num)) != OK) {
+            return rc;
+        }
+        *replaced = dst_num;
+    } else if ((rc = dir_add_nolock(fs, new_dir, new_name, src_num, src_ino.file_type)) != OK) {
+        return rc;
+    }
+
+    if ((rc = dir_remove_nolock(fs, old_dir, old_name)) != OK) {
+        return rc;
+    }
+
+    if (cross && src_ino.file_type == FTypeDirectory) {
+        return dir_set_entry_nolock(fs, &src_ino, (const uint8_t*)"..", new_num);
+    }
+    return OK;
+}
+
+RC dir_rename(filesystem *fs, inode *old_dir, const uint8_t *old_name,
+              inode *new_dir, const uint8_t *new_name, uint32_t *replaced) {
+    if (!fs || !old_dir || !old_name || !new_dir || !new_name || !replaced ||
+        dirent_check_valid_name(old_name) != OK || dirent_check_valid_name(new_name) != OK ||
+        dir_is_dot_name(old_name) || dir_is_dot_name(new_name) ||
+        old_dir->file_type != FTypeDirectory || new_dir->file_type != FTypeDirectory) {
+        fprintf(stderr, "dir_rename error: wrong args...\n");
+        return ErrArg;
+    }
+    *replaced = 0;
+
+    uint32_t old_num = old_dir->inode_number;
+    uint32_t new_num = new_dir->inode_number;
+    if (old_num == new_num && old_dir != new_dir) {
+        fprintf(stderr, "dir_rename error: pass the same inode for one directory\n");
+        return ErrArg;
+    }
+
+    // Cross directory renames are serialized so no other move changes the tree under
+    // the ancestor check, then the entry locks are taken in stripe order
+    uint8_t cross = old_num != new_num;
+    pthread_mutex_t *locks[3] = {dir_lock_of(fs, old_num), dir_lock_of(fs, new_num), NULL};
+    uint32_t nlocks = 2;
+    if (cross)
+        pthread_mutex_lock(&fs->rename_lock);
+
+    RC rc;
+    for (;;) {
+        dir_lock_sorted(locks, nlocks);
+        rc = dir_refresh(fs, old_dir);
+        if (rc == OK && new_dir != old_dir)
+            rc = dir_refresh(fs, new_dir);
+        if (rc != OK || !cross)
+            break;
+
+        // A moved directory gets its ".." rewritten, so its own stripe is needed too,
+        // the entry can change while no lock is held, look it up again after relocking
+        inode src_ino;
+        uint32_t src_num = dir_lookup(fs, old_dir, old_name);
+        if (src_num == 0 || ino_read(fs, src_num, &src_ino) != OK ||
+            src_ino.file_type != FTypeDirectory)
+            break;
+        pthread_mutex_t *src_lock = dir_lock_of(fs, src_num);
+        uint8_t held = 0;
+        for (uint32_t i=0; i<nlocks; i++)
+            held |= locks[i] == src_lock;
+        if (held)
+            break;
+        dir_unlock_sorted(locks, nlocks);
+        locks[0] = dir_lock_of(fs, old_num);
+        locks[1] = dir_lock_of(fs, new_num);
+        locks[2] = src_lock;
+        nlocks = 3;
+    }
+
+    if (rc == OK && (rc = dir_rename_nolock(fs, old_dir, old_name, new_dir, new_name, replaced)) == OK) {
+        rc = ino_write(fs, old_num, old_dir);
+        if (rc == OK && new_dir != old_dir)
+            rc = ino_write(fs, new_num, new_dir);
+    }
+
+    dir_unlock_sorted(locks, nlocks);
+    if (cross)
+        pthread_mutex_unlock(&fs->rename_lock);
+    return rc;
+}
+
+struct s_dir_batch_name {
+    const char *name;
+    uint32_t index; // Position in the caller's arrays
+};
+
+static int dir_batch_name_cmp(const void *a, const void *b) {
+    const struct s_dir_batch_name *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+    if (c != 0)
+        return c;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+// Sort the names that pass keep (results[i] == OK), equal names end up adjacent in caller order
+static struct s_dir_batch_name *dir_batch_sort(const char *const *names, const RC *results,
+                                               uint32_t count, uint32_t *sorted_count) {
+    struct s_dir_batch_name *sorted = malloc((count ? count : 1) * sizeof(struct s_dir_batch_name));
+    if (!sorted) {
+        return NULL;
+    }
+    uint32_t n = 0;
+    for (uint32_t i=0; i<count; i++) {
+        if (results && results[i] != OK)
+            continue;
+        sorted[n].name = names[i];
+        sorted[n].index = i;
+        n++;
+    }
+    qsort(sorted, n, sizeof(struct s_dir_batch_name), dir_batch_name_cmp);
+    *sorted_count = n;
+    return sorted;
+}
+
+// First sorted position whose name is not below name
+static uint32_t dir_batch_lower(const struct s_dir_batch_name *sorted, uint32_t count,
+                                const char *name) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(sorted[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void dir_batch_check_names(const char *const *names, uint32_t count, RC *results) {
+    for (uint32_t i=0; i<count; i++) {
+        if (!names[i] || strlen(names[i]) >= MAX_FILENAME_LEN ||
+            dirent_check_valid_name((const uint8_t *)names[i]) != OK ||
+            dir_is_dot_name((const uint8_t *)names[i]))
+            results[i] = ErrName;
+        else
+            results[i] = OK;
+    }
+}
+
+RC dir_lookup_batch(filesystem *fs, inode *dir_ino, const char *const *names, uint32_t count,
+                    uint32_t *inode_nums) {
+    if (!fs || !dir_ino || (count && (!names || !inode_nums)) ||
+        dir_ino->file_type != FTypeDirectory) {
+        fprintf(stderr, "dir_lookup_batch error: wrong args...\n");
+        return ErrArg;
+    }
+    memset(inode_nums, 0, count * sizeof(uint32_t));
+
+    uint32_t sorted_count;
+    struct s_dir_batch_name *sorted = dir_batch_sort(names, NULL, count, &sorted_count);
+    if (!sorted) {
+        fprintf(stderr, "dir_lookup_batch error: failed to alloc memory\n");
+        return ErrNoMem;
+    }
+
+    uint32_t block_size = fs->dd->block_size;
+    uint8_t block_buf[block_size];
+    uint32_t dirent_per_block = get_dirent_per_block(fs);
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    uint32_t map[max_offset];
+    if (ino_get_block_map(fs, dir_ino, map) != OK) {
+        fprintf(stderr, "dir_lookup_batch error: could not read block map of inode [%d]\n",
+                dir_ino->inode_number);
+        free(sorted);
+        return ErrInode;
+    }
+
+    // One pass over the directory answers every name
+    for (uint32_t n=0; n<max_offset; n++) {
+        uint32_t block_number = map[n] & INO_BLOCK_MASK;
+        if (block_number == 0)
+            continue;
+        if (dread(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_lookup_batch error: failed to read block [%d]\n", block_number);
+            free(sorted);
+            return ErrDread;
+        }
+        dirent *dirent_list = (dirent *)block_buf;
+        for (uint32_t j=0; j<dirent_per_block; j++) {
+            if (dirent_list[j].inode_num == 0)
+                continue;
+            const char *name = (const char *)dirent_list[j].name;
+            for (uint32_t k=dir_batch_lower(sorted, sorted_count, name);
+                 k<sorted_count && strcmp(sorted[k].name, name) == 0; k++)
+                inode_nums[sorted[k].index] = dirent_inode(&dirent_list[j]);
+        }
+    }
+
+    free(sorted);
+    return OK;
+}
+
+// A free dirent slot found by the scan, block offset and index in the block
+struct s_dir_batch_slot {
+    uint32_t offset;
+    uint32_t slot;
+};
+
+static RC dir_add_batch_nolock(filesystem *fs, inode *dir_ino, const char *const *names,
+                               const uint32_t *inode_nums, filetype type, uint32_t count,
+                               RC *results) {
+    uint32_t sorted_count;
+    struct s_dir_batch_name *sorted = dir_batch_sort(names, results, count, &sorted_count);
+    struct s_dir_batch_slot *slots = malloc((count ? count : 1) * sizeof(struct s_dir_batch_slot));
+    if (!sorted || !slots) {
+        fprintf(stderr, "dir_add_batch error: failed to alloc memory\n");
+        free(sorted);
+        free(slots);
+        return ErrNoMem;
+    }
+    // The batch itself may name one entry twice, the first one wins
+    for (uint32_t k=1; k<sorted_count; k++) {
+        if (strcmp(sorted[k].name, sorted[k-1].name) == 0)
+            results[sorted[k].index] = ErrDirentExists;
+    }
+
+    uint32_t dirent_size = sizeof(struct s_dirent);
+    uint32_t block_size = fs->dd->block_size;
+    uint8_t block_buf[block_size];
+    uint32_t dirent_per_block = get_dirent_per_block(fs);
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    uint32_t map[max_offset];
+    if (ino_get_block_map(fs, dir_ino, map) != OK) {
+        fprintf(stderr, "dir_add_batch error: could not read block map of inode [%d]\n",
+                dir_ino->inode_number);
+        free(sorted);
+        free(slots);
+        return ErrInode;
+    }
+
+    // One scan finds the names already taken and enough free slots for the rest
+    RC rc = OK;
+    uint32_t free_slots = 0;
+    for (uint32_t n=0; n<max_offset && rc == OK; n++) {
+        uint32_t block_number = map[n] & INO_BLOCK_MASK;
+        if (block_number == 0)
+            continue;
+        if (dread(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_add_batch error: failed to read block [%d]\n", block_number);
+            rc = ErrDread;
+            break;
+        }
+        dirent *dirent_list = (dirent *)block_buf;
+        for (uint32_t j=0; j<dirent_per_block; j++) {
+            if (dirent_list[j].inode_num == 0) {
+                if (free_slots < count) {
+                    slots[free_slots].offset = n;
+                    slots[free_slots].slot = j;
+                    free_slots++;
+                }
+                continue;
+            }
+            const char *name = (const char *)dirent_list[j].name;
+            for (uint32_t k=dir_batch_lower(sorted, sorted_count, name);
+                 k<sorted_count && strcmp(sorted[k].name, name) == 0; k++)
+                results[sorted[k].index] = ErrDirentExists;
+        }
+    }
+    free(sorted);
+
+    // Fill the free slots block by block, each block is written once
+    uint32_t next = 0, used = 0, added = 0;
+    while (rc == OK && used < free_slots) {
+        while (next < count && results[next] != OK)
+            next++;
+        if (next == count)
+            break;
+        uint32_t offset = slots[used].offset;
+        uint32_t block_number = map[offset] & INO_BLOCK_MASK;
+        if (dread(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_add_batch error: failed to read block [%d]\n", block_number);
+            rc = ErrDread;
+            break;
+        }
+        for (; used < free_slots && slots[used].offset == offset && next < count; used++) {
+            dirent *d = (dirent *)(block_buf + slots[used].slot * dirent_size);
+            memset(d, 0, dirent_size);
+            d->inode_num = dirent_pack(inode_nums[next], type);
+            memcpy(d->name, names[next], strlen(names[next]));
+            added++;
+            for (next++; next < count && results[next] != OK; next++)
+                ;
+        }
+        if (dwrite(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_add_batch error: failed to write block [%d]\n", block_number);
+            rc = ErrDwrite;
+        }
+    }
+    free(slots);
+
+    // The rest go into new blocks, filled in memory and written once each
+    for (uint32_t n=0; n<max_offset && rc == OK; n++) {
+        while (next < count && results[next] != OK)
+            next++;
+        if (next == count)
+            break;
+        if ((map[n] & INO_BLOCK_MASK) != 0)
+            continue;
+        uint32_t block_number = ino_alloc_block_at(fs, dir_ino, n);
+        if (block_number == 0) {
+            break;
+        }
+        memset(block_buf, 0, block_size);
+        for (uint32_t j=0; j<dirent_per_block && next < count; j++) {
+            dirent *d = (dirent *)(block_buf + j * dirent_size);
+            d->inode_num = dirent_pack(inode_nums[next], type);
+            memcpy(d->name, names[next], strlen(names[next]));
+            added++;
+            for (next++; next < count && results[next] != OK; next++)
+                ;
+        }
+        if (dwrite(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_add_batch error: failed to write block [%d]\n", block_number);
+            rc = ErrDwrite;
+        }
+    }
+    dir_ino->file_size += added * dirent_size;
+
+    // Whatever is left did not fit
+    for (; next < count; next++) {
+        if (results[next] == OK)
+            results[next] = rc == OK ? ErrNoSpace : rc;
+    }
+
+    return rc;
+}
+
+RC dir_add_batch(filesystem *fs, inode *dir_ino, const char *const *names,
+                 const uint32_t *inode_nums, filetype type, uint32_t count, RC *results) {
+    if (!fs || !dir_ino || (count && (!names || !inode_nums || !results))) {
+        fprintf(stderr, "dir_add_batch error: wrong args...\n");
+        return ErrArg;
+    }
+    dir_batch_check_names(names, count, results);
+    for (uint32_t i=0; i<count; i++) {
+        if (results[i] == OK && (inode_nums[i] == 0 || inode_nums[i] > fs->inodes))
+            results[i] = ErrArg;
+    }
+
+    pthread_mutex_t *lock = dir_lock_of(fs, dir_ino->inode_number);
+    pthread_mutex_lock(lock);
+    RC rc = dir_refresh(fs, dir_ino);
+    if (rc == OK && dir_ino->file_type != FTypeDirectory)
+        rc = ErrArg;
+    if (rc == OK && (rc = dir_add_batch_nolock(fs, dir_ino, names, inode_nums, type, count, results)) == OK)
+        rc = ino_write(fs, dir_ino->inode_number, dir_ino);
+    pthread_mutex_unlock(lock);
+    return rc;
+}
+
+static RC dir_remove_batch_nolock(filesystem *fs, inode *dir_ino, const char *const *names,
+                                  uint32_t count, uint32_t *inode_nums, RC *results) {
+    uint32_t sorted_count;
+    struct s_dir_batch_name *sorted = dir_batch_sort(names, results, count, &sorted_count);
+    if (!sorted) {
+        fprintf(stderr, "dir_remove_batch error: failed to alloc memory\n");
+        return ErrNoMem;
+    }
+    for (uint32_t k=0; k<sorted_count; k++)
+        results[sorted[k].index] = ErrNotFound;
+
+    uint32_t block_size = fs->dd->block_size;
+    uint8_t block_buf[block_size];
+    uint32_t dirent_per_block = get_dirent_per_block(fs);
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    uint32_t map[max_offset];
+    if (ino_get_block_map(fs, dir_ino, map) != OK) {
+        fprintf(stderr, "dir_remove_batch error: could not read block map of inode [%d]\n",
+                dir_ino->inode_number);
+        free(sorted);
+        return ErrInode;
+    }
+
+    // Clear every matching entry in one pass, a block is written once whatever it lost
+    RC rc = OK;
+    for (uint32_t n=0; n<max_offset && rc == OK; n++) {
+        uint32_t block_number = map[n] & INO_BLOCK_MASK;
+        if (block_number == 0)
+            continue;
+        if (dread(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_remove_batch error: failed to read block [%d]\n", block_number);
+            rc = ErrDread;
+            break;
+        }
+        uint8_t dirty = 0;
+        dirent *dirent_list = (dirent *)block_buf;
+        for (uint32_t j=0; j<dirent_per_block; j++) {
+            if (dirent_list[j].inode_num == 0)
+                continue;
+            const char *name = (const char *)dirent_list[j].name;
+            uint32_t k = dir_batch_lower(sorted, sorted_count, name);
+            if (k == sorted_count || strcmp(sorted[k].name, name) != 0)
+                continue;
+            uint32_t index = sorted[k].index; // Repeats of the name stay ErrNotFound
+            filetype type = dirent_type(&dirent_list[j]);
+            if (type == FTypeNotValid) { // Written before entries recorded their type
+                inode child;
+                if (ino_read(fs, dirent_inode(&dirent_list[j]), &child) != OK) {
+                    results[index] = ErrInode;
+                    continue;
+                }
+                type = child.file_type;
+            }
+            if (type == FTypeDirectory) {
+                results[index] = ErrArg;
+                continue;
+            }
+            inode_nums[index] = dirent_inode(&dirent_list[j]);
+            results[index] = OK;
+            memset(&dirent_list[j], 0, sizeof(struct s_dirent));
+            dirty = 1;
+        }
+        if (dirty && dwrite(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "dir_remove_batch error: failed to write block [%d]\n", block_number);
+            rc = ErrDwrite;
+        }
+    }
+
+    free(sorted);
+    return rc;
+}
+
+RC dir_remove_batch(filesystem *fs, inode *dir_ino, const char *const *names, uint32_t count,
+                    uint32_t *inode_nums, RC *results) {
+    if (!fs || !dir_ino || (count && (!names || !inode_nums || !results))) {
+        fprintf(stderr, "dir_remove_batch error: wrong args...\n");
+        return ErrArg;
+    }
+    dir_batch_check_names(names, count, results);
+    memset(inode_nums, 0, count * sizeof(uint32_t));
+
+    pthread_mutex_t *lock = dir_lock_of(fs, dir_ino->inode_number);
+    pthread_mutex_lock(lock);
+    RC rc = dir_refresh(fs, dir_ino);
+    if (rc == OK && dir_ino->file_type != FTypeDirectory)
+        rc = ErrArg;
+    if (rc == OK)
+        rc = dir_remove_batch_nolock(fs, dir_ino, names, count, inode_nums, results);
+    pthread_mutex_unlock(lock);
+    return rc;
+}
+
 RC dir_list(filesystem *fs, inode *dir_ino) {
     if (!fs || !dir_ino) {
         fprintf(stderr, "dir_list error: wrong args...\n");
@@ -312,7 +929,7 @@ RC dir_list(filesystem *fs, inode *dir_ino) {
                 printf("dirent %d:\n"
                        "  inode_num: %d\n"
                        "  name     : %s\n"
-                        , dirent_count, dirent_list[j].inode_num,
+                        , dirent_count, dirent_inode(&dirent_list[j]),
                         (char*)dirent_list[j].name
                 );
             }
@@ -324,6 +941,137 @@ RC dir_list(filesystem *fs, inode *dir_ino) {
     return OK;
 }
 
+dir_iter *dir_open(filesystem *fs, inode *dir_ino) {
+    if (!fs || !dir_ino || dir_ino->file_type != FTypeDirectory) {
+        fprintf(stderr, "dir_open error: wrong args...\n");
+        return NULL;
+    }
+
+    dir_iter *it = calloc(1, sizeof(dir_iter));
+    if (!it) {
+        fprintf(stderr, "dir_open error: failed to alloc iterator\n");
+        return NULL;
+    }
+    it->fs = fs;
+    it->max_offset = ino_get_max_block_offset(fs);
+    it->block_map = malloc(it->max_offset * sizeof(uint32_t));
+    it->block_buf = malloc(fs->dd->block_size);
+    if (!it->block_map || !it->block_buf) {
+        fprintf(stderr, "dir_open error: failed to alloc buffers\n");
+        dir_close(it);
+        return NULL;
+    }
+
+    // Snapshot the map, later lookups never touch the indirect block again
+    if (ino_get_block_map(fs, dir_ino, it->block_map) != OK) {
+        fprintf(stderr, "dir_open error: could not read block map of inode [%d]\n",
+                dir_ino->inode_number);
+        dir_close(it);
+        return NULL;
+    }
+
+    return it;
+}
+
+// Copy up to max entries out of the directory blocks, type is the one the entry recorded
+static RC dir_iter_fill(dir_iter *it, dir_entry_info *out, uint32_t max, uint32_t *count) {
+    uint32_t dirent_per_block = get_dirent_per_block(it->fs);
+    uint32_t n = 0;
+    *count = 0;
+
+    while (n < max) {
+        if (!it->loaded || it->slot >= dirent_per_block) {
+            // Advance to the next allocated directory block
+            uint32_t block_number = 0;
+            while (it->block_offset < it->max_offset &&
+                   (block_number = it->block_map[it->block_offset] & INO_BLOCK_MASK) == 0) {
+                it->block_offset++;
+            }
+            if (it->block_offset >= it->max_offset) {
+                break;
+            }
+            if (dread(it->fs->dd, it->block_buf, block_number) != OK) {
+                fprintf(stderr, "dir_iter error: failed to read block [%d]\n",
+                        block_number);
+                return ErrDread;
+            }
+            it->block_offset++;
+            it->slot = 0;
+            it->loaded = 1;
+        }
+
+        dirent *dirent_list = (dirent *)it->block_buf;
+        for (; it->slot < dirent_per_block && n < max; it->slot++) {
+            if (dirent_list[it->slot].inode_num == 0) {
+                continue;
+            }
+            memcpy(out[n].name, dirent_list[it->slot].name, MAX_FILENAME_LEN);
+            out[n].name[MAX_FILENAME_LEN-1] = '\0';
+            out[n].inode_num = dirent_inode(&dirent_list[it->slot]);
+            out[n].type = dirent_type(&dirent_list[it->slot]);
+            out[n].size = 0;
+            out[n].nlink = 0;
+            n++;
+        }
+    }
+
+    *count = n;
+    return OK;
+}
+
+RC dir_next_names(dir_iter *it, dir_entry_info *out, uint32_t max, uint32_t *count) {
+    if (!it || !out || max == 0 || !count) {
+        fprintf(stderr, "dir_next_names error: wrong args...\n");
+        return ErrArg;
+    }
+
+    return dir_iter_fill(it, out, max, count);
+}
+
+RC dir_next_batch(dir_iter *it, dir_entry_info *out, uint32_t max, uint32_t *count) {
+    if (!it || !out || max == 0 || !count) {
+        fprintf(stderr, "dir_next_batch error: wrong args...\n");
+        return ErrArg;
+    }
+
+    uint32_t n;
+    RC rc = dir_iter_fill(it, out, max, count);
+    if (rc != OK || (n = *count) == 0) {
+        return rc;
+    }
+    *count = 0;
+
+    uint32_t inode_numbers[n];
+    for (uint32_t i=0; i<n; i++)
+        inode_numbers[i] = out[i].inode_num;
+
+    inode inodes[n];
+    if (ino_read_batch(it->fs, inode_numbers, n, inodes) != OK) {
+        fprintf(stderr, "dir_next_batch error: failed to read inodes\n");
+        return ErrInode;
+    }
+    for (uint32_t i=0; i<n; i++) {
+        out[i].type = inodes[i].file_type;
+        out[i].size = inodes[i].file_size;
+        out[i].nlink = ino_nlink(&inodes[i]);
+    }
+
+    *count = n;
+    return OK;
+}
+
+RC dir_close(dir_iter *it) {
+    if (!it) {
+        fprintf(stderr, "dir_close error: wrong args...\n");
+        return ErrArg;
+    }
+
+    free(it->block_map);
+    free(it->block_buf);
+    free(it);
+    return OK;
+}
+
 uint8_t dir_is_empty(filesystem *fs, inode *dir_ino) {
     if (!fs || !dir_ino) {
         fprintf(stderr, "dir_is_empty error: wrong args...\n");
@@ -409,8 +1157,8 @@ uint32_t dir_create_root(filesystem *fs) {
     dir_ino.file_type = FTypeDirectory;
     dir_ino.single_indirect = indirect_blk_num;
 
-    // Add "." entry pointing to itself
-    ret = dir_add(fs, &dir_ino, cur_dir_name, inode_num);
+    // Add "." entry pointing to itself, root is not on disk yet so no lock or refresh
+    ret = dir_add_nolock(fs, &dir_ino, cur_dir_name, inode_num, FTypeDirectory);
     if (ret != OK) {
         fprintf(stderr, "dir_create_root error: failed to add current dir entry...\n");
         bl_free(fs, indirect_blk_num);
@@ -419,7 +1167,7 @@ uint32_t dir_create_root(filesystem *fs) {
     }
 
     // Add ".." entry also pointing to itself (root's parent is itself)
-    ret = dir_add(fs, &dir_ino, parent_dir_name, inode_num);
+    ret = dir_add_nolock(fs, &dir_ino, parent_dir_name, inode_num, FTypeDirectory);
     if (ret != OK) {
         fprintf(stderr, "dir_create_root error: failed to add parent dir entry...\n");
         ino_free_all_blocks(fs, &dir_ino);
@@ -468,7 +1216,7 @@ uint32_t dir_create(filesystem *fs, uint32_t parent_ino) {
         return 0;
     }
 
-    inode_num = ino_alloc(fs);
+    inode_num = ino_alloc_near(fs, parent_ino, FTypeDirectory);
     if (inode_num == 0) {
         fprintf(stderr, "dir_create error: failed to alloc inode number...\n");
         return 0;
@@ -494,7 +1242,8 @@ uint32_t dir_create(filesystem *fs, uint32_t parent_ino) {
     dir_ino.single_indirect = indirect_blk_num;
 
     // Add ".." => inum
-    ret = dir_add(fs, &dir_ino, parent_dir_name, parent_ino);
+    // The new directory is neither on disk nor linked yet, nothing to lock or refresh
+    ret = dir_add_nolock(fs, &dir_ino, parent_dir_name, parent_ino, FTypeDirectory);
     if (ret != OK) {
         fprintf(stderr, "dir_create error: failed to add parent dir entry...\n"
                 "parent_dir_name: %s\n"
@@ -506,7 +1255,7 @@ uint32_t dir_create(filesystem *fs, uint32_t parent_ino) {
         return 0;
     }
     // Add "." => inum
-    ret = dir_add(fs, &dir_ino, cur_dir_name, inode_num);
+    ret = dir_add_nolock(fs, &dir_ino, cur_dir_name, inode_num, FTypeDirectory);
     if (ret != OK) {
         fprintf(stderr, "dir_create error: failed to add current dir entry...\n"
                 "cur_dir_name: %s\n"
@@ -662,7 +1411,7 @@ void dir_show(filesystem *fs, inode *dir_ino) {
                 entry_idx++;
                 printf("%-4u %-10u %-28s",
                        entry_idx,
-                       dirent_list[j].inode_num,
+                       dirent_inode(&dirent_list[j]),
                        (char*)dirent_list[j].name);
 
                 // Mark special entries
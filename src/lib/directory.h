@@ -11,16 +11,51 @@
 
 #include "fs.h"
 #include "inode.h"
+#include "dirent.h"
 #include "error.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+#define DIR_BATCH_ENTRIES 64 // fs_ls lists this many entries per dir_next_batch
+
+/*
+ * One entry returned by dir_next_batch, the inode fields come with it (readdirplus)
+ */
+struct s_dir_entry_info {
+    char name[MAX_FILENAME_LEN];
+    uint32_t inode_num;
+    filetype type;
+    uint32_t size;
+    uint32_t nlink;
+};
+typedef struct s_dir_entry_info dir_entry_info;
+
+/*
+ * Directory iterator, owns a copy of the block map and the current directory block
+ */
+struct s_dir_iter {
+    filesystem *fs;
+    uint32_t *block_map;    // ino_get_block_map layout
+    uint32_t max_offset;
+    uint32_t block_offset;  // Next logical block to read
+    uint32_t slot;          // Next dirent in block_buf
+    uint8_t loaded;         // block_buf holds block_offset-1
+    uint8_t *block_buf;
+};
+typedef struct s_dir_iter dir_iter;
 /*
  * Find the inode number for specifile filename through a directory inode
  */
 uint32_t dir_lookup(filesystem *fs, inode *dir_ino, const uint8_t *name);
 
+/*
+ * Same as dir_lookup, name is LEN bytes and need not be NUL terminated
+ *  used by the path resolver to look up components in place
+ */
+uint32_t dir_lookup_n(filesystem *fs, inode *dir_ino, const char *name, uint32_t len);
+
 
 /*
  * Find dirent name by inode number
@@ -28,20 +63,76 @@ uint32_t dir_lookup(filesystem *fs, inode *dir_ino, const uint8_t *name);
 RC dir_lookup_by_id(filesystem *fs, inode*dir_ino, uint8_t *buf, uint32_t inode_num);
 
 /*
- * Add a new entry to a directory inode
+ * Add a new entry to a directory inode, type is the filetype of inode_num
+ *  dir_ino is refreshed from disk and written back under the directory lock,
+ *  callers must not write their copy back afterwards, dir_remove and dir_rename alike
  */
-RC dir_add(filesystem *fs, inode *dir_ino, const uint8_t *name, uint32_t inode_num);
+RC dir_add(filesystem *fs, inode *dir_ino, const uint8_t *name, uint32_t inode_num, filetype type);
 
 /*
  * Remove an entry from a directory inode
  */
 RC dir_remove(filesystem *fs, inode *dir_ino, const uint8_t *name);
 
+/*
+ * Move entry old_name of old_dir to new_name of new_dir, no data is copied
+ *  both directory locks are held for the whole move, a directory gets its ".." updated
+ *  an existing file at new_name is replaced, its inode number goes to *replaced for the caller to release
+ *  pass the same inode pointer twice when both names are in one directory
+ */
+RC dir_rename(filesystem *fs, inode *old_dir, const uint8_t *old_name,
+              inode *new_dir, const uint8_t *new_name, uint32_t *replaced);
+
+/*
+ * dir_lookup for count names in one pass over the directory, 0 for a missing name
+ */
+RC dir_lookup_batch(filesystem *fs, inode *dir_ino, const char *const *names, uint32_t count,
+                    uint32_t *inode_nums);
+
+/*
+ * dir_add for count entries of one type under one lock, the directory is scanned once,
+ *  new entries are packed into its free slots and then into new blocks, each block written once
+ *  results[i] is OK, or why names[i] was skipped (ErrName, ErrDirentExists, ErrNoSpace)
+ */
+RC dir_add_batch(filesystem *fs, inode *dir_ino, const char *const *names,
+                 const uint32_t *inode_nums, filetype type, uint32_t count, RC *results);
+
+/*
+ * dir_remove for count non directory entries in one pass, inode_nums[i] gets the removed inode
+ *  results[i] is OK, ErrNotFound, ErrName, or ErrArg for a directory
+ *  an entry with no recorded type is checked against its inode, ErrInode if that read fails
+ */
+RC dir_remove_batch(filesystem *fs, inode *dir_ino, const char *const *names, uint32_t count,
+                    uint32_t *inode_nums, RC *results);
+
 /*
  * List all entry from a directory inode
  */
 RC dir_list(filesystem *fs, inode *dir_ino);
 
+/*
+ * Start iterating a directory, like opendir(3), NULL on failure
+ */
+dir_iter *dir_open(filesystem *fs, inode *dir_ino);
+
+/*
+ * Fill up to max entries with name, inode number, type, size and link count
+ *  directory blocks are read once, the inodes of a batch are read grouped by inode table block
+ *  *count is 0 once the directory is exhausted
+ */
+RC dir_next_batch(dir_iter *it, dir_entry_info *out, uint32_t max, uint32_t *count);
+
+/*
+ * Like dir_next_batch without touching the inode table, only name, inode number and
+ *  the type recorded in the entry (FTypeNotValid if unknown), size and nlink are 0
+ */
+RC dir_next_names(dir_iter *it, dir_entry_info *out, uint32_t max, uint32_t *count);
+
+/*
+ * Release an iterator from dir_open
+ */
+RC dir_close(dir_iter *it);
+
 /*
  * Check a directory inode, whether it has entries
  */
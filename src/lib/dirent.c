@@ -51,3 +51,15 @@ uint32_t get_dirent_per_block(filesystem *fs) {
 
     return fs->dd->block_size / dirent_size;
 }
+
+uint32_t dirent_inode(const dirent *d) {
+    return d->inode_num & DIRENT_INO_MASK;
+}
+
+filetype dirent_type(const dirent *d) {
+    return (filetype)(d->inode_num >> DIRENT_TYPE_SHIFT);
+}
+
+uint32_t dirent_pack(uint32_t inode_num, filetype type) {
+    return (inode_num & DIRENT_INO_MASK) | ((uint32_t)type << DIRENT_TYPE_SHIFT);
+}
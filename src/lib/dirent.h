@@ -11,6 +11,7 @@
 
 #include "error.h"
 #include "fs.h"
+#include "inode.h"
 
 #include <stdint.h>
 
@@ -21,13 +22,34 @@ extern "C" {
 #define MAX_FILENAME_LEN 252 // ori is 28, 255 
 #define VALID_NAME_SPECIAL_CHARS (uint8_t*)"._-" // Special chars
 
-// 32 bytes now
+// inode_num keeps the entry's filetype in its top bits (like d_type), 0 for entries
+// written before types were recorded, readers mask with DIRENT_INO_MASK
+#define DIRENT_TYPE_SHIFT 30
+#define DIRENT_INO_MASK   0x3FFFFFFF
+
+// 256 bytes now
 struct s_dirent {
     uint32_t inode_num;              // 4 bytes
-    uint8_t name[MAX_FILENAME_LEN];  // 28 bytes
+    uint8_t name[MAX_FILENAME_LEN];  // 252 bytes
 };
 typedef struct s_dirent dirent;
 
+/*
+ * Inode number of an entry, without the type bits
+ * */
+uint32_t dirent_inode(const dirent *d);
+
+/*
+ * Filetype recorded in an entry, FTypeNotValid when unknown
+ *  the directory walk uses it to skip entries without reading their inode
+ * */
+filetype dirent_type(const dirent *d);
+
+/*
+ * Pack an inode number and its filetype into dirent.inode_num
+ * */
+uint32_t dirent_pack(uint32_t inode_num, filetype type);
+
 RC dirent_check_valid_name(const uint8_t *name);
 uint32_t get_dirent_per_block(filesystem *fs); // Block size should be integer multiple of directory entry size
 
@@ -6,6 +6,7 @@
  *
  */
 
+#define _GNU_SOURCE // copy_file_range
 #include "disk.h"
 #include "error.h"
 
@@ -15,6 +16,8 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <linux/falloc.h>
 
 char *disk_paths[MAX_DISKS] = {
     "/tmp/disk0.img",
@@ -138,18 +141,22 @@ RC dreads(disk *dd, uint8_t *block, uint32_t start, uint32_t end) {
          return ErrArg;
      }
 
-    uint32_t n;
-    RC ret = OK;
-    for (n=start; n<=end; n++) {
-        ret = dread(dd, block, n);
-        if (ret != OK) {
-            fprintf(stderr, "dreads failed at block %d\n", (int)n);
-            break;
+    // One pread for the whole run instead of one per block
+    size_t total = (size_t)(end-start+1) * dd->block_size;
+    off_t offset = (off_t)(start-1) * dd->block_size;
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = pread(dd->fd, block+done, total-done, offset+done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "dreads failed at block %d\n",
+                    (int)(start + done/dd->block_size));
+            return ErrDread;
         }
-
-        block += dd->block_size;
+        done += n;
     }
-    return ret;
+    return OK;
 }
 
 RC dwrite(disk *dd, uint8_t *block, uint32_t blockno) {
@@ -198,16 +205,125 @@ RC dwrites(disk *dd, uint8_t *block, uint32_t start, uint32_t end) {
          return ErrArg;
      }
 
-    uint32_t n;
-    RC ret = OK;
-    for (n=start; n<=end; n++) {
-        ret = dwrite(dd, block, n);
-        if (ret != OK) {
-            fprintf(stderr, "dwrites failed at block %d\n", (int)n);
-            break;
+    // One pwrite for the whole run instead of one per block
+    size_t total = (size_t)(end-start+1) * dd->block_size;
+    off_t offset = (off_t)(start-1) * dd->block_size;
+    size_t done = 0;
+    while (done < total) {
+        ssize_t n = pwrite(dd->fd, block+done, total-done, offset+done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "dwrites failed at block %d\n",
+                    (int)(start + done/dd->block_size));
+            return ErrDwrite;
         }
+        done += n;
+    }
+    return OK;
+}
 
-        block += dd->block_size;
+// Fallback of dcopy, bounce through a bounded buffer
+static RC dcopy_bounce(disk *dd, uint32_t src, uint32_t dst, uint32_t count) {
+    uint32_t chunk = DCOPY_BOUNCE_BLOCKS;
+    uint8_t *buf = (uint8_t *)malloc((size_t)chunk * dd->block_size);
+    if (!buf) {
+        fprintf(stderr, "dcopy error: no enough memory for bounce buffer\n");
+        return ErrNoMem;
     }
+
+    RC ret = OK;
+    for (uint32_t n=0; n<count && ret == OK; n+=chunk) {
+        uint32_t len = count-n < chunk ? count-n : chunk;
+        ret = dreads(dd, buf, src+n, src+n+len-1);
+        if (ret == OK)
+            ret = dwrites(dd, buf, dst+n, dst+n+len-1);
+    }
+
+    free(buf);
     return ret;
 }
+
+RC dcopy(disk *dd, uint32_t src, uint32_t dst, uint32_t count) {
+    if (!dd || count == 0) {
+        fprintf(stderr, "dcopy error, wrong args...\n");
+        return ErrArg;
+    }
+
+    if (src < 1 || dst < 1 ||
+        src+count-1 > dd->blocks || dst+count-1 > dd->blocks) {
+        fprintf(stderr, "dcopy error, run [%d+%d] -> [%d+%d] out of range 1 ~ %d\n",
+                (int)src, (int)count, (int)dst, (int)count, (int)dd->blocks);
+        return ErrArg;
+    }
+
+    if ((src <= dst && dst < src+count) || (dst <= src && src < dst+count)) {
+        fprintf(stderr, "dcopy error, source and destination runs overlap\n");
+        return ErrArg;
+    }
+
+    // Let the kernel copy inside the image file, no data passes through user space
+    loff_t off_in  = (loff_t)(src-1) * dd->block_size;
+    loff_t off_out = (loff_t)(dst-1) * dd->block_size;
+    size_t remaining = (size_t)count * dd->block_size;
+    while (remaining > 0) {
+        ssize_t n = copy_file_range(dd->fd, &off_in, dd->fd, &off_out, remaining, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        remaining -= n;
+    }
+
+    if (remaining == 0)
+        return OK;
+
+    // Unsupported or partial copy, finish the rest block aligned
+    uint32_t copied = count - (uint32_t)((remaining + dd->block_size - 1) / dd->block_size);
+    return dcopy_bounce(dd, src+copied, dst+copied, count-copied);
+}
+
+RC dsync(disk *dd) {
+    if (!dd) {
+        fprintf(stderr, "dsync error, dd pointer is null...\n");
+        return ErrArg;
+    }
+
+    if (fsync(dd->fd) < 0) {
+        fprintf(stderr, "dsync error, could not fsync disk [%d]...\n", (int)dd->id);
+        return ErrSync;
+    }
+    return OK;
+}
+
+RC ddatasync(disk *dd) {
+    if (!dd) {
+        fprintf(stderr, "ddatasync error, dd pointer is null...\n");
+        return ErrArg;
+    }
+
+    if (fdatasync(dd->fd) < 0) {
+        fprintf(stderr, "ddatasync error, could not fdatasync disk [%d]...\n", (int)dd->id);
+        return ErrSync;
+    }
+    return OK;
+}
+
+RC ddiscard(disk *dd, uint32_t start, uint32_t count) {
+    if (!dd || start < 1 || count == 0 || start+count-1 > dd->blocks) {
+        fprintf(stderr, "ddiscard error, wrong args...\n");
+        return ErrArg;
+    }
+
+    off_t offset = (off_t)(start-1) * dd->block_size;
+    off_t len = (off_t)count * dd->block_size;
+    if (fallocate(dd->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) < 0) {
+        // Not supported by the host filesystem, the blocks just keep their old bytes
+        if (errno == EOPNOTSUPP || errno == ENOSYS)
+            return OK;
+        fprintf(stderr, "ddiscard error, could not punch blocks [%d+%d]...\n",
+                (int)start, (int)count);
+        return ErrDwrite;
+    }
+    return OK;
+}
@@ -17,6 +17,7 @@ extern "C" {
 
 #define MAX_DISKS 10
 #define MIN_BLOCK_SIZE 512
+#define DCOPY_BOUNCE_BLOCKS 64 // Buffer size of dcopy when copy_file_range is not usable
 
 extern char *disk_paths[MAX_DISKS];
 
@@ -65,6 +66,27 @@ RC dwrite(disk *dd, uint8_t *block, uint32_t blockno);
 // Write include number of END
 RC dwrites(disk *dd, uint8_t *block, uint32_t start, uint32_t end);
 
+/*
+ * Copy COUNT blocks from block SRC to block DST inside the disk image
+ *  uses copy_file_range, falls back to buffered reads and writes
+ *  runs should not overlap
+*/
+RC dcopy(disk *dd, uint32_t src, uint32_t dst, uint32_t count);
+
+/*
+ * Give COUNT blocks from START back to the host, fallocate(PUNCH_HOLE) on the image
+ *  later reads of them return zeros, succeeds silently if the host can not punch
+*/
+RC ddiscard(disk *dd, uint32_t start, uint32_t count);
+
+/*
+ * Flush the disk image to stable storage
+ *  dsync: data and file metadata, like fsync(2)
+ *  ddatasync: data only, like fdatasync(2)
+*/
+RC dsync(disk *dd);
+RC ddatasync(disk *dd);
+
 #ifdef __cplusplus
 }
 #endif
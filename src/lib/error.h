@@ -30,7 +30,8 @@ typedef enum {
     ErrNoSpace,
     ErrFileFlags,
     ErrWhence,
-    ErrPath
+    ErrPath,
+    ErrSync
 } RC; // Return Code
 
 #ifdef __cplusplus
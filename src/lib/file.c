@@ -17,61 +17,493 @@
 
 global_file_table g_file_table = {0};
 
+// Open inodes hashed by inode number, one entry per (fs, inode)
+static struct {
+    open_inode *buckets[OPEN_INODE_BUCKETS];
+    uint32_t count;
+    pthread_mutex_t lock;
+} g_open_inodes = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Find or create the shared object for an inode, takes one reference
+static open_inode *oi_get(filesystem *fs, uint32_t inode_number) {
+    uint32_t bucket = inode_number % OPEN_INODE_BUCKETS;
+    open_inode *oi;
+
+    pthread_mutex_lock(&g_open_inodes.lock);
+    for (oi = g_open_inodes.buckets[bucket]; oi; oi = oi->next) {
+        if (oi->fs == fs && oi->inode_number == inode_number) {
+            oi->refcount++;
+            pthread_mutex_unlock(&g_open_inodes.lock);
+            return oi;
+        }
+    }
+
+    // First opener reads the inode, later ones share it
+    oi = (open_inode *)calloc(1, sizeof(open_inode));
+    if (!oi) {
+        pthread_mutex_unlock(&g_open_inodes.lock);
+        fprintf(stderr, "oi_get error: failed to allocate memory for open inode\n");
+        return NULL;
+    }
+    oi->fs = fs;
+    oi->inode_number = inode_number;
+    oi->refcount = 1;
+    oi->block_map = (uint32_t *)malloc(ino_get_max_block_offset(fs) * sizeof(uint32_t));
+    if (!oi->block_map ||
+        pthread_rwlock_init(&oi->rwlock, NULL) != 0 ||
+        ino_read(fs, inode_number, &oi->cached_inode) != OK) {
+        pthread_mutex_unlock(&g_open_inodes.lock);
+        fprintf(stderr, "oi_get error: could not set up inode %d...\n", inode_number);
+        free(oi->block_map);
+        free(oi);
+        return NULL;
+    }
+    oi->cache_valid = 1;
+
+    oi->next = g_open_inodes.buckets[bucket];
+    g_open_inodes.buckets[bucket] = oi;
+    g_open_inodes.count++;
+    pthread_mutex_unlock(&g_open_inodes.lock);
+
+    return oi;
+}
+
+// Drop one reference, the last one frees the object
+static void oi_put(open_inode *oi) {
+    uint32_t bucket = oi->inode_number % OPEN_INODE_BUCKETS;
+
+    pthread_mutex_lock(&g_open_inodes.lock);
+    if (--oi->refcount > 0) {
+        pthread_mutex_unlock(&g_open_inodes.lock);
+        return;
+    }
+
+    open_inode **pp = &g_open_inodes.buckets[bucket];
+    while (*pp && *pp != oi)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = oi->next;
+    g_open_inodes.count--;
+    pthread_mutex_unlock(&g_open_inodes.lock);
+
+    pthread_rwlock_destroy(&oi->rwlock);
+    free(oi->block_map);
+    free(oi);
+}
+
+uint32_t file_open_inode_count() {
+    pthread_mutex_lock(&g_open_inodes.lock);
+    uint32_t count = g_open_inodes.count;
+    pthread_mutex_unlock(&g_open_inodes.lock);
+    return count;
+}
+
+// Reload whatever cache went stale, caller holds oi->rwlock for writing
+static RC oi_refresh(open_inode *oi) {
+    if (!oi->cache_valid) {
+        if (ino_read(oi->fs, oi->inode_number, &oi->cached_inode) != OK) {
+            fprintf(stderr, "oi_refresh error: could not read inode %d...\n",
+                    oi->inode_number);
+            return ErrInode;
+        }
+        oi->cache_valid = 1;
+        oi->map_valid = 0;
+    }
+
+    if (!oi->map_valid) {
+        if (ino_get_block_map(oi->fs, &oi->cached_inode, oi->block_map) != OK) {
+            fprintf(stderr, "oi_refresh error: failed to read block map of inode [%d]\n",
+                    oi->inode_number);
+            return ErrInode;
+        }
+        oi->map_valid = 1;
+    }
+    return OK;
+}
+
+RC file_inode_link_adjust(filesystem *fs, uint32_t inode_number, int32_t delta, uint32_t *nlink) {
+    if (!fs || !nlink) {
+        fprintf(stderr, "file_inode_link_adjust error: wrong args...\n");
+        return ErrArg;
+    }
+
+    // Borrow the shared object even when nobody has the file open, it serializes the update
+    open_inode *oi = oi_get(fs, inode_number);
+    if (!oi) {
+        return ErrInode;
+    }
+
+    pthread_rwlock_wrlock(&oi->rwlock);
+    RC ret = OK;
+    if (!oi->cache_valid && ino_read(fs, inode_number, &oi->cached_inode) != OK) {
+        ret = ErrInode;
+    } else {
+        oi->cache_valid = 1;
+        int64_t count = (int64_t)ino_nlink(&oi->cached_inode) + delta;
+        if (count < 0 || count > UINT32_MAX) {
+            fprintf(stderr, "file_inode_link_adjust error: inode %d link count out of range\n",
+                    inode_number);
+            ret = ErrInternal;
+        } else {
+            oi->cached_inode.nlink = (uint32_t)count;
+            *nlink = (uint32_t)count;
+            ret = ino_write(fs, inode_number, &oi->cached_inode);
+        }
+    }
+    pthread_rwlock_unlock(&oi->rwlock);
+
+    oi_put(oi);
+    return ret;
+}
+
+// Move the blocks of oi into as few runs as bl_alloc_run gives, caller holds oi->rwlock for writing
+// *before and *after are extent counts, the file is left alone unless the count goes down
+static RC file_defrag_locked(open_inode *oi, uint32_t *before, uint32_t *after) {
+    filesystem *fs = oi->fs;
+    inode *ino = &oi->cached_inode;
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+
+    *before = *after = ino_map_extents(oi->block_map, max_offset);
+    if (ino->file_type != FTypeFile || ino_is_inline(ino) || *before <= 1) {
+        return OK;
+    }
+
+    // Blocks shared with a clone stay put, moving them would end the sharing
+    uint32_t used = 0;
+    uint8_t need_indirect = 0;
+    for (uint32_t i=0; i<max_offset; i++) {
+        uint32_t physical = oi->block_map[i] & INO_BLOCK_MASK;
+        if (physical == 0)
+            continue;
+        if (bl_is_shared(fs, physical))
+            return OK;
+        used++;
+        need_indirect |= i >= DIRECT_POINTERS;
+    }
+
+    // New home, the data in logical order, then the indirect block
+    uint32_t want = used + need_indirect;
+    uint32_t fresh[want];
+    uint32_t fresh_count = 0;
+    while (fresh_count < want) {
+        uint32_t got;
+        uint32_t start = bl_alloc_run(fs, want - fresh_count, &got);
+        if (start == 0) {
+            bl_free_batch(fs, fresh, fresh_count);
+            return ErrNoSpace;
+        }
+        for (uint32_t n=0; n<got; n++)
+            fresh[fresh_count++] = start + n;
+    }
+
+    uint32_t map[max_offset];
+    uint32_t old[want + 1];
+    uint32_t old_count = 0, next = 0;
+    for (uint32_t i=0; i<max_offset; i++) {
+        uint32_t entry = oi->block_map[i];
+        map[i] = 0;
+        if ((entry & INO_BLOCK_MASK) == 0)
+            continue;
+        map[i] = fresh[next++] | (entry & INO_BLOCK_UNWRITTEN);
+        old[old_count++] = entry & INO_BLOCK_MASK;
+    }
+    if (ino->single_indirect)
+        old[old_count++] = ino->single_indirect;
+
+    *after = ino_map_extents(map, max_offset);
+    if (*after >= *before) { // Free space is no better than the file, keep it as it is
+        bl_free_batch(fs, fresh, fresh_count);
+        *after = *before;
+        return OK;
+    }
+
+    // Unwritten blocks read as zeros, only written ones are copied, contiguous runs in one dcopy
+    for (uint32_t i=0; i<max_offset; ) {
+        uint32_t entry = oi->block_map[i];
+        if ((entry & INO_BLOCK_MASK) == 0 || (entry & INO_BLOCK_UNWRITTEN)) {
+            i++;
+            continue;
+        }
+
+        uint32_t len = 1;
+        while (i+len < max_offset &&
+               oi->block_map[i+len] == entry+len &&
+               map[i+len] == map[i]+len)
+            len++;
+
+        if (dcopy(fs->dd, entry, map[i], len) != OK) {
+            fprintf(stderr, "file_defrag error: failed to copy blocks [%d+%d] -> [%d+%d]\n",
+                    entry, len, map[i], len);
+            bl_free_batch(fs, fresh, fresh_count);
+            return ErrDwrite;
+        }
+        i += len;
+    }
+
+    // The new indirect block is written first, then one inode write switches over
+    inode updated = *ino;
+    updated.single_indirect = need_indirect ? fresh[want-1] : 0;
+    if (ino_set_block_map(fs, &updated, map) != OK) {
+        fprintf(stderr, "file_defrag error: failed to write block map of inode [%d]\n",
+                oi->inode_number);
+        bl_free_batch(fs, fresh, fresh_count);
+        return ErrInode;
+    }
+    updated.alloc_goal = fresh[used-1];
+    if (ino_write(fs, oi->inode_number, &updated) != OK) {
+        fprintf(stderr, "file_defrag error: failed to write inode [%d]\n", oi->inode_number);
+        bl_free_batch(fs, fresh, fresh_count);
+        return ErrInode;
+    }
+
+    *ino = updated;
+    memcpy(oi->block_map, map, max_offset * sizeof(uint32_t));
+    return bl_free_batch(fs, old, old_count);
+}
+
+RC file_inode_defrag(filesystem *fs, uint32_t inode_number, uint32_t *before, uint32_t *after) {
+    if (!fs || !before || !after) {
+        fprintf(stderr, "file_inode_defrag error: wrong args...\n");
+        return ErrArg;
+    }
+
+    // Same shared object as open handles, their reads and writes wait while blocks move
+    open_inode *oi = oi_get(fs, inode_number);
+    if (!oi) {
+        return ErrInode;
+    }
+
+    pthread_rwlock_wrlock(&oi->rwlock);
+    // fs_unlink_at frees the last link's blocks after this lock is dropped, so an inode that
+    // is no longer allocated or linked is skipped rather than moved under it
+    pthread_mutex_lock(&fs->alloc_lock);
+    uint8_t allocated = inode_number >= 1 && inode_number <= fs->inodes &&
+                        bm_getbit(fs->inode_bitmap, inode_number-1);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    *before = *after = 0;
+    RC ret = allocated ? oi_refresh(oi) : OK;
+    if (ret == OK && allocated && ino_nlink(&oi->cached_inode) > 0) {
+        ret = file_defrag_locked(oi, before, after);
+    }
+    pthread_rwlock_unlock(&oi->rwlock);
+
+    oi_put(oi);
+    return ret;
+}
+
+// Take oi->rwlock for reading with both caches valid, no lock held on failure
+static RC oi_rdlock_ready(open_inode *oi) {
+    for (;;) {
+        pthread_rwlock_rdlock(&oi->rwlock);
+        if (oi->cache_valid && oi->map_valid)
+            return OK;
+        pthread_rwlock_unlock(&oi->rwlock);
+
+        pthread_rwlock_wrlock(&oi->rwlock);
+        RC ret = oi_refresh(oi);
+        pthread_rwlock_unlock(&oi->rwlock);
+        if (ret != OK)
+            return ret;
+    }
+}
+
+open_inode *file_inode_rdlock(filesystem *fs, uint32_t inode_number, inode *ino) {
+    if (!fs || !ino) {
+        fprintf(stderr, "file_inode_rdlock error: wrong args...\n");
+        return NULL;
+    }
+
+    open_inode *oi = oi_get(fs, inode_number);
+    if (!oi) {
+        return NULL;
+    }
+    if (oi_rdlock_ready(oi) != OK) {
+        fprintf(stderr, "file_inode_rdlock error: could not read inode %d...\n", inode_number);
+        oi_put(oi);
+        return NULL;
+    }
+    *ino = oi->cached_inode;
+    return oi;
+}
+
+void file_inode_unlock(open_inode *oi) {
+    if (!oi) {
+        return;
+    }
+    pthread_rwlock_unlock(&oi->rwlock);
+    oi_put(oi);
+}
+
+// Raw map entry of logical block idx from the cache, 0 on failure
+// caller holds oi->rwlock for writing, or for reading after oi_rdlock_ready
+static uint32_t oi_map_entry(open_inode *oi, uint32_t idx) {
+    if ((!oi->cache_valid || !oi->map_valid) && oi_refresh(oi) != OK) {
+        return 0;
+    }
+    return oi->block_map[idx];
+}
+
+// Keep the cache in step with a single entry change, caller holds oi->rwlock for writing
+static void oi_map_set(open_inode *oi, uint32_t idx, uint32_t entry) {
+    if (oi->map_valid)
+        oi->block_map[idx] = entry;
+}
+
 void file_table_init() {
     pthread_mutex_init(&g_file_table.lock, NULL);
-    for (uint32_t i=0; i<MAX_OPEN_FILES; i++) {
+    free(g_file_table.handles);
+    free(g_file_table.free_slots);
+    g_file_table.handles = NULL;
+    g_file_table.free_slots = NULL;
+    g_file_table.free_count = 0;
+    g_file_table.capacity = 0;
+    g_file_table.count = 0;
+}
+
+// Double the table, new slots go on the free stack lowest on top
+// caller holds g_file_table.lock
+static RC file_table_grow() {
+    uint32_t old_cap = g_file_table.capacity;
+    uint32_t new_cap = old_cap ? old_cap * 2 : FILE_TABLE_INIT_SLOTS;
+    if (new_cap > INT32_MAX) {
+        fprintf(stderr, "file_table_grow error: too many open files\n");
+        return ErrNoSpace;
+    }
+
+    file_handle **handles = (file_handle **)realloc(g_file_table.handles,
+            new_cap * sizeof(file_handle *));
+    if (!handles) {
+        fprintf(stderr, "file_table_grow error: failed to grow to [%u] slots\n", new_cap);
+        return ErrNoMem;
+    }
+    g_file_table.handles = handles;
+
+    int32_t *free_slots = (int32_t *)realloc(g_file_table.free_slots,
+            new_cap * sizeof(int32_t));
+    if (!free_slots) {
+        fprintf(stderr, "file_table_grow error: failed to grow to [%u] slots\n", new_cap);
+        return ErrNoMem;
+    }
+    g_file_table.free_slots = free_slots;
+
+    for (uint32_t i=old_cap; i<new_cap; i++) {
         g_file_table.handles[i] = NULL;
     }
-    g_file_table.count = 0;
+    // Only grown when the stack is empty
+    for (uint32_t i=new_cap; i>old_cap; i--) {
+        g_file_table.free_slots[g_file_table.free_count++] = i-1;
+    }
+    g_file_table.capacity = new_cap;
+    return OK;
+}
+
+// Put fh in a free slot, returns the descriptor or -1
+static int32_t file_table_insert(file_handle *fh) {
+    int32_t fd = -1;
+
+    pthread_mutex_lock(&g_file_table.lock);
+    if (g_file_table.free_count > 0 || file_table_grow() == OK) {
+        fd = g_file_table.free_slots[--g_file_table.free_count];
+        g_file_table.handles[fd] = fh;
+        g_file_table.count++;
+    }
+    pthread_mutex_unlock(&g_file_table.lock);
+
+    return fd;
+}
+
+// Release the slot of fh, caller holds g_file_table.lock
+static void file_table_remove_locked(file_handle *fh) {
+    int32_t fd = fh->fd;
+    if (fd >= 0 && (uint32_t)fd < g_file_table.capacity && g_file_table.handles[fd] == fh) {
+        g_file_table.handles[fd] = NULL;
+        g_file_table.free_slots[g_file_table.free_count++] = fd;
+        g_file_table.count--;
+    }
+}
+
+// Drop one reference, caller holds g_file_table.lock, returns the references left
+// the last one also gives the slot back, so file_from_fd never finds a dying handle
+static uint32_t file_unref_locked(file_handle *fh) {
+    uint32_t refcount = --fh->refcount;
+    if (refcount == 0) {
+        file_table_remove_locked(fh);
+    }
+    return refcount;
+}
+
+// Free a handle whose last reference is gone
+static void file_destroy(file_handle *fh) {
+    oi_put(fh->oi);
+    free(fh);
 }
 
 file_handle *file_open(filesystem *fs, const char *path_str, uint32_t flags) {
-    if (!fs || !path_str || file_check_flags(flags) != OK) {
-        fprintf(stderr, "file_open error: error args...\n");
-        return (file_handle*)0;
+    return file_open_at(fs, MY_AT_FDCWD, path_str, flags);
+}
+
+RC file_dirfd_inode(int32_t dirfd, uint32_t *inode_num) {
+    if (!inode_num) {
+        fprintf(stderr, "file_dirfd_inode error: wrong args...\n");
+        return ErrArg;
     }
 
-    if (path_str[strlen(path_str)-1] == '/') { // open only allowed to create file
-        fprintf(stderr, "file_open error: path_str should be a file path, not directory\n");
-        return (file_handle*)0;
+    if (dirfd == MY_AT_FDCWD) {
+        *inode_num = 0;
+        return OK;
     }
 
-    path p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&p, 0, size);
+    file_handle *fh = file_from_fd(dirfd);
+    if (!fh || !(fh->flags & MY_O_DIRECTORY)) {
+        fprintf(stderr, "file_dirfd_inode error: [%d] is not a directory descriptor\n", dirfd);
+        file_put(fh);
+        return ErrArg;
+    }
 
-    if (path_parse(path_str, &p) != OK) {
-        fprintf(stderr, "file_open error: failed to parse path_str [%s] to path structure...\n",
-                path_str);
+    *inode_num = fh->inode_number;
+    file_put(fh);
+    return OK;
+}
+
+file_handle *file_open_at(filesystem *fs, int32_t dirfd, const char *path_str, uint32_t flags) {
+    if (!fs || !path_str || path_str[0] == '\0' || file_check_flags(flags) != OK) {
+        fprintf(stderr, "file_open error: error args...\n");
         return (file_handle*)0;
     }
 
-    inode ino;
-    uint32_t inode_num;
-    if (p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
+    uint8_t want_dir = (flags & MY_O_DIRECTORY) != 0;
+    if (want_dir && (flags & ~MY_O_DIRECTORY) != MY_O_RDONLY) {
+        fprintf(stderr, "file_open error: directory can only be opened read only\n");
+        return (file_handle*)0;
     }
 
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "file_open error: failed to read base inode [%d]\n",
-                inode_num);
+    if (!want_dir && path_str[strlen(path_str)-1] == '/') { // open only allowed to create file
+        fprintf(stderr, "file_open error: path_str should be a file path, not directory\n");
+        return (file_handle*)0;
+    }
+
+    uint32_t dir_inode_num;
+    if (file_dirfd_inode(dirfd, &dir_inode_num) != OK) {
         return (file_handle*)0;
     }
 
     // Check whether file exists
-    if ((inode_num = path_lookup(fs, ino, &p)) == 0) {
+    inode ino;
+    uint32_t inode_num;
+    if ((inode_num = path_resolve_at(fs, dir_inode_num, path_str, &ino)) == 0) {
         fprintf(stderr, "file_open error: file does not exists [%s]\n",
                 path_str);
         return (file_handle*)0;
     }
 
+    if (want_dir && ino.file_type != FTypeDirectory) {
+        fprintf(stderr, "file_open error: [%s] is not a directory\n", path_str);
+        return (file_handle*)0;
+    }
+
     file_handle *fh;
 
-    size = sizeof(struct s_file_handle);
+    uint32_t size = sizeof(struct s_file_handle);
     fh = (file_handle *)malloc(size);
     if (!fh) {
         fprintf(stderr, "file_open error: failed to allocate memory for file handle\n");
@@ -84,41 +516,30 @@ file_handle *file_open(filesystem *fs, const char *path_str, uint32_t flags) {
     fh->flags = flags;
     fh->refcount = 1;
 
-    if (ino_read(fs, inode_num, &fh->cached_inode) != OK) {
-        fprintf(stderr, "file_open error: could not read inode %d...\n",
+    // Shared with every other handle on this inode, read from disk only once
+    if ((fh->oi = oi_get(fs, inode_num)) == NULL) {
+        fprintf(stderr, "file_open error: could not open inode %d...\n",
                 inode_num);
         free(fh);
         return (file_handle*)0;
     }
-    fh->cache_valid = 1;
 
     if (flags & MY_O_APPEND) {
-        fh->offset = fh->cached_inode.file_size;
+        pthread_rwlock_rdlock(&fh->oi->rwlock);
+        fh->offset = fh->oi->cached_inode.file_size;
+        pthread_rwlock_unlock(&fh->oi->rwlock);
     }
 
-    if (pthread_rwlock_init(&fh->rwlock, NULL) != 0) {
-        fprintf(stderr, "file_open error: could not init rwlock...\n");
+    if ((fh->fd = file_table_insert(fh)) < 0) {
+        fprintf(stderr, "file_open error: no free descriptor\n");
+        oi_put(fh->oi);
         free(fh);
-        return (file_handle*)0;
-    }
-
-    pthread_mutex_lock(&g_file_table.lock);
-
-    uint32_t slot = -1;
-    for (uint32_t i=0; i<MAX_OPEN_FILES; i++) {
-        if (g_file_table.handles[i] == NULL) {
-            slot = i;
-            g_file_table.handles[i] = fh;
-            g_file_table.count++;
-            break;
-        }
+        return NULL;
     }
-    pthread_mutex_unlock(&g_file_table.lock);
 
-    if (slot == -1) {
-        fprintf(stderr, "file_open error: too many open files (%d max)\n", MAX_OPEN_FILES);
-        pthread_rwlock_destroy(&fh->rwlock);
-        free(fh);
+    if ((flags & MY_O_TRUNC) && file_truncate(fh, 0) != OK) {
+        fprintf(stderr, "file_open error: failed to truncate [%s]\n", path_str);
+        file_close(fh);
         return NULL;
     }
 
@@ -131,28 +552,66 @@ RC file_close(file_handle *fh) {
         return ErrArg;
     }
 
-    pthread_rwlock_wrlock(&fh->rwlock);
-    fh->refcount--;
-    uint32_t refcount = fh->refcount;
-    pthread_rwlock_unlock(&fh->rwlock);
+    // refcount is guarded by the table lock, file_from_fd takes references under it
+    pthread_mutex_lock(&g_file_table.lock);
+    uint32_t refcount = file_unref_locked(fh);
+    pthread_mutex_unlock(&g_file_table.lock);
 
     if (refcount == 0) {
-        pthread_mutex_lock(&g_file_table.lock);
+        file_destroy(fh);
+    }
 
-        for (int i = 0; i < MAX_OPEN_FILES; i++) {
-            if (g_file_table.handles[i] == fh) {
-                g_file_table.handles[i] = NULL;
-                g_file_table.count--;
-                break;
-            }
-        }
+    return OK;
+}
+
+void file_put(file_handle *fh) {
+    if (fh) {
+        file_close(fh);
+    }
+}
+
+int32_t file_open_fd(filesystem *fs, const char *path_str, uint32_t flags) {
+    file_handle *fh = file_open(fs, path_str, flags);
+    return fh ? fh->fd : -1;
+}
 
-        pthread_mutex_unlock(&g_file_table.lock);
+file_handle *file_from_fd(int32_t fd) {
+    file_handle *fh = NULL;
 
-        pthread_rwlock_destroy(&fh->rwlock);
-        free(fh);
+    pthread_mutex_lock(&g_file_table.lock);
+    if (fd >= 0 && (uint32_t)fd < g_file_table.capacity) {
+        fh = g_file_table.handles[fd];
     }
+    if (fh) {
+        fh->refcount++; // Keeps a concurrent file_close_fd from freeing it under the caller
+    }
+    pthread_mutex_unlock(&g_file_table.lock);
+
+    return fh;
+}
 
+RC file_close_fd(int32_t fd) {
+    file_handle *fh = NULL;
+    uint32_t refcount = 0;
+
+    // The descriptor goes away at once, borrowers from file_from_fd keep the handle alive
+    pthread_mutex_lock(&g_file_table.lock);
+    if (fd >= 0 && (uint32_t)fd < g_file_table.capacity) {
+        fh = g_file_table.handles[fd];
+    }
+    if (fh) {
+        file_table_remove_locked(fh);
+        refcount = file_unref_locked(fh);
+    }
+    pthread_mutex_unlock(&g_file_table.lock);
+
+    if (!fh) {
+        fprintf(stderr, "file_close_fd error: bad descriptor [%d]\n", fd);
+        return ErrArg;
+    }
+    if (refcount == 0) {
+        file_destroy(fh);
+    }
     return OK;
 }
 
@@ -169,28 +628,34 @@ uint32_t file_read(file_handle *fh, uint8_t *buf, uint32_t size) {
         return 0;
     }
 
-    if (fh->cache_valid == 0) {
-        pthread_rwlock_wrlock(&fh->rwlock);
-        if (ino_read(fh->fs, fh->inode_number, &fh->cached_inode) != OK) {
-            fprintf(stderr, "file_read error: could not read inode %d...\n",
-                    fh->inode_number);
-            pthread_rwlock_unlock(&fh->rwlock);
-            return 0;
-        }
-        fh->cache_valid = 1;
-        pthread_rwlock_unlock(&fh->rwlock);
+    // Size and block map are shared, a write through another handle is seen here
+    if (oi_rdlock_ready(fh->oi) != OK) {
+        fprintf(stderr, "file_read error: could not read inode %d...\n",
+                fh->inode_number);
+        return 0;
     }
 
-    if (fh->offset >= fh->cached_inode.file_size) {
+    if (fh->offset >= fh->oi->cached_inode.file_size) {
+        pthread_rwlock_unlock(&fh->oi->rwlock);
         return 0;  // EOF
     }
 
-    uint32_t remaining = fh->cached_inode.file_size - fh->offset;
+    uint32_t remaining = fh->oi->cached_inode.file_size - fh->offset;
     if (size > remaining) {
         size = remaining;
     }
 
-    pthread_rwlock_rdlock(&fh->rwlock);
+    if (ino_is_inline(&fh->oi->cached_inode)) {
+        // Content sits in the cached inode, no disk access
+        memcpy(buf, fh->oi->cached_inode.inline_data+fh->offset, size);
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+
+        pthread_rwlock_wrlock(&fh->oi->rwlock);
+        fh->offset += size;
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return size;
+    }
+
     uint32_t block_size = fh->fs->dd->block_size;
 
     uint32_t start_block_idx = fh->offset / block_size;
@@ -200,20 +665,21 @@ uint32_t file_read(file_handle *fh, uint8_t *buf, uint32_t size) {
     uint8_t block_buf[block_size];
     uint32_t cur_block_idx = start_block_idx;
     while (bytes_read < size) {
-        uint32_t physical_block = ino_get_block_at(fh->fs, &fh->cached_inode, cur_block_idx);
+        uint32_t entry = fh->oi->block_map[cur_block_idx];
+        uint32_t physical_block = entry & INO_BLOCK_MASK;
 
         uint32_t copy_size = block_size - block_offset;
         if (copy_size > size - bytes_read) {
             copy_size = size - bytes_read;
         }
 
-        if (physical_block == 0) { // Hole
+        if (physical_block == 0 || (entry & INO_BLOCK_UNWRITTEN)) { // Hole or reserved
             memset(buf+bytes_read, 0, copy_size);
         } else {
             if (dread(fh->fs->dd, block_buf, physical_block) != OK) {
                 fprintf(stderr, "file_read error: failed to read block [%d]\n",
                     physical_block);
-                return bytes_read;
+                break; // The lock is shared by every handle on the inode, drop it below
             }
 
             memcpy(buf+bytes_read, block_buf+block_offset, copy_size);
@@ -222,15 +688,86 @@ uint32_t file_read(file_handle *fh, uint8_t *buf, uint32_t size) {
         block_offset = 0;
         cur_block_idx++;
     }
-    pthread_rwlock_unlock(&fh->rwlock);
+    pthread_rwlock_unlock(&fh->oi->rwlock);
 
-    pthread_rwlock_wrlock(&fh->rwlock);
+    pthread_rwlock_wrlock(&fh->oi->rwlock);
     fh->offset += bytes_read;
-    pthread_rwlock_unlock(&fh->rwlock);
+    pthread_rwlock_unlock(&fh->oi->rwlock);
 
     return bytes_read;
 }
 
+// Give logical block IDX a private copy of shared PHYSICAL, returns the new block
+// the caller writes the content, caller holds fh->oi->rwlock for writing
+static uint32_t file_unshare_block(file_handle *fh, uint32_t idx, uint32_t physical) {
+    uint32_t new_block = bl_alloc_goal(fh->fs, ino_block_goal(fh->fs, &fh->oi->cached_inode, idx));
+    if (new_block == 0) {
+        fprintf(stderr, "file_unshare_block error: failed to allocate block\n");
+        return 0;
+    }
+    if (ino_set_block_at(fh->fs, &fh->oi->cached_inode, idx, new_block) != OK) {
+        fprintf(stderr, "file_unshare_block error: failed to remap block [%d]\n", idx);
+        bl_free(fh->fs, new_block);
+        return 0;
+    }
+    oi_map_set(fh->oi, idx, new_block);
+    fh->oi->cached_inode.alloc_goal = new_block;
+    bl_free(fh->fs, physical); // Drop our reference only
+    return new_block;
+}
+
+// Zero bytes [from, to) inside logical block IDX, holes stay holes
+// caller holds fh->oi->rwlock for writing
+static RC file_zero_in_block(file_handle *fh, uint32_t idx, uint32_t from, uint32_t to) {
+    uint32_t block_size = fh->fs->dd->block_size;
+    uint32_t entry = oi_map_entry(fh->oi, idx);
+    uint32_t physical = entry & INO_BLOCK_MASK;
+    if (physical == 0 || (entry & INO_BLOCK_UNWRITTEN) || from >= to) {
+        return OK; // Reads back as zeros already
+    }
+
+    uint8_t block_buf[block_size];
+    if (dread(fh->fs->dd, block_buf, physical) != OK) {
+        fprintf(stderr, "file_zero_in_block error: failed to read block [%d]\n", physical);
+        return ErrDread;
+    }
+    memset(block_buf+from, 0, to-from);
+
+    if (bl_is_shared(fh->fs, physical) &&
+        (physical = file_unshare_block(fh, idx, physical)) == 0) {
+        return ErrNoSpace;
+    }
+
+    if (dwrite(fh->fs->dd, block_buf, physical) != OK) {
+        fprintf(stderr, "file_zero_in_block error: failed to write block [%d]\n", physical);
+        return ErrDwrite;
+    }
+    return OK;
+}
+
+// Caller holds fh->oi->rwlock for writing
+static RC file_check_writable(file_handle *fh, const char *who) {
+    uint32_t accmode = fh->flags & MY_ACCMODE;
+    if ((accmode != MY_O_WRONLY) && (accmode != MY_O_RDWR)) {
+        fprintf(stderr, "%s error: error file handle flags %x\n", who, fh->flags);
+        return ErrFileFlags;
+    }
+
+    if (fh->oi->cache_valid == 0) {
+        if (ino_read(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK) {
+            fprintf(stderr, "%s error: could not read inode %d...\n", who, fh->inode_number);
+            return ErrInode;
+        }
+        fh->oi->cache_valid = 1;
+    }
+
+    if (fh->oi->cached_inode.file_type != FTypeFile) {
+        fprintf(stderr, "%s error: inode %d is not a regular file\n", who, fh->inode_number);
+        return ErrArg;
+    }
+    return OK;
+}
+
 uint32_t file_write(file_handle *fh, uint8_t *buf, uint32_t size) {
     if (!fh || !buf) {
         fprintf(stderr, "file_write error: wrong args\n");
@@ -244,19 +781,20 @@ uint32_t file_write(file_handle *fh, uint8_t *buf, uint32_t size) {
         return 0;
     }
 
-    pthread_rwlock_wrlock(&fh->rwlock);
+    pthread_rwlock_wrlock(&fh->oi->rwlock);
 
-    if (fh->cache_valid == 0) {
-        if (ino_read(fh->fs, fh->inode_number, &fh->cached_inode) != OK) {
+    if (fh->oi->cache_valid == 0) {
+        if (ino_read(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK) {
             fprintf(stderr, "file_read error: could not read inode %d...\n",
                     fh->inode_number);
+            pthread_rwlock_unlock(&fh->oi->rwlock);
             return 0;
         }
-        fh->cache_valid = 1;
+        fh->oi->cache_valid = 1;
     }
 
     if (fh->flags & MY_O_APPEND) {
-        fh->offset = fh->cached_inode.file_size;
+        fh->offset = fh->oi->cached_inode.file_size;
     }
 
     // Check whether over maximum file size
@@ -264,9 +802,40 @@ uint32_t file_write(file_handle *fh, uint8_t *buf, uint32_t size) {
     if (fh->offset + size > max_file_size) {
         fprintf(stderr, "file_write error: offset [%d] + size [%d] over maximum file size [%d]\n",
                 fh->offset, size, max_file_size);
+        pthread_rwlock_unlock(&fh->oi->rwlock);
         return 0;
     }
 
+    if (ino_is_inline(&fh->oi->cached_inode)) {
+        // Still fits, one inode write and no block at all
+        if (fh->offset + size <= INO_INLINE_SIZE) {
+            memcpy(fh->oi->cached_inode.inline_data+fh->offset, buf, size);
+            fh->offset += size;
+            if (fh->offset > fh->oi->cached_inode.file_size) {
+                fh->oi->cached_inode.file_size = fh->offset;
+            }
+            if (ino_write(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK) {
+                fprintf(stderr, "file_write error: failed to write inode [%d]\n",
+                        fh->inode_number);
+                fh->oi->cache_valid = 0;
+                fh->oi->map_valid = 0;
+                size = 0;
+            }
+            pthread_rwlock_unlock(&fh->oi->rwlock);
+            return size;
+        }
+
+        // Grows past the inode, move the content to a real block and go on
+        // the size grows too, so the inode is written back below
+        fh->oi->map_valid = 0;
+        if (ino_promote_inline(fh->fs, &fh->oi->cached_inode) != OK) {
+            fprintf(stderr, "file_write error: failed to move inline data of inode [%d]\n",
+                    fh->inode_number);
+            pthread_rwlock_unlock(&fh->oi->rwlock);
+            return 0;
+        }
+    }
+
     uint32_t block_size = fh->fs->dd->block_size;
     uint32_t start_block_idx = fh->offset / block_size;
     uint32_t block_offset = fh->offset % block_size;
@@ -278,22 +847,34 @@ uint32_t file_write(file_handle *fh, uint8_t *buf, uint32_t size) {
     int inode_modified = 0;  // Track if inode needs to be written back
 
     while (bytes_write < size) {
-        uint32_t physical_block = ino_get_block_at(fh->fs, &fh->cached_inode, cur_block_idx);
+        uint32_t entry = oi_map_entry(fh->oi, cur_block_idx);
+        uint32_t physical_block = entry & INO_BLOCK_MASK;
 
         if (physical_block == 0) {
-            physical_block = ino_alloc_block_at(fh->fs, &fh->cached_inode, cur_block_idx);
-            if (bl_clean(fh->fs, physical_block) != OK) {
-                fprintf(stderr, "file_write error: failed to init a block\n");
-                pthread_rwlock_unlock(&fh->rwlock);
-                return bytes_write;
-            }
-
+            // ino_alloc_block_at hands back a cleaned block
+            physical_block = ino_alloc_block_at(fh->fs, &fh->oi->cached_inode, cur_block_idx);
             if (physical_block == 0) {
                 fprintf(stderr, "file_write error: failed to allocate block\n");
                 break;
             }
+            oi_map_set(fh->oi, cur_block_idx, physical_block);
             memset(block_buf, 0, block_size);
             inode_modified = 1;  // Block allocation modifies inode
+        } else if (entry & INO_BLOCK_UNWRITTEN) {
+            // Reserved by fallocate, the old bytes on disk are not ours
+            memset(block_buf, 0, block_size);
+            if (bl_is_shared(fh->fs, physical_block)) {
+                physical_block = file_unshare_block(fh, cur_block_idx, physical_block);
+            } else if (ino_set_block_at(fh->fs, &fh->oi->cached_inode, cur_block_idx, physical_block) != OK) {
+                physical_block = 0;
+            } else {
+                oi_map_set(fh->oi, cur_block_idx, physical_block);
+            }
+            if (physical_block == 0) {
+                fprintf(stderr, "file_write error: failed to mark reserved block written\n");
+                break;
+            }
+            inode_modified = 1;
         } else {
             if (block_offset != 0 || size - bytes_write < block_size) {
                 if (dread(fh->fs->dd, block_buf, physical_block) != OK) {
@@ -302,6 +883,15 @@ uint32_t file_write(file_handle *fh, uint8_t *buf, uint32_t size) {
                     break;
                 }
             }
+
+            // Block is shared with a clone, copy on write
+            if (bl_is_shared(fh->fs, physical_block)) {
+                if ((physical_block = file_unshare_block(fh, cur_block_idx, physical_block)) == 0) {
+                    fprintf(stderr, "file_write error: failed to copy-on-write block\n");
+                    break;
+                }
+                inode_modified = 1;
+            }
         }
 
         uint32_t write_size = block_size - block_offset;
@@ -322,21 +912,262 @@ uint32_t file_write(file_handle *fh, uint8_t *buf, uint32_t size) {
     }
 
     fh->offset += bytes_write;
-    if (fh->offset > fh->cached_inode.file_size) {
-        fh->cached_inode.file_size = fh->offset;
+    if (fh->offset > fh->oi->cached_inode.file_size) {
+        fh->oi->cached_inode.file_size = fh->offset;
         inode_modified = 1;  // File size change modifies inode
     }
 
     // Write back inode if modified (either by block allocation or size change)
     if (inode_modified && bytes_write > 0) {
-        fh->cache_valid = 1;
-        ino_write(fh->fs, fh->inode_number, &fh->cached_inode);
+        fh->oi->cache_valid = 1;
+        ino_write(fh->fs, fh->inode_number, &fh->oi->cached_inode);
     }
 
-    pthread_rwlock_unlock(&fh->rwlock);
+    pthread_rwlock_unlock(&fh->oi->rwlock);
     return bytes_write;
 }
 
+RC file_truncate(file_handle *fh, uint32_t size) {
+    if (!fh || size > ino_get_max_filesize(fh->fs)) {
+        fprintf(stderr, "file_truncate error: wrong args\n");
+        return ErrArg;
+    }
+
+    pthread_rwlock_wrlock(&fh->oi->rwlock);
+    RC ret = file_check_writable(fh, "file_truncate");
+    if (ret != OK) {
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return ret;
+    }
+
+    if (ino_is_inline(&fh->oi->cached_inode) && size > INO_INLINE_SIZE) {
+        ret = ino_promote_inline(fh->fs, &fh->oi->cached_inode);
+    }
+
+    if (ret != OK) {
+        // Reported below
+    } else if (ino_is_inline(&fh->oi->cached_inode)) {
+        if (size < fh->oi->cached_inode.file_size) {
+            memset(fh->oi->cached_inode.inline_data+size, 0, fh->oi->cached_inode.file_size-size);
+        }
+    } else if (size < fh->oi->cached_inode.file_size) {
+        // Growing only moves the size, the new range reads back as a hole
+        uint32_t block_size = fh->fs->dd->block_size;
+        uint32_t first = (size + block_size - 1) / block_size;
+
+        ret = ino_release_range(fh->fs, &fh->oi->cached_inode, first, ino_get_max_block_offset(fh->fs));
+        if (ret == OK && size % block_size != 0) {
+            // Growing again later must not bring the old tail back
+            ret = file_zero_in_block(fh, size / block_size, size % block_size, block_size);
+        }
+    }
+
+    if (ret == OK) {
+        fh->oi->cached_inode.file_size = size;
+    } else {
+        fprintf(stderr, "file_truncate error: failed to release blocks of inode [%d]\n",
+                fh->inode_number);
+    }
+
+    // Block map may have changed even on failure, keep the inode in step
+    fh->oi->map_valid = 0;
+    if (ino_write(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK && ret == OK) {
+        ret = ErrInode;
+    }
+    pthread_rwlock_unlock(&fh->oi->rwlock);
+    return ret;
+}
+
+RC file_punch_hole(file_handle *fh, uint32_t offset, uint32_t len) {
+    if (!fh) {
+        fprintf(stderr, "file_punch_hole error: wrong args\n");
+        return ErrArg;
+    }
+
+    pthread_rwlock_wrlock(&fh->oi->rwlock);
+    RC ret = file_check_writable(fh, "file_punch_hole");
+    if (ret != OK) {
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return ret;
+    }
+
+    uint32_t file_size = fh->oi->cached_inode.file_size;
+    if (offset >= file_size || len == 0) {
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return OK;
+    }
+    uint32_t end = (len > file_size - offset) ? file_size : offset + len;
+
+    if (ino_is_inline(&fh->oi->cached_inode)) {
+        memset(fh->oi->cached_inode.inline_data+offset, 0, end-offset);
+        ret = ino_write(fh->fs, fh->inode_number, &fh->oi->cached_inode);
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return ret;
+    }
+
+    // [first, last) are blocks fully inside the range, a block only cut by EOF counts as full
+    uint32_t block_size = fh->fs->dd->block_size;
+    uint32_t first = (offset + block_size - 1) / block_size;
+    uint32_t last = (end == file_size) ? (end + block_size - 1) / block_size : end / block_size;
+
+    if (offset % block_size != 0) {
+        uint32_t head_end = (end < first*block_size) ? end : first*block_size;
+        ret = file_zero_in_block(fh, offset / block_size, offset % block_size,
+                head_end - (offset / block_size)*block_size);
+    }
+    if (ret == OK && last >= first && last*block_size < end) {
+        ret = file_zero_in_block(fh, last, 0, end - last*block_size);
+    }
+    if (ret == OK && first < last) {
+        ret = ino_release_range(fh->fs, &fh->oi->cached_inode, first, last);
+    }
+
+    if (ret != OK) {
+        fprintf(stderr, "file_punch_hole error: failed to punch [%d+%d] in inode [%d]\n",
+                offset, len, fh->inode_number);
+    }
+    fh->oi->map_valid = 0;
+
+    if (ino_write(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK && ret == OK) {
+        ret = ErrInode;
+    }
+    pthread_rwlock_unlock(&fh->oi->rwlock);
+    return ret;
+}
+
+RC file_fallocate(file_handle *fh, uint32_t offset, uint32_t len, uint32_t flags) {
+    if (!fh || len == 0 || (flags & ~MY_FALLOC_KEEP_SIZE) ||
+        len > ino_get_max_filesize(fh->fs) ||
+        offset > ino_get_max_filesize(fh->fs) - len) {
+        fprintf(stderr, "file_fallocate error: wrong args\n");
+        return ErrArg;
+    }
+
+    pthread_rwlock_wrlock(&fh->oi->rwlock);
+    RC ret = file_check_writable(fh, "file_fallocate");
+    if (ret != OK) {
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return ret;
+    }
+
+    uint32_t block_size = fh->fs->dd->block_size;
+    uint32_t first = offset / block_size;
+    uint32_t last = (offset + len + block_size - 1) / block_size;
+    uint32_t map[ino_get_max_block_offset(fh->fs)];
+    // One extra slot for a block made by promoting inline content
+    uint32_t reserved[last-first+1];
+    uint32_t reserved_count = 0;
+
+    // Inline content is already reserved, only a range past it needs blocks
+    if (ino_is_inline(&fh->oi->cached_inode)) {
+        if (offset + len <= INO_INLINE_SIZE) {
+            first = last; // Nothing to reserve, inode stays inline
+        } else if ((ret = ino_promote_inline(fh->fs, &fh->oi->cached_inode)) != OK) {
+            fprintf(stderr, "file_fallocate error: failed to move inline data of inode [%d]\n",
+                    fh->inode_number);
+            pthread_rwlock_unlock(&fh->oi->rwlock);
+            return ret;
+        } else if (fh->oi->cached_inode.direct_blocks[0]) {
+            reserved[reserved_count++] = fh->oi->cached_inode.direct_blocks[0];
+        }
+    }
+
+    if ((ret = ino_get_block_map(fh->fs, &fh->oi->cached_inode, map)) != OK) {
+        fprintf(stderr, "file_fallocate error: failed to read block map of inode [%d]\n",
+                fh->inode_number);
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return ret;
+    }
+
+    // Fill every hole with runs as long as the allocator gives, no bl_clean
+    for (uint32_t i=first; i<last; ) {
+        if (map[i] != 0) {
+            i++;
+            continue;
+        }
+
+        uint32_t want = 0;
+        while (i+want < last && map[i+want] == 0)
+            want++;
+
+        uint32_t got;
+        uint32_t start = bl_alloc_run(fh->fs, want, &got);
+        if (start == 0) {
+            fprintf(stderr, "file_fallocate error: no space for [%d] blocks\n", (int)want);
+            ret = ErrNoSpace;
+            break;
+        }
+        for (uint32_t n=0; n<got; n++) {
+            map[i+n] = (start + n) | INO_BLOCK_UNWRITTEN;
+            reserved[reserved_count++] = start + n;
+        }
+        i += got;
+    }
+
+    if (ret == OK && first < last &&
+        (ret = ino_set_block_map(fh->fs, &fh->oi->cached_inode, map)) != OK) {
+        fprintf(stderr, "file_fallocate error: failed to write block map of inode [%d]\n",
+                fh->inode_number);
+    }
+
+    // All or nothing, give back what was reserved
+    if (ret != OK) {
+        bl_free_batch(fh->fs, reserved, reserved_count);
+        fh->oi->cache_valid = 0;
+        fh->oi->map_valid = 0;
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        return ret;
+    }
+
+    if (!(flags & MY_FALLOC_KEEP_SIZE) && offset + len > fh->oi->cached_inode.file_size) {
+        fh->oi->cached_inode.file_size = offset + len;
+    }
+    fh->oi->map_valid = 0;
+    ret = ino_write(fh->fs, fh->inode_number, &fh->oi->cached_inode);
+    pthread_rwlock_unlock(&fh->oi->rwlock);
+    return ret;
+}
+
+// Find next data/hole offset from the block map, caller holds fh->oi->rwlock for writing
+static RC file_seek_data_hole(file_handle *fh, uint32_t offset, uint8_t whence, uint32_t *result) {
+    if (oi_refresh(fh->oi) != OK) {
+        fprintf(stderr, "file_seek error: failed to read inode [%d]\n",
+            fh->inode_number);
+        return ErrInode;
+    }
+
+    uint32_t file_size = fh->oi->cached_inode.file_size;
+    if (offset >= file_size) {
+        return ErrNotFound;
+    }
+
+    // Inline content is all data
+    if (ino_is_inline(&fh->oi->cached_inode)) {
+        *result = (whence == MY_SEEK_DATA) ? offset : file_size;
+        return OK;
+    }
+
+    uint32_t *map = fh->oi->block_map;
+    uint32_t block_size = fh->fs->dd->block_size;
+    uint32_t last = (file_size + block_size - 1) / block_size;
+    uint32_t idx = offset / block_size;
+    for (; idx < last; idx++) {
+        uint8_t is_data = map[idx] != 0 && !(map[idx] & INO_BLOCK_UNWRITTEN);
+        if (is_data == (whence == MY_SEEK_DATA))
+            break;
+    }
+
+    if (idx == last) {
+        if (whence == MY_SEEK_DATA)
+            return ErrNotFound;
+        *result = file_size;
+        return OK;
+    }
+
+    *result = (idx*block_size > offset) ? idx*block_size : offset;
+    return OK;
+}
+
 RC file_seek(file_handle *fh, uint32_t offset, uint8_t whence) {
     if (!fh ||
         offset > ino_get_max_filesize(fh->fs) ||
@@ -345,7 +1176,7 @@ RC file_seek(file_handle *fh, uint32_t offset, uint8_t whence) {
         return ErrArg;
     }
 
-    pthread_rwlock_wrlock(&fh->rwlock);
+    pthread_rwlock_wrlock(&fh->oi->rwlock);
     switch (whence) {
     case MY_SEEK_SET:
         fh->offset = offset;
@@ -354,19 +1185,30 @@ RC file_seek(file_handle *fh, uint32_t offset, uint8_t whence) {
         fh->offset += offset;
         break;
     case MY_SEEK_END:
-        if (fh->cache_valid == 0) {
-            if (ino_read(fh->fs, fh->inode_number, &fh->cached_inode) != OK) {
+        if (fh->oi->cache_valid == 0) {
+            if (ino_read(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK) {
                 fprintf(stderr, "file_seek error: failed to read inode [%d]\n",
                     fh->inode_number);
-                pthread_rwlock_unlock(&fh->rwlock);
+                pthread_rwlock_unlock(&fh->oi->rwlock);
                 return ErrInode;
             }
-            fh->cache_valid = 1;
+            fh->oi->cache_valid = 1;
         }
-        fh->offset = fh->cached_inode.file_size + offset;
+        fh->offset = fh->oi->cached_inode.file_size + offset;
         break;
+    case MY_SEEK_DATA:
+    case MY_SEEK_HOLE: {
+        uint32_t result;
+        RC ret = file_seek_data_hole(fh, offset, whence, &result);
+        if (ret != OK) {
+            pthread_rwlock_unlock(&fh->oi->rwlock);
+            return ret;
+        }
+        fh->offset = result;
+        break;
+    }
     }
-    pthread_rwlock_unlock(&fh->rwlock);
+    pthread_rwlock_unlock(&fh->oi->rwlock);
     return OK;
 }
 
@@ -376,9 +1218,9 @@ uint32_t file_tell(file_handle *fh) {
         return 0;
     }
 
-    pthread_rwlock_rdlock(&fh->rwlock);
+    pthread_rwlock_rdlock(&fh->oi->rwlock);
     uint32_t offset = fh->offset;
-    pthread_rwlock_unlock(&fh->rwlock);
+    pthread_rwlock_unlock(&fh->oi->rwlock);
 
     return offset;
 }
@@ -389,31 +1231,72 @@ uint32_t file_size(file_handle *fh) {
         return 0;
     }
 
-    pthread_rwlock_rdlock(&fh->rwlock);
+    pthread_rwlock_rdlock(&fh->oi->rwlock);
 
-    if (fh->cache_valid == 0) {
-        pthread_rwlock_unlock(&fh->rwlock);
-        pthread_rwlock_wrlock(&fh->rwlock);
+    if (fh->oi->cache_valid == 0) {
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        pthread_rwlock_wrlock(&fh->oi->rwlock);
 
-        if (fh->cache_valid == 0) {
-            if (ino_read(fh->fs, fh->inode_number, &fh->cached_inode) != OK) {
+        if (fh->oi->cache_valid == 0) {
+            if (ino_read(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK) {
                 fprintf(stderr, "file_size error: failed to read inode [%d]\n",
                     fh->inode_number);
-                pthread_rwlock_unlock(&fh->rwlock);
+                pthread_rwlock_unlock(&fh->oi->rwlock);
                 return 0;
             }
-            fh->cache_valid = 1;
+            fh->oi->cache_valid = 1;
         }
-        pthread_rwlock_unlock(&fh->rwlock);
-        pthread_rwlock_rdlock(&fh->rwlock);
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        pthread_rwlock_rdlock(&fh->oi->rwlock);
     }
 
-    uint32_t size = fh->cached_inode.file_size;
-    pthread_rwlock_unlock(&fh->rwlock);
+    uint32_t size = fh->oi->cached_inode.file_size;
+    pthread_rwlock_unlock(&fh->oi->rwlock);
 
     return size;
 }
 
+RC file_fsync(file_handle *fh) {
+    if (!fh) {
+        fprintf(stderr, "file_fsync error: wrong args\n");
+        return ErrArg;
+    }
+
+    pthread_rwlock_rdlock(&fh->oi->rwlock);
+    if (fh->oi->cache_valid) {
+        if (ino_write(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK) {
+            fprintf(stderr, "file_fsync error: failed to write inode [%d]\n",
+                    fh->inode_number);
+            pthread_rwlock_unlock(&fh->oi->rwlock);
+            return ErrInode;
+        }
+    }
+    pthread_rwlock_unlock(&fh->oi->rwlock);
+
+    if (fs_flush_bitmaps(fh->fs) != OK) {
+        fprintf(stderr, "file_fsync error: failed to flush bitmaps\n");
+        return ErrDwrite;
+    }
+
+    return dsync(fh->fs->dd);
+}
+
+RC file_fdatasync(file_handle *fh) {
+    if (!fh) {
+        fprintf(stderr, "file_fdatasync error: wrong args\n");
+        return ErrArg;
+    }
+
+    // file_write keeps inode size and block map on disk already,
+    // only the block bitmap may still be in memory
+    if (fs_flush_bitmaps(fh->fs) != OK) {
+        fprintf(stderr, "file_fdatasync error: failed to flush bitmaps\n");
+        return ErrDwrite;
+    }
+
+    return ddatasync(fh->fs->dd);
+}
+
 RC file_check_flags(uint32_t flags) {
     if (flags & (~MY_ALL_FLAGS)) {
         fprintf(stderr, "file_check_flags error: invalid flags %x\n", flags);
@@ -443,7 +1326,7 @@ RC file_check_flags(uint32_t flags) {
 }
 
 RC file_check_whence(uint8_t whence) {
-    if (whence < MY_SEEK_SET || whence > MY_SEEK_END)
+    if (whence < MY_SEEK_SET || whence > MY_SEEK_HOLE)
         return ErrWhence;
     return OK;
 }
@@ -459,23 +1342,23 @@ void file_show(file_handle *fh) {
     printf("========================================\n");
 
     // Get data protected by lock
-    pthread_rwlock_rdlock(&fh->rwlock);
+    pthread_rwlock_rdlock(&fh->oi->rwlock);
 
-    if (!fh->cache_valid) {
-        pthread_rwlock_unlock(&fh->rwlock);
-        pthread_rwlock_wrlock(&fh->rwlock);
+    if (!fh->oi->cache_valid) {
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        pthread_rwlock_wrlock(&fh->oi->rwlock);
 
-        if (!fh->cache_valid) {
-            if (ino_read(fh->fs, fh->inode_number, &fh->cached_inode) != OK) {
-                pthread_rwlock_unlock(&fh->rwlock);
+        if (!fh->oi->cache_valid) {
+            if (ino_read(fh->fs, fh->inode_number, &fh->oi->cached_inode) != OK) {
+                pthread_rwlock_unlock(&fh->oi->rwlock);
                 printf("ERROR: Failed to read inode\n");
                 printf("========================================\n");
                 return;
             }
-            fh->cache_valid = 1;
+            fh->oi->cache_valid = 1;
         }
-        pthread_rwlock_unlock(&fh->rwlock);
-        pthread_rwlock_rdlock(&fh->rwlock);
+        pthread_rwlock_unlock(&fh->oi->rwlock);
+        pthread_rwlock_rdlock(&fh->oi->rwlock);
     }
 
     // Copy info
@@ -483,11 +1366,12 @@ void file_show(file_handle *fh) {
     uint32_t offset = fh->offset;
     uint32_t flags = fh->flags;
     uint32_t refcount = fh->refcount;
-    inode ino_copy = fh->cached_inode;
+    inode ino_copy = fh->oi->cached_inode;
 
-    pthread_rwlock_unlock(&fh->rwlock);
+    pthread_rwlock_unlock(&fh->oi->rwlock);
 
     // === File Handle info ===
+    printf("Descriptor:         %d\n", fh->fd);
     printf("Inode number:       %u\n", inode_num);
     printf("Current offset:     %u bytes", offset);
     if (offset >= 1024*1024) {
@@ -554,9 +1438,14 @@ void file_show(file_handle *fh) {
     // === Block usage ===
     printf("\nBlock allocation:\n");
 
-    // statistics of allocated blocks
+    if (ino_is_inline(&ino_copy)) {
+        printf("  Inline data:      %u of %d bytes, no blocks\n",
+               ino_copy.file_size, INO_INLINE_SIZE);
+    }
+
+    // statistics of allocated blocks, all 0 for inline
     uint32_t direct_blocks = 0;
-    for (int i = 0; i < DIRECT_POINTERS; i++) {
+    for (int i = 0; i < DIRECT_POINTERS && !ino_is_inline(&ino_copy); i++) {
         if (ino_copy.direct_blocks[i] != 0) {
             direct_blocks++;
         }
@@ -564,7 +1453,7 @@ void file_show(file_handle *fh) {
 
     // Check indirect block
     uint32_t indirect_blocks = 0;
-    if (ino_copy.single_indirect != 0) {
+    if (!ino_is_inline(&ino_copy) && ino_copy.single_indirect != 0) {
         uint32_t block_size = fh->fs->dd->block_size;
         uint8_t indirect_buf[block_size];
 
@@ -586,7 +1475,7 @@ void file_show(file_handle *fh) {
 
     // Real Disk usage
     uint32_t total_blocks = direct_blocks + indirect_blocks;
-    if (ino_copy.single_indirect != 0) {
+    if (!ino_is_inline(&ino_copy) && ino_copy.single_indirect != 0) {
         total_blocks++;  // Indirect block itself
     }
     uint32_t disk_usage = total_blocks * fh->fs->dd->block_size;
@@ -637,14 +1526,14 @@ void file_table_show() {
 
     pthread_mutex_lock(&g_file_table.lock);
 
-    printf("Open files: %u / %d\n\n", g_file_table.count, MAX_OPEN_FILES);
+    printf("Open files: %u / %u slots\n\n", g_file_table.count, g_file_table.capacity);
 
     if (g_file_table.count > 0) {
         printf("%-5s %-8s %-8s %-10s %-8s\n",
                 "Slot", "Inode", "Offset", "Flags", "Refcnt");
         printf("---------------------------------------------\n");
 
-        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        for (uint32_t i = 0; i < g_file_table.capacity; i++) {
             if (g_file_table.handles[i] != NULL) {
                 file_handle *fh = g_file_table.handles[i];
                 printf("%-5d %-8u %-8u 0x%-8x %-8u\n",
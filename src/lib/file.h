@@ -27,39 +27,71 @@ extern "C" {
 #define MY_O_CREATE 0x04 // 0000 0100
 #define MY_O_APPEND 0x08 // 0000 1000
 #define MY_O_TRUNC  0x010// 0001 0000
+#define MY_O_DIRECTORY 0x020 // 0010 0000, must be a directory, read only, used as dirfd
 #define MY_ALL_FLAGS (\
         MY_O_RDONLY | \
         MY_O_WRONLY | \
         MY_O_RDWR   | \
         MY_O_CREATE | \
         MY_O_APPEND | \
-        MY_O_TRUNC \
+        MY_O_TRUNC  | \
+        MY_O_DIRECTORY \
 )
 
+#define MY_AT_FDCWD (-100) // dirfd meaning the current working directory
+
 #define MY_SEEK_SET 0 // begin
 #define MY_SEEK_CUR 1 // current offset
 #define MY_SEEK_END 2 // end
+#define MY_SEEK_DATA 3 // next data at or after offset
+#define MY_SEEK_HOLE 4 // next hole at or after offset, EOF counts as a hole
 
-#define MAX_OPEN_FILES 1024
+#define MY_FALLOC_KEEP_SIZE 0x01 // Reserve blocks without growing the file
 
+#define FILE_TABLE_INIT_SLOTS 64 // Table doubles from here when full
 
-struct s_file_handle {
-    filesystem *fs;
 
+#define OPEN_INODE_BUCKETS 256
+
+/*
+ * One per open inode, shared by every handle on it
+ * rwlock guards the cached inode, the block map cache and file data
+ * */
+struct s_open_inode {
+    filesystem *fs;
     uint32_t inode_number;
+
     inode cached_inode;
     uint8_t cache_valid;
 
+    uint32_t *block_map; // Logical to physical map, ino_get_block_map layout
+    uint8_t map_valid;
+
+    uint32_t refcount;   // Handles on it, protected by the open inode table lock
+    pthread_rwlock_t rwlock;
+
+    struct s_open_inode *next; // Hash chain
+};
+typedef struct s_open_inode open_inode;
+
+struct s_file_handle {
+    filesystem *fs;
+
+    uint32_t inode_number;
+    open_inode *oi;
+
     uint32_t refcount;
     uint32_t offset;
     uint32_t flags;
-
-    pthread_rwlock_t rwlock;
+    int32_t fd; // Descriptor, slot in g_file_table
 };
 typedef struct s_file_handle file_handle;
 
 struct s_global_file_table {
-    file_handle *handles[MAX_OPEN_FILES];
+    file_handle **handles;  // Slot fd holds descriptor fd, NULL if free
+    int32_t *free_slots;    // Stack of free descriptors, open and close are O(1)
+    uint32_t free_count;
+    uint32_t capacity;      // Allocated slots, grows by doubling
     pthread_mutex_t lock;
     uint32_t count;
 };
@@ -72,6 +104,38 @@ extern global_file_table g_file_table;
  * */
 void file_table_init();
 
+/*
+ * Add delta to the link count of an inode and write it back, the new count goes to *nlink
+ * goes through the shared open inode, so open handles never write back a stale count
+ * */
+RC file_inode_link_adjust(filesystem *fs, uint32_t inode_number, int32_t delta, uint32_t *nlink);
+
+/*
+ * Move the blocks of a regular file into contiguous runs from bl_alloc_run, data in logical order
+ * then the indirect block, the new map is published with one inode write and the old blocks freed
+ * open handles wait on the shared open inode meanwhile, *before and *after are extent counts
+ * nothing moves unless the count goes down, or while a block is shared with a clone
+ * an inode that was unlinked or freed meanwhile is skipped with both counts 0
+ * */
+RC file_inode_defrag(filesystem *fs, uint32_t inode_number, uint32_t *before, uint32_t *after);
+
+/*
+ * Hold the shared open inode of inode_number for reading, *ino gets its current copy
+ * blocks stay where the map says until file_inode_unlock, defrag and writers wait
+ * NULL on failure, nothing held then
+ * */
+open_inode *file_inode_rdlock(filesystem *fs, uint32_t inode_number, inode *ino);
+
+/*
+ * Release what file_inode_rdlock took
+ * */
+void file_inode_unlock(open_inode *oi);
+
+/*
+ * Number of inodes with at least one open handle
+ * */
+uint32_t file_open_inode_count();
+
 /*
  * Display global file table content
  * */
@@ -88,11 +152,45 @@ uint32_t file_table_count();
 
 file_handle *file_open(filesystem *fs, const char *path_str, uint32_t flags);
 
+/*
+ * Like openat(2), relative path_str starts at the directory open as dirfd
+ * dirfd is a descriptor opened with MY_O_DIRECTORY, or MY_AT_FDCWD
+ * */
+file_handle *file_open_at(filesystem *fs, int32_t dirfd, const char *path_str, uint32_t flags);
+
+/*
+ * Inode number a dirfd resolves from, 0 for MY_AT_FDCWD (the cwd)
+ * fails with ErrArg unless dirfd is an open directory handle
+ * */
+RC file_dirfd_inode(int32_t dirfd, uint32_t *inode_num);
+
 /*
  * Close a file handle, free resources
  * */
 RC file_close(file_handle *fh);
 
+/*
+ * Like open(2), same as file_open but returns a descriptor, -1 on failure
+ * */
+int32_t file_open_fd(filesystem *fs, const char *path_str, uint32_t flags);
+
+/*
+ * Get the file handle of a descriptor, NULL if it is not open
+ *  takes a reference under the table lock, release it with file_put, the handle stays
+ *  valid until then even if another thread closes the descriptor
+ * */
+file_handle *file_from_fd(int32_t fd);
+
+/*
+ * Drop a reference taken by file_from_fd, NULL is ignored
+ * */
+void file_put(file_handle *fh);
+
+/*
+ * Like close(2)
+ * */
+RC file_close_fd(int32_t fd);
+
 /*
  * Read file content
  * */
@@ -103,8 +201,29 @@ uint32_t file_read(file_handle *fh, uint8_t *buf, uint32_t size);
  * */
 uint32_t file_write(file_handle *fh, uint8_t *buf, uint32_t size);
 
+/*
+ * Like ftruncate(2), blocks past the new size are released in one pass
+ * growing leaves a hole that reads back as zeros
+ * */
+RC file_truncate(file_handle *fh, uint32_t size);
+
+/*
+ * Like fallocate(PUNCH_HOLE | KEEP_SIZE), zero [offset, offset+len)
+ * whole blocks inside the range are released, the file size does not change
+ * */
+RC file_punch_hole(file_handle *fh, uint32_t offset, uint32_t len);
+
+/*
+ * Like fallocate(2), reserve blocks for [offset, offset+len) in contiguous runs
+ * new blocks are marked unwritten and read back as zeros, later writes allocate nothing
+ * the file grows to offset+len unless MY_FALLOC_KEEP_SIZE is set
+ * */
+RC file_fallocate(file_handle *fh, uint32_t offset, uint32_t len, uint32_t flags);
+
 /*
  * Set file offset
+ * MY_SEEK_DATA/MY_SEEK_HOLE walk the block map, unwritten blocks count as holes
+ * they return ErrNotFound when offset is at or past EOF (or no data follows)
  * */
 RC file_seek(file_handle *fh, uint32_t offset, uint8_t whence);
 
@@ -118,6 +237,16 @@ uint32_t file_tell(file_handle *fh);
  * */
 uint32_t file_size(file_handle *fh);
 
+/*
+ * Like fsync(2), write back the inode, dirty bitmaps and flush the disk image
+ * */
+RC file_fsync(file_handle *fh);
+
+/*
+ * Like fdatasync(2), file data and the metadata needed to read it back
+ * */
+RC file_fdatasync(file_handle *fh);
+
 /*
  * Display file content
  * */
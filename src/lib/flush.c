@@ -0,0 +1,167 @@
+/*
+ * flush.c
+ * 
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#include "flush.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint32_t flusher_dirty_percent(filesystem *fs) {
+    uint32_t total = fs->inode_bitmap_bl_count + fs->block_bitmap_bl_count
+        + (fs->block_refs ? fs->refcount_bl_count : 0);
+    if (total == 0) {
+        return 0;
+    }
+    return fs->dirty_count * 100 / total;
+}
+
+// Caller holds fs->alloc_lock
+static uint8_t flusher_should_flush(flusher *fl, uint64_t now) {
+    filesystem *fs = fl->fs;
+    if (fs->dirty_count == 0) {
+        return 0;
+    }
+
+    if (now - fs->dirty_since_ms >= fl->cfg.dirty_expire_ms) {
+        return 1;
+    }
+
+    return flusher_dirty_percent(fs) >= fl->cfg.dirty_ratio;
+}
+
+static void *flusher_main(void *arg) {
+    flusher *fl = (flusher *)arg;
+    filesystem *fs = fl->fs;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (!fl->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += fl->cfg.interval_ms / 1000;
+        deadline.tv_nsec += (long)(fl->cfg.interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&fl->cond, &fs->alloc_lock, &deadline);
+
+        if (fl->stop || !flusher_should_flush(fl, fs_now_ms())) {
+            continue;
+        }
+
+        // fs_flush_bitmaps takes alloc_lock per block
+        pthread_mutex_unlock(&fs->alloc_lock);
+        if (fs_flush_bitmaps(fs) != OK) {
+            fprintf(stderr, "flusher error: failed to write back bitmaps\n");
+        } else if (fl->cfg.datasync) {
+            ddatasync(fs->dd);
+        }
+        pthread_mutex_lock(&fs->alloc_lock);
+        fl->rounds++;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return NULL;
+}
+
+RC fs_flusher_start(filesystem *fs, const flusher_config *cfg) {
+    if (!fs) {
+        fprintf(stderr, "fs_flusher_start error: wrong args...\n");
+        return ErrArg;
+    }
+
+    if (fs->flusher) {
+        fprintf(stderr, "fs_flusher_start error: flusher is already running\n");
+        return ErrInternal;
+    }
+
+    flusher *fl = (flusher *)malloc(sizeof(struct s_flusher));
+    if (!fl) {
+        fprintf(stderr, "fs_flusher_start error: no enough memory for flusher\n");
+        return ErrNoMem;
+    }
+    memset(fl, 0, sizeof(struct s_flusher));
+    fl->fs = fs;
+
+    if (cfg) {
+        fl->cfg = *cfg;
+    } else {
+        fl->cfg.interval_ms     = FLUSH_DEFAULT_INTERVAL_MS;
+        fl->cfg.dirty_expire_ms = FLUSH_DEFAULT_DIRTY_EXPIRE_MS;
+        fl->cfg.dirty_ratio     = FLUSH_DEFAULT_DIRTY_RATIO;
+        fl->cfg.datasync        = 1;
+    }
+    if (fl->cfg.interval_ms == 0) {
+        fl->cfg.interval_ms = FLUSH_DEFAULT_INTERVAL_MS;
+    }
+    if (fl->cfg.dirty_ratio > 100) {
+        fl->cfg.dirty_ratio = 100;
+    }
+
+    if (pthread_cond_init(&fl->cond, NULL) != 0) {
+        fprintf(stderr, "fs_flusher_start error: failed to init cond\n");
+        free(fl);
+        return ErrInternal;
+    }
+
+    // Publish before the thread runs, flusher_kick may be called right away
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->flusher = fl;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if (pthread_create(&fl->thread, NULL, flusher_main, fl) != 0) {
+        fprintf(stderr, "fs_flusher_start error: failed to create thread\n");
+        pthread_mutex_lock(&fs->alloc_lock);
+        fs->flusher = NULL;
+        pthread_mutex_unlock(&fs->alloc_lock);
+        pthread_cond_destroy(&fl->cond);
+        free(fl);
+        return ErrInternal;
+    }
+
+    return OK;
+}
+
+RC fs_flusher_stop(filesystem *fs) {
+    if (!fs || !fs->flusher) {
+        fprintf(stderr, "fs_flusher_stop error: flusher is not running\n");
+        return ErrArg;
+    }
+
+    flusher *fl = fs->flusher;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    fl->stop = 1;
+    pthread_cond_signal(&fl->cond);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    pthread_join(fl->thread, NULL);
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->flusher = NULL;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    pthread_cond_destroy(&fl->cond);
+    free(fl);
+
+    return fs_flush_bitmaps(fs);
+}
+
+void flusher_kick(filesystem *fs) {
+    flusher *fl = fs->flusher;
+    if (!fl) {
+        return;
+    }
+
+    if (flusher_dirty_percent(fs) >= fl->cfg.dirty_ratio) {
+        pthread_cond_signal(&fl->cond);
+    }
+}
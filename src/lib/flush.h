@@ -0,0 +1,66 @@
+/*
+ * flush.h
+ * Background write-back thread for dirty metadata
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#ifndef MY_FLUSH_H_
+#define MY_FLUSH_H_
+
+#include "error.h"
+#include "fs.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLUSH_DEFAULT_INTERVAL_MS     500  // How often the flusher wakes up
+#define FLUSH_DEFAULT_DIRTY_EXPIRE_MS 3000 // Dirty data older than this is written back
+#define FLUSH_DEFAULT_DIRTY_RATIO     20   // Percent of dirty metadata blocks to force write-back
+
+struct s_flusher_config {
+    uint32_t interval_ms;
+    uint32_t dirty_expire_ms;
+    uint32_t dirty_ratio;  // 0 ~ 100
+    uint8_t  datasync;     // 1: fdatasync the disk image after every write-back
+};
+typedef struct s_flusher_config flusher_config;
+
+struct s_flusher {
+    filesystem *fs;
+    flusher_config cfg;
+
+    pthread_t thread;
+    pthread_cond_t cond;   // Waits with fs->alloc_lock
+    uint8_t stop;
+
+    uint64_t rounds;       // Write-back rounds done, for statistics
+};
+typedef struct s_flusher flusher;
+
+/*
+ * Start a flusher thread for fs, cfg NULL means default config
+ * */
+RC fs_flusher_start(filesystem *fs, const flusher_config *cfg);
+
+/*
+ * Stop the flusher thread, dirty metadata is written back before return
+ * */
+RC fs_flusher_stop(filesystem *fs);
+
+/*
+ * Wake the flusher up if the dirty ratio is over threshold
+ *  caller must hold fs->alloc_lock
+ * */
+void flusher_kick(filesystem *fs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,10 +12,12 @@
 #include "error.h"
 #include "disk.h"
 #include "bitmap.h"
+#include "flush.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 RC fs_format(disk *dd) {
     if (!dd) {
@@ -38,6 +40,7 @@ RC fs_format(disk *dd) {
 
     super_data->magic1 = Magic1;    // Constant define in fs.h
     super_data->magic2 = Magic2;    // Constant define in fs.h
+    super_data->version = FsVersion; // fs_mount refuses any other layout
     super_data->blocks = dd->blocks;
 
     super_data->inodeblocks = dd->blocks
@@ -52,13 +55,18 @@ RC fs_format(disk *dd) {
         + super_data->inode_bitmap_bl_count;
     super_data->block_bitmap_bl_count = cal_needed_bitmap_blocks(dd->blocks, dd->block_size);
 
-    super_data->inode_table_start  = super_data->block_bitmap_start 
+    super_data->refcount_start = super_data->block_bitmap_start
         + super_data->block_bitmap_bl_count;
+    super_data->refcount_bl_count = cal_needed_refcount_blocks(dd->blocks, dd->block_size);
+
+    super_data->inode_table_start  = super_data->refcount_start
+        + super_data->refcount_bl_count;
 
     super_data->datablock_start = super_data->inode_table_start 
         + super_data->inodeblocks;
     super_data->datablock_bl_count = super_data->blocks - super_data->inodeblocks - 1 -
-        super_data->inode_bitmap_bl_count - super_data->block_bitmap_bl_count;
+        super_data->inode_bitmap_bl_count - super_data->block_bitmap_bl_count -
+        super_data->refcount_bl_count;
 
     super_data->free_blocks = super_data->blocks - super_data->datablock_start + 1;
     super_data->free_inodes = super_data->inodes;
@@ -106,6 +114,26 @@ RC fs_format(disk *dd) {
     }
 
     bm_destroy(block_bitmap);
+
+    // Init refcount blocks, no block is shared yet
+    uint8_t *zero_buf = (uint8_t *)malloc(dd->block_size);
+    if (!zero_buf) {
+        free(super_data);
+        fprintf(stderr, "fs_format error: Failed to allocate refcount buffer\n");
+        return ErrNoMem;
+    }
+    memset(zero_buf, 0, dd->block_size);
+    for (uint32_t i = 0; i < super_data->refcount_bl_count; i++) {
+        ret = dwrite(dd, zero_buf, super_data->refcount_start+i);
+        if (ret != OK) {
+            free(zero_buf);
+            free(super_data);
+            fprintf(stderr, "fs_format error: falied to init refcount block at block %d\n", i);
+            return ret;
+        }
+    }
+    free(zero_buf);
+
     // Init inode table blocks
     uint8_t *block_buf = (uint8_t *)malloc(dd->block_size);
     if (!block_buf) {
@@ -141,6 +169,41 @@ RC fs_format(disk *dd) {
     return ret;
 }
 
+static RC fs_stripe_locks_init(filesystem *fs) {
+    for (uint32_t i=0; i<DIR_LOCK_STRIPES; i++) {
+        if (pthread_mutex_init(&fs->dir_locks[i], NULL) != 0) {
+            while (i-- > 0)
+                pthread_mutex_destroy(&fs->dir_locks[i]);
+            return ErrInternal;
+        }
+    }
+    for (uint32_t i=0; i<INO_LOCK_STRIPES; i++) {
+        if (pthread_mutex_init(&fs->ino_locks[i], NULL) != 0) {
+            while (i-- > 0)
+                pthread_mutex_destroy(&fs->ino_locks[i]);
+            for (uint32_t j=0; j<DIR_LOCK_STRIPES; j++)
+                pthread_mutex_destroy(&fs->dir_locks[j]);
+            return ErrInternal;
+        }
+    }
+    if (pthread_mutex_init(&fs->rename_lock, NULL) != 0) {
+        for (uint32_t i=0; i<DIR_LOCK_STRIPES; i++)
+            pthread_mutex_destroy(&fs->dir_locks[i]);
+        for (uint32_t i=0; i<INO_LOCK_STRIPES; i++)
+            pthread_mutex_destroy(&fs->ino_locks[i]);
+        return ErrInternal;
+    }
+    return OK;
+}
+
+static void fs_stripe_locks_destroy(filesystem *fs) {
+    for (uint32_t i=0; i<DIR_LOCK_STRIPES; i++)
+        pthread_mutex_destroy(&fs->dir_locks[i]);
+    for (uint32_t i=0; i<INO_LOCK_STRIPES; i++)
+        pthread_mutex_destroy(&fs->ino_locks[i]);
+    pthread_mutex_destroy(&fs->rename_lock);
+}
+
 RC fs_mount(disk *dd, filesystem *fs) {
     if (!dd || !fs)
         return ErrArg;
@@ -160,6 +223,15 @@ RC fs_mount(disk *dd, filesystem *fs) {
         return ret;
     }
 
+    // Inodes, block maps and inline data would all be read at the wrong offsets
+    if (super_data->magic1 != Magic1 || super_data->magic2 != Magic2 ||
+        super_data->version != FsVersion) {
+        fprintf(stderr, "fs_mount error: disk layout version [%d] is not [%d], format it again\n",
+                super_data->version, FsVersion);
+        free(super_data);
+        return ErrArg;
+    }
+
     // Clear filesystem structure
     size = sizeof(struct s_filesystem);
     memset(fs, 0, size);
@@ -172,6 +244,8 @@ RC fs_mount(disk *dd, filesystem *fs) {
     fs->inode_bitmap_bl_count = super_data->inode_bitmap_bl_count;
     fs->block_bitmap_start    = super_data->block_bitmap_start;
     fs->block_bitmap_bl_count = super_data->block_bitmap_bl_count;
+    fs->refcount_start        = super_data->refcount_start;
+    fs->refcount_bl_count     = super_data->refcount_bl_count;
     fs->inode_table_start     = super_data->inode_table_start;
     fs->datablock_start       = super_data->datablock_start;
     fs->datablock_bl_count    = super_data->datablock_bl_count;
@@ -215,9 +289,10 @@ RC fs_mount(disk *dd, filesystem *fs) {
 
     fs->inode_bitmap = inode_bitmap;
     fs->block_bitmap = block_bitmap;
+    ino_groups_init(fs);
 
-    // Initialize directory lock
-    if (pthread_mutex_init(&fs->dir_lock, NULL) != 0) {
+    // Initialize directory locks
+    if (fs_stripe_locks_init(fs) != OK) {
         free(super_data);
         bm_destroy(inode_bitmap);
         bm_destroy(block_bitmap);
@@ -225,6 +300,55 @@ RC fs_mount(disk *dd, filesystem *fs) {
         return ErrInternal;
     }
 
+    // Initialize allocation lock and write-back state
+    if (pthread_mutex_init(&fs->alloc_lock, NULL) != 0) {
+        free(super_data);
+        bm_destroy(inode_bitmap);
+        bm_destroy(block_bitmap);
+        fs_stripe_locks_destroy(fs);
+        fprintf(stderr, "fs_mount error: failed to initialize allocation lock\n");
+        return ErrInternal;
+    }
+
+    fs->inode_bitmap_dirty = bm_create((fs->inode_bitmap_bl_count+7) / 8);
+    fs->block_bitmap_dirty = bm_create((fs->block_bitmap_bl_count+7) / 8);
+    if (!fs->inode_bitmap_dirty || !fs->block_bitmap_dirty) {
+        free(super_data);
+        bm_destroy(inode_bitmap);
+        bm_destroy(block_bitmap);
+        bm_destroy(fs->inode_bitmap_dirty);
+        bm_destroy(fs->block_bitmap_dirty);
+        fs_stripe_locks_destroy(fs);
+        pthread_mutex_destroy(&fs->alloc_lock);
+        fprintf(stderr, "fs_mount error: failed to create dirty bitmaps\n");
+        return ErrBmCreate;
+    }
+    fs->dirty_count = 0;
+    fs->dirty_since_ms = 0;
+    fs->flusher = NULL;
+
+    // Shared block counters, disks formatted before have none and can not clone
+    if (fs->refcount_bl_count) {
+        fs->block_refs = (uint16_t *)malloc(fs->refcount_bl_count * dd->block_size);
+        fs->block_refs_dirty = bm_create((fs->refcount_bl_count+7) / 8);
+        start = fs->refcount_start;
+        end = start+fs->refcount_bl_count-1;
+        if (!fs->block_refs || !fs->block_refs_dirty ||
+                dreads(dd, (uint8_t*)fs->block_refs, start, end) != OK) {
+            free(super_data);
+            free(fs->block_refs);
+            bm_destroy(fs->block_refs_dirty);
+            bm_destroy(inode_bitmap);
+            bm_destroy(block_bitmap);
+            bm_destroy(fs->inode_bitmap_dirty);
+            bm_destroy(fs->block_bitmap_dirty);
+            fs_stripe_locks_destroy(fs);
+            pthread_mutex_destroy(&fs->alloc_lock);
+            fprintf(stderr, "fs_mount error: failed to load refcount table\n");
+            return ErrDread;
+        }
+    }
+
     free(super_data);
     return ret;
 }
@@ -238,6 +362,11 @@ RC fs_unmount(filesystem *fs) {
     RC ret = OK;
     uint32_t start, end;
 
+    // Stop background write-back first, the bitmaps are written in full below
+    if (fs->flusher) {
+        fs_flusher_stop(fs);
+    }
+
     start = fs->inode_bitmap_start;
     end = start+fs->inode_bitmap_bl_count-1;
     ret = dwrites(fs->dd, fs->inode_bitmap->bytes, start, end);
@@ -254,6 +383,18 @@ RC fs_unmount(filesystem *fs) {
         return ret;
     }
 
+    if (fs->block_refs) {
+        start = fs->refcount_start;
+        end = start+fs->refcount_bl_count-1;
+        ret = dwrites(fs->dd, (uint8_t*)fs->block_refs, start, end);
+        if (ret != OK) {
+            fprintf(stderr, "fs_unmount error, failed to write refcount table back to disk...\n");
+            return ret;
+        }
+        free(fs->block_refs);
+        fs->block_refs = NULL;
+    }
+
     // Use bm_destroy() to properly free bitmaps
     if (fs->inode_bitmap) {
         bm_destroy(fs->inode_bitmap);
@@ -265,8 +406,17 @@ RC fs_unmount(filesystem *fs) {
         fs->block_bitmap = NULL;
     }
 
-    // Destroy directory lock
-    pthread_mutex_destroy(&fs->dir_lock);
+    bm_destroy(fs->inode_bitmap_dirty);
+    bm_destroy(fs->block_bitmap_dirty);
+    bm_destroy(fs->block_refs_dirty);
+    fs->inode_bitmap_dirty = NULL;
+    fs->block_bitmap_dirty = NULL;
+    fs->block_refs_dirty = NULL;
+    fs->dirty_count = 0;
+
+    // Destroy directory locks
+    fs_stripe_locks_destroy(fs);
+    pthread_mutex_destroy(&fs->alloc_lock);
 
     return ret;
 }
@@ -320,6 +470,12 @@ RC fs_show(filesystem *fs) {
            fs->block_bitmap_start,
            fs->block_bitmap_bl_count,
            fs->block_bitmap_bl_count > 1 ? "s" : "");
+    if (fs->refcount_bl_count) {
+        printf("  [Block %3u]:      Refcount Table (%u block%s)\n",
+               fs->refcount_start,
+               fs->refcount_bl_count,
+               fs->refcount_bl_count > 1 ? "s" : "");
+    }
     printf("  [Block %3u-%3u]:  Inode Table (%u blocks)\n",
            fs->inode_table_start,
            fs->inode_table_start + fs->inodeblocks - 1,
@@ -351,6 +507,7 @@ RC fs_show(filesystem *fs) {
         printf("    Free:           %u (%.1f%%)\n",
                free_inodes,
                (double)free_inodes / fs->inodes * 100.0);
+        printf("    Groups:         %u x %u inodes\n", INO_GROUPS, fs->ino_group_size);
     } else {
         printf("  Inode bitmap:     <not loaded>\n");
     }
@@ -393,6 +550,125 @@ RC fs_show(filesystem *fs) {
     return OK;
 }
 
+// Caller holds fs->alloc_lock
+static void fs_mark_dirty(filesystem *fs, bitmap *dirty, uint32_t bl_idx) {
+    if (!dirty) { // Not mounted through fs_mount, or no such area
+        return;
+    }
+
+    if (bm_getbit(dirty, bl_idx)) {
+        return;
+    }
+
+    bm_setbit(dirty, bl_idx);
+    if (fs->dirty_count++ == 0) {
+        fs->dirty_since_ms = fs_now_ms();
+    }
+
+    if (fs->flusher) {
+        flusher_kick(fs);
+    }
+}
+
+void fs_mark_bitmap_dirty(filesystem *fs, bitmap *bm, uint32_t idx) {
+    if (!fs || !bm) {
+        return;
+    }
+
+    bitmap *dirty = (bm == fs->inode_bitmap) ? fs->inode_bitmap_dirty : fs->block_bitmap_dirty;
+
+    // Every bitmap block holds block_size*8 bits
+    fs_mark_dirty(fs, dirty, idx / (fs->dd->block_size * 8));
+}
+
+void fs_mark_refs_dirty(filesystem *fs, uint32_t idx) {
+    if (!fs) {
+        return;
+    }
+
+    // Every refcount block holds block_size/2 counters
+    fs_mark_dirty(fs, fs->block_refs_dirty, idx / (fs->dd->block_size / sizeof(uint16_t)));
+}
+
+// Write back dirty blocks of one in-memory area, start is its first block number on disk
+static RC fs_flush_area(filesystem *fs, uint8_t *bytes, bitmap *dirty,
+        uint32_t start, uint32_t bl_count) {
+    uint32_t block_size = fs->dd->block_size;
+    uint8_t block_buf[block_size];
+    RC ret = OK;
+
+    if (!bytes || !dirty) {
+        return OK;
+    }
+
+    for (uint32_t i=0; i<bl_count; i++) {
+        // Copy the block under lock, then write it without blocking allocators
+        pthread_mutex_lock(&fs->alloc_lock);
+        if (!bm_getbit(dirty, i)) {
+            pthread_mutex_unlock(&fs->alloc_lock);
+            continue;
+        }
+        memcpy(block_buf, bytes + i*block_size, block_size);
+        bm_unsetbit(dirty, i);
+        fs->dirty_count--;
+        if (fs->dirty_count == 0) {
+            fs->dirty_since_ms = 0;
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+
+        if (dwrite(fs->dd, block_buf, start+i) != OK) {
+            fprintf(stderr, "fs_flush_bitmaps error: failed to write metadata block [%d]\n",
+                    start+i);
+            // Keep it dirty, the next flush will retry
+            pthread_mutex_lock(&fs->alloc_lock);
+            fs_mark_dirty(fs, dirty, i);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            ret = ErrDwrite;
+        }
+    }
+
+    return ret;
+}
+
+RC fs_flush_bitmaps(filesystem *fs) {
+    if (!fs || !fs->inode_bitmap_dirty || !fs->block_bitmap_dirty) {
+        fprintf(stderr, "fs_flush_bitmaps error: wrong args...\n");
+        return ErrArg;
+    }
+
+    RC ret = fs_flush_area(fs, fs->inode_bitmap->bytes, fs->inode_bitmap_dirty,
+            fs->inode_bitmap_start, fs->inode_bitmap_bl_count);
+    RC ret2 = fs_flush_area(fs, fs->block_bitmap->bytes, fs->block_bitmap_dirty,
+            fs->block_bitmap_start, fs->block_bitmap_bl_count);
+    RC ret3 = fs_flush_area(fs, (uint8_t*)fs->block_refs, fs->block_refs_dirty,
+            fs->refcount_start, fs->refcount_bl_count);
+
+    if (ret != OK)
+        return ret;
+    return ret2 != OK ? ret2 : ret3;
+}
+
+RC fs_sync(filesystem *fs) {
+    if (!fs) {
+        fprintf(stderr, "fs_sync error: wrong args...\n");
+        return ErrArg;
+    }
+
+    RC ret = fs_flush_bitmaps(fs);
+    if (ret != OK) {
+        fprintf(stderr, "fs_sync error: failed to flush bitmaps\n");
+        return ret;
+    }
+
+    return dsync(fs->dd);
+}
+
+uint64_t fs_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 uint32_t cal_needed_bitmap_blocks(uint32_t bits, uint32_t block_size) {
     uint32_t bits_per_block = block_size * 8;
     uint32_t ret = bits / bits_per_block;
@@ -400,3 +676,11 @@ uint32_t cal_needed_bitmap_blocks(uint32_t bits, uint32_t block_size) {
         ret += 1;
     return ret;
 }
+
+uint32_t cal_needed_refcount_blocks(uint32_t blocks, uint32_t block_size) {
+    uint32_t refs_per_block = block_size / sizeof(uint16_t);
+    uint32_t ret = blocks / refs_per_block;
+    if (blocks % refs_per_block)
+        ret += 1;
+    return ret;
+}
@@ -21,7 +21,13 @@ extern "C" {
 
 #define Magic1 (0x04)
 #define Magic2 (0x17)
+#define FsVersion (2) // Bumped with the on-disk layout, 2: 128 byte inodes with inline data
 #define InodeBlockPercentage (0.1) // How many blocks inode table takes in
+#define DIR_LOCK_STRIPES 64 // Directories hash onto this many entry locks
+#define INO_LOCK_STRIPES 64 // Inode table blocks hash onto this many locks
+#define INO_GROUPS 32       // Inode numbers are split into this many allocation groups
+
+struct s_flusher;
 
 struct s_filesystem {
     disk *dd;                     // Low level disk simulator
@@ -34,6 +40,8 @@ struct s_filesystem {
     uint32_t inode_bitmap_bl_count;
     uint32_t block_bitmap_start; // Dynamic calc
     uint32_t block_bitmap_bl_count;
+    uint32_t refcount_start;     // Dynamic calc, 0 if the disk was formatted without it
+    uint32_t refcount_bl_count;
     uint32_t inode_table_start; // Dynamic calc
     uint32_t datablock_start;    // Dynamic calc
     uint32_t datablock_bl_count;
@@ -42,8 +50,30 @@ struct s_filesystem {
     bitmap *inode_bitmap;          // inode alloc
     bitmap *block_bitmap;          // block alloc
 
+    // Shared block counters, index is block number - 1
+    // 0 means one owner, n means n+1 owners, NULL if the disk has no refcount area
+    uint16_t *block_refs;
+
     // Thread synchronization
-    pthread_mutex_t dir_lock;      // Protects directory operations (dir_add, dir_remove, dir_lookup)
+    pthread_mutex_t dir_locks[DIR_LOCK_STRIPES]; // Directory entry changes, striped by directory inode number
+    pthread_mutex_t rename_lock;   // Serializes renames across directories, keeps the subtree check stable
+    pthread_mutex_t ino_locks[INO_LOCK_STRIPES]; // ino_write read-modify-write, striped by inode table block
+    pthread_mutex_t alloc_lock;    // Protects both bitmaps and their dirty state
+
+    // Inode placement, a group is a run of whole inode table blocks, counters under alloc_lock
+    uint32_t ino_group_size;               // Inodes per group
+    uint32_t ino_group_free[INO_GROUPS];   // Free inodes per group
+    uint32_t ino_dir_cursor;               // Group the next top level directory search starts at
+
+    // Write-back state, bitmaps live in memory and reach disk at sync time
+    bitmap *inode_bitmap_dirty;    // One bit per inode bitmap block
+    bitmap *block_bitmap_dirty;    // One bit per block bitmap block
+    bitmap *block_refs_dirty;      // One bit per refcount block
+    uint32_t dirty_count;          // Dirty bitmap blocks in total
+    uint64_t dirty_since_ms;       // Monotonic time the oldest dirty block was marked, 0 if clean
+    struct s_flusher *flusher;     // Background write-back thread, NULL if not started
+
+    uint8_t discard;               // 1: punch freed runs out of the disk image, off by default
 };
 typedef struct s_filesystem filesystem;
 
@@ -52,8 +82,33 @@ RC fs_mount(disk *dd, filesystem *fs);   // Init a filesystem struct
 RC fs_unmount(filesystem *fs);           // Destroy a filesystem struct
 RC fs_show(filesystem *fs); // display filesystem infomation
 
+/*
+ * Mark the bitmap block holding bit idx as dirty
+ *  bm should be fs->inode_bitmap or fs->block_bitmap
+ *  caller must hold fs->alloc_lock
+ */
+void fs_mark_bitmap_dirty(filesystem *fs, bitmap *bm, uint32_t idx);
+
+/*
+ * Mark the refcount block holding counter idx as dirty
+ *  caller must hold fs->alloc_lock
+ */
+void fs_mark_refs_dirty(filesystem *fs, uint32_t idx);
+
+/*
+ * Write dirty bitmap and refcount blocks back to disk, no fsync on the disk image
+ */
+RC fs_flush_bitmaps(filesystem *fs);
+
+/*
+ * Like sync(2), write back all dirty metadata and fsync the disk image
+ */
+RC fs_sync(filesystem *fs);
+
 // Helper function
 uint32_t cal_needed_bitmap_blocks(uint32_t bits, uint32_t block_size);
+uint32_t cal_needed_refcount_blocks(uint32_t blocks, uint32_t block_size);
+uint64_t fs_now_ms();
 
 #ifdef __cplusplus
 }
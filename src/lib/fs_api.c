@@ -12,13 +12,26 @@
 #include "directory.h"
 #include "block.h"
 #include "file.h"
+#include "pool.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fnmatch.h>
+
+#define FS_CAT_CHUNK_BLOCKS 16 // fs_cat streams this many blocks per read
+#define RMDIR_FREE_BATCH 1024  // fs_rmdir_parallel frees blocks in batches of about this many
+#define FRAG_SCAN_BATCH 64     // fs_frag_report reads this many inodes per ino_read_batch
+#define DEFRAG_THREADS 4       // fs_defrag walks a directory tree with this many threads
 
 RC fs_touch(filesystem *fs, const char *path_str) {
-    if (!fs || !path_str) {
+    return fs_touch_at(fs, MY_AT_FDCWD, path_str);
+}
+
+RC fs_touch_at(filesystem *fs, int32_t dirfd, const char *path_str) {
+    uint32_t dir_inode_num;
+    if (!fs || !path_str || path_str[0] == '\0' || file_dirfd_inode(dirfd, &dir_inode_num) != OK) {
         fprintf(stderr, "fs_touch error: wrong args...\n");
         return ErrArg;
     }
@@ -28,34 +41,23 @@ RC fs_touch(filesystem *fs, const char *path_str) {
         return ErrArg;
     }
 
-    path p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&p, 0, size);
-
-    if (path_parse(path_str, &p) != OK) {
-        fprintf(stderr, "fs_touch error: failed to parse path_str [%s] to path structure...\n",
-                path_str);
-        return ErrName;
-    }
-
+    // Resolve the parent in place, name points into path_str
     inode ino;
-    uint32_t inode_num;
-    if (p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
+    path_component last;
+    uint32_t parent_num = path_resolve_parent_at(fs, dir_inode_num, path_str, &ino, &last);
+    if (parent_num == 0) {
+        fprintf(stderr, "fs_touch error: directory not exists for [%s]\n",
+                path_str);
+        return ErrPath;
     }
 
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_touch error: failed to read base inode [%d]\n",
-                inode_num);
-        return ErrInode;
+    char name[MAX_FILENAME_LEN];
+    if (path_component_copy(&last, name) != OK) {
+        return ErrName;
     }
 
     // Check whether file exists (outside lock for better performance)
-    if ((inode_num = path_lookup(fs, ino, &p)) != 0) {
+    if (dir_lookup_n(fs, &ino, last.name, last.len) != 0) {
         fprintf(stderr, "fs_touch error: file already exists [%s]\n",
                 path_str);
         return ErrDirentExists;
@@ -65,62 +67,34 @@ RC fs_touch(filesystem *fs, const char *path_str) {
     inode new_ino;
     ino_init(&new_ino);
     new_ino.file_type = FTypeFile;
-    if ((new_ino.inode_number = ino_alloc(fs)) == 0) {
+    if ((new_ino.inode_number = ino_alloc_near(fs, parent_num, FTypeFile)) == 0) {
         fprintf(stderr, "fs_touch error: failed to alloc new inode number\n");
         return ErrInternal;
     }
-    if ((new_ino.single_indirect = bl_alloc(fs)) == 0) {
-        fprintf(stderr, "fs_touch error: failed to alloc new block number\n");
-        ino_free(fs, new_ino.inode_number);
-        return ErrInternal;
-    }
-    if (bl_clean(fs, new_ino.single_indirect) != OK) {
-        fprintf(stderr, "fs_touch error: failed to init a single_indirect block\n");
-        bl_free(fs, new_ino.single_indirect);
-        ino_free(fs, new_ino.inode_number);
-        return ErrInternal;
-    }
+    // Start inline, blocks come with the first write past INO_INLINE_SIZE
+    new_ino.flags = INO_FLAG_INLINE;
+    new_ino.nlink = 1;
     ino_write(fs, new_ino.inode_number, &new_ino);
 
     // Now add to directory - dir_add handles locking internally
-    inode_num = 1;
-    for (uint32_t i=0; i<p.count; i++) {
-        if (i != (p.count - 1)) {// path directory check
-            if ((inode_num = dir_lookup(fs, &ino, (uint8_t*)p.components[i])) == 0) {
-                fprintf(stderr, "fs_touch error: directory not exists [%s] at level [%d]\n",
-                        p.components[i], i);
-                // Cleanup allocated resources
-                bl_free(fs, new_ino.single_indirect);
-                ino_free(fs, new_ino.inode_number);
-                return ErrPath;
-            }
-
-            if (ino_read(fs, inode_num, &ino) != OK) {
-                fprintf(stderr, "fs_touch error: failed to read dir inode [%d]\n",
-                        inode_num);
-                // Cleanup allocated resources
-                bl_free(fs, new_ino.single_indirect);
-                ino_free(fs, new_ino.inode_number);
-                return ErrInode;
-            }
-        } else { // last component, file name
-            RC rc = dir_add(fs, &ino, (uint8_t*)p.components[i], new_ino.inode_number);
-            if (rc != OK) {
-                // If dir_add fails (e.g., already exists due to race), cleanup
-                bl_free(fs, new_ino.single_indirect);
-                ino_free(fs, new_ino.inode_number);
-                return rc;
-            }
-            ino_write(fs, inode_num, &ino);
-        }
+    RC rc = dir_add(fs, &ino, (uint8_t*)name, new_ino.inode_number, FTypeFile);
+    if (rc != OK) {
+        // If dir_add fails (e.g., already exists due to race), cleanup
+        ino_free(fs, new_ino.inode_number);
+        return rc;
     }
 
     return OK;
 }
 
-// Just delete file, no link count info in inode now
-RC fs_unlink(filesystem *fs, const char *path_str) { 
-    if (!fs || !path_str) {
+// Drop one name, the inode and its blocks go with the last one
+RC fs_unlink(filesystem *fs, const char *path_str) {
+    return fs_unlink_at(fs, MY_AT_FDCWD, path_str);
+}
+
+RC fs_unlink_at(filesystem *fs, int32_t dirfd, const char *path_str) {
+    uint32_t dir_inode_num;
+    if (!fs || !path_str || path_str[0] == '\0' || file_dirfd_inode(dirfd, &dir_inode_num) != OK) {
         fprintf(stderr, "fs_unlink error: wrong args...\n");
         return ErrArg;
     }
@@ -130,35 +104,11 @@ RC fs_unlink(filesystem *fs, const char *path_str) {
         return ErrArg;
     }
 
-    path p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&p, 0, size);
-
-    if (path_parse(path_str, &p) != OK) {
-        fprintf(stderr, "fs_unlink error: failed to parse path_str [%s] to path structure...\n",
-                path_str);
-        return ErrName;
-    }
-
     inode ino, target_ino;
-    uint32_t inode_num;
-    if (p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
-    }
-
-    // Read base inode
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_unlink error: failed to read base inode [%d]\n",
-                inode_num);
-        return ErrInode;
-    }
-
-    // Check whether file exists
-    if ((inode_num = path_lookup(fs, ino, &p)) == 0) {
+    path_component last;
+    uint32_t parent_num = path_resolve_parent_at(fs, dir_inode_num, path_str, &ino, &last);
+    uint32_t inode_num = 0;
+    if (parent_num == 0 || (inode_num = dir_lookup_n(fs, &ino, last.name, last.len)) == 0) {
         fprintf(stderr, "fs_unlink error: no file exists [%s]\n",
                 path_str);
         return ErrPath;
@@ -171,69 +121,86 @@ RC fs_unlink(filesystem *fs, const char *path_str) {
     }
 
     // Remove from directory first - dir_remove handles locking internally
-    uint32_t save_inode_num = inode_num;
-    inode_num = 1;
-    RC rc = OK;
-    for (uint32_t i=0; i<p.count; i++) {
-        if (i != (p.count - 1)) { // path directory check
-            inode_num = dir_lookup(fs, &ino, (uint8_t*)p.components[i]);
+    char name[MAX_FILENAME_LEN];
+    if (path_component_copy(&last, name) != OK) {
+        fprintf(stderr, "fs_unlink error: name too long in [%s]\n", path_str);
+        return ErrName;
+    }
+    RC rc = dir_remove(fs, &ino, (uint8_t*)name);
+    if (rc != OK) {
+        return rc;
+    }
 
-            if (ino_read(fs, inode_num, &ino) != OK) {
-                fprintf(stderr, "fs_unlink error: failed to read dir inode [%d]\n",
-                        inode_num);
-                return ErrInode;
-            }
-        } else { // last component, file name
-            rc = dir_remove(fs, &ino, (uint8_t*)p.components[i]);
-            if (rc != OK) {
-                return rc;
-            }
-            ino_write(fs, inode_num, &ino);
-        }
+    // Other names keep the inode alive
+    uint32_t nlink;
+    if (file_inode_link_adjust(fs, inode_num, -1, &nlink) != OK) {
+        fprintf(stderr, "fs_unlink error: failed to drop link of inode [%d]\n",
+                inode_num);
+        return ErrInode;
+    }
+    if (nlink > 0) {
+        return OK;
     }
 
     // Now free filesystem resources (inode already removed from directory)
     // This happens outside the lock for better performance
+    ino_read(fs, inode_num, &target_ino);
     ino_free_all_blocks(fs, &target_ino);
-    ino_free(fs, save_inode_num);
+    ino_free(fs, inode_num);
 
     return OK;
 }
 
-RC fs_exists(filesystem *fs, const char *path_str) {
-    if (!fs || !path_str) {
-        fprintf(stderr, "fs_exists error: wrong args...\n");
+RC fs_link(filesystem *fs, const char *existing_path, const char *new_path) {
+    if (!fs || !existing_path || !new_path) {
+        fprintf(stderr, "fs_link error: wrong args...\n");
         return ErrArg;
     }
-    
-    path p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&p, 0, size);
 
-    if (path_parse(path_str, &p) != OK) {
-        fprintf(stderr, "fs_exists error: failed to parse path_str [%s] to path structure...\n",
-                path_str);
-        return ErrName;
+    inode target_ino;
+    uint32_t inode_num = path_resolve(fs, existing_path, &target_ino);
+    if (inode_num == 0) {
+        fprintf(stderr, "fs_link error: no file exists [%s]\n", existing_path);
+        return ErrNotFound;
+    }
+    if (target_ino.file_type != FTypeFile) { // ".." could no longer name one parent
+        fprintf(stderr, "fs_link error: [%s] is not a regular file\n", existing_path);
+        return ErrArg;
     }
 
-    inode ino;
-    uint32_t inode_num;
-    if (p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
+    inode parent;
+    path_component last;
+    char name[MAX_FILENAME_LEN];
+    uint32_t parent_num = path_resolve_parent(fs, new_path, &parent, &last);
+    if (parent_num == 0 || path_component_copy(&last, name) != OK) {
+        fprintf(stderr, "fs_link error: directory not exists for [%s]\n", new_path);
+        return ErrPath;
     }
 
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_exists error: failed to read base inode [%d]\n",
-                inode_num);
+    // Count the link before the name exists, a failure in between leaks rather than frees
+    uint32_t nlink;
+    if (file_inode_link_adjust(fs, inode_num, 1, &nlink) != OK) {
+        fprintf(stderr, "fs_link error: failed to add link to inode [%d]\n", inode_num);
         return ErrInode;
     }
 
+    RC rc = dir_add(fs, &parent, (uint8_t*)name, inode_num, FTypeFile);
+    if (rc != OK) {
+        file_inode_link_adjust(fs, inode_num, -1, &nlink);
+        return rc;
+    }
+
+    return OK;
+}
+
+RC fs_exists(filesystem *fs, const char *path_str) {
+    if (!fs || !path_str) {
+        fprintf(stderr, "fs_exists error: wrong args...\n");
+        return ErrArg;
+    }
+    
     // Check whether file exists
-    if ((inode_num = path_lookup(fs, ino, &p)) != 0) {
+    if (path_resolve(fs, path_str, NULL) != 0) {
         return OK;
     }
 
@@ -262,9 +229,7 @@ RC fs_mkdir(filesystem *fs, const char *path_str) {
     if (p.is_absolute) {
         inode_num = 1; // Hard encode, root dir inode num
     } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
+        inode_num = cwd_get_inode();
     }
 
     if (ino_read(fs, inode_num, &ino) != OK) {
@@ -280,16 +245,18 @@ RC fs_mkdir(filesystem *fs, const char *path_str) {
         return ErrDirentExists;
     }
 
-    inode_num = 1;
+    inode_num = ino.inode_number;
     char checked_path[MAX_PATH_LEN];
     memset(checked_path, 0, MAX_PATH_LEN);
-    checked_path[0] = '/';
+    if (p.is_absolute) {
+        checked_path[0] = '/';
+    }
     for (uint32_t i=0; i<p.count; i++) {
         if (i != (p.count - 1)) {// path directory check
+            // Prefix walked so far, existing components included
+            strcat(checked_path, p.components[i]);
+            strcat(checked_path, "/");
             if ((inode_num = dir_lookup(fs, &ino, (uint8_t*)p.components[i])) == 0) { 
-                strcat(checked_path, p.components[i]);
-                strcat(checked_path, "/");
-
                 if (fs_mkdir(fs, checked_path) != OK) {
                     fprintf(stderr, "fs_mkdir error: failed to recursively make directory [%s]\n",
                             checked_path);
@@ -306,8 +273,7 @@ RC fs_mkdir(filesystem *fs, const char *path_str) {
             // Create new inode
             uint32_t new_inode_num = dir_create(fs, inode_num);
             
-            dir_add(fs, &ino, (uint8_t*)p.components[i], new_inode_num);
-            ino_write(fs, inode_num, &ino);
+            dir_add(fs, &ino, (uint8_t*)p.components[i], new_inode_num, FTypeDirectory);
         }
     }
 
@@ -320,46 +286,14 @@ RC fs_rmdir(filesystem *fs, const char *path_str) {
         return ErrArg;
     }
 
-    path p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&p, 0, size);
-
-    if (path_parse(path_str, &p) != OK) {
-        fprintf(stderr, "fs_rmdir error: failed to parse path_str [%s] to path structure...\n",
-                path_str);
-        return ErrName;
-    }
-
-    inode ino, target_ino;
+    inode target_ino;
     uint32_t inode_num;
-    if (p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
-    }
-
-    // Read base inode
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_rmdir error: failed to read base inode [%d]\n",
-                inode_num);
-        return ErrInode;
-    }
-
-    // Check whether file exists
-    if ((inode_num = path_lookup(fs, ino, &p)) == 0) {
+    if ((inode_num = path_resolve(fs, path_str, &target_ino)) == 0) {
         fprintf(stderr, "fs_rmdir error: no file exists [%s]\n",
                 path_str);
         return ErrPath;
     }
 
-    if (ino_read(fs, inode_num, &target_ino) != OK) {
-        fprintf(stderr, "fs_rmdir error: failed to read target inode [%d]\n",
-                inode_num);
-        return ErrInode;
-    }
-
     // Free directory entries
     uint32_t max_block_offset = ino_get_max_block_offset(fs);
     uint32_t dirent_per_block = get_dirent_per_block(fs);
@@ -382,16 +316,22 @@ RC fs_rmdir(filesystem *fs, const char *path_str) {
             if (dirent_list[j].inode_num != 0 &&
                 strcmp((char*)dirent_list[j].name, ".")  != 0 &&
                 strcmp((char*)dirent_list[j].name, "..") != 0) {
+                uint32_t child_num = dirent_inode(&dirent_list[j]);
                 // Check inode type
-                if (ino_read(fs, dirent_list[j].inode_num, &inner_ino) != OK) {
+                if (ino_read(fs, child_num, &inner_ino) != OK) {
                     fprintf(stderr, "fs_rmdir error: failed to read inode [%d]",
-                        dirent_list[j].inode_num);
+                        child_num);
                     return ErrInode;
                 }
                 if (inner_ino.file_type == FTypeFile) {
-                    // Just free inode and block resources
-                    ino_free_all_blocks(fs, &inner_ino);
-                    ino_free(fs, dirent_list[j].inode_num);
+                    // Free inode and block resources unless another name links to it
+                    uint32_t nlink;
+                    if (file_inode_link_adjust(fs, child_num, -1, &nlink) == OK &&
+                        nlink == 0) {
+                        ino_free_all_blocks(fs, &inner_ino);
+                        ino_free(fs, child_num);
+                    }
+                    dir_remove(fs, &target_ino, dirent_list[j].name);
                 } else if (inner_ino.file_type == FTypeDirectory) {
                     char new_path[MAX_PATH_LEN] = {0};
                     strcpy(new_path, path_str);
@@ -405,8 +345,8 @@ RC fs_rmdir(filesystem *fs, const char *path_str) {
                                 new_path);
                         return ErrInternal;
                     }
+                    // The recursive call already removed its entry from this directory
                 }
-                dir_remove(fs, &target_ino, dirent_list[j].name);
             }
         }
     }
@@ -415,261 +355,879 @@ RC fs_rmdir(filesystem *fs, const char *path_str) {
     dir_delete_empty(fs, &target_ino);
 
     // Free parent directory entry
-    inode_num = 1;
-    for (uint32_t i=0; i<p.count; i++) {
-        if (i != (p.count - 1)) { // path directory check
-            inode_num = dir_lookup(fs, &ino, (uint8_t*)p.components[i]);
-
-            if (ino_read(fs, inode_num, &ino) != OK) {
-                fprintf(stderr, "fs_touch error: failed to read dir inode [%d]\n",
-                        inode_num);
-            }
-        } else { // last component, file name
-            // remove file from directory
-            dir_remove(fs, &ino, (uint8_t*)p.components[i]);
-            ino_write(fs, inode_num, &ino);
-        }
+    inode ino;
+    path_component last;
+    char name[MAX_FILENAME_LEN];
+    uint32_t parent_num = path_resolve_parent(fs, path_str, &ino, &last);
+    if (parent_num == 0 || path_component_copy(&last, name) != OK) {
+        fprintf(stderr, "fs_rmdir error: failed to find parent of [%s]\n", path_str);
+        return ErrPath;
     }
+    dir_remove(fs, &ino, (uint8_t*)name);
 
     return OK;
 }
 
-RC fs_ls(filesystem *fs, const char *path_str) {
-    if (!fs || !path_str) {
-        fprintf(stderr, "fs_ls error: wrong args...\n");
-        return ErrArg;
-    }
+// Populate f_stat from an inode already read
+static void fs_fill_stat(filesystem *fs, uint32_t inode_num, inode *ino, f_stat *st) {
+    st->inode_num = inode_num;
+    st->type = ino->file_type;
+    st->size = ino->file_size;
+    st->blocks = ino_get_block_count(fs, ino);
+    st->nlink = ino_nlink(ino);
+}
 
-    path p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&p, 0, size);
+struct s_rmdir_ctx {
+    filesystem *fs;
+    pool *p;
+    RC rc;             // First error, OK if none
 
-    if (path_parse(path_str, &p) != OK) {
-        fprintf(stderr, "fs_ls error: failed to parse path_str [%s] to path structure...\n",
-                path_str);
-        return ErrName;
-    }
+    // Directory inodes are freed after the walk, a child's ".." still reads its parent
+    pthread_mutex_t dirs_lock;
+    uint32_t *dirs;
+    uint32_t dir_count;
+    uint32_t dir_capacity;
+};
 
-    inode ino, target_ino;
+struct s_rmdir_task {
+    struct s_rmdir_ctx *ctx;
     uint32_t inode_num;
-    if (p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
-    }
+};
 
-    // Read base inode
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_ls error: failed to read base inode [%d]\n",
-                inode_num);
-        return ErrInode;
-    }
+static int fs_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
 
-    // Check whether file exists
-    if ((inode_num = path_lookup(fs, ino, &p)) == 0) {
-        fprintf(stderr, "fs_ls error: no file exists [%s]\n",
-                path_str);
-        return ErrPath;
-    }
+// Keep the first error of a pool job, later ones are dropped
+static void fs_fail_once(RC *slot, RC rc) {
+    RC expected = OK;
+    __atomic_compare_exchange_n(slot, &expected, rc, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
 
-    if (ino_read(fs, inode_num, &target_ino) != OK) {
-        fprintf(stderr, "fs_ls error: failed to read target inode [%d]\n",
-                inode_num);
-        return ErrInode;
-    }
+static void rmdir_fail(struct s_rmdir_ctx *ctx, RC rc) {
+    fs_fail_once(&ctx->rc, rc);
+}
 
-    uint32_t max_block_offset = ino_get_max_block_offset(fs);
-    uint32_t dirent_per_block = get_dirent_per_block(fs);
-    uint32_t block_size = fs->dd->block_size;
-    uint8_t block_buf[block_size];
-    uint32_t block_number;
-    inode inner_ino;
-    printf("Type Size(bytes)\n");
-    for (uint32_t i=0; i<max_block_offset; i++) {
-        if ((block_number = ino_get_block_at(fs, &target_ino, i)) == 0)
-            continue;
+// Give blocks and inodes back with one bitmap lock each, sorted so neighbours
+// share bitmap blocks and the dirty marking touches as few of them as possible
+static void rmdir_flush(struct s_rmdir_ctx *ctx, uint32_t *blocks, uint32_t *block_count,
+                        uint32_t *inodes, uint32_t *inode_count) {
+    qsort(blocks, *block_count, sizeof(uint32_t), fs_cmp_u32);
+    if (bl_free_batch(ctx->fs, blocks, *block_count) != OK)
+        rmdir_fail(ctx, ErrBmOpe);
+    qsort(inodes, *inode_count, sizeof(uint32_t), fs_cmp_u32);
+    if (ino_free_batch(ctx->fs, inodes, *inode_count) != OK)
+        rmdir_fail(ctx, ErrBmOpe);
+    *block_count = 0;
+    *inode_count = 0;
+}
 
-        if (dread(fs->dd, block_buf, block_number) != OK) {
-            fprintf(stderr, "fs_ls error: failed to read block [%d]\n",
-                    block_number);
-            return ErrDread;
+static void rmdir_defer_dir(struct s_rmdir_ctx *ctx, uint32_t inode_num) {
+    pthread_mutex_lock(&ctx->dirs_lock);
+    if (ctx->dir_count == ctx->dir_capacity) {
+        uint32_t capacity = ctx->dir_capacity ? ctx->dir_capacity * 2 : 64;
+        uint32_t *dirs = realloc(ctx->dirs, capacity * sizeof(uint32_t));
+        if (!dirs) {
+            pthread_mutex_unlock(&ctx->dirs_lock);
+            rmdir_fail(ctx, ErrNoMem);
+            return;
         }
-        dirent *dirent_list = (dirent *)block_buf;
+        ctx->dirs = dirs;
+        ctx->dir_capacity = capacity;
+    }
+    ctx->dirs[ctx->dir_count++] = inode_num;
+    pthread_mutex_unlock(&ctx->dirs_lock);
+}
 
-        for (uint32_t j=0; j<dirent_per_block; j++) {
-            if (dirent_list[j].inode_num != 0) {
-                // Check inode type
-                if (ino_read(fs, dirent_list[j].inode_num, &inner_ino) != OK) {
-                    fprintf(stderr, "fs_ls error: failed to read inode [%d]\n",
-                        dirent_list[j].inode_num);
-                    return ErrInode;
-                }
+static void rmdir_task(void *varg);
 
-                char type_prefix;
-                if (inner_ino.file_type == FTypeFile) {
-                    type_prefix = 'f';
-                } else if (inner_ino.file_type == FTypeDirectory) {
-                    type_prefix = 'd';
-                }
-                printf("%c.   %-32d    %s \n",type_prefix, inner_ino.file_size, dirent_list[j].name);
-            }
-        }
+// Queue a subdirectory, run it here if the pool can not take it
+static void rmdir_spawn(struct s_rmdir_ctx *ctx, uint32_t inode_num) {
+    struct s_rmdir_task *task = malloc(sizeof(struct s_rmdir_task));
+    if (!task) {
+        rmdir_fail(ctx, ErrNoMem);
+        return;
     }
-
-    return OK;
+    task->ctx = ctx;
+    task->inode_num = inode_num;
+    if (pool_submit(ctx->p, rmdir_task, task) != OK)
+        rmdir_task(task);
 }
 
-RC fs_cat(filesystem *fs, const char *path_str) {
-    file_handle *fh = file_open(fs, path_str, MY_O_RDONLY);
-    if (!fh) {
-        fprintf(stderr, "fs_cat error: failed to open file [%s]",
-            path_str);
-        return ErrInternal;
-    }
-    uint32_t file_size = fh->cached_inode.file_size;
-    uint8_t buf[file_size+1];
-    uint32_t bytes_read = file_read(fh, buf, file_size);
-    if (bytes_read != file_size) {
-        fprintf(stderr, "fs_cat error: failed to read file, bytes read [%d]\n",
-            bytes_read);
-        return ErrInternal;
-    }
-    
-    write(STDOUT_FILENO, buf, bytes_read);
-    if (bytes_read > 0 && buf[bytes_read-1] != '\n') {
-        write(STDOUT_FILENO, "\n", 1);
+// Delete one directory, its files and its own blocks, subdirectories become new tasks
+// entries are never removed one by one, the whole directory goes at once
+static void rmdir_task(void *varg) {
+    struct s_rmdir_task *task = (struct s_rmdir_task *)varg;
+    struct s_rmdir_ctx *ctx = task->ctx;
+    filesystem *fs = ctx->fs;
+    uint32_t dir_num = task->inode_num;
+    free(task);
+
+    inode dir;
+    dir_iter *it;
+    if (ino_read(fs, dir_num, &dir) != OK || (it = dir_open(fs, &dir)) == NULL) {
+        fprintf(stderr, "fs_rmdir_parallel error: failed to open directory inode [%d]\n",
+                dir_num);
+        rmdir_fail(ctx, ErrInode);
+        return;
+    }
+
+    uint32_t per_inode = ino_get_max_block_offset(fs) + 1;
+    uint32_t *blocks = malloc((RMDIR_FREE_BATCH + per_inode) * sizeof(uint32_t));
+    if (!blocks) {
+        dir_close(it);
+        rmdir_fail(ctx, ErrNoMem);
+        return;
+    }
+    uint32_t block_count = 0;
+    uint32_t victims[DIR_BATCH_ENTRIES + 1];
+    uint32_t victim_count = 0;
+    dir_entry_info entries[DIR_BATCH_ENTRIES];
+    inode files[DIR_BATCH_ENTRIES];
+    uint32_t count;
+    RC rc;
+
+    while ((rc = dir_next_batch(it, entries, DIR_BATCH_ENTRIES, &count)) == OK && count > 0) {
+        uint32_t file_nums[DIR_BATCH_ENTRIES];
+        uint32_t file_count = 0;
+        for (uint32_t i=0; i<count; i++) {
+            if (strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0)
+                continue;
+
+            if (entries[i].type == FTypeDirectory) {
+                rmdir_spawn(ctx, entries[i].inode_num);
+                continue;
+            }
+
+            // Last name goes with the tree, linked files only lose a count
+            uint32_t nlink = 0;
+            if (entries[i].nlink > 1 &&
+                file_inode_link_adjust(fs, entries[i].inode_num, -1, &nlink) != OK) {
+                rmdir_fail(ctx, ErrInode);
+                continue;
+            }
+            if (nlink == 0)
+                file_nums[file_count++] = entries[i].inode_num;
+        }
+
+        // Inodes of the batch are read grouped by inode table block
+        if (ino_read_batch(fs, file_nums, file_count, files) != OK) {
+            rmdir_fail(ctx, ErrInode);
+            continue;
+        }
+        for (uint32_t i=0; i<file_count; i++) {
+            block_count += ino_collect_blocks(fs, &files[i], blocks + block_count);
+            victims[victim_count++] = file_nums[i];
+            if (block_count >= RMDIR_FREE_BATCH)
+                rmdir_flush(ctx, blocks, &block_count, victims, &victim_count);
+        }
+        rmdir_flush(ctx, blocks, &block_count, victims, &victim_count);
     }
+    dir_close(it);
+    if (rc != OK)
+        rmdir_fail(ctx, rc);
 
-    return OK;
+    // The directory blocks go now, children already have their own tasks
+    block_count += ino_collect_blocks(fs, &dir, blocks + block_count);
+    rmdir_defer_dir(ctx, dir_num);
+    rmdir_flush(ctx, blocks, &block_count, victims, &victim_count);
+    free(blocks);
 }
 
-RC fs_stat(filesystem *fs, const char *path_str, f_stat *st) {
-    if (!fs || !path_str || !st) {
-        fprintf(stderr, "fs_stat error: wrong args...\n");
+RC fs_rmdir_parallel(filesystem *fs, const char *path_str, uint32_t threads) {
+    if (!fs || !path_str || threads == 0 || threads > POOL_MAX_WORKERS) {
+        fprintf(stderr, "fs_rmdir_parallel error: wrong args...\n");
         return ErrArg;
     }
 
-    // Parse the path
-    path p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&p, 0, size);
-
-    if (path_parse(path_str, &p) != OK) {
-        fprintf(stderr, "fs_stat error: failed to parse path_str [%s] to path structure...\n",
+    inode target_ino, parent;
+    path_component last;
+    char name[MAX_FILENAME_LEN];
+    uint32_t inode_num = path_resolve(fs, path_str, &target_ino);
+    uint32_t parent_num = path_resolve_parent(fs, path_str, &parent, &last);
+    if (inode_num == 0 || parent_num == 0 || target_ino.file_type != FTypeDirectory ||
+        path_component_copy(&last, name) != OK) {
+        fprintf(stderr, "fs_rmdir_parallel error: no directory to remove [%s]\n",
                 path_str);
-        return ErrName;
+        return ErrPath;
     }
 
-    // Get base inode (root or cwd)
-    inode ino;
-    uint32_t inode_num;
-    if (p.is_absolute) {
-        inode_num = 1; // Hard encoded, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
+    // Unlink the tree first, nobody can walk into it while it is torn down
+    RC rc = dir_remove(fs, &parent, (uint8_t*)name);
+    if (rc != OK) {
+        return rc;
     }
 
-    // Read base inode
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_stat error: failed to read base inode [%d]\n",
-                inode_num);
-        return ErrInode;
+    struct s_rmdir_ctx ctx = { .fs = fs, .rc = OK };
+    if ((ctx.p = pool_create(threads)) == NULL) {
+        return ErrInternal;
     }
+    pthread_mutex_init(&ctx.dirs_lock, NULL);
+    rmdir_spawn(&ctx, inode_num);
+    pool_wait(ctx.p);
+    pool_destroy(ctx.p);
 
-    // Lookup target inode
-    if ((inode_num = path_lookup(fs, ino, &p)) == 0) {
-        fprintf(stderr, "fs_stat error: no file exists [%s]\n",
+    qsort(ctx.dirs, ctx.dir_count, sizeof(uint32_t), fs_cmp_u32);
+    if (ino_free_batch(fs, ctx.dirs, ctx.dir_count) != OK)
+        rmdir_fail(&ctx, ErrBmOpe);
+    free(ctx.dirs);
+    pthread_mutex_destroy(&ctx.dirs_lock);
+
+    return ctx.rc;
+}
+
+struct s_walk_ctx {
+    filesystem *fs;
+    pool *p;
+    const walk_filter *filter;
+    walk_fn fn;
+    void *arg;
+    uint8_t stop;      // Set once fn asks to stop
+    RC rc;             // First error, OK if none
+};
+
+struct s_walk_task {
+    struct s_walk_ctx *ctx;
+    uint32_t inode_num;
+    char path[];       // Path of the directory
+};
+
+static uint8_t walk_name_ok(const walk_filter *filter, const char *name) {
+    return !filter->name || fnmatch(filter->name, name, 0) == 0;
+}
+
+static uint8_t walk_type_ok(const walk_filter *filter, filetype type) {
+    return filter->types == 0 ||
+        (type == FTypeFile && (filter->types & WALK_TYPE_FILE)) ||
+        (type == FTypeDirectory && (filter->types & WALK_TYPE_DIR));
+}
+
+static uint8_t walk_size_ok(const walk_filter *filter, uint32_t size) {
+    return size >= filter->min_size && (filter->max_size == 0 || size <= filter->max_size);
+}
+
+// dir + "/" + name into out, MAX_PATH_LEN bytes
+static RC walk_join(char *out, const char *dir, const char *name) {
+    uint32_t dir_len = strlen(dir);
+    uint8_t slash = dir_len > 0 && dir[dir_len-1] != '/';
+    if (dir_len + slash + strlen(name) >= MAX_PATH_LEN) {
+        fprintf(stderr, "fs_walk error: path too long under [%s]\n", dir);
+        return ErrPath;
+    }
+    strcpy(out, dir);
+    if (slash)
+        strcat(out, "/");
+    strcat(out, name);
+    return OK;
+}
+
+static void walk_task(void *varg);
+
+// Queue a directory, run it here if the pool can not take it
+static void walk_spawn(struct s_walk_ctx *ctx, const char *path, uint32_t inode_num) {
+    struct s_walk_task *task = malloc(sizeof(struct s_walk_task) + strlen(path) + 1);
+    if (!task) {
+        fs_fail_once(&ctx->rc, ErrNoMem);
+        return;
+    }
+    task->ctx = ctx;
+    task->inode_num = inode_num;
+    strcpy(task->path, path);
+    if (pool_submit(ctx->p, walk_task, task) != OK)
+        walk_task(task);
+}
+
+// List one directory, subdirectories become new tasks, matching entries go to fn
+static void walk_task(void *varg) {
+    struct s_walk_task *task = (struct s_walk_task *)varg;
+    struct s_walk_ctx *ctx = task->ctx;
+    filesystem *fs = ctx->fs;
+    const walk_filter *filter = ctx->filter;
+
+    inode dir;
+    dir_iter *it;
+    if (ino_read(fs, task->inode_num, &dir) != OK || (it = dir_open(fs, &dir)) == NULL) {
+        fprintf(stderr, "fs_walk error: failed to open directory [%s]\n", task->path);
+        fs_fail_once(&ctx->rc, ErrInode);
+        free(task);
+        return;
+    }
+
+    dir_entry_info entries[DIR_BATCH_ENTRIES];
+    uint32_t picked[DIR_BATCH_ENTRIES];
+    uint32_t nums[DIR_BATCH_ENTRIES];
+    uint8_t name_ok[DIR_BATCH_ENTRIES];
+    inode inodes[DIR_BATCH_ENTRIES];
+    char path[MAX_PATH_LEN];
+    uint32_t count;
+    RC rc = OK;
+
+    while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED) &&
+           (rc = dir_next_names(it, entries, DIR_BATCH_ENTRIES, &count)) == OK && count > 0) {
+        // Only entries that may match, or whose type the entry did not record, are read
+        uint32_t n = 0;
+        for (uint32_t i=0; i<count; i++) {
+            dir_entry_info *e = &entries[i];
+            if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0)
+                continue;
+
+            if (e->type == FTypeDirectory && walk_join(path, task->path, e->name) == OK)
+                walk_spawn(ctx, path, e->inode_num);
+
+            uint8_t ok = walk_name_ok(filter, e->name);
+            if (e->type == FTypeNotValid || (ok && walk_type_ok(filter, e->type))) {
+                picked[n] = i;
+                name_ok[n] = ok;
+                nums[n++] = e->inode_num;
+            }
+        }
+        if (n == 0)
+            continue;
+
+        if (ino_read_batch(fs, nums, n, inodes) != OK) {
+            fs_fail_once(&ctx->rc, ErrInode);
+            continue;
+        }
+        for (uint32_t k=0; k<n && !__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED); k++) {
+            dir_entry_info *e = &entries[picked[k]];
+            inode *ino = &inodes[k];
+            if (walk_join(path, task->path, e->name) != OK) {
+                fs_fail_once(&ctx->rc, ErrPath);
+                continue;
+            }
+            if (e->type == FTypeNotValid && ino->file_type == FTypeDirectory)
+                walk_spawn(ctx, path, e->inode_num);
+
+            if (!name_ok[k] || !walk_type_ok(filter, ino->file_type) ||
+                !walk_size_ok(filter, ino->file_size))
+                continue;
+
+            f_stat st;
+            fs_fill_stat(fs, e->inode_num, ino, &st);
+            if (ctx->fn(path, &st, ctx->arg) != 0)
+                __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELAXED);
+        }
+    }
+    dir_close(it);
+    if (rc != OK)
+        fs_fail_once(&ctx->rc, rc);
+    free(task);
+}
+
+RC fs_walk(filesystem *fs, const char *path_str, const walk_filter *filter, uint32_t threads,
+           walk_fn fn, void *arg) {
+    if (!fs || !path_str || !fn || threads == 0 || threads > POOL_MAX_WORKERS ||
+        strlen(path_str) >= MAX_PATH_LEN) {
+        fprintf(stderr, "fs_walk error: wrong args...\n");
+        return ErrArg;
+    }
+
+    inode start;
+    uint32_t inode_num = path_resolve(fs, path_str, &start);
+    if (inode_num == 0 || start.file_type != FTypeDirectory) {
+        fprintf(stderr, "fs_walk error: no directory [%s]\n", path_str);
+        return ErrPath;
+    }
+
+    walk_filter all = {0};
+    struct s_walk_ctx ctx = {
+        .fs = fs, .filter = filter ? filter : &all, .fn = fn, .arg = arg, .rc = OK
+    };
+    if ((ctx.p = pool_create(threads)) == NULL) {
+        return ErrInternal;
+    }
+    walk_spawn(&ctx, path_str, inode_num);
+    pool_wait(ctx.p);
+    pool_destroy(ctx.p);
+
+    return ctx.rc;
+}
+
+RC fs_ls(filesystem *fs, const char *path_str) {
+    if (!fs || !path_str) {
+        fprintf(stderr, "fs_ls error: wrong args...\n");
+        return ErrArg;
+    }
+
+    inode target_ino;
+    if (path_resolve(fs, path_str, &target_ino) == 0) {
+        fprintf(stderr, "fs_ls error: no file exists [%s]\n",
                 path_str);
-        return ErrNotFound;
+        return ErrPath;
+    }
+
+    dir_iter *it = dir_open(fs, &target_ino);
+    if (!it) {
+        fprintf(stderr, "fs_ls error: [%s] is not a directory\n", path_str);
+        return ErrPath;
+    }
+
+    dir_entry_info entries[DIR_BATCH_ENTRIES];
+    uint32_t count;
+    RC rc;
+    printf("Type Size(bytes)\n");
+    while ((rc = dir_next_batch(it, entries, DIR_BATCH_ENTRIES, &count)) == OK && count > 0) {
+        for (uint32_t i=0; i<count; i++) {
+            char type_prefix = entries[i].type == FTypeDirectory ? 'd' : 'f';
+            printf("%c.   %-32d    %s \n", type_prefix, entries[i].size, entries[i].name);
+        }
+    }
+    dir_close(it);
+
+    if (rc != OK) {
+        fprintf(stderr, "fs_ls error: failed to list [%s]\n", path_str);
+        return rc;
+    }
+
+    return OK;
+}
+
+RC fs_cat(filesystem *fs, const char *path_str) {
+    file_handle *fh = file_open(fs, path_str, MY_O_RDONLY);
+    if (!fh) {
+        fprintf(stderr, "fs_cat error: failed to open file [%s]",
+            path_str);
+        return ErrInternal;
+    }
+
+    // Stream in chunks, holes are printed from a zero buffer without touching the disk
+    uint32_t total = file_size(fh);
+    uint32_t chunk = fs->dd->block_size * FS_CAT_CHUNK_BLOCKS;
+    uint8_t *buf = (uint8_t *)malloc(chunk);
+    uint8_t *zeros = (uint8_t *)calloc(1, chunk);
+    if (!buf || !zeros) {
+        fprintf(stderr, "fs_cat error: failed to alloc buffers\n");
+        free(buf);
+        free(zeros);
+        file_close(fh);
+        return ErrNoMem;
+    }
+
+    RC rc = OK;
+    uint8_t last_byte = '\n';
+    uint32_t pos = 0;
+    while (pos < total && rc == OK) {
+        uint32_t data_start = total, data_end;
+        if (file_seek(fh, pos, MY_SEEK_DATA) == OK)
+            data_start = file_tell(fh);
+
+        while (pos < data_start) {
+            uint32_t n = (data_start - pos < chunk) ? data_start - pos : chunk;
+            write(STDOUT_FILENO, zeros, n);
+            last_byte = 0;
+            pos += n;
+        }
+        if (pos >= total)
+            break;
+
+        if (file_seek(fh, pos, MY_SEEK_HOLE) != OK) {
+            rc = ErrInternal;
+            break;
+        }
+        data_end = file_tell(fh);
+        file_seek(fh, pos, MY_SEEK_SET);
+
+        while (pos < data_end) {
+            uint32_t want = (data_end - pos < chunk) ? data_end - pos : chunk;
+            uint32_t bytes_read = file_read(fh, buf, want);
+            if (bytes_read != want) {
+                fprintf(stderr, "fs_cat error: failed to read file, bytes read [%d]\n",
+                    bytes_read);
+                rc = ErrInternal;
+                break;
+            }
+            write(STDOUT_FILENO, buf, bytes_read);
+            last_byte = buf[bytes_read-1];
+            pos += bytes_read;
+        }
     }
 
-    // Read target inode
+    if (rc == OK && last_byte != '\n') {
+        write(STDOUT_FILENO, "\n", 1);
+    }
+
+    free(buf);
+    free(zeros);
+    file_close(fh);
+    return rc;
+}
+
+RC fs_stat(filesystem *fs, const char *path_str, f_stat *st) {
+    return fs_stat_at(fs, MY_AT_FDCWD, path_str, st);
+}
+
+RC fs_stat_at(filesystem *fs, int32_t dirfd, const char *path_str, f_stat *st) {
+    uint32_t dir_inode_num;
+    if (!fs || !path_str || !st || file_dirfd_inode(dirfd, &dir_inode_num) != OK) {
+        fprintf(stderr, "fs_stat error: wrong args...\n");
+        return ErrArg;
+    }
+
+    // Resolve in place, the target inode is left in target_ino
     inode target_ino;
-    if (ino_read(fs, inode_num, &target_ino) != OK) {
-        fprintf(stderr, "fs_stat error: failed to read target inode [%d]\n",
-                inode_num);
-        return ErrInode;
+    uint32_t inode_num;
+    if ((inode_num = path_resolve_at(fs, dir_inode_num, path_str, &target_ino)) == 0) {
+        fprintf(stderr, "fs_stat error: no file exists [%s]\n",
+                path_str);
+        return ErrNotFound;
     }
 
-    // Populate f_stat structure
-    st->inode_num = inode_num;
-    st->type = target_ino.file_type;
-    st->size = target_ino.file_size;
-    st->blocks = ino_get_block_count(fs, &target_ino);
+    fs_fill_stat(fs, inode_num, &target_ino, st);
+    return OK;
+}
 
+// Resolve the directory a batch works in, once for all its names
+static RC fs_batch_dir(filesystem *fs, const char *dir_path, inode *dir, const char *who) {
+    if (path_resolve(fs, dir_path, dir) == 0 || dir->file_type != FTypeDirectory) {
+        fprintf(stderr, "%s error: [%s] is not a directory\n", who, dir_path);
+        return ErrPath;
+    }
     return OK;
 }
 
-RC fs_cp(filesystem *fs, const char *src_path, const char *dst_path) {
-    if (!fs || !src_path || !dst_path) {
-        fprintf(stderr, "fs_cp error: wrong args...\n");
+// First per name error, OK when every name went through
+static RC fs_batch_first_error(const RC *results, uint32_t count) {
+    for (uint32_t i=0; i<count; i++) {
+        if (results[i] != OK)
+            return results[i];
+    }
+    return OK;
+}
+
+// fs_batch_create once the buffers exist
+static RC fs_batch_create_in(filesystem *fs, inode *dir, const char *const *names, uint32_t count,
+                             RC *res, uint32_t *nums, inode *inos) {
+    // A contiguous run of inodes shares table blocks, so they go out in a few writes
+    RC rc = ino_alloc_batch(fs, dir->inode_number, count, nums);
+    if (rc != OK) {
+        return rc;
+    }
+    for (uint32_t i=0; i<count; i++) {
+        ino_init(&inos[i]);
+        inos[i].inode_number = nums[i];
+        inos[i].file_type = FTypeFile;
+        inos[i].flags = INO_FLAG_INLINE; // Like fs_touch
+        inos[i].nlink = 1;
+    }
+    if ((rc = ino_write_batch(fs, inos, count)) != OK) {
+        ino_free_batch(fs, nums, count);
+        return rc;
+    }
+
+    rc = dir_add_batch(fs, dir, names, nums, FTypeFile, count, res);
+
+    // Names that were not added give their inodes back
+    uint32_t unused = 0;
+    for (uint32_t i=0; i<count; i++) {
+        if (rc != OK || res[i] != OK)
+            nums[unused++] = nums[i];
+    }
+    ino_free_batch(fs, nums, unused);
+
+    return rc == OK ? fs_batch_first_error(res, count) : rc;
+}
+
+RC fs_batch_create(filesystem *fs, const char *dir_path, const char *const *names, uint32_t count,
+                   RC *results) {
+    if (!fs || !dir_path || (count && !names)) {
+        fprintf(stderr, "fs_batch_create error: wrong args...\n");
         return ErrArg;
     }
+    if (count == 0) {
+        return OK;
+    }
 
-    path src_p;
-    uint32_t size = sizeof(struct s_path);
-    memset(&src_p, 0, size);
+    inode dir;
+    RC rc = fs_batch_dir(fs, dir_path, &dir, "fs_batch_create");
+    if (rc != OK) {
+        return rc;
+    }
 
-    if (path_parse(src_path, &src_p) != OK) {
-        fprintf(stderr, "fs_cp error: failed to parse src_path [%s] to path structure...\n",
-                src_path);
-        return ErrName;
+    RC *res = results ? results : (RC *)malloc(count * sizeof(RC));
+    uint32_t *nums = (uint32_t *)malloc(count * sizeof(uint32_t));
+    inode *inos = (inode *)malloc(count * sizeof(inode));
+    if (!res || !nums || !inos) {
+        fprintf(stderr, "fs_batch_create error: failed to alloc memory\n");
+        rc = ErrNoMem;
+    } else {
+        rc = fs_batch_create_in(fs, &dir, names, count, res, nums, inos);
     }
 
-    path dst_p;
-    memset(&dst_p, 0, size);
+    if (res != results)
+        free(res);
+    free(nums);
+    free(inos);
+    return rc;
+}
 
-    if (path_parse(dst_path, &dst_p) != OK) {
-        fprintf(stderr, "fs_cp error: failed to parse dst_path [%s] to path structure...\n",
-                dst_path);
-        return ErrName;
+// fs_batch_unlink once the buffers exist
+static RC fs_batch_unlink_in(filesystem *fs, inode *dir, const char *const *names, uint32_t count,
+                             RC *res, uint32_t *nums, inode *inos) {
+    RC rc = dir_remove_batch(fs, dir, names, count, nums, res);
+    if (rc != OK) {
+        return rc;
     }
 
-    //
-    // Handle src file
-    //
-    // Get src inode number and dst inode number
-    inode ino, src_ino, dst_ino;
-    uint32_t inode_num, src_inode_num, dst_inode_num;
-    if (src_p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
+    // Like fs_unlink, other names keep an inode alive
+    uint32_t dead = 0;
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t nlink;
+        if (res[i] != OK)
+            continue;
+        if (file_inode_link_adjust(fs, nums[i], -1, &nlink) != OK) {
+            fprintf(stderr, "fs_batch_unlink error: failed to drop link of inode [%d]\n", nums[i]);
+            res[i] = ErrInode;
+            continue;
+        }
+        if (nlink == 0)
+            nums[dead++] = nums[i];
     }
 
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_cp error: failed to read base inode [%d]\n",
-                inode_num);
+    if ((rc = ino_read_batch(fs, nums, dead, inos)) != OK) {
+        return rc;
+    }
+    for (uint32_t i=0; i<dead; i++)
+        ino_free_all_blocks(fs, &inos[i]);
+    if ((rc = ino_free_batch(fs, nums, dead)) != OK) {
+        return rc;
+    }
+
+    return fs_batch_first_error(res, count);
+}
+
+RC fs_batch_unlink(filesystem *fs, const char *dir_path, const char *const *names, uint32_t count,
+                   RC *results) {
+    if (!fs || !dir_path || (count && !names)) {
+        fprintf(stderr, "fs_batch_unlink error: wrong args...\n");
+        return ErrArg;
+    }
+    if (count == 0) {
+        return OK;
+    }
+
+    inode dir;
+    RC rc = fs_batch_dir(fs, dir_path, &dir, "fs_batch_unlink");
+    if (rc != OK) {
+        return rc;
+    }
+
+    RC *res = results ? results : (RC *)malloc(count * sizeof(RC));
+    uint32_t *nums = (uint32_t *)malloc(count * sizeof(uint32_t));
+    inode *inos = (inode *)malloc(count * sizeof(inode));
+    if (!res || !nums || !inos) {
+        fprintf(stderr, "fs_batch_unlink error: failed to alloc memory\n");
+        rc = ErrNoMem;
+    } else {
+        rc = fs_batch_unlink_in(fs, &dir, names, count, res, nums, inos);
+    }
+
+    if (res != results)
+        free(res);
+    free(nums);
+    free(inos);
+    return rc;
+}
+
+// fs_batch_stat once the buffers exist
+static RC fs_batch_stat_in(filesystem *fs, inode *dir, const char *const *names, uint32_t count,
+                           f_stat *out, RC *results, uint32_t *nums, uint32_t *found, inode *inos) {
+    // One directory pass for the names, then one read per inode table block
+    RC rc = dir_lookup_batch(fs, dir, names, count, nums);
+    if (rc != OK) {
+        return rc;
+    }
+    uint32_t n = 0;
+    for (uint32_t i=0; i<count; i++) {
+        if (nums[i] != 0)
+            found[n++] = nums[i];
+    }
+    if ((rc = ino_read_batch(fs, found, n, inos)) != OK) {
+        return rc;
+    }
+
+    n = 0;
+    for (uint32_t i=0; i<count; i++) {
+        memset(&out[i], 0, sizeof(f_stat));
+        if (nums[i] == 0) {
+            if (results)
+                results[i] = ErrNotFound;
+            rc = ErrNotFound;
+            continue;
+        }
+        fs_fill_stat(fs, nums[i], &inos[n++], &out[i]);
+        if (results)
+            results[i] = OK;
+    }
+
+    return rc;
+}
+
+RC fs_batch_stat(filesystem *fs, const char *dir_path, const char *const *names, uint32_t count,
+                 f_stat *out, RC *results) {
+    if (!fs || !dir_path || (count && (!names || !out))) {
+        fprintf(stderr, "fs_batch_stat error: wrong args...\n");
+        return ErrArg;
+    }
+    if (count == 0) {
+        return OK;
+    }
+
+    inode dir;
+    RC rc = fs_batch_dir(fs, dir_path, &dir, "fs_batch_stat");
+    if (rc != OK) {
+        return rc;
+    }
+
+    uint32_t *nums = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t *found = (uint32_t *)malloc(count * sizeof(uint32_t));
+    inode *inos = (inode *)malloc(count * sizeof(inode));
+    if (!nums || !found || !inos) {
+        fprintf(stderr, "fs_batch_stat error: failed to alloc memory\n");
+        rc = ErrNoMem;
+    } else {
+        rc = fs_batch_stat_in(fs, &dir, names, count, out, results, nums, found, inos);
+    }
+
+    free(nums);
+    free(found);
+    free(inos);
+    return rc;
+}
+
+// How fs_cp_mode fills the data blocks of a file
+typedef enum {
+    CpModeAuto,   // Share blocks if the disk supports it, copy otherwise
+    CpModeCopy,   // Always copy
+    CpModeClone   // Always share, fail if not possible
+} cp_mode;
+
+// Make dst_ino share all data blocks of src_ino, blocks dst_ino owned are released
+static RC fs_clone_blocks(filesystem *fs, inode *src_ino, inode *dst_ino) {
+    if (!fs->block_refs) {
+        fprintf(stderr, "fs_clone error: disk has no refcount table, format it again\n");
+        return ErrInternal;
+    }
+
+    uint32_t max_block_offset = ino_get_max_block_offset(fs);
+    uint32_t src_map[max_block_offset];
+    uint32_t dst_map[max_block_offset];
+    if (ino_get_block_map(fs, src_ino, src_map) != OK ||
+        ino_get_block_map(fs, dst_ino, dst_map) != OK) {
+        fprintf(stderr, "fs_clone error: failed to read block maps\n");
         return ErrInode;
     }
 
+    for (uint32_t i=0; i<max_block_offset; i++) {
+        if (src_map[i] == 0)
+            continue;
+
+        // Unwritten flag stays in the map, the clone reads zeros as well
+        if (bl_ref(fs, src_map[i] & INO_BLOCK_MASK) != OK) {
+            // Undo the references taken so far
+            for (uint32_t j=0; j<i; j++) {
+                if (src_map[j] != 0)
+                    bl_free(fs, src_map[j] & INO_BLOCK_MASK);
+            }
+            return ErrNoSpace;
+        }
+    }
+
+    for (uint32_t i=0; i<max_block_offset; i++) {
+        if (dst_map[i] != 0)
+            bl_free(fs, dst_map[i] & INO_BLOCK_MASK);
+    }
+
+    if (ino_set_block_map(fs, dst_ino, src_map) != OK) {
+        fprintf(stderr, "fs_clone error: failed to write dst block map\n");
+        return ErrInode;
+    }
+    dst_ino->file_size = src_ino->file_size;
+
+    return OK;
+}
+
+// Give a new, empty file dst_ino the size and content of file src_ino, caller writes dst_ino
+// and holds the source's open inode for reading
+static RC fs_cp_data_locked(filesystem *fs, inode *src_ino, inode *dst_ino, cp_mode mode,
+                            const char *src_path) {
+    // Copy inode metadata
+    dst_ino->file_size = src_ino->file_size; // file_type and inode_number is set before
+
+    // Share or copy block content, inline content is just copied with the inode
+    if (ino_is_inline(src_ino)) {
+        dst_ino->flags |= INO_FLAG_INLINE;
+        memcpy(dst_ino->inline_data, src_ino->inline_data, INO_INLINE_SIZE);
+        return OK;
+    }
+
+    RC rc = ErrInternal;
+    if (mode != CpModeCopy && fs->block_refs) {
+        rc = fs_clone_blocks(fs, src_ino, dst_ino);
+        if (rc != OK && mode == CpModeClone) {
+            fprintf(stderr, "fs_clone error: failed to share blocks of [%s]\n",
+                    src_path);
+            return rc;
+        }
+    }
+
+    if (rc != OK) {
+        uint32_t block_count = (src_ino->file_size + fs->dd->block_size - 1) / fs->dd->block_size;
+        rc = fs_copy_range(fs, src_ino, dst_ino, 0, block_count);
+        if (rc != OK) {
+            fprintf(stderr, "fs_cp error: failed to copy blocks of [%s]\n",
+                    src_path);
+            return rc;
+        }
+    }
+
+    return OK;
+}
+
+// fs_cp_data_locked with the source pinned, defrag moves blocks under its open inode lock
+// so the map copied or shared here is never one whose blocks were just freed
+static RC fs_cp_data(filesystem *fs, uint32_t src_num, inode *src_ino, inode *dst_ino,
+                     cp_mode mode, const char *src_path) {
+    open_inode *oi = file_inode_rdlock(fs, src_num, src_ino);
+    if (!oi) {
+        fprintf(stderr, "fs_cp error: failed to pin source [%s]\n", src_path);
+        return ErrInode;
+    }
+    RC rc = fs_cp_data_locked(fs, src_ino, dst_ino, mode, src_path);
+    file_inode_unlock(oi);
+    return rc;
+}
+
+static RC fs_cp_mode(filesystem *fs, const char *src_path, const char *dst_path, cp_mode mode) {
+    if (!fs || !src_path || !dst_path) {
+        fprintf(stderr, "fs_cp error: wrong args...\n");
+        return ErrArg;
+    }
+
+    //
+    // Handle src file
+    //
+    inode src_ino, dst_ino;
+    uint32_t src_inode_num, dst_inode_num;
+
     // src file should exist
-    if ((src_inode_num = path_lookup(fs, ino, &src_p)) == 0) {
+    if ((src_inode_num = path_resolve(fs, src_path, &src_ino)) == 0) {
         fprintf(stderr, "fs_cp error: source file does not exists [%s]\n",
                 src_path);
         return ErrNotFound;
     }
-    if (ino_read(fs, src_inode_num, &src_ino) != OK) {
-        fprintf(stderr, "fs_cp error: failed to read src inode [%d]\n",
-                src_inode_num);
-        return ErrInode;
+
+    if (mode == CpModeClone && (src_ino.file_type != FTypeFile || !fs->block_refs)) {
+        fprintf(stderr, "fs_clone error: [%s] can not be cloned\n", src_path);
+        return ErrArg;
     }
 
-    // if src is file, using touch, else if src is directory, using mkdir
-    RC (*create_new_func)(filesystem*,const char*);
-    if (src_ino.file_type == FTypeFile) {
-        create_new_func = fs_touch;
-    } else if (src_ino.file_type == FTypeDirectory) {
-        create_new_func = fs_mkdir;
+    // A directory is copied with everything below it
+    if (src_ino.file_type == FTypeDirectory) {
+        return fs_cp_tree(fs, src_path, dst_path, 1, NULL);
     }
 
-    RC rc = create_new_func(fs, dst_path);
+    RC rc = fs_touch(fs, dst_path);
     if (rc != OK) {
         fprintf(stderr, "fs_cp error: failed to create destination [%s], rc=%d\n",
                 dst_path, rc);
@@ -679,69 +1237,527 @@ RC fs_cp(filesystem *fs, const char *src_path, const char *dst_path) {
     //
     // Handle dst file
     //
-    if (dst_p.is_absolute) {
-        inode_num = 1; // Hard encode, root dir inode num
-    } else { // relative path
-        pthread_rwlock_rdlock(&g_cwd.rwlock);
-        inode_num = g_cwd.cwd_inode_num;
-        pthread_rwlock_unlock(&g_cwd.rwlock);
+    // dst file now should exist
+    if ((dst_inode_num = path_resolve(fs, dst_path, &dst_ino)) == 0) {
+        fprintf(stderr, "fs_cp error: can not find new created file [%s]\n",
+                dst_path);
+        return ErrNotFound;
     }
 
-    if (ino_read(fs, inode_num, &ino) != OK) {
-        fprintf(stderr, "fs_cp error: failed to read base inode [%d]\n",
-                inode_num);
+    if ((rc = fs_cp_data(fs, src_inode_num, &src_ino, &dst_ino, mode, src_path)) != OK) {
+        return rc;
+    }
+
+    if (ino_write(fs, dst_inode_num, &dst_ino) != OK) {
+        fprintf(stderr, "fs_cp error: failed to write inode back to disk [%d]\n",
+                dst_inode_num);
         return ErrInode;
     }
 
-    // dst file now should exist
-    if ((dst_inode_num = path_lookup(fs, ino, &dst_p)) == 0) {
-        fprintf(stderr, "fs_cp error: can not find new created file [%s]\n",
-                dst_path);
+    return OK;
+}
+
+RC fs_rename(filesystem *fs, const char *old_path, const char *new_path) {
+    if (!fs || !old_path || !new_path) {
+        fprintf(stderr, "fs_rename error: wrong args...\n");
+        return ErrArg;
+    }
+
+    inode old_parent, new_parent;
+    path_component old_last, new_last;
+    char old_name[MAX_FILENAME_LEN], new_name[MAX_FILENAME_LEN];
+    uint32_t old_parent_num = path_resolve_parent(fs, old_path, &old_parent, &old_last);
+    uint32_t new_parent_num = path_resolve_parent(fs, new_path, &new_parent, &new_last);
+    if (old_parent_num == 0 || new_parent_num == 0 ||
+        path_component_copy(&old_last, old_name) != OK ||
+        path_component_copy(&new_last, new_name) != OK) {
+        fprintf(stderr, "fs_rename error: can not resolve [%s] -> [%s]\n",
+                old_path, new_path);
+        return ErrPath;
+    }
+
+    // One directory, one inode copy, otherwise the second write back loses the first
+    inode *dst_dir = old_parent_num == new_parent_num ? &old_parent : &new_parent;
+    uint32_t replaced;
+    RC rc = dir_rename(fs, &old_parent, (uint8_t*)old_name, dst_dir, (uint8_t*)new_name, &replaced);
+    if (rc != OK) {
+        return rc;
+    }
+
+    // The file that used to be at new_path lost one name
+    uint32_t nlink;
+    if (replaced != 0 && file_inode_link_adjust(fs, replaced, -1, &nlink) == OK && nlink == 0) {
+        inode replaced_ino;
+        if (ino_read(fs, replaced, &replaced_ino) == OK) {
+            ino_free_all_blocks(fs, &replaced_ino);
+            ino_free(fs, replaced);
+        }
+    }
+
+    return OK;
+}
+
+RC fs_cp(filesystem *fs, const char *src_path, const char *dst_path) {
+    return fs_cp_mode(fs, src_path, dst_path, CpModeAuto);
+}
+
+RC fs_clone(filesystem *fs, const char *src_path, const char *dst_path) {
+    return fs_cp_mode(fs, src_path, dst_path, CpModeClone);
+}
+
+struct s_cp_tree_ctx {
+    filesystem *fs;
+    pool *p;
+    cp_progress *progress;
+    uint32_t dst_root;   // Skipped when met in the source, a tree copied into itself
+    RC rc;               // First error, OK if none
+};
+
+struct s_cp_tree_task {
+    struct s_cp_tree_ctx *ctx;
+    uint32_t src_num;
+    uint32_t dst_num;
+    char name[MAX_FILENAME_LEN]; // For error messages
+};
+
+static void cp_tree_spawn(struct s_cp_tree_ctx *ctx, pool_fn fn, uint32_t src_num,
+                          uint32_t dst_num, const char *name) {
+    struct s_cp_tree_task *task = malloc(sizeof(struct s_cp_tree_task));
+    if (!task) {
+        fs_fail_once(&ctx->rc, ErrNoMem);
+        return;
+    }
+    task->ctx = ctx;
+    task->src_num = src_num;
+    task->dst_num = dst_num;
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    if (pool_submit(ctx->p, fn, task) != OK)
+        fn(task);
+}
+
+// Fill one file created by its directory task
+static void cp_tree_file_task(void *varg) {
+    struct s_cp_tree_task *task = (struct s_cp_tree_task *)varg;
+    struct s_cp_tree_ctx *ctx = task->ctx;
+    filesystem *fs = ctx->fs;
+
+    inode src_ino, dst_ino;
+    RC rc = ErrInode;
+    if (ino_read(fs, task->src_num, &src_ino) == OK && ino_read(fs, task->dst_num, &dst_ino) == OK &&
+        (rc = fs_cp_data(fs, task->src_num, &src_ino, &dst_ino, CpModeAuto, task->name)) == OK &&
+        (rc = ino_write(fs, task->dst_num, &dst_ino)) == OK) {
+        __atomic_add_fetch(&ctx->progress->files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ctx->progress->bytes, src_ino.file_size, __ATOMIC_RELAXED);
+    } else {
+        fprintf(stderr, "fs_cp_tree error: failed to copy file [%s]\n", task->name);
+        fs_fail_once(&ctx->rc, rc);
+    }
+    free(task);
+}
+
+// New empty file in dst_dir, named like fs_touch would
+static uint32_t cp_tree_touch(filesystem *fs, inode *dst_dir, const char *name) {
+    inode new_ino;
+    ino_init(&new_ino);
+    new_ino.file_type = FTypeFile;
+    if ((new_ino.inode_number = ino_alloc_near(fs, dst_dir->inode_number, FTypeFile)) == 0) {
+        return 0;
+    }
+    new_ino.flags = INO_FLAG_INLINE;
+    new_ino.nlink = 1;
+    if (ino_write(fs, new_ino.inode_number, &new_ino) != OK ||
+        dir_add(fs, dst_dir, (const uint8_t*)name, new_ino.inode_number, FTypeFile) != OK) {
+        ino_free(fs, new_ino.inode_number);
+        return 0;
+    }
+    return new_ino.inode_number;
+}
+
+// Copy the entries of one directory, dst_num exists and is empty
+//  subdirectories are created here and then queued, files are queued once they have a name
+static void cp_tree_dir_task(void *varg) {
+    struct s_cp_tree_task *task = (struct s_cp_tree_task *)varg;
+    struct s_cp_tree_ctx *ctx = task->ctx;
+    filesystem *fs = ctx->fs;
+
+    inode src_dir, dst_dir;
+    dir_iter *it;
+    if (ino_read(fs, task->src_num, &src_dir) != OK || ino_read(fs, task->dst_num, &dst_dir) != OK ||
+        (it = dir_open(fs, &src_dir)) == NULL) {
+        fprintf(stderr, "fs_cp_tree error: failed to open directory [%s]\n", task->name);
+        fs_fail_once(&ctx->rc, ErrInode);
+        free(task);
+        return;
+    }
+
+    dir_entry_info entries[DIR_BATCH_ENTRIES];
+    uint32_t count;
+    RC rc;
+    while ((rc = dir_next_batch(it, entries, DIR_BATCH_ENTRIES, &count)) == OK && count > 0) {
+        for (uint32_t i=0; i<count; i++) {
+            dir_entry_info *e = &entries[i];
+            if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0 ||
+                e->inode_num == ctx->dst_root)
+                continue;
+
+            uint32_t new_num;
+            if (e->type == FTypeDirectory) {
+                if ((new_num = dir_create(fs, task->dst_num)) == 0 ||
+                    dir_add(fs, &dst_dir, (const uint8_t*)e->name, new_num, FTypeDirectory) != OK) {
+                    fprintf(stderr, "fs_cp_tree error: failed to create directory [%s]\n", e->name);
+                    fs_fail_once(&ctx->rc, ErrInternal);
+                    continue;
+                }
+                __atomic_add_fetch(&ctx->progress->dirs, 1, __ATOMIC_RELAXED);
+                cp_tree_spawn(ctx, cp_tree_dir_task, e->inode_num, new_num, e->name);
+            } else if (e->type == FTypeFile) {
+                if ((new_num = cp_tree_touch(fs, &dst_dir, e->name)) == 0) {
+                    fprintf(stderr, "fs_cp_tree error: failed to create file [%s]\n", e->name);
+                    fs_fail_once(&ctx->rc, ErrInternal);
+                    continue;
+                }
+                if (e->size == 0) {
+                    __atomic_add_fetch(&ctx->progress->files, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                cp_tree_spawn(ctx, cp_tree_file_task, e->inode_num, new_num, e->name);
+            }
+        }
+    }
+    dir_close(it);
+    if (rc != OK)
+        fs_fail_once(&ctx->rc, rc);
+    free(task);
+}
+
+RC fs_cp_tree(filesystem *fs, const char *src_path, const char *dst_path, uint32_t threads,
+              cp_progress *progress) {
+    if (!fs || !src_path || !dst_path || threads == 0 || threads > POOL_MAX_WORKERS) {
+        fprintf(stderr, "fs_cp_tree error: wrong args...\n");
+        return ErrArg;
+    }
+
+    inode src_ino;
+    uint32_t src_num = path_resolve(fs, src_path, &src_ino);
+    if (src_num == 0 || src_ino.file_type != FTypeDirectory) {
+        fprintf(stderr, "fs_cp_tree error: no source directory [%s]\n", src_path);
+        return ErrPath;
+    }
+
+    RC rc = fs_mkdir(fs, dst_path);
+    if (rc != OK) {
+        fprintf(stderr, "fs_cp_tree error: failed to create destination [%s], rc=%d\n",
+                dst_path, rc);
+        return rc;
+    }
+    uint32_t dst_num = path_resolve(fs, dst_path, NULL);
+    if (dst_num == 0) {
         return ErrNotFound;
     }
 
-    // Copy inode metadata
-    if (ino_read(fs, dst_inode_num, &dst_ino) != OK) {
-        fprintf(stderr, "fs_cp error: failed to read dst inode [%d]\n",
-                dst_inode_num);
+    cp_progress local;
+    struct s_cp_tree_ctx ctx = {
+        .fs = fs, .progress = progress ? progress : &local, .dst_root = dst_num, .rc = OK
+    };
+    memset(ctx.progress, 0, sizeof(cp_progress));
+    ctx.progress->dirs = 1;
+    if ((ctx.p = pool_create(threads)) == NULL) {
+        return ErrInternal;
+    }
+    cp_tree_spawn(&ctx, cp_tree_dir_task, src_num, dst_num, src_path);
+    pool_wait(ctx.p);
+    pool_destroy(ctx.p);
+
+    return ctx.rc;
+}
+
+RC fs_copy_range(filesystem *fs, inode *src_ino, inode *dst_ino, uint32_t start, uint32_t count) {
+    uint32_t max_block_offset;
+    if (!fs || !src_ino || !dst_ino ||
+        start + count > (max_block_offset = ino_get_max_block_offset(fs))) {
+        fprintf(stderr, "fs_copy_range error: wrong args...\n");
+        return ErrArg;
+    }
+
+    if (count == 0) {
+        return OK;
+    }
+
+    if (ino_is_inline(src_ino)) {
+        fprintf(stderr, "fs_copy_range error: inline inode [%d] has no blocks to copy...\n",
+                src_ino->inode_number);
+        return ErrArg;
+    }
+
+    uint32_t src_map[max_block_offset];
+    uint32_t dst_map[max_block_offset];
+    if (ino_get_block_map(fs, src_ino, src_map) != OK ||
+        ino_get_block_map(fs, dst_ino, dst_map) != OK) {
+        fprintf(stderr, "fs_copy_range error: failed to read block maps\n");
         return ErrInode;
     }
-    dst_ino.file_size = src_ino.file_size; // file_type, inode_number and single_indirect pointer is set before
 
-    // Copy block content
-    uint32_t max_block_offset = ino_get_max_block_offset(fs);
-    uint32_t block_number, dst_block_number;
-    uint32_t block_size = fs->dd->block_size;
-    uint8_t block_buf[block_size];
-    for (uint32_t i=0; i<max_block_offset; i++) {
-        if ((block_number = ino_get_block_at(fs, &src_ino, i)) == 0)
+    uint32_t end = start + count;
+    RC rc = OK;
+
+    // Keep the destination as sparse as the source, its blocks over source holes go away
+    uint32_t victims[count];
+    uint32_t victim_count = 0;
+    for (uint32_t i=start; i<end; i++) {
+        // Reserved but unwritten source reads as zeros, nothing to copy
+        if (src_map[i] & INO_BLOCK_UNWRITTEN)
+            src_map[i] = 0;
+
+        if (src_map[i] != 0) {
+            // Destination block gets real content below
+            dst_map[i] &= INO_BLOCK_MASK;
+        } else if (dst_map[i] != 0) {
+            victims[victim_count++] = dst_map[i] & INO_BLOCK_MASK;
+            dst_map[i] = 0;
+        }
+    }
+
+    // Never write into a block shared with a clone, give it up and allocate a new one
+    for (uint32_t i=start; i<end; i++) {
+        if (src_map[i] != 0 && dst_map[i] != 0 && bl_is_shared(fs, dst_map[i])) {
+            bl_free(fs, dst_map[i]);
+            dst_map[i] = 0;
+        }
+    }
+
+    // Allocate destination blocks, one contiguous run per gap
+    for (uint32_t i=start; i<end && rc == OK; ) {
+        if (src_map[i] == 0 || dst_map[i] != 0) {
+            i++;
             continue;
+        }
 
-        if (dread(fs->dd, block_buf, block_number) != OK) {
-            fprintf(stderr, "fs_cp error: failed to read block [%d]\n",
-                    block_number);
-            return ErrDread;
+        uint32_t want = 0;
+        while (i+want < end && src_map[i+want] != 0 && dst_map[i+want] == 0)
+            want++;
+
+        uint32_t got;
+        uint32_t first = bl_alloc_run(fs, want, &got);
+        if (first == 0) {
+            fprintf(stderr, "fs_copy_range error: failed to alloc new blocks\n");
+            rc = ErrNoSpace;
+            break;
         }
+        for (uint32_t n=0; n<got; n++)
+            dst_map[i+n] = first + n;
+        i += got;
+    }
 
-        if ((dst_block_number = ino_get_block_at(fs, &dst_ino, i)) == 0) {
-            if ((dst_block_number = ino_alloc_block_at(fs, &dst_ino, i)) == 0) {
-                fprintf(stderr, "fs_cp error: failed to alloc new block\n");
-                return ErrInternal;
-            }
+    // Copy runs contiguous on both sides, a fragmented source falls back to shorter runs
+    for (uint32_t i=start; i<end && rc == OK; ) {
+        if (src_map[i] == 0 || dst_map[i] == 0) {
+            i++;
+            continue;
         }
 
-        if (dwrite(fs->dd, block_buf, dst_block_number) != OK) {
-            fprintf(stderr, "fs_cp error: failed to write block [%d]\n",
-                    dst_block_number);
-            return ErrDwrite;
+        uint32_t len = 1;
+        while (i+len < end &&
+               src_map[i+len] == src_map[i]+len &&
+               dst_map[i+len] == dst_map[i]+len)
+            len++;
+
+        if (dcopy(fs->dd, src_map[i], dst_map[i], len) != OK) {
+            fprintf(stderr, "fs_copy_range error: failed to copy blocks [%d+%d] -> [%d+%d]\n",
+                    src_map[i], len, dst_map[i], len);
+            rc = ErrDwrite;
         }
+        i += len;
     }
 
-    if (ino_write(fs, dst_inode_num, &dst_ino) != OK) {
-        fprintf(stderr, "fs_cp error: failed to write inode back to disk [%d]\n",
-                dst_inode_num);
+    // Publish the new blocks even on failure, so they are owned and freed with the inode
+    if (ino_set_block_map(fs, dst_ino, dst_map) != OK) {
+        fprintf(stderr, "fs_copy_range error: failed to write dst block map\n");
         return ErrInode;
     }
 
+    if (bl_free_batch(fs, victims, victim_count) != OK) {
+        fprintf(stderr, "fs_copy_range error: failed to release dst blocks over holes\n");
+        rc = ErrInternal;
+    }
+
+    return rc;
+}
+
+// Histogram bucket of a file with extents > 0 runs
+static uint32_t frag_bucket(uint32_t extents) {
+    uint32_t b = 0;
+    while (b < FRAG_HIST_BUCKETS-1 && (1u << b) < extents)
+        b++;
+    return b;
+}
+
+// Add a batch of inodes to rep, map holds ino_get_max_block_offset(fs) entries
+static void frag_add(filesystem *fs, const inode *inos, uint32_t count, uint32_t *map,
+                     frag_report *rep) {
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    for (uint32_t i=0; i<count; i++) {
+        inode ino = inos[i];
+        if (ino.file_type != FTypeFile || ino_is_inline(&ino) ||
+            ino_get_block_map(fs, &ino, map) != OK)
+            continue;
+
+        uint32_t extents = ino_map_extents(map, max_offset);
+        if (extents == 0)
+            continue;
+        for (uint32_t n=0; n<max_offset; n++)
+            rep->blocks += (map[n] & INO_BLOCK_MASK) != 0;
+        rep->files++;
+        rep->extents += extents;
+        rep->hist[frag_bucket(extents)]++;
+    }
+}
+
+RC fs_frag_report(filesystem *fs, frag_report *rep) {
+    if (!fs || !rep) {
+        fprintf(stderr, "fs_frag_report error: wrong args...\n");
+        return ErrArg;
+    }
+    memset(rep, 0, sizeof(*rep));
+
+    uint32_t map[ino_get_max_block_offset(fs)];
+    uint32_t nums[FRAG_SCAN_BATCH];
+    inode inos[FRAG_SCAN_BATCH];
+    uint32_t idx = 0;
+    while (idx < fs->inodes) {
+        // One lock acquisition collects a batch, the scan is capped so long free runs do not hold it
+        uint32_t n = 0;
+        uint32_t end = fs->inodes - idx > FRAG_SCAN_BATCH*8 ? idx + FRAG_SCAN_BATCH*8 : fs->inodes;
+        pthread_mutex_lock(&fs->alloc_lock);
+        for (; idx<end && n<FRAG_SCAN_BATCH; idx++) {
+            if (bm_getbit(fs->inode_bitmap, idx))
+                nums[n++] = idx + 1; // bitmap is 0-based, inode numbers 1-based
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+        if (n == 0)
+            continue;
+
+        if (ino_read_batch(fs, nums, n, inos) != OK) {
+            fprintf(stderr, "fs_frag_report error: failed to read inodes from [%d]\n", nums[0]);
+            return ErrInode;
+        }
+        frag_add(fs, inos, n, map, rep);
+    }
+
     return OK;
 }
+
+void fs_frag_show(const frag_report *rep) {
+    if (!rep) {
+        return;
+    }
+
+    printf("Fragmentation:\n");
+    printf("  Files:            %u (%u blocks, %u extents, %.2f per file)\n",
+           rep->files, rep->blocks, rep->extents,
+           rep->files ? (double)rep->extents / rep->files : 0.0);
+    uint32_t most = 1;
+    for (uint32_t b=0; b<FRAG_HIST_BUCKETS; b++)
+        most = rep->hist[b] > most ? rep->hist[b] : most;
+    for (uint32_t b=0; b<FRAG_HIST_BUCKETS; b++) {
+        char label[32];
+        if (b == 0) {
+            snprintf(label, sizeof(label), "1");
+        } else if (b == FRAG_HIST_BUCKETS-1) {
+            snprintf(label, sizeof(label), "%u+", (1u << (b-1)) + 1);
+        } else if (b == 1) {
+            snprintf(label, sizeof(label), "2");
+        } else {
+            snprintf(label, sizeof(label), "%u-%u", (1u << (b-1)) + 1, 1u << b);
+        }
+        char bar[42] = ""; // Space and up to 40 marks
+        uint32_t width = (uint32_t)((uint64_t)rep->hist[b] * 40 / most);
+        if (width > 0) {
+            bar[0] = ' ';
+            memset(bar+1, '#', width);
+            bar[width+1] = '\0';
+        }
+        printf("    %-6s extents: %6u%s\n", label, rep->hist[b], bar);
+    }
+}
+
+RC fs_defrag_file(filesystem *fs, const char *path_str, uint32_t *before, uint32_t *after) {
+    if (!fs || !path_str) {
+        fprintf(stderr, "fs_defrag_file error: wrong args...\n");
+        return ErrArg;
+    }
+
+    inode target;
+    uint32_t inode_num = path_resolve(fs, path_str, &target);
+    if (inode_num == 0) {
+        fprintf(stderr, "fs_defrag_file error: no file exists [%s]\n", path_str);
+        return ErrNotFound;
+    }
+    if (target.file_type != FTypeFile) {
+        fprintf(stderr, "fs_defrag_file error: [%s] is not a regular file\n", path_str);
+        return ErrArg;
+    }
+
+    uint32_t b = 0, a = 0;
+    RC rc = file_inode_defrag(fs, inode_num, &b, &a);
+    if (before)
+        *before = b;
+    if (after)
+        *after = a;
+    return rc;
+}
+
+struct s_defrag_ctx {
+    filesystem *fs;
+    defrag_stats st;
+    RC rc;
+};
+
+static void defrag_count(defrag_stats *st, uint32_t before, uint32_t after) {
+    __atomic_fetch_add(&st->files, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->moved, after < before, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->extents_before, before, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->extents_after, after, __ATOMIC_RELAXED);
+}
+
+static int defrag_one(const char *path, const f_stat *st, void *arg) {
+    struct s_defrag_ctx *ctx = (struct s_defrag_ctx *)arg;
+    uint32_t before, after;
+    RC rc = file_inode_defrag(ctx->fs, st->inode_num, &before, &after);
+    if (rc != OK) {
+        fprintf(stderr, "fs_defrag error: failed to defrag [%s], rc=%d\n", path, rc);
+        fs_fail_once(&ctx->rc, rc);
+        return 0; // Keep going, other files may still fit
+    }
+    defrag_count(&ctx->st, before, after);
+    return 0;
+}
+
+RC fs_defrag(filesystem *fs, const char *path_str, defrag_stats *st) {
+    if (!fs || !path_str) {
+        fprintf(stderr, "fs_defrag error: wrong args...\n");
+        return ErrArg;
+    }
+
+    struct s_defrag_ctx ctx = { .fs = fs, .rc = OK };
+    inode target;
+    if (path_resolve(fs, path_str, &target) == 0) {
+        fprintf(stderr, "fs_defrag error: no file exists [%s]\n", path_str);
+        return ErrNotFound;
+    }
+
+    if (target.file_type == FTypeDirectory) {
+        walk_filter filter = { .types = WALK_TYPE_FILE };
+        RC rc = fs_walk(fs, path_str, &filter, DEFRAG_THREADS, defrag_one, &ctx);
+        if (rc != OK)
+            fs_fail_once(&ctx.rc, rc);
+    } else {
+        uint32_t before, after;
+        ctx.rc = fs_defrag_file(fs, path_str, &before, &after);
+        if (ctx.rc == OK)
+            defrag_count(&ctx.st, before, after);
+    }
+
+    if (st)
+        *st = ctx.st;
+    return ctx.rc;
+}
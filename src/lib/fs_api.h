@@ -24,23 +24,104 @@ typedef struct {
     filetype type;
     uint32_t size;
     uint32_t blocks;
+    uint32_t nlink;
 } f_stat;
 
+#define WALK_TYPE_FILE 0x01
+#define WALK_TYPE_DIR  0x02
+
+/*
+ * Predicates for fs_walk, an entry is reported only if all of them hold
+ *  name and type are checked on the directory entry, before its inode is read
+ * */
+typedef struct {
+    const char *name;  // fnmatch(3) pattern on the entry name, NULL matches every name
+    uint32_t types;    // WALK_TYPE_* mask, 0 matches every type
+    uint32_t min_size;
+    uint32_t max_size; // 0 for no upper bound
+} walk_filter;
+
+/*
+ * fs_walk callback, path is the full path of the entry
+ *  called from the pool threads, several calls may run at once
+ *  return non 0 to stop the walk
+ * */
+typedef int (*walk_fn)(const char *path, const f_stat *st, void *arg);
+
 /*
  * Like shell command 'touch', create a file
  * */
 RC fs_touch(filesystem *fs, const char *path_str);
 
+/*
+ * Like fs_touch, relative path_str starts at directory descriptor dirfd (or MY_AT_FDCWD)
+ *  creating many files in one directory resolves it once with file_open_fd(..., MY_O_DIRECTORY)
+ * */
+RC fs_touch_at(filesystem *fs, int32_t dirfd, const char *path_str);
+
 /*
  * Like shell command 'rm', decrease the link count by 1, remove the file when link count is 0
  * */
 RC fs_unlink(filesystem *fs, const char *path_str);
 
+/*
+ * Like fs_unlink, relative to directory descriptor dirfd
+ * */
+RC fs_unlink_at(filesystem *fs, int32_t dirfd, const char *path_str);
+
+/*
+ * Like rename(2) and shell command 'mv', move an entry without touching its data
+ *  an existing file at new_path is replaced, directories get their ".." updated
+ * */
+RC fs_rename(filesystem *fs, const char *old_path, const char *new_path);
+
+/*
+ * Like link(2) and shell command 'ln', give an existing file another name, blocks are not copied
+ *  directories can not be linked
+ * */
+RC fs_link(filesystem *fs, const char *existing_path, const char *new_path);
+
 /*
  * Like shell command 'cp', cp file content to create a new file
+ *  a directory is copied recursively with fs_cp_tree on one thread
  * */
 RC fs_cp(filesystem *fs, const char *src_path, const char *dst_path);
 
+/*
+ * fs_cp_tree progress, updated atomically while the copy runs
+ *  another thread may read it with __atomic_load_n to report progress
+ * */
+typedef struct {
+    uint64_t dirs;   // Directories created, dst_path included
+    uint64_t files;  // Files created and filled
+    uint64_t bytes;  // File bytes copied
+} cp_progress;
+
+/*
+ * Like shell command 'cp -r', copy the directory tree src_path to a new dst_path on a pool of threads
+ *  every directory is a task that creates its subdirectories before queueing them,
+ *  so a parent always exists before its children, file contents are copied by their own tasks
+ *  progress may be NULL, a tree copied into itself skips the copy
+ * */
+RC fs_cp_tree(filesystem *fs, const char *src_path, const char *dst_path, uint32_t threads,
+              cp_progress *progress);
+
+/*
+ * Like 'cp --reflink=always', create dst sharing all data blocks of src
+ *  blocks are copied on write later, fs_cp also clones when the disk supports it
+ * */
+RC fs_clone(filesystem *fs, const char *src_path, const char *dst_path);
+
+/*
+ * Copy logical blocks [start, start+count) from src inode to dst inode
+ *  holes of src stay holes, shared or missing dst blocks are allocated as contiguous runs without zeroing
+ *  runs contiguous on both sides are copied inside the disk image with one dcopy
+ *  dst block map is written back once, caller writes dst inode
+ *  an inline src has no blocks, copy its inode content instead
+ *  src_ino comes from file_inode_rdlock, held until this returns, so defrag can not move its blocks
+ * */
+RC fs_copy_range(filesystem *fs, inode *src_ino, inode *dst_ino, uint32_t start, uint32_t count);
+
 /*
  * Like shell command 'mkdir', create a directory, could recursively create
  * */
@@ -51,6 +132,21 @@ RC fs_mkdir(filesystem *fs, const char *path_str);
  * */
 RC fs_rmdir(filesystem *fs, const char *path_str);
 
+/*
+ * fs_rmdir on a pool of threads, for big trees
+ *  the tree is unlinked from its parent first, then every directory is a task on a work-stealing pool
+ *  directories are freed whole instead of entry by entry, blocks and inodes go back in sorted batches
+ * */
+RC fs_rmdir_parallel(filesystem *fs, const char *path_str, uint32_t threads);
+
+/*
+ * Like shell command 'find', walk the tree under path_str on a pool of threads
+ *  every directory is a task, fn gets path and stat of each entry matching filter (NULL for all)
+ *  path_str itself is not reported, "." and ".." are skipped
+ * */
+RC fs_walk(filesystem *fs, const char *path_str, const walk_filter *filter, uint32_t threads,
+           walk_fn fn, void *arg);
+
 /*
  * Like shell command 'ls', list all entries under a directory
  * */
@@ -71,6 +167,75 @@ RC fs_exists(filesystem *fs, const char *path_str);
  * */
 RC fs_stat(filesystem *fs, const char *path_str, f_stat *st);
 
+/*
+ * Like fstatat(2), relative to directory descriptor dirfd
+ * */
+RC fs_stat_at(filesystem *fs, int32_t dirfd, const char *path_str, f_stat *st);
+
+/*
+ * Create count empty files named names[i] in directory dir_path
+ *  the directory is resolved and locked once, the inodes come from one contiguous run,
+ *  the entries are packed into as few directory blocks as possible, each written once
+ *  results[i] (may be NULL) says what happened to names[i], returns the first failure or OK
+ * */
+RC fs_batch_create(filesystem *fs, const char *dir_path, const char *const *names, uint32_t count,
+                   RC *results);
+
+/*
+ * fs_unlink for count files of directory dir_path, one pass over the directory,
+ *  the inodes whose last name went are freed together
+ * */
+RC fs_batch_unlink(filesystem *fs, const char *dir_path, const char *const *names, uint32_t count,
+                   RC *results);
+
+/*
+ * fs_stat for count names of directory dir_path into out[i], one pass over the directory,
+ *  then ino_read_batch, a missing name leaves out[i] zeroed and returns ErrNotFound
+ * */
+RC fs_batch_stat(filesystem *fs, const char *dir_path, const char *const *names, uint32_t count,
+                 f_stat *out, RC *results);
+
+#define FRAG_HIST_BUCKETS 8 // Extent count histogram: 1, 2, 3-4, 5-8, ..., 65 and more
+
+/*
+ * Fragmentation of the block mapped regular files
+ * */
+typedef struct {
+    uint32_t files;   // Files with at least one block
+    uint32_t blocks;  // Blocks they map
+    uint32_t extents; // Physically contiguous runs over all of them
+    uint32_t hist[FRAG_HIST_BUCKETS]; // Files by extents, bucket b > 0 holds 2^(b-1)+1 to 2^b
+} frag_report;
+
+typedef struct {
+    uint32_t files;          // Regular files looked at
+    uint32_t moved;          // Files whose blocks were relocated
+    uint32_t extents_before;
+    uint32_t extents_after;
+} defrag_stats;
+
+/*
+ * Fill rep from one pass over the used inodes, their table blocks read with ino_read_batch
+ * */
+RC fs_frag_report(filesystem *fs, frag_report *rep);
+
+/*
+ * Print rep as a histogram, for my_fsinfo and my_defrag
+ * */
+void fs_frag_show(const frag_report *rep);
+
+/*
+ * Online defragmentation of one regular file, see file_inode_defrag
+ *  before and after get its extent count, either may be NULL
+ * */
+RC fs_defrag_file(filesystem *fs, const char *path_str, uint32_t *before, uint32_t *after);
+
+/*
+ * fs_defrag_file on path_str, or on every regular file below it when it is a directory
+ *  st may be NULL
+ * */
+RC fs_defrag(filesystem *fs, const char *path_str, defrag_stats *st);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,413 @@
+/*
+ * fs_coro.hpp
+ * C++20 coroutines over the aio ring, co_await filesystem calls from one event loop thread
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ * Usage:
+ *  fs_coro::task<int32_t> head(fs_coro::executor &ex, const char *path, uint8_t *buf) {
+ *      fs_coro::io_result fd = co_await ex.open(path, MY_O_RDONLY);
+ *      fs_coro::io_result n  = co_await ex.read(fd.res, buf, 64);
+ *      co_await ex.close(fd.res);
+ *      co_return n.res;
+ *  }
+ *
+ *  fs_coro::executor ex(fs, 4, 256);
+ *  int32_t n = ex.block_on(head(ex, "/a.txt", buf)); // Or ex.spawn(...) many, then ex.run()
+ *
+ * Pass state to coroutines as parameters, a lambda coroutine's captures die with the lambda.
+ *
+ * Coroutines are only ever resumed on the thread calling run/poll, the blocking calls
+ * themselves run on the ring's worker pool. Paths and buffers passed in must live until
+ * the co_await returns, which they do when they are locals of the awaiting coroutine.
+ */
+
+#ifndef MY_FS_CORO_HPP_
+#define MY_FS_CORO_HPP_
+
+#include "aio.h"
+#include "directory.h"
+#include "file.h"
+#include "fs_api.h"
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace fs_coro {
+
+// Completions the executor takes off the ring per reap
+constexpr uint32_t REAP_BATCH = 64;
+
+// What an aio request completed with, res is the descriptor or byte count where one applies
+struct io_result {
+    RC rc;
+    int32_t res;
+    bool ok() const { return rc == OK; }
+};
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+// Resume whoever awaited the finished task, nothing if it was started detached
+struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+        std::coroutine_handle<> next = h.promise().continuation;
+        return next ? next : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+};
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+    void rethrow() const {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object() noexcept;
+    template <typename U>
+    void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T take() {
+        rethrow();
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void take() const { rethrow(); }
+};
+
+// Started by executor::spawn, frees itself when done
+struct detached {
+    struct promise_type {
+        detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+} // namespace detail
+
+/*
+ * Lazy coroutine, starts when awaited and resumes its awaiter when it returns
+ * */
+template <typename T>
+class [[nodiscard]] task {
+public:
+    using promise_type = detail::promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit task(handle_type h) noexcept : h_(h) {}
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task() {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+    T await_resume() { return h_.promise().take(); }
+
+private:
+    handle_type h_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object() noexcept {
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept {
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+class executor;
+
+/*
+ * One aio request, submitted when the awaiting coroutine suspends
+ * */
+class io_awaiter {
+public:
+    io_awaiter(executor *ex, const aio_sqe &sqe) noexcept : ex_(ex), sqe_(sqe), cqe_{} {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h);
+    io_result await_resume() const noexcept { return io_result{cqe_.rc, cqe_.res}; }
+
+private:
+    friend class executor;
+    executor *ex_;
+    aio_sqe sqe_;
+    aio_cqe cqe_;
+    std::coroutine_handle<> handle_;
+};
+
+/*
+ * Any callable run on a worker, co_await gives back what it returned
+ *  exceptions thrown on the worker are rethrown in the coroutine
+ * */
+template <typename F>
+class call_awaiter : public io_awaiter {
+public:
+    using result_type = std::invoke_result_t<F &>;
+
+    call_awaiter(executor *ex, F f) : io_awaiter(ex, make_sqe(this)), f_(std::move(f)) {}
+    call_awaiter(const call_awaiter &) = delete;
+
+    result_type await_resume() {
+        if (error_)
+            std::rethrow_exception(error_);
+        if constexpr (!std::is_void_v<result_type>)
+            return std::move(*value_);
+    }
+
+private:
+    static aio_sqe make_sqe(call_awaiter *self) noexcept {
+        aio_sqe sqe{};
+        sqe.op = AioCall;
+        sqe.call = &call_awaiter::trampoline;
+        sqe.arg = self;
+        return sqe;
+    }
+
+    static RC trampoline(void *arg, int32_t *res) {
+        call_awaiter *self = static_cast<call_awaiter *>(arg);
+        *res = 0;
+        try {
+            if constexpr (std::is_void_v<result_type>)
+                self->f_();
+            else
+                self->value_.emplace(self->f_());
+        } catch (...) {
+            self->error_ = std::current_exception();
+        }
+        return OK;
+    }
+
+    using stored_type = std::conditional_t<std::is_void_v<result_type>, char, result_type>;
+
+    F f_;
+    std::optional<stored_type> value_;
+    std::exception_ptr error_;
+};
+
+/*
+ * Owns an aio ring and drives the coroutines waiting on it
+ *  requests queue up while coroutines run and are submitted in one batch per loop
+ * */
+class executor {
+public:
+    explicit executor(filesystem *fs, uint32_t workers = 4, uint32_t depth = 256)
+        : fs_(fs), ring_(aio_create(fs, workers, depth)) {
+        if (!ring_)
+            throw std::runtime_error("fs_coro::executor: aio_create failed");
+    }
+    executor(const executor &) = delete;
+    executor &operator=(const executor &) = delete;
+    ~executor() { aio_destroy(ring_); }
+
+    filesystem *fs() const noexcept { return fs_; }
+
+    // Readable when completions wait, for callers that own the epoll loop and call poll()
+    int event_fd() const noexcept { return aio_event_fd(ring_); }
+
+    // Start t now, it runs until its first co_await, the executor keeps it alive
+    void spawn(task<void> t) {
+        live_++;
+        run_detached(this, std::move(t));
+    }
+
+    // Loop until every spawned task has finished, rethrow the first exception one threw
+    void run() {
+        while (live_ > 0) {
+            if (!step(1))
+                break; // Nothing in flight, nothing can wake a task
+        }
+        rethrow();
+    }
+
+    // One round without waiting, true while spawned tasks are still alive
+    bool poll() {
+        step(0);
+        rethrow();
+        return live_ > 0;
+    }
+
+    // Run t to completion on this thread and hand back its value
+    template <typename T>
+    T block_on(task<T> t) {
+        std::optional<std::conditional_t<std::is_void_v<T>, char, T>> out;
+        spawn(capture(std::move(t), out));
+        run();
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*out);
+    }
+
+    io_awaiter open(const char *path, uint32_t flags) {
+        aio_sqe sqe{};
+        sqe.op = AioOpen;
+        sqe.path = path;
+        sqe.flags = flags;
+        return io_awaiter(this, sqe);
+    }
+
+    io_awaiter close(int32_t fd) {
+        aio_sqe sqe{};
+        sqe.op = AioClose;
+        sqe.fd = fd;
+        return io_awaiter(this, sqe);
+    }
+
+    io_awaiter read(int32_t fd, uint8_t *buf, uint32_t len) {
+        aio_sqe sqe{};
+        sqe.op = AioRead;
+        sqe.fd = fd;
+        sqe.buf = buf;
+        sqe.len = len;
+        return io_awaiter(this, sqe);
+    }
+
+    io_awaiter write(int32_t fd, uint8_t *buf, uint32_t len) {
+        aio_sqe sqe{};
+        sqe.op = AioWrite;
+        sqe.fd = fd;
+        sqe.buf = buf;
+        sqe.len = len;
+        return io_awaiter(this, sqe);
+    }
+
+    io_awaiter stat(const char *path, f_stat *st) {
+        aio_sqe sqe{};
+        sqe.op = AioStat;
+        sqe.path = path;
+        sqe.st = st;
+        return io_awaiter(this, sqe);
+    }
+
+    io_awaiter touch(const char *path) { return path_op(AioTouch, path); }
+    io_awaiter unlink(const char *path) { return path_op(AioUnlink, path); }
+    io_awaiter mkdir(const char *path) { return path_op(AioMkdir, path); }
+
+    // Inode number of name in directory dir_ino, 0 if missing
+    auto lookup(inode *dir_ino, const char *name) {
+        filesystem *fs = fs_;
+        return call([fs, dir_ino, name] { return dir_lookup(fs, dir_ino, (const uint8_t *)name); });
+    }
+
+    template <typename F>
+    call_awaiter<F> call(F f) {
+        return call_awaiter<F>(this, std::move(f));
+    }
+
+private:
+    friend class io_awaiter;
+
+    static detail::detached run_detached(executor *ex, task<void> t) {
+        try {
+            co_await t;
+        } catch (...) {
+            if (!ex->error_)
+                ex->error_ = std::current_exception();
+        }
+        ex->live_--;
+    }
+
+    template <typename T, typename Out>
+    static task<void> capture(task<T> t, Out &out) {
+        if constexpr (std::is_void_v<T>)
+            co_await t;
+        else
+            out.emplace(co_await t);
+    }
+
+    io_awaiter path_op(aio_op op, const char *path) {
+        aio_sqe sqe{};
+        sqe.op = op;
+        sqe.path = path;
+        return io_awaiter(this, sqe);
+    }
+
+    void enqueue(io_awaiter *op) { pending_.push_back(op); }
+
+    // Submit what queued up, reap, resume, false once nothing is queued or in flight
+    bool step(uint32_t min_complete) {
+        if (!pending_.empty()) {
+            std::vector<aio_sqe> batch;
+            batch.reserve(pending_.size());
+            for (io_awaiter *op : pending_)
+                batch.push_back(op->sqe_);
+            uint32_t taken = 0;
+            aio_submit(ring_, batch.data(), (uint32_t)batch.size(), &taken);
+            pending_.erase(pending_.begin(), pending_.begin() + taken);
+            inflight_ += taken;
+        }
+        if (inflight_ == 0)
+            return !pending_.empty();
+
+        aio_cqe cqes[REAP_BATCH];
+        uint32_t n = aio_reap(ring_, cqes, REAP_BATCH, min_complete);
+        inflight_ -= n;
+        for (uint32_t i = 0; i < n; i++) {
+            io_awaiter *op = reinterpret_cast<io_awaiter *>(cqes[i].user_data);
+            op->cqe_ = cqes[i];
+            op->handle_.resume();
+        }
+        return true;
+    }
+
+    void rethrow() {
+        if (error_)
+            std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+
+    filesystem *fs_;
+    aio_ring *ring_;
+    std::deque<io_awaiter *> pending_;
+    uint32_t inflight_ = 0;
+    uint32_t live_ = 0;
+    std::exception_ptr error_;
+};
+
+inline void io_awaiter::await_suspend(std::coroutine_handle<> h) {
+    handle_ = h;
+    sqe_.user_data = reinterpret_cast<uint64_t>(this);
+    ex_->enqueue(this);
+}
+
+} // namespace fs_coro
+
+#endif
@@ -11,6 +11,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 RC ino_init(inode *ino) {
     if (!ino) {
@@ -28,26 +29,132 @@ RC ino_init(inode *ino) {
     return OK;
 }
 
+void ino_groups_init(filesystem *fs) {
+    // A multiple of the inodes per table block, inode n sits in block n / per_block, so a group
+    // covers whole blocks except its last inode, which opens the next group's first block
+    uint32_t per_block = get_inode_per_block(fs->dd);
+    uint32_t size = (fs->inodes + INO_GROUPS - 1) / INO_GROUPS;
+    size = (size + per_block - 1) / per_block * per_block;
+    fs->ino_group_size = size ? size : per_block;
+
+    memset(fs->ino_group_free, 0, sizeof(fs->ino_group_free));
+    for (uint32_t idx=0; idx<fs->inodes; idx++) {
+        if (!bm_getbit(fs->inode_bitmap, idx))
+            fs->ino_group_free[idx / fs->ino_group_size]++;
+    }
+    fs->ino_dir_cursor = 0;
+}
+
+// Take bitmap index idx, with alloc_lock held
+static void ino_take_locked(filesystem *fs, uint32_t idx) {
+    bm_setbit(fs->inode_bitmap, idx); // Allocate means it is used
+    fs_mark_bitmap_dirty(fs, fs->inode_bitmap, idx);
+    fs->ino_group_free[idx / fs->ino_group_size]--;
+}
+
+// Group the search for a new inode starts at, with alloc_lock held
+static uint32_t ino_pick_group_locked(filesystem *fs, uint32_t parent_num, filetype type) {
+    uint32_t parent_group = parent_num ? (parent_num-1) / fs->ino_group_size : 0;
+    if (type != FTypeDirectory) {
+        return parent_group;
+    }
+
+    if (parent_num <= 1) { // Under root, spread out, the cursor breaks ties differently each time
+        uint32_t best = parent_group, best_free = 0;
+        for (uint32_t i=0; i<INO_GROUPS; i++) {
+            uint32_t g = (fs->ino_dir_cursor + i) % INO_GROUPS;
+            if (fs->ino_group_free[g] > best_free) {
+                best = g;
+                best_free = fs->ino_group_free[g];
+            }
+        }
+        fs->ino_dir_cursor = (best + 1) % INO_GROUPS;
+        return best;
+    }
+
+    // Deeper down, stay close to the parent unless its group is fuller than average
+    uint64_t total = 0;
+    for (uint32_t g=0; g<INO_GROUPS; g++)
+        total += fs->ino_group_free[g];
+    uint32_t avg = (uint32_t)(total / INO_GROUPS);
+    for (uint32_t i=0; i<INO_GROUPS; i++) {
+        uint32_t g = (parent_group + i) % INO_GROUPS;
+        if (fs->ino_group_free[g] > 0 && fs->ino_group_free[g] >= avg)
+            return g;
+    }
+    return parent_group;
+}
+
 uint32_t ino_alloc(filesystem *fs) {
+    return ino_alloc_near(fs, 0, FTypeFile);
+}
+
+uint32_t ino_alloc_near(filesystem *fs, uint32_t parent_num, filetype type) {
     if (!fs) {
-        fprintf(stderr, "ino_alloc error: non null filesystem pointer is needed...\n");
+        fprintf(stderr, "ino_alloc_near error: non null filesystem pointer is needed...\n");
+        return 0;
+    }
+    if (parent_num > fs->inodes) {
+        fprintf(stderr, "ino_alloc_near error: wrong parent inode number [%d]\n", parent_num);
         return 0;
     }
 
-    // Iterating all possible inodes
-    uint32_t idx;
-    for (idx=0; idx<=fs->inodes; idx++) {
+    // Iterating all possible inodes, from the chosen group on and around
+    pthread_mutex_lock(&fs->alloc_lock);
+    uint32_t start = ino_pick_group_locked(fs, parent_num, type) * fs->ino_group_size;
+    for (uint32_t i=0; i<fs->inodes; i++) {
+        uint32_t idx = (start + i) % fs->inodes;
         if (!bm_getbit(fs->inode_bitmap, idx)) { // if bit == 0, which means it is available
-            bm_setbit(fs->inode_bitmap, idx); // Allocate means it is used
+            ino_take_locked(fs, idx);
+            pthread_mutex_unlock(&fs->alloc_lock);
             // bitmap is 0-based
             // inode number/index is 1-based
             // Therefore return idx + 1
             return idx+1;
         }
     }
+    pthread_mutex_unlock(&fs->alloc_lock);
 
     fprintf(stderr, "ino_alloc error: no free inode...\n");
-    return idx;
+    return 0;
+}
+
+RC ino_alloc_batch(filesystem *fs, uint32_t parent_num, uint32_t count, uint32_t *out) {
+    if (!fs || (!out && count) || parent_num > fs->inodes) {
+        fprintf(stderr, "ino_alloc_batch error: wrong arguments\n");
+        return ErrArg;
+    }
+
+    // One scan from the parent's group finds the first run long enough,
+    // the first count free ones are the fallback
+    uint32_t found = 0, run_start = 0, run_len = 0;
+    pthread_mutex_lock(&fs->alloc_lock);
+    uint32_t start = ino_pick_group_locked(fs, parent_num, FTypeFile) * fs->ino_group_size;
+    for (uint32_t i=0; i<fs->inodes && run_len < count; i++) {
+        uint32_t idx = (start + i) % fs->inodes;
+        if (idx == 0 || bm_getbit(fs->inode_bitmap, idx)) // A run does not wrap around
+            run_len = 0;
+        if (bm_getbit(fs->inode_bitmap, idx))
+            continue;
+        if (run_len++ == 0)
+            run_start = idx;
+        if (found < count)
+            out[found++] = idx + 1;
+    }
+    if (found < count) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        fprintf(stderr, "ino_alloc_batch error: only [%d] free inodes for [%d]\n", found, count);
+        return ErrNoSpace;
+    }
+    if (run_len == count) {
+        for (uint32_t i=0; i<count; i++)
+            out[i] = run_start + i + 1;
+    }
+    for (uint32_t i=0; i<count; i++)
+        ino_take_locked(fs, out[i]-1);
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return OK;
 }
 
 RC ino_free(filesystem *fs, uint32_t inode_number) {
@@ -57,15 +164,50 @@ RC ino_free(filesystem *fs, uint32_t inode_number) {
     }
 
     // Convert back to 0-based
-    if (bm_unsetbit(fs->inode_bitmap, inode_number-1) < 0) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    uint8_t was_used = bm_getbit(fs->inode_bitmap, inode_number-1);
+    if (bm_unsetbit(fs->inode_bitmap, inode_number-1) != 0) {
+        pthread_mutex_unlock(&fs->alloc_lock);
         fprintf(stderr, "ino_free error: failed to unsetbit at [%d]\n",
                 (int)(inode_number));
         return ErrBmOpe;
     }
+    fs_mark_bitmap_dirty(fs, fs->inode_bitmap, inode_number-1);
+    if (was_used) // Freeing twice must not count the inode twice
+        fs->ino_group_free[(inode_number-1) / fs->ino_group_size]++;
+    pthread_mutex_unlock(&fs->alloc_lock);
 
     return OK;
 }
 
+RC ino_free_batch(filesystem *fs, const uint32_t *inode_numbers, uint32_t count) {
+    if (!fs || (!inode_numbers && count)) {
+        fprintf(stderr, "ino_free_batch error: wrong arguments\n");
+        return ErrArg;
+    }
+
+    RC ret = OK;
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (uint32_t n=0; n<count; n++) {
+        uint32_t inode_number = inode_numbers[n];
+        uint8_t was_used = inode_number >= 1 && inode_number <= fs->inodes &&
+                           bm_getbit(fs->inode_bitmap, inode_number-1);
+        if (inode_number < 1 || inode_number > fs->inodes ||
+            bm_unsetbit(fs->inode_bitmap, inode_number-1) != 0) {
+            fprintf(stderr, "ino_free_batch error: failed to unsetbit at [%d]\n",
+                    (int)inode_number);
+            ret = ErrBmOpe;
+            continue;
+        }
+        fs_mark_bitmap_dirty(fs, fs->inode_bitmap, inode_number-1);
+        if (was_used)
+            fs->ino_group_free[(inode_number-1) / fs->ino_group_size]++;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return ret;
+}
+
 RC ino_read(filesystem *fs, uint32_t inode_number, inode* ino) {
     if (!fs || inode_number < 1 || inode_number > fs->inodes
             || !ino) {
@@ -115,6 +257,129 @@ RC ino_read(filesystem *fs, uint32_t inode_number, inode* ino) {
     return ret;
 }
 
+struct s_ino_batch_slot {
+    uint32_t block_number;
+    uint32_t index; // Position in the caller's arrays
+};
+
+static int ino_batch_slot_cmp(const void *a, const void *b) {
+    const struct s_ino_batch_slot *x = a, *y = b;
+    if (x->block_number != y->block_number)
+        return x->block_number < y->block_number ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+RC ino_read_batch(filesystem *fs, const uint32_t *inode_numbers, uint32_t count, inode *out) {
+    if (!fs || !inode_numbers || !out) {
+        fprintf(stderr, "ino_read_batch error: wrong arguments\n");
+        return ErrArg;
+    }
+    if (count == 0) {
+        return OK;
+    }
+
+    struct s_ino_batch_slot *slots = malloc(count * sizeof(struct s_ino_batch_slot));
+    if (!slots) {
+        fprintf(stderr, "ino_read_batch error: failed to alloc memory\n");
+        return ErrNoMem;
+    }
+
+    // Same layout as ino_read
+    uint32_t ino_per_block = get_inode_per_block(fs->dd);
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t inode_number = inode_numbers[i];
+        if (inode_number < 1 || inode_number > fs->inodes ||
+            !bm_getbit(fs->inode_bitmap, inode_number-1)) {
+            fprintf(stderr, "ino_read_batch error: inode [%d] is not allocated...\n",
+                    inode_number);
+            free(slots);
+            return ErrArg;
+        }
+        slots[i].block_number = inode_number / ino_per_block + fs->inode_table_start;
+        slots[i].index = i;
+    }
+    qsort(slots, count, sizeof(struct s_ino_batch_slot), ino_batch_slot_cmp);
+
+    uint32_t size = fs->dd->block_size;
+    uint8_t block[size];
+    uint32_t loaded = 0;
+    for (uint32_t i=0; i<count; i++) {
+        if (slots[i].block_number != loaded) {
+            if (dread(fs->dd, block, slots[i].block_number) != OK) {
+                fprintf(stderr, "ino_read_batch error: failed to read from block [%d]...\n",
+                        (int)slots[i].block_number);
+                free(slots);
+                return ErrDread;
+            }
+            loaded = slots[i].block_number;
+        }
+        uint32_t inode_pos = (inode_numbers[slots[i].index]-1) % ino_per_block;
+        memcpy(&out[slots[i].index], block+inode_pos*sizeof(struct s_inode), sizeof(struct s_inode));
+    }
+
+    free(slots);
+    return OK;
+}
+
+RC ino_write_batch(filesystem *fs, const inode *inodes, uint32_t count) {
+    if (!fs || (!inodes && count)) {
+        fprintf(stderr, "ino_write_batch error: wrong arguments\n");
+        return ErrArg;
+    }
+    if (count == 0) {
+        return OK;
+    }
+
+    struct s_ino_batch_slot *slots = malloc(count * sizeof(struct s_ino_batch_slot));
+    if (!slots) {
+        fprintf(stderr, "ino_write_batch error: failed to alloc memory\n");
+        return ErrNoMem;
+    }
+
+    // Same layout as ino_write
+    uint32_t ino_per_block = get_inode_per_block(fs->dd);
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t inode_number = inodes[i].inode_number;
+        if (inode_number < 1 || inode_number > fs->inodes) {
+            fprintf(stderr, "ino_write_batch error: wrong inode number [%d]\n", inode_number);
+            free(slots);
+            return ErrArg;
+        }
+        slots[i].block_number = inode_number / ino_per_block + fs->inode_table_start;
+        slots[i].index = i;
+    }
+    qsort(slots, count, sizeof(struct s_ino_batch_slot), ino_batch_slot_cmp);
+
+    uint32_t size = fs->dd->block_size;
+    uint8_t block[size];
+    RC ret = OK;
+    for (uint32_t i=0; i<count && ret == OK; ) {
+        uint32_t block_number = slots[i].block_number;
+        pthread_mutex_t *lock = &fs->ino_locks[block_number % INO_LOCK_STRIPES];
+        pthread_mutex_lock(lock);
+        if ((ret = dread(fs->dd, block, block_number)) != OK) {
+            pthread_mutex_unlock(lock);
+            fprintf(stderr, "ino_write_batch error: failed to read from block [%d]...\n",
+                    (int)block_number);
+            break;
+        }
+        for (; i<count && slots[i].block_number == block_number; i++) {
+            const inode *ino = &inodes[slots[i].index];
+            uint32_t inode_pos = (ino->inode_number-1) % ino_per_block;
+            memcpy(block+inode_pos*sizeof(struct s_inode), ino, sizeof(struct s_inode));
+        }
+        ret = dwrite(fs->dd, block, block_number);
+        pthread_mutex_unlock(lock);
+        if (ret != OK) {
+            fprintf(stderr, "ino_write_batch error: failed to write to block [%d]...\n",
+                    (int)block_number);
+        }
+    }
+
+    free(slots);
+    return ret;
+}
+
 RC ino_write(filesystem *fs, uint32_t inode_number, inode* ino) {
     if (!fs || inode_number < 1 || inode_number > fs->inodes
             || !ino) {
@@ -139,8 +404,12 @@ RC ino_write(filesystem *fs, uint32_t inode_number, inode* ino) {
 
     inode_pos = (inode_number-1) % ino_per_block;
 
+    // Neighbours in the same table block are written by other threads too
+    pthread_mutex_t *lock = &fs->ino_locks[block_number % INO_LOCK_STRIPES];
+    pthread_mutex_lock(lock);
     ret = dread(fs->dd, block, block_number);
     if (ret != OK) {
+        pthread_mutex_unlock(lock);
         fprintf(stderr, "ino_write error: failed to read from block [%d]...\n",
                 (int)block_number);
         return ret;
@@ -151,6 +420,7 @@ RC ino_write(filesystem *fs, uint32_t inode_number, inode* ino) {
     memcpy(data_begin, ino, size);
 
     ret = dwrite(fs->dd, block, block_number);
+    pthread_mutex_unlock(lock);
     if (ret != OK) {
         fprintf(stderr, "ino_write error: failed to write to block [%d]...\n",
                 (int)block_number);
@@ -160,6 +430,10 @@ RC ino_write(filesystem *fs, uint32_t inode_number, inode* ino) {
 }
 
 uint32_t ino_get_block_at(filesystem *fs, inode *ino, uint32_t offset) {
+    return ino_get_block_entry(fs, ino, offset) & INO_BLOCK_MASK;
+}
+
+uint32_t ino_get_block_entry(filesystem *fs, inode *ino, uint32_t offset) {
     uint32_t block_number_size = (sizeof(uint32_t));
     uint32_t max_offset = DIRECT_POINTERS + fs->dd->block_size/block_number_size; // Block number is uint32_t type
     if (!fs || !ino || offset < 0 || offset > max_offset) {
@@ -167,13 +441,15 @@ uint32_t ino_get_block_at(filesystem *fs, inode *ino, uint32_t offset) {
         return 0;
     }
 
+    if (ino_is_inline(ino)) {
+        return 0; // No blocks behind inline content
+    }
+
 
     if (offset < DIRECT_POINTERS) {
         return ino->direct_blocks[offset];
     } else if (!ino->single_indirect) {
-        fprintf(stderr, "ino_get_block error: failed to get block at offset [%d], no single_indirect pointer...\n",
-                (int)offset);
-        return 0;
+        return 0; // Nothing past the direct blocks, a hole
     } else {
         RC ret;
         uint32_t size = fs->dd->block_size;
@@ -198,6 +474,31 @@ uint32_t ino_get_block_at(filesystem *fs, inode *ino, uint32_t offset) {
 }
 
 
+uint32_t ino_block_goal(filesystem *fs, inode *ino, uint32_t offset) {
+    if (!fs || !ino) {
+        return 0;
+    }
+
+    // Right after the previous logical block, only looked up when no disk read is needed
+    if (!ino_is_inline(ino) && offset > 0 && offset <= DIRECT_POINTERS) {
+        uint32_t prev = ino->direct_blocks[offset-1] & INO_BLOCK_MASK;
+        if (prev)
+            return prev + 1;
+    }
+
+    // Right after whatever this inode took last, sequential writes past the direct blocks
+    if (ino->alloc_goal) {
+        return ino->alloc_goal + 1;
+    }
+
+    // First block of the inode, start in the slice of the data area matching its inode group
+    if (ino->inode_number == 0 || fs->ino_group_size == 0) {
+        return 0;
+    }
+    uint32_t group = (ino->inode_number-1) / fs->ino_group_size;
+    return fs->datablock_start + group * (fs->datablock_bl_count / INO_GROUPS);
+}
+
 uint32_t ino_alloc_block_at(filesystem *fs, inode *ino, uint32_t offset) {
     uint32_t block_number_size = (sizeof(uint32_t));
     uint32_t max_offset = DIRECT_POINTERS + fs->dd->block_size/block_number_size; // Block number is uint32_t type
@@ -206,6 +507,12 @@ uint32_t ino_alloc_block_at(filesystem *fs, inode *ino, uint32_t offset) {
         return 0;
     }
 
+    if (ino_is_inline(ino)) {
+        fprintf(stderr, "ino_alloc_block error: inode [%d] is inline, promote it first...\n",
+                ino->inode_number);
+        return 0;
+    }
+
     uint32_t block_number = ino_get_block_at(fs, ino, offset);
     if (block_number != 0) {
         // fprintf(stderr, "ino_alloc_block error: inode [%d] offset at [%d] is already allocated...\n",
@@ -213,25 +520,41 @@ uint32_t ino_alloc_block_at(filesystem *fs, inode *ino, uint32_t offset) {
         return 0;
     }
 
-    block_number = bl_alloc(fs);
-    if (!block_number) { // block_number == 0 means failed
-        fprintf(stderr, "ino_alloc_block error: failed to alloc a block number...\n");
-        return 0;
+    uint32_t goal = ino_block_goal(fs, ino, offset);
+
+    // Indirect block may have been released by a truncate, bring it back
+    // it goes in front of the data it maps, so the data after it stays one run
+    uint32_t new_indirect = 0;
+    if (offset >= DIRECT_POINTERS && !ino->single_indirect) {
+        new_indirect = bl_alloc_goal(fs, goal);
+        if (!new_indirect || bl_clean(fs, new_indirect) != OK) {
+            fprintf(stderr, "ino_alloc_block error: failed to alloc at offset [%d], no single_indirect pointer...\n",
+                    (int)offset);
+            if (new_indirect)
+                bl_free(fs, new_indirect);
+            return 0;
+        }
+        goal = new_indirect + 1;
     }
-    if (bl_clean(fs, block_number) != 0) {
-        fprintf(stderr, "ino_alloc_block error: failed to init a block...\n");
-        bl_free(fs, block_number);
+
+    block_number = bl_alloc_goal(fs, goal);
+    if (!block_number || bl_clean(fs, block_number) != OK) { // block_number == 0 means failed
+        fprintf(stderr, "ino_alloc_block error: failed to alloc a block number...\n");
+        if (block_number)
+            bl_free(fs, block_number);
+        if (new_indirect)
+            bl_free(fs, new_indirect);
         return 0;
     }
+    ino->alloc_goal = block_number;
 
     // If offset point to direct blocks
     if (offset < DIRECT_POINTERS) {
         ino->direct_blocks[offset] = block_number;
-    } else if (!ino->single_indirect) { // Handle indirect condition
-        fprintf(stderr, "ino_alloc_block error: failed to alloc at offset [%d], no single_indirect pointer...\n",
-                (int)offset);
-        return 0;
-    } else { // Has single indirect
+    } else {
+        if (new_indirect)
+            ino->single_indirect = new_indirect;
+
         RC ret;
         uint32_t size = fs->dd->block_size;
         uint8_t block_buf[size];
@@ -259,6 +582,50 @@ uint32_t ino_alloc_block_at(filesystem *fs, inode *ino, uint32_t offset) {
     return block_number; // 0 is bad block number
 }
 
+RC ino_set_block_at(filesystem *fs, inode *ino, uint32_t offset, uint32_t block_number) {
+    uint32_t block_number_size = (sizeof(uint32_t));
+    if (!fs || !ino || offset >= ino_get_max_block_offset(fs)) {
+        fprintf(stderr, "ino_set_block_at error: wrong arguments...\n");
+        return ErrArg;
+    }
+
+    if (ino_is_inline(ino)) {
+        fprintf(stderr, "ino_set_block_at error: inode [%d] is inline...\n", ino->inode_number);
+        return ErrInode;
+    }
+
+    if (offset < DIRECT_POINTERS) {
+        ino->direct_blocks[offset] = block_number;
+        return OK;
+    }
+
+    if (!ino->single_indirect) {
+        fprintf(stderr, "ino_set_block_at error: failed to set offset [%d], no single_indirect pointer...\n",
+                (int)offset);
+        return ErrInode;
+    }
+
+    RC ret;
+    uint32_t size = fs->dd->block_size;
+    uint8_t block_buf[size];
+    ret = dread(fs->dd, block_buf, ino->single_indirect);
+    if (ret != OK) {
+        fprintf(stderr, "ino_set_block_at error: failed to read from a block at [%d]...\n",
+                ino->single_indirect);
+        return ret;
+    }
+
+    uint32_t slot_pos = (offset - DIRECT_POINTERS)*block_number_size;
+    memcpy(block_buf+slot_pos, &block_number, block_number_size);
+
+    ret = dwrite(fs->dd, block_buf, ino->single_indirect);
+    if (ret != OK) {
+        fprintf(stderr, "ino_set_block_at error: failed to write a block at [%d]...\n",
+                ino->single_indirect);
+    }
+    return ret;
+}
+
 RC ino_free_block_at(filesystem *fs, inode *ino, uint32_t offset) {
     uint32_t block_number_size = (sizeof(uint32_t));
     uint32_t max_offset = DIRECT_POINTERS + fs->dd->block_size/block_number_size; // Block number is uint32_t type
@@ -314,70 +681,221 @@ RC ino_free_block_at(filesystem *fs, inode *ino, uint32_t offset) {
 }
 
 RC ino_free_all_blocks(filesystem *fs, inode *ino) {
-    uint32_t block_number_size = (sizeof(uint32_t));
     if (!fs || !ino) {
-        fprintf(stderr, "ino_free_block_at error: wrong arguments...\n");
+        fprintf(stderr, "ino_free_all_blocks error: wrong arguments...\n");
         return ErrArg;
     }
 
-    RC ret = OK;
+    RC ret = ino_release_range(fs, ino, 0, ino_get_max_block_offset(fs));
+    if (ret != OK) {
+        fprintf(stderr, "ino_free_all_blocks error: failed to release blocks of inode [%d]...\n",
+                ino->inode_number);
+    }
+    return ret;
+}
 
-    uint32_t offset;
-    for (offset=0; offset < DIRECT_POINTERS; offset++) {
-        if (ino->direct_blocks[offset] == 0)
-            continue;
+uint32_t ino_collect_blocks(filesystem *fs, inode *ino, uint32_t *out) {
+    if (!fs || !ino || !out || ino_is_inline(ino)) {
+        return 0;
+    }
 
-        // unset bitmap
-        ret = bl_free(fs, ino->direct_blocks[offset]);
-        if (ret != OK) {
-            fprintf(stderr, "ino_free_block_at error: failed to free a block at [%d]...\n",
-                    ino->direct_blocks[offset]);
-            return ret;
-        }
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    uint32_t map[max_offset];
+    if (ino_get_block_map(fs, ino, map) != OK) {
+        fprintf(stderr, "ino_collect_blocks error: failed to read block map...\n");
+        return 0;
+    }
 
-        ino->direct_blocks[offset] = 0;
+    uint32_t count = 0;
+    for (uint32_t n=0; n<max_offset; n++) {
+        if (map[n] != 0)
+            out[count++] = map[n] & INO_BLOCK_MASK;
     }
+    if (ino->single_indirect)
+        out[count++] = ino->single_indirect;
+    return count;
+}
 
-    if (!ino->single_indirect) { // Handle indirect condition
-        return ret; // It's OK
-    } else { // Has single indirect
-        uint32_t size = fs->dd->block_size;
-        uint8_t block_buf[size];
-        memset(block_buf, 0, size);
-        ret = dread(fs->dd, block_buf, ino->single_indirect);
-        if (ret != OK) {
-            fprintf(stderr, "ino_free_block_at error: failed to read from a block at [%d]...\n",
-                    ino->single_indirect);
-            return ret;
+RC ino_release_range(filesystem *fs, inode *ino, uint32_t first, uint32_t last) {
+    if (!fs || !ino || first > last || last > ino_get_max_block_offset(fs)) {
+        fprintf(stderr, "ino_release_range error: wrong arguments...\n");
+        return ErrArg;
+    }
+
+    if (first == last || ino_is_inline(ino)) {
+        return OK;
+    }
+
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    uint32_t map[max_offset];
+    // One extra slot for the indirect block itself
+    uint32_t victims[last-first+1];
+    uint32_t victim_count = 0;
+    RC ret;
+
+    if ((ret = ino_get_block_map(fs, ino, map)) != OK) {
+        fprintf(stderr, "ino_release_range error: failed to read block map...\n");
+        return ret;
+    }
+
+    for (uint32_t n=first; n<last; n++) {
+        if (map[n] == 0)
+            continue;
+        victims[victim_count++] = map[n] & INO_BLOCK_MASK;
+        map[n] = 0;
+    }
+
+    // Indirect block is released too once no slot in it is used
+    uint8_t indirect_used = 0;
+    for (uint32_t n=DIRECT_POINTERS; n<max_offset; n++) {
+        if (map[n] != 0) {
+            indirect_used = 1;
+            break;
         }
-        // unset bitmap
-        uint32_t block_number_per_block = size / block_number_size;
-        uint32_t block_numbers[block_number_per_block];
-        memcpy(block_numbers, block_buf, size);
-        for (uint32_t n=0; n < block_number_per_block; n++) {
-            if (block_numbers[n] == 0)
-                continue;
-
-            ret = bl_free(fs, block_numbers[n]);
-            if (ret != OK) {
-                fprintf(stderr, "ino_free_block_at error: failed to free a block at [%d]...\n",
-                        block_numbers[n]);
+    }
+
+    memcpy(ino->direct_blocks, map, DIRECT_POINTERS*sizeof(uint32_t));
+    if (ino->single_indirect) {
+        if (indirect_used) {
+            if ((ret = dwrite(fs->dd, (uint8_t*)(map+DIRECT_POINTERS), ino->single_indirect)) != OK) {
+                fprintf(stderr, "ino_release_range error: failed to write indirect block [%d]...\n",
+                        ino->single_indirect);
                 return ret;
             }
+        } else {
+            victims[victim_count++] = ino->single_indirect;
+            ino->single_indirect = 0;
         }
+    }
 
-        // unset bitmap for single_indirect block
-        ret = bl_free(fs, ino->single_indirect);
-        if (ret != OK) {
-            fprintf(stderr, "ino_free_block_at error: failed to free a block at [%d]...\n",
-                    ino->single_indirect);
-            return ret;
+    // Map is on disk before any block goes back to the bitmap
+    if ((ret = bl_free_batch(fs, victims, victim_count)) != OK) {
+        fprintf(stderr, "ino_release_range error: failed to free [%d] blocks...\n",
+                (int)victim_count);
+    }
+    return ret;
+}
+
+RC ino_promote_inline(filesystem *fs, inode *ino) {
+    if (!fs || !ino) {
+        fprintf(stderr, "ino_promote_inline error: wrong arguments...\n");
+        return ErrArg;
+    }
+
+    if (!ino_is_inline(ino)) {
+        return OK;
+    }
+
+    uint32_t size = fs->dd->block_size;
+    uint8_t block_buf[size];
+    uint32_t used = ino->file_size < INO_INLINE_SIZE ? ino->file_size : INO_INLINE_SIZE;
+    memset(block_buf, 0, size);
+    memcpy(block_buf, ino->inline_data, used);
+
+    // Empty file needs no block at all
+    uint32_t block_number = 0;
+    if (used > 0) {
+        // Fully written below, no need to clean it
+        if ((block_number = bl_alloc_goal(fs, ino_block_goal(fs, ino, 0))) == 0) {
+            fprintf(stderr, "ino_promote_inline error: failed to alloc a block...\n");
+            return ErrNoSpace;
+        }
+        if (dwrite(fs->dd, block_buf, block_number) != OK) {
+            fprintf(stderr, "ino_promote_inline error: failed to write block [%d]...\n",
+                    block_number);
+            bl_free(fs, block_number);
+            return ErrDwrite;
+        }
+    }
+
+    ino->flags &= ~INO_FLAG_INLINE;
+    memset(ino->inline_data, 0, INO_INLINE_SIZE);
+    ino->direct_blocks[0] = block_number;
+    if (block_number)
+        ino->alloc_goal = block_number;
+    return OK;
+}
+
+RC ino_get_block_map(filesystem *fs, inode *ino, uint32_t *map) {
+    if (!fs || !ino || !map) {
+        fprintf(stderr, "ino_get_block_map error: wrong arguments...\n");
+        return ErrArg;
+    }
+
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    if (ino_is_inline(ino)) {
+        memset(map, 0, max_offset*sizeof(uint32_t));
+        return OK;
+    }
+    memcpy(map, ino->direct_blocks, DIRECT_POINTERS*sizeof(uint32_t));
+
+    if (!ino->single_indirect) {
+        memset(map+DIRECT_POINTERS, 0, (max_offset-DIRECT_POINTERS)*sizeof(uint32_t));
+        return OK;
+    }
+
+    // Read straight into the map, indirect slots follow the direct ones
+    if (dread(fs->dd, (uint8_t*)(map+DIRECT_POINTERS), ino->single_indirect) != OK) {
+        fprintf(stderr, "ino_get_block_map error: failed to read indirect block [%d]...\n",
+                ino->single_indirect);
+        return ErrDread;
+    }
+
+    return OK;
+}
+
+RC ino_set_block_map(filesystem *fs, inode *ino, const uint32_t *map) {
+    if (!fs || !ino || !map) {
+        fprintf(stderr, "ino_set_block_map error: wrong arguments...\n");
+        return ErrArg;
+    }
+
+    uint32_t max_offset = ino_get_max_block_offset(fs);
+    if (ino_is_inline(ino)) {
+        ino->flags &= ~INO_FLAG_INLINE;
+        memset(ino->inline_data, 0, INO_INLINE_SIZE);
+    }
+    memcpy(ino->direct_blocks, map, DIRECT_POINTERS*sizeof(uint32_t));
+
+    uint8_t need_indirect = 0;
+    for (uint32_t n=DIRECT_POINTERS; n<max_offset; n++) {
+        if (map[n] != 0) {
+            need_indirect = 1;
+            break;
         }
     }
 
+    if (!ino->single_indirect) {
+        if (!need_indirect)
+            return OK;
+
+        // The block is fully written below, no need to clean it
+        if ((ino->single_indirect = bl_alloc(fs)) == 0) {
+            fprintf(stderr, "ino_set_block_map error: failed to alloc indirect block...\n");
+            return ErrNoSpace;
+        }
+    }
+
+    if (dwrite(fs->dd, (uint8_t*)(map+DIRECT_POINTERS), ino->single_indirect) != OK) {
+        fprintf(stderr, "ino_set_block_map error: failed to write indirect block [%d]...\n",
+                ino->single_indirect);
+        return ErrDwrite;
+    }
+
     return OK;
 }
 
+uint32_t ino_map_extents(const uint32_t *map, uint32_t count) {
+    uint32_t extents = 0, prev = 0;
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t cur = map[i] & INO_BLOCK_MASK;
+        if (cur != 0 && (prev == 0 || cur != prev + 1))
+            extents++;
+        prev = cur;
+    }
+    return extents;
+}
+
 void ino_show(inode *ino) {
     if (!ino) {
         fprintf(stderr, "ino_show: null inode pointer\n");
@@ -415,6 +933,12 @@ void ino_show(inode *ino) {
     }
     printf("\n");
 
+    if (ino_is_inline(ino)) {
+        printf("\nInline data:        %u of %d bytes\n", ino->file_size, INO_INLINE_SIZE);
+        printf("========================================\n");
+        return;
+    }
+
     // Show direct blocks
     printf("\nDirect blocks:\n");
     int has_direct = 0;
@@ -467,7 +991,7 @@ uint32_t ino_get_block_count(filesystem *fs, inode *ino) {
     uint32_t block_size = fs->dd->block_size;
 
     // Method 1: Calculate from file_size (logical blocks needed)
-    if (ino->file_size == 0) {
+    if (ino->file_size == 0 || ino_is_inline(ino)) {
         return 0;
     }
 
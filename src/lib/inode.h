@@ -15,6 +15,11 @@
 
 #define DIRECT_POINTERS 12
 
+// High bit of a block map entry: block is reserved by fallocate but never written,
+// it reads back as zeros without having been cleaned
+#define INO_BLOCK_UNWRITTEN 0x80000000u
+#define INO_BLOCK_MASK      0x7fffffffu
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,51 +30,140 @@ typedef enum {
     FTypeDirectory
 } filetype;
 
-// 64 bytes
+// Bytes of file content an inode can hold in its block pointer area
+#define INO_INLINE_SIZE 60
+
+// inode flags
+#define INO_FLAG_INLINE 0x01 // content lives in inline_data, no blocks
+
+// 128 bytes, must stay a power of 2 so inodes never straddle a block
 struct s_inode {
     uint32_t inode_number;
     filetype file_type;
     uint32_t file_size;
+    uint32_t flags;
 
-    uint32_t direct_blocks[DIRECT_POINTERS]; // 12 * 4 = 48 bytes
+    union {
+        struct {
+            uint32_t direct_blocks[DIRECT_POINTERS]; // 12 * 4 = 48 bytes
+            uint32_t single_indirect;
+        };
+        uint8_t inline_data[INO_INLINE_SIZE];
+    };
 
-    uint32_t single_indirect;
+    uint32_t nlink; // Directory entries naming this inode, see ino_nlink
+    uint32_t alloc_goal; // Block number of the last block allocated for it, 0 if none yet
+
+    uint8_t reserved[44];
 };
 typedef struct s_inode inode;
 
+// Is the inode content stored inline
+#define ino_is_inline(ino) (((ino)->flags & INO_FLAG_INLINE) != 0)
+
+// Link count, inodes written before nlink existed have 0 and exactly one name
+#define ino_nlink(ino) ((ino)->nlink ? (ino)->nlink : 1u)
+
 // Set a inode to init state
 RC ino_init(inode *ino);
 
-// Get a available inode by inode number
+// Count free inodes per allocation group from the inode bitmap, at mount
+// group g holds inodes g*size+1 .. (g+1)*size, the last one shares a table block with group g+1
+void ino_groups_init(filesystem *fs);
+
+// Get a available inode by inode number, the lowest free one
 // it will edit inode_bitmap
 uint32_t ino_alloc(filesystem *fs);
 
+// Orlov style placement for a new inode of type under directory parent_num:
+//  files go to the group of their parent, so a directory's inodes share table blocks,
+//  top level directories go to the group with the most free inodes, spreading the trees,
+//  other directories to the first group from their parent's with at least average free inodes
+uint32_t ino_alloc_near(filesystem *fs, uint32_t parent_num, filetype type);
+
 // Set a inode to invalid and clear the content
 // it will edit inode_bitmap
 RC ino_free(filesystem *fs, uint32_t inode_number);
 
+// Allocate count file inodes under parent_num at once, a contiguous run of numbers from the
+// parent's group when one is free so their table entries share blocks, all or nothing,
+// ErrNoSpace when fewer are free
+RC ino_alloc_batch(filesystem *fs, uint32_t parent_num, uint32_t count, uint32_t *out);
+
+// ino_free for many inodes, the bitmap lock is taken once
+RC ino_free_batch(filesystem *fs, const uint32_t *inode_numbers, uint32_t count);
+
 // Read inode from disk
 RC ino_read(filesystem *fs, uint32_t inode_number, inode *ino);
 
 // Write inode to disk
 RC ino_write(filesystem *fs, uint32_t inode_number, inode *ino); // Should check inode number
 
+// Read count inodes into out[i], each inode table block is read once however the numbers are ordered
+RC ino_read_batch(filesystem *fs, const uint32_t *inode_numbers, uint32_t count, inode *out);
+
+// Write count inodes, each by its inode_number, one read-modify-write per inode table block
+RC ino_write_batch(filesystem *fs, const inode *inodes, uint32_t count);
+
+// Where a new block for logical block offset should go, for bl_alloc_goal:
+//  right after the previous logical block when it is mapped directly,
+//  else right after the inode's last allocation, else the data slice of its inode group
+uint32_t ino_block_goal(filesystem *fs, inode *ino, uint32_t offset);
+
 // Get a available block by block number
 // offset is used for creating sparse file easily
-// wrap bl_alloc inside
+// wrap bl_alloc_goal inside, placed by ino_block_goal, fails on an inline inode
+// sets ino->alloc_goal, the caller writes the inode
 uint32_t ino_alloc_block_at(filesystem *fs, inode *ino, uint32_t offset);
 
-// Get block number
+// Get block number, without the unwritten flag
 uint32_t ino_get_block_at(filesystem *fs, inode *ino, uint32_t offset);
 
+// Get the raw block map entry, may carry INO_BLOCK_UNWRITTEN
+uint32_t ino_get_block_entry(filesystem *fs, inode *ino, uint32_t offset);
+
+// Point offset to an existing block number (or raw entry), 0 makes a hole
+// the old block is not freed, used by copy-on-write
+RC ino_set_block_at(filesystem *fs, inode *ino, uint32_t offset, uint32_t block_number);
+
 // Clear a block
 // wrap bl_free inside
 RC ino_free_block_at(filesystem *fs, inode *ino, uint32_t offset);
 
 // Clear all blocks
-// wrap bl_free inside
+// wrap ino_release_range inside
 RC ino_free_all_blocks(filesystem *fs, inode *ino);
 
+// Release logical blocks [first, last) in one pass
+// the map is written once and the blocks go back with one bl_free_batch
+// the indirect block is released too once nothing points through it
+// an inline inode has no blocks, nothing to do
+RC ino_release_range(filesystem *fs, inode *ino, uint32_t first, uint32_t last);
+
+// Put every block the inode owns into out, data blocks and the indirect block
+// out holds ino_get_max_block_offset(fs)+1 entries, returns how many were stored
+// nothing is freed or written, for callers that free many inodes with one bl_free_batch
+uint32_t ino_collect_blocks(filesystem *fs, inode *ino, uint32_t *out);
+
+// Move inline content to a real block 0, the inode is block mapped afterwards
+// caller writes the inode back
+RC ino_promote_inline(filesystem *fs, inode *ino);
+
+// Read the whole logical to physical block map in one pass
+// map should hold ino_get_max_block_offset(fs) entries, holes are 0
+// entries are raw, mask with INO_BLOCK_MASK before using them as block numbers
+// an inline inode reads as all holes
+RC ino_get_block_map(filesystem *fs, inode *ino, uint32_t *map);
+
+// Write the whole block map back, the single indirect block is written once
+// and allocated if needed, caller writes the inode itself
+// an inline inode becomes block mapped, its inline bytes are dropped
+RC ino_set_block_map(filesystem *fs, inode *ino, const uint32_t *map);
+
+// Extents in a block map of count entries, runs of mapped blocks physically contiguous
+// in logical order, a hole ends a run, unwritten blocks count as mapped
+uint32_t ino_map_extents(const uint32_t *map, uint32_t count);
+
 void ino_show(inode *ino);
 int ino_is_valid(inode *ino);
 uint32_t ino_get_block_count(filesystem *fs, inode *ino);
@@ -9,6 +9,7 @@
 #include "path.h"
 #include "error.h"
 #include "directory.h"
+#include "cwd.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -162,6 +163,145 @@ uint8_t path_is_valid(const path *p) {
     return 1;
 }
 
+uint8_t path_next_component(const char **cursor, path_component *comp) {
+    const char *s = *cursor;
+    while (*s == '/')
+        s++;
+
+    if (*s == '\0') {
+        *cursor = s;
+        return 0;
+    }
+
+    comp->name = s;
+    while (*s && *s != '/')
+        s++;
+    comp->len = s - comp->name;
+    *cursor = s;
+    return 1;
+}
+
+RC path_component_copy(const path_component *comp, char *buf) {
+    if (!comp || !buf || comp->len >= MAX_FILENAME_LEN) {
+        fprintf(stderr, "path_component_copy error: wrong args\n");
+        return ErrArg;
+    }
+
+    memcpy(buf, comp->name, comp->len);
+    buf[comp->len] = '\0';
+    return OK;
+}
+
+uint32_t path_start_inode(const char *path_str) {
+    return path_start_inode_at(0, path_str);
+}
+
+uint32_t path_start_inode_at(uint32_t dir_inode_num, const char *path_str) {
+    if (path_str[0] == '/') {
+        return 1; // Hard encode, root dir inode num
+    }
+    if (dir_inode_num != 0) {
+        return dir_inode_num;
+    }
+
+    return cwd_get_inode();
+}
+
+// Walk one component from cur, cur is replaced by the found inode
+static uint32_t path_step(filesystem *fs, inode *cur, const path_component *comp) {
+    if (comp->len == 1 && comp->name[0] == '.') {
+        return cur->inode_number;
+    }
+
+    // ".." is a real entry in every directory, root points to itself
+    uint32_t inode_num = dir_lookup_n(fs, cur, comp->name, comp->len);
+    if (inode_num == 0) {
+        return 0;
+    }
+
+    if (ino_read(fs, inode_num, cur) != OK) {
+        fprintf(stderr, "path_resolve error: failed to read inode [%d]\n",
+                inode_num);
+        return 0;
+    }
+    return inode_num;
+}
+
+uint32_t path_resolve(filesystem *fs, const char *path_str, inode *ino) {
+    return path_resolve_at(fs, 0, path_str, ino);
+}
+
+uint32_t path_resolve_at(filesystem *fs, uint32_t dir_inode_num, const char *path_str, inode *ino) {
+    if (!fs || !path_str || path_str[0] == '\0') {
+        fprintf(stderr, "path_resolve error: wrong args\n");
+        return 0;
+    }
+
+    inode local;
+    inode *cur = ino ? ino : &local;
+    uint32_t inode_num = path_start_inode_at(dir_inode_num, path_str);
+    if (inode_num == 0 || ino_read(fs, inode_num, cur) != OK) {
+        fprintf(stderr, "path_resolve error: failed to read base inode [%d]\n",
+                inode_num);
+        return 0;
+    }
+    if (cur->file_type != FTypeDirectory) {
+        fprintf(stderr, "path_resolve error: base inode [%d] is not a directory\n",
+                inode_num);
+        return 0;
+    }
+
+    const char *cursor = path_str;
+    path_component comp;
+    while (inode_num != 0 && path_next_component(&cursor, &comp)) {
+        inode_num = path_step(fs, cur, &comp);
+    }
+
+    return inode_num;
+}
+
+uint32_t path_resolve_parent(filesystem *fs, const char *path_str, inode *parent, path_component *last) {
+    return path_resolve_parent_at(fs, 0, path_str, parent, last);
+}
+
+uint32_t path_resolve_parent_at(filesystem *fs, uint32_t dir_inode_num, const char *path_str,
+                                inode *parent, path_component *last) {
+    if (!fs || !path_str || !parent || !last || path_str[0] == '\0') {
+        fprintf(stderr, "path_resolve_parent error: wrong args\n");
+        return 0;
+    }
+
+    uint32_t inode_num = path_start_inode_at(dir_inode_num, path_str);
+    if (inode_num == 0 || ino_read(fs, inode_num, parent) != OK) {
+        fprintf(stderr, "path_resolve_parent error: failed to read base inode [%d]\n",
+                inode_num);
+        return 0;
+    }
+
+    // Keep one component of lookahead, the last one is not walked
+    const char *cursor = path_str;
+    path_component next;
+    if (!path_next_component(&cursor, last)) {
+        return 0; // Root has no parent entry
+    }
+    while (inode_num != 0 && path_next_component(&cursor, &next)) {
+        inode_num = path_step(fs, parent, last);
+        *last = next;
+    }
+
+    if (inode_num == 0 || parent->file_type != FTypeDirectory) {
+        return 0;
+    }
+
+    if ((last->len == 1 && last->name[0] == '.') ||
+        (last->len == 2 && last->name[0] == '.' && last->name[1] == '.') ||
+        last->len >= MAX_FILENAME_LEN) {
+        return 0;
+    }
+
+    return inode_num;
+}
+
 uint32_t path_lookup(filesystem *fs, inode ino, const path *p) {
     if (!fs || ino.inode_number == 0 || !p) {
         fprintf(stderr, "path_lookup error: wrong args\n");
@@ -29,6 +29,13 @@ struct s_path {
     uint8_t is_absolute;    // 1 if starts with '/', 0 otherwise
 };
 typedef struct s_path path;
+
+// One component of a path string, a view into the caller's string
+struct s_path_component {
+    const char *name;   // Not NUL terminated
+    uint32_t len;
+};
+typedef struct s_path_component path_component;
  
 /*
  * Parse a path string into components
@@ -69,6 +76,52 @@ uint8_t path_is_valid(const path *p);
  */
 uint32_t path_lookup(filesystem *fs, inode begin_dir_ino, const path *p);
 
+/*
+ * Step *cursor to the next component of a path string, empty components are skipped
+ *  returns 1 and fills comp, 0 when no component is left
+ */
+uint8_t path_next_component(const char **cursor, path_component *comp);
+
+/*
+ * Copy a component into buf as a NUL terminated name, buf holds MAX_FILENAME_LEN bytes
+ */
+RC path_component_copy(const path_component *comp, char *buf);
+
+/*
+ * Inode number a path string starts from, root for absolute paths, cwd otherwise
+ */
+uint32_t path_start_inode(const char *path_str);
+
+/*
+ * Same as path_start_inode, but relative paths start at dir_inode_num (0 means cwd)
+ */
+uint32_t path_start_inode_at(uint32_t dir_inode_num, const char *path_str);
+
+/*
+ * Resolve a path string without building a path structure
+ *  components are looked up in place, "." is skipped and ".." follows the directory entry
+ *  the last inode is left in ino (may be NULL), returns its number, 0 if not found
+ */
+uint32_t path_resolve(filesystem *fs, const char *path_str, inode *ino);
+
+/*
+ * Like openat(2) resolution, relative paths start at directory dir_inode_num (0 means cwd)
+ */
+uint32_t path_resolve_at(filesystem *fs, uint32_t dir_inode_num, const char *path_str, inode *ino);
+
+/*
+ * Resolve all but the last component, for calls that create or remove an entry
+ *  parent gets the directory inode, last points at the final name inside path_str
+ *  returns the parent inode number, 0 if not found or the last name is "." / ".." / missing
+ */
+uint32_t path_resolve_parent(filesystem *fs, const char *path_str, inode *parent, path_component *last);
+
+/*
+ * path_resolve_parent relative to directory dir_inode_num (0 means cwd)
+ */
+uint32_t path_resolve_parent_at(filesystem *fs, uint32_t dir_inode_num, const char *path_str,
+                                inode *parent, path_component *last);
+
 /*
  * Merge two path components
  *  first path should be an absolute path
@@ -0,0 +1,233 @@
+/*
+ * pool.c
+ *
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Which pool and deque the current thread works for, -1 outside any pool
+static __thread pool *t_pool = NULL;
+static __thread int32_t t_worker = -1;
+
+struct s_pool_worker_arg {
+    pool *p;
+    uint32_t index;
+};
+
+static RC deque_push(pool_deque *dq, pool_task task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        uint32_t capacity = dq->capacity * 2;
+        pool_task *tasks = (pool_task *)malloc(capacity * sizeof(pool_task));
+        if (!tasks) {
+            pthread_mutex_unlock(&dq->lock);
+            fprintf(stderr, "pool_submit error: failed to grow deque\n");
+            return ErrNoMem;
+        }
+        for (uint32_t i=0; i<dq->count; i++)
+            tasks[i] = dq->tasks[(dq->head + i) % dq->capacity];
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->head = 0;
+        dq->capacity = capacity;
+    }
+    dq->tasks[(dq->head + dq->count) % dq->capacity] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return OK;
+}
+
+// Owner end, newest first keeps the walk depth first and the deque short
+static uint8_t deque_pop_tail(pool_deque *dq, pool_task *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == 0) {
+        pthread_mutex_unlock(&dq->lock);
+        return 0;
+    }
+    dq->count--;
+    *task = dq->tasks[(dq->head + dq->count) % dq->capacity];
+    pthread_mutex_unlock(&dq->lock);
+    return 1;
+}
+
+// Thief end, oldest first
+static uint8_t deque_pop_head(pool_deque *dq, pool_task *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == 0) {
+        pthread_mutex_unlock(&dq->lock);
+        return 0;
+    }
+    *task = dq->tasks[dq->head];
+    dq->head = (dq->head + 1) % dq->capacity;
+    dq->count--;
+    pthread_mutex_unlock(&dq->lock);
+    return 1;
+}
+
+// Caller has claimed one queued task, so some deque holds one for it
+static pool_task pool_take(pool *p, uint32_t self) {
+    pool_task task;
+    for (;;) {
+        if (deque_pop_tail(&p->deques[self], &task))
+            return task;
+        for (uint32_t i=1; i<p->workers; i++) {
+            if (deque_pop_head(&p->deques[(self + i) % p->workers], &task)) {
+                __atomic_add_fetch(&p->steals, 1, __ATOMIC_RELAXED);
+                return task;
+            }
+        }
+    }
+}
+
+static void *pool_worker(void *varg) {
+    struct s_pool_worker_arg *arg = (struct s_pool_worker_arg *)varg;
+    pool *p = arg->p;
+    uint32_t self = arg->index;
+    free(arg);
+
+    t_pool = p;
+    t_worker = (int32_t)self;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->queued == 0 && !p->stop)
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        if (p->queued == 0) { // Stopping and nothing left
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        p->queued--;
+        pthread_mutex_unlock(&p->lock);
+
+        pool_task task = pool_take(p, self);
+        task.fn(task.arg);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->pending == 0)
+            pthread_cond_broadcast(&p->idle_cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return NULL;
+}
+
+pool *pool_create(uint32_t workers) {
+    if (workers == 0 || workers > POOL_MAX_WORKERS) {
+        fprintf(stderr, "pool_create error: wrong worker count [%d]\n", workers);
+        return NULL;
+    }
+
+    pool *p = (pool *)calloc(1, sizeof(pool));
+    if (!p) {
+        fprintf(stderr, "pool_create error: failed to allocate pool\n");
+        return NULL;
+    }
+    p->workers = workers;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->idle_cond, NULL);
+
+    for (uint32_t i=0; i<workers; i++) {
+        p->deques[i].capacity = POOL_QUEUE_INIT;
+        p->deques[i].tasks = (pool_task *)malloc(POOL_QUEUE_INIT * sizeof(pool_task));
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+        if (!p->deques[i].tasks) {
+            fprintf(stderr, "pool_create error: failed to allocate deque\n");
+            p->workers = 0; // No thread started yet
+            pool_destroy(p);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i=0; i<workers; i++) {
+        struct s_pool_worker_arg *arg = malloc(sizeof(struct s_pool_worker_arg));
+        if (arg) {
+            arg->p = p;
+            arg->index = i;
+        }
+        if (!arg || pthread_create(&p->threads[i], NULL, pool_worker, arg) != 0) {
+            fprintf(stderr, "pool_create error: failed to start worker [%d]\n", i);
+            free(arg);
+            // Only the started workers are joined
+            p->workers = i;
+            pool_destroy(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+RC pool_submit(pool *p, pool_fn fn, void *arg) {
+    if (!p || !fn || p->workers == 0) {
+        fprintf(stderr, "pool_submit error: wrong args...\n");
+        return ErrArg;
+    }
+
+    uint32_t target;
+    if (t_pool == p) {
+        target = (uint32_t)t_worker;
+    } else {
+        pthread_mutex_lock(&p->lock);
+        target = p->next_deque++ % p->workers;
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pool_task task = { .fn = fn, .arg = arg };
+    RC ret = deque_push(&p->deques[target], task);
+    if (ret != OK) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->queued++;
+    p->pending++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    return OK;
+}
+
+void pool_wait(pool *p) {
+    if (!p) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0)
+        pthread_cond_wait(&p->idle_cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(pool *p) {
+    if (!p) {
+        return;
+    }
+
+    pool_wait(p);
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (uint32_t i=0; i<p->workers; i++)
+        pthread_join(p->threads[i], NULL);
+
+    for (uint32_t i=0; i<POOL_MAX_WORKERS; i++) {
+        if (p->deques[i].tasks) {
+            free(p->deques[i].tasks);
+            pthread_mutex_destroy(&p->deques[i].lock);
+        }
+    }
+    pthread_cond_destroy(&p->work_cond);
+    pthread_cond_destroy(&p->idle_cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
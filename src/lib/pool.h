@@ -0,0 +1,87 @@
+/*
+ * pool.h
+ * Work-stealing thread pool for tree walks
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#ifndef MY_POOL_H_
+#define MY_POOL_H_
+
+#include "error.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POOL_MAX_WORKERS   64
+#define POOL_QUEUE_INIT    64 // Per worker deque, grows by doubling
+
+typedef void (*pool_fn)(void *arg);
+
+struct s_pool_task {
+    pool_fn fn;
+    void *arg;
+};
+typedef struct s_pool_task pool_task;
+
+/*
+ * One deque per worker, the owner pushes and pops at the tail
+ * idle workers steal from the head, so big subtrees found early move first
+ * */
+struct s_pool_deque {
+    pool_task *tasks;    // Ring buffer
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+    pthread_mutex_t lock;
+};
+typedef struct s_pool_deque pool_deque;
+
+struct s_pool {
+    uint32_t workers;
+    pthread_t threads[POOL_MAX_WORKERS];
+    pool_deque deques[POOL_MAX_WORKERS];
+
+    pthread_mutex_t lock;     // Guards the counters below
+    pthread_cond_t work_cond; // Signalled when a task is queued or on stop
+    pthread_cond_t idle_cond; // Signalled when pending drops to 0
+    uint32_t queued;          // Tasks in deques not yet claimed by a worker
+    uint32_t pending;         // Tasks queued or running
+    uint32_t next_deque;      // Round robin for submits from outside the pool
+    uint8_t stop;
+
+    uint64_t steals;          // Tasks run by a worker other than the one queueing them
+};
+typedef struct s_pool pool;
+
+/*
+ * Start a pool with workers threads (1 ~ POOL_MAX_WORKERS), NULL on failure
+ * */
+pool *pool_create(uint32_t workers);
+
+/*
+ * Queue fn(arg), tasks may submit more tasks
+ *  from a worker the task goes to that worker's own deque
+ * */
+RC pool_submit(pool *p, pool_fn fn, void *arg);
+
+/*
+ * Block until every submitted task, and every task they submitted, has finished
+ * */
+void pool_wait(pool *p);
+
+/*
+ * Wait for outstanding tasks, stop the workers and free the pool
+ * */
+void pool_destroy(pool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
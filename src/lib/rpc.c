@@ -0,0 +1,700 @@
+/*
+ * rpc.c
+ *
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#include "rpc.h"
+#include "file.h"
+#include "path.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define RPC_WINDOW 16 // Chunked reads/writes keep this many requests in flight
+
+// ============================================
+// Socket helpers
+// ============================================
+
+static RC rpc_read_full(int fd, void *buf, uint32_t len) {
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ErrInternal; // Peer closed or broken connection
+        p += n;
+        len -= (uint32_t)n;
+    }
+    return OK;
+}
+
+// Drop len bytes, for payloads larger than the caller's buffer
+static RC rpc_skip(int fd, uint32_t len) {
+    uint8_t scratch[4096];
+    while (len > 0) {
+        uint32_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (rpc_read_full(fd, scratch, n) != OK)
+            return ErrInternal;
+        len -= n;
+    }
+    return OK;
+}
+
+// sendmsg with MSG_NOSIGNAL, a client going away must not kill the daemon with SIGPIPE
+static RC rpc_write_iov(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return ErrInternal;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return OK;
+}
+
+static void rpc_sockaddr(const char *sock_path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, sock_path, sizeof(addr->sun_path) - 1);
+}
+
+// ============================================
+// Server
+// ============================================
+
+static RC rpc_respond(int fd, uint32_t id, RC rc, uint32_t res, uint16_t flags,
+                      const uint8_t *payload, uint32_t len) {
+    rpc_resp_hdr hdr = { .id = id, .rc = rc, .res = res, .flags = flags, .pad = 0, .len = len };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)payload, .iov_len = len },
+    };
+    return rpc_write_iov(fd, iov, len ? 2 : 1);
+}
+
+// Stream the entries in batches, every response but the last has RPC_F_MORE
+static RC rpc_serve_ls(filesystem *fs, int fd, uint32_t id, const char *path, uint8_t *out) {
+    inode dir_ino;
+    if (path_resolve(fs, path, &dir_ino) == 0)
+        return rpc_respond(fd, id, ErrPath, 0, 0, NULL, 0);
+
+    dir_iter *it = dir_open(fs, &dir_ino);
+    if (!it)
+        return rpc_respond(fd, id, ErrPath, 0, 0, NULL, 0);
+
+    dir_entry_info entries[DIR_BATCH_ENTRIES];
+    uint32_t count;
+    RC rc, ret = OK;
+    while ((rc = dir_next_batch(it, entries, DIR_BATCH_ENTRIES, &count)) == OK && count > 0) {
+        uint32_t len = 0;
+        for (uint32_t i=0; i<count; i++) {
+            rpc_dirent d;
+            size_t name_len = strnlen(entries[i].name, MAX_FILENAME_LEN);
+            d.inode_num = entries[i].inode_num;
+            d.size = entries[i].size;
+            d.nlink = entries[i].nlink;
+            d.type = (uint8_t)entries[i].type;
+            d.name_len = (uint8_t)name_len;
+            memcpy(out + len, &d, sizeof(d));
+            memcpy(out + len + sizeof(d), entries[i].name, name_len);
+            len += sizeof(d) + name_len;
+        }
+        if ((ret = rpc_respond(fd, id, OK, count, RPC_F_MORE, out, len)) != OK)
+            break;
+    }
+    dir_close(it);
+    if (ret != OK)
+        return ret;
+
+    return rpc_respond(fd, id, rc, 0, 0, NULL, 0);
+}
+
+static RC rpc_serve_io(filesystem *fs, int fd, const rpc_req_hdr *hdr, const char *path,
+                       const uint8_t *data, uint32_t data_len, uint8_t *out) {
+    uint8_t is_read = hdr->op == RpcRead;
+    file_handle *fh = file_open(fs, path, is_read ? MY_O_RDONLY : MY_O_WRONLY);
+    if (!fh)
+        return rpc_respond(fd, hdr->id, ErrPath, 0, 0, NULL, 0);
+
+    RC rc;
+    uint32_t res = 0;
+    if (!is_read && hdr->arg0 == RPC_APPEND)
+        rc = file_seek(fh, 0, MY_SEEK_END);
+    else
+        rc = file_seek(fh, hdr->arg0, MY_SEEK_SET);
+
+    if (rc == OK && is_read) {
+        uint32_t len = hdr->arg1 < RPC_MAX_PAYLOAD ? hdr->arg1 : RPC_MAX_PAYLOAD;
+        res = file_read(fh, out, len);
+    } else if (rc == OK && data_len > 0) {
+        res = file_write(fh, (uint8_t *)data, data_len);
+        if (res == 0)
+            rc = ErrInternal;
+    }
+    file_close(fh);
+
+    return rpc_respond(fd, hdr->id, rc, res, 0, out, is_read ? res : 0);
+}
+
+// Run one request and answer it, an error means the connection is unusable
+static RC rpc_dispatch(filesystem *fs, int fd, const rpc_req_hdr *hdr, uint8_t *payload,
+                       uint8_t *out) {
+    // payload is path '\0' [path2 '\0'] [data], NUL terminated one past len by the caller
+    const char *path = (const char *)payload;
+    uint32_t path_len = (uint32_t)strnlen(path, hdr->len);
+    if (path_len == hdr->len)
+        return rpc_respond(fd, hdr->id, ErrArg, 0, 0, NULL, 0);
+    const char *path2 = path + path_len + 1;
+    const uint8_t *data = payload + path_len + 1;
+    uint32_t data_len = hdr->len - path_len - 1;
+
+    RC rc;
+    f_stat st;
+    defrag_stats ds;
+    switch (hdr->op) {
+    case RpcStat:
+        memset(&st, 0, sizeof(st));
+        rc = fs_stat(fs, path, &st);
+        return rpc_respond(fd, hdr->id, rc, 0, 0, (uint8_t *)&st, rc == OK ? sizeof(st) : 0);
+    case RpcTouch:
+        rc = fs_touch(fs, path);
+        break;
+    case RpcUnlink:
+        rc = fs_unlink(fs, path);
+        break;
+    case RpcMkdir:
+        rc = fs_mkdir(fs, path);
+        break;
+    case RpcRmdir:
+        rc = hdr->arg0 ? fs_rmdir_parallel(fs, path, hdr->arg0) : fs_rmdir(fs, path);
+        break;
+    case RpcRename:
+    case RpcLink:
+    case RpcCp:
+        if (data_len == 0 || strnlen(path2, data_len) == data_len) {
+            rc = ErrArg;
+        } else if (hdr->op == RpcRename) {
+            rc = fs_rename(fs, path, path2);
+        } else if (hdr->op == RpcLink) {
+            rc = fs_link(fs, path, path2);
+        } else {
+            rc = hdr->arg0 ? fs_cp_tree(fs, path, path2, hdr->arg0, NULL) : fs_cp(fs, path, path2);
+        }
+        break;
+    case RpcRead:
+    case RpcWrite:
+        return rpc_serve_io(fs, fd, hdr, path, data, data_len, out);
+    case RpcLs:
+        return rpc_serve_ls(fs, fd, hdr->id, path, out);
+    case RpcDefrag:
+        memset(&ds, 0, sizeof(ds));
+        rc = fs_defrag(fs, path, &ds);
+        return rpc_respond(fd, hdr->id, rc, 0, 0, (uint8_t *)&ds, sizeof(ds));
+    default:
+        fprintf(stderr, "rpc_dispatch error: unknown op [%d]\n", hdr->op);
+        rc = ErrArg;
+        break;
+    }
+
+    return rpc_respond(fd, hdr->id, rc, 0, 0, NULL, 0);
+}
+
+static void *rpc_conn_main(void *varg) {
+    rpc_conn *conn = (rpc_conn *)varg;
+    filesystem *fs = conn->srv->fs;
+    uint8_t *payload = (uint8_t *)malloc(RPC_MAX_PAYLOAD + 1);
+    uint8_t *out = (uint8_t *)malloc(RPC_MAX_PAYLOAD);
+
+    rpc_req_hdr hdr;
+    while (payload && out && rpc_read_full(conn->fd, &hdr, sizeof(hdr)) == OK) {
+        if (hdr.magic != RPC_MAGIC || hdr.len > RPC_MAX_PAYLOAD) {
+            fprintf(stderr, "rpc_conn error: bad request header, dropping client\n");
+            break;
+        }
+        if (rpc_read_full(conn->fd, payload, hdr.len) != OK)
+            break;
+        payload[hdr.len] = '\0';
+        if (rpc_dispatch(fs, conn->fd, &hdr, payload, out) != OK)
+            break;
+    }
+
+    free(payload);
+    free(out);
+    __atomic_store_n(&conn->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Join and free connections whose client went away, with srv->lock held
+static void rpc_reap_conns(rpc_server *s, uint8_t all) {
+    rpc_conn **pp = &s->conns;
+    while (*pp) {
+        rpc_conn *conn = *pp;
+        if (all || __atomic_load_n(&conn->done, __ATOMIC_ACQUIRE)) {
+            if (all)
+                shutdown(conn->fd, SHUT_RDWR); // Wakes a thread blocked on the client
+            pthread_join(conn->thread, NULL);
+            close(conn->fd);
+            *pp = conn->next;
+            free(conn);
+        } else {
+            pp = &conn->next;
+        }
+    }
+}
+
+static void *rpc_accept_main(void *varg) {
+    rpc_server *s = (rpc_server *)varg;
+    for (;;) {
+        int fd = accept(s->listen_fd, NULL, NULL);
+        pthread_mutex_lock(&s->lock);
+        if (s->stop) {
+            pthread_mutex_unlock(&s->lock);
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        rpc_reap_conns(s, 0);
+        pthread_mutex_unlock(&s->lock);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "rpc_accept error: accept failed [%s]\n", strerror(errno));
+            continue;
+        }
+
+        rpc_conn *conn = (rpc_conn *)calloc(1, sizeof(rpc_conn));
+        if (!conn) {
+            fprintf(stderr, "rpc_accept error: failed to allocate connection\n");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->srv = s;
+        if (pthread_create(&conn->thread, NULL, rpc_conn_main, conn) != 0) {
+            fprintf(stderr, "rpc_accept error: failed to start connection thread\n");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        conn->next = s->conns;
+        s->conns = conn;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+// 1 if a daemon answers on sock_path, a socket file left behind by one that died is removed
+static int rpc_sock_in_use(const struct sockaddr_un *addr, const char *sock_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return 0; // bind reports whatever is wrong
+    }
+    int rc = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+    int err = errno;
+    close(fd);
+    if (rc == 0) {
+        return 1;
+    }
+    if (err == ECONNREFUSED) { // Nobody listens, only then the file is ours to take
+        unlink(sock_path);
+    }
+    return 0;
+}
+
+rpc_server *rpc_server_start(filesystem *fs, const char *sock_path) {
+    struct sockaddr_un addr;
+    if (!fs || !sock_path || strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "rpc_server_start error: wrong args...\n");
+        return NULL;
+    }
+
+    rpc_server *s = (rpc_server *)calloc(1, sizeof(rpc_server));
+    if (!s) {
+        fprintf(stderr, "rpc_server_start error: failed to allocate server\n");
+        return NULL;
+    }
+    s->fs = fs;
+    strcpy(s->path, sock_path);
+    rpc_sockaddr(sock_path, &addr);
+
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s->listen_fd < 0) {
+        fprintf(stderr, "rpc_server_start error: failed to create socket\n");
+        free(s);
+        return NULL;
+    }
+    if (rpc_sock_in_use(&addr, sock_path)) {
+        fprintf(stderr, "rpc_server_start error: a daemon already serves [%s]\n", sock_path);
+        close(s->listen_fd);
+        free(s);
+        return NULL;
+    }
+    if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(s->listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "rpc_server_start error: failed to listen on [%s]: %s\n",
+                sock_path, strerror(errno));
+        close(s->listen_fd);
+        free(s);
+        return NULL;
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    if (pthread_create(&s->accept_thread, NULL, rpc_accept_main, s) != 0) {
+        fprintf(stderr, "rpc_server_start error: failed to start accept thread\n");
+        pthread_mutex_destroy(&s->lock);
+        close(s->listen_fd);
+        unlink(sock_path);
+        free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+void rpc_server_stop(rpc_server *s) {
+    if (!s) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_mutex_unlock(&s->lock);
+    shutdown(s->listen_fd, SHUT_RDWR); // accept returns EINVAL from here on
+    pthread_join(s->accept_thread, NULL);
+    close(s->listen_fd);
+    unlink(s->path);
+
+    pthread_mutex_lock(&s->lock);
+    rpc_reap_conns(s, 1);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+// ============================================
+// Client
+// ============================================
+
+void rpc_sock_path(int32_t disk_id, char *buf, uint32_t size) {
+    snprintf(buf, size, RPC_SOCK_FMT, disk_id);
+}
+
+rpc_client *rpc_connect(const char *sock_path) {
+    struct sockaddr_un addr;
+    if (!sock_path || strlen(sock_path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    rpc_sockaddr(sock_path, &addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    // No daemon is not an error, the caller falls back to mounting
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    rpc_client *c = (rpc_client *)calloc(1, sizeof(rpc_client));
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->next_id = 1;
+    return c;
+}
+
+rpc_client *rpc_connect_disk(int32_t disk_id) {
+    char path[108];
+    rpc_sock_path(disk_id, path, sizeof(path));
+    return rpc_connect(path);
+}
+
+void rpc_close(rpc_client *c) {
+    if (!c) {
+        return;
+    }
+    close(c->fd);
+    free(c);
+}
+
+RC rpc_send(rpc_client *c, rpc_req *req) {
+    if (!c || !req || !req->path || (req->data_len && !req->data)) {
+        fprintf(stderr, "rpc_send error: wrong args...\n");
+        return ErrArg;
+    }
+
+    uint64_t len = strlen(req->path) + 1 + req->data_len;
+    if (req->path2)
+        len += strlen(req->path2) + 1;
+    if (len > RPC_MAX_PAYLOAD) {
+        fprintf(stderr, "rpc_send error: request too large [%lu]\n", (unsigned long)len);
+        return ErrArg;
+    }
+    if (req->id == 0)
+        req->id = c->next_id++;
+
+    rpc_req_hdr hdr = {
+        .magic = RPC_MAGIC, .id = req->id, .op = (uint16_t)req->op, .flags = 0,
+        .arg0 = req->arg0, .arg1 = req->arg1, .len = (uint32_t)len,
+    };
+    struct iovec iov[4];
+    int n = 0;
+    iov[n].iov_base = &hdr;
+    iov[n++].iov_len = sizeof(hdr);
+    iov[n].iov_base = (void *)req->path;
+    iov[n++].iov_len = strlen(req->path) + 1;
+    if (req->path2) {
+        iov[n].iov_base = (void *)req->path2;
+        iov[n++].iov_len = strlen(req->path2) + 1;
+    }
+    if (req->data_len) {
+        iov[n].iov_base = (void *)req->data;
+        iov[n++].iov_len = req->data_len;
+    }
+
+    if (rpc_write_iov(c->fd, iov, n) != OK) {
+        fprintf(stderr, "rpc_send error: connection to daemon lost\n");
+        return ErrInternal;
+    }
+    return OK;
+}
+
+RC rpc_recv(rpc_client *c, rpc_resp *resp, uint8_t *buf, uint32_t cap) {
+    if (!c || !resp || (cap && !buf)) {
+        fprintf(stderr, "rpc_recv error: wrong args...\n");
+        return ErrArg;
+    }
+
+    if (rpc_read_full(c->fd, resp, sizeof(*resp)) != OK) {
+        fprintf(stderr, "rpc_recv error: connection to daemon lost\n");
+        return ErrInternal;
+    }
+    uint32_t keep = resp->len < cap ? resp->len : cap;
+    if (rpc_read_full(c->fd, buf, keep) != OK || rpc_skip(c->fd, resp->len - keep) != OK) {
+        fprintf(stderr, "rpc_recv error: connection to daemon lost\n");
+        return ErrInternal;
+    }
+    return keep == resp->len ? OK : ErrNoSpace;
+}
+
+RC rpc_call(rpc_client *c, rpc_req *req, rpc_resp *resp, uint8_t *buf, uint32_t cap) {
+    RC ret = rpc_send(c, req);
+    if (ret != OK) {
+        return ret;
+    }
+    ret = rpc_recv(c, resp, buf, cap);
+    if (ret != OK) {
+        return ret;
+    }
+    return (RC)resp->rc;
+}
+
+static RC rpc_simple(rpc_client *c, rpc_op op, const char *path, const char *path2,
+                     uint32_t arg0) {
+    rpc_req req;
+    rpc_resp resp;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.path = path;
+    req.path2 = path2;
+    req.arg0 = arg0;
+    return rpc_call(c, &req, &resp, NULL, 0);
+}
+
+RC rpc_stat(rpc_client *c, const char *path, f_stat *st) {
+    rpc_req req;
+    rpc_resp resp;
+    memset(&req, 0, sizeof(req));
+    req.op = RpcStat;
+    req.path = path;
+    return rpc_call(c, &req, &resp, (uint8_t *)st, sizeof(*st));
+}
+
+RC rpc_touch(rpc_client *c, const char *path) {
+    return rpc_simple(c, RpcTouch, path, NULL, 0);
+}
+
+RC rpc_unlink(rpc_client *c, const char *path) {
+    return rpc_simple(c, RpcUnlink, path, NULL, 0);
+}
+
+RC rpc_mkdir(rpc_client *c, const char *path) {
+    return rpc_simple(c, RpcMkdir, path, NULL, 0);
+}
+
+RC rpc_rmdir(rpc_client *c, const char *path, uint32_t threads) {
+    return rpc_simple(c, RpcRmdir, path, NULL, threads);
+}
+
+RC rpc_rename(rpc_client *c, const char *old_path, const char *new_path) {
+    return rpc_simple(c, RpcRename, old_path, new_path, 0);
+}
+
+RC rpc_link(rpc_client *c, const char *existing_path, const char *new_path) {
+    return rpc_simple(c, RpcLink, existing_path, new_path, 0);
+}
+
+RC rpc_cp(rpc_client *c, const char *src_path, const char *dst_path, uint32_t threads) {
+    return rpc_simple(c, RpcCp, src_path, dst_path, threads);
+}
+
+/*
+ * Large transfers go out as RPC_IO_CHUNK requests, RPC_WINDOW of them in flight
+ *  responses are small for writes and requests are small for reads,
+ *  so the window keeps either side from filling both socket buffers
+ * */
+static RC rpc_transfer(rpc_client *c, rpc_op op, const char *path, uint32_t offset,
+                       uint8_t *buf, uint32_t len, uint32_t *bytes) {
+    if (!c || !path || (len && !buf) || !bytes) {
+        fprintf(stderr, "rpc_transfer error: wrong args...\n");
+        return ErrArg;
+    }
+
+    uint32_t chunks = (len + RPC_IO_CHUNK - 1) / RPC_IO_CHUNK;
+    uint32_t sent = 0, received = 0, total = 0;
+    uint8_t short_io = 0;
+    RC rc = OK;
+
+    *bytes = 0;
+    while (received < chunks) {
+        // Stop queueing once one chunk failed or came back short, but drain what is in flight
+        while (sent < chunks && sent - received < RPC_WINDOW && rc == OK && !short_io) {
+            uint32_t pos = sent * RPC_IO_CHUNK;
+            uint32_t n = len - pos < RPC_IO_CHUNK ? len - pos : RPC_IO_CHUNK;
+            rpc_req req;
+            memset(&req, 0, sizeof(req));
+            req.op = op;
+            req.path = path;
+            req.arg0 = (op == RpcWrite && offset == RPC_APPEND) ? RPC_APPEND : offset + pos;
+            if (op == RpcRead) {
+                req.arg1 = n;
+            } else {
+                req.data = buf + pos;
+                req.data_len = n;
+            }
+            RC ret = rpc_send(c, &req);
+            if (ret != OK)
+                return ret;
+            sent++;
+        }
+        if (received == sent)
+            break;
+
+        uint32_t pos = received * RPC_IO_CHUNK;
+        uint32_t want = len - pos < RPC_IO_CHUNK ? len - pos : RPC_IO_CHUNK;
+        rpc_resp resp;
+        RC ret = rpc_recv(c, &resp, op == RpcRead ? buf + pos : NULL, op == RpcRead ? want : 0);
+        if (ret != OK && ret != ErrNoSpace)
+            return ret;
+        received++;
+        if (rc == OK && resp.rc != OK)
+            rc = (RC)resp.rc;
+        if (rc == OK && !short_io) {
+            total += resp.res;
+            if (resp.res < want)
+                short_io = 1;
+        }
+    }
+
+    *bytes = total;
+    return rc;
+}
+
+RC rpc_read(rpc_client *c, const char *path, uint32_t offset, uint8_t *buf, uint32_t len,
+            uint32_t *bytes) {
+    return rpc_transfer(c, RpcRead, path, offset, buf, len, bytes);
+}
+
+RC rpc_write(rpc_client *c, const char *path, uint32_t offset, const uint8_t *buf, uint32_t len,
+             uint32_t *bytes) {
+    return rpc_transfer(c, RpcWrite, path, offset, (uint8_t *)buf, len, bytes);
+}
+
+RC rpc_ls(rpc_client *c, const char *path, rpc_ls_fn fn, void *arg) {
+    if (!c || !path || !fn) {
+        fprintf(stderr, "rpc_ls error: wrong args...\n");
+        return ErrArg;
+    }
+
+    uint8_t *buf = (uint8_t *)malloc(RPC_MAX_PAYLOAD);
+    if (!buf) {
+        fprintf(stderr, "rpc_ls error: failed to alloc buffer\n");
+        return ErrNoMem;
+    }
+
+    rpc_req req;
+    rpc_resp resp;
+    memset(&req, 0, sizeof(req));
+    req.op = RpcLs;
+    req.path = path;
+    RC ret = rpc_send(c, &req);
+    while (ret == OK) {
+        if ((ret = rpc_recv(c, &resp, buf, RPC_MAX_PAYLOAD)) != OK)
+            break;
+        uint32_t pos = 0;
+        while (pos + sizeof(rpc_dirent) <= resp.len) {
+            rpc_dirent d;
+            dir_entry_info e;
+            memcpy(&d, buf + pos, sizeof(d));
+            pos += sizeof(d);
+            if (pos + d.name_len > resp.len)
+                break;
+            memset(&e, 0, sizeof(e));
+            memcpy(e.name, buf + pos, d.name_len);
+            pos += d.name_len;
+            e.inode_num = d.inode_num;
+            e.type = (filetype)d.type;
+            e.size = d.size;
+            e.nlink = d.nlink;
+            fn(&e, arg);
+        }
+        if (!(resp.flags & RPC_F_MORE)) {
+            ret = (RC)resp.rc;
+            break;
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+
+RC rpc_defrag(rpc_client *c, const char *path, defrag_stats *st) {
+    rpc_req req;
+    rpc_resp resp;
+    defrag_stats ds;
+    memset(&req, 0, sizeof(req));
+    memset(&ds, 0, sizeof(ds));
+    req.op = RpcDefrag;
+    req.path = path;
+    RC rc = rpc_call(c, &req, &resp, (uint8_t *)&ds, sizeof(ds));
+    if (st)
+        *st = ds;
+    return rc;
+}
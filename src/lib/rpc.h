@@ -0,0 +1,212 @@
+/*
+ * rpc.h
+ * Local RPC over a Unix domain socket, simplefsd serves a mounted fs to many clients
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+
+#ifndef MY_RPC_H_
+#define MY_RPC_H_
+
+#include "error.h"
+#include "fs.h"
+#include "fs_api.h"
+#include "directory.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RPC_MAGIC       0x53465331 // "SFS1", first field of every request
+#define RPC_SOCK_FMT    "/tmp/simplefsd.%d.sock" // Default socket of the daemon serving a disk id
+#define RPC_MAX_PAYLOAD (1u << 20) // Bytes after one header, reads and writes are split below it
+#define RPC_IO_CHUNK    (64u * 1024) // Read/write size the utilities use
+#define RPC_APPEND      0xFFFFFFFFu  // RpcWrite offset meaning end of file
+#define RPC_F_MORE      0x0001       // Response flag, more responses follow for this id
+
+typedef enum {
+    RpcStat = 1, // path                -> payload is an f_stat
+    RpcTouch,    // path
+    RpcUnlink,   // path
+    RpcMkdir,    // path
+    RpcRmdir,    // path, arg0 threads (0 runs fs_rmdir)
+    RpcRename,   // path, path2
+    RpcLink,     // path, path2
+    RpcCp,       // path, path2, arg0 threads (0 runs fs_cp)
+    RpcRead,     // path, arg0 offset, arg1 length -> res bytes, payload the data
+    RpcWrite,    // path, arg0 offset or RPC_APPEND, data -> res bytes
+    RpcLs,       // path                -> packed entries, RPC_F_MORE on all but the last
+    RpcDefrag    // path                -> payload is a defrag_stats
+} rpc_op;
+
+/*
+ * Wire format, native byte order since both ends are on one host
+ *  request:  rpc_req_hdr, then len bytes: path '\0' [path2 '\0'] [data]
+ *  response: rpc_resp_hdr, then len bytes
+ * Requests on one connection are answered in order, a client may send many before reading
+ * */
+typedef struct {
+    uint32_t magic;
+    uint32_t id;    // Echoed in the response
+    uint16_t op;
+    uint16_t flags;
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t len;
+} rpc_req_hdr;
+
+typedef struct {
+    uint32_t id;
+    int32_t rc;
+    uint32_t res;
+    uint16_t flags;
+    uint16_t pad;
+    uint32_t len;
+} rpc_resp_hdr;
+
+/*
+ * RpcLs entry on the wire, name_len bytes of name follow without a terminator
+ * */
+typedef struct __attribute__((packed)) {
+    uint32_t inode_num;
+    uint32_t size;
+    uint32_t nlink;
+    uint8_t type;
+    uint8_t name_len;
+} rpc_dirent;
+
+/*
+ * Server, one thread per client connection, requests run straight on the mounted fs
+ * */
+struct s_rpc_conn {
+    int fd;
+    pthread_t thread;
+    uint8_t done;             // Set by the connection thread, reaped by the accept loop
+    struct s_rpc_server *srv;
+    struct s_rpc_conn *next;
+};
+typedef struct s_rpc_conn rpc_conn;
+
+struct s_rpc_server {
+    filesystem *fs;
+    int listen_fd;
+    char path[108];           // sun_path
+    pthread_t accept_thread;
+    pthread_mutex_t lock;     // Guards conns and stop
+    rpc_conn *conns;
+    uint8_t stop;
+};
+typedef struct s_rpc_server rpc_server;
+
+/*
+ * Listen on sock_path and serve fs from a background thread, NULL on failure
+ *  a socket file left by a dead daemon is replaced, NULL while a live one answers on it
+ * */
+rpc_server *rpc_server_start(filesystem *fs, const char *sock_path);
+
+/*
+ * Stop accepting, close every connection, wait for their threads and remove the socket
+ * */
+void rpc_server_stop(rpc_server *s);
+
+/*
+ * Client side
+ * */
+struct s_rpc_client {
+    int fd;
+    uint32_t next_id;
+};
+typedef struct s_rpc_client rpc_client;
+
+/*
+ * A request before encoding, unused pointers are NULL
+ * */
+typedef struct {
+    rpc_op op;
+    uint32_t id;
+    uint32_t arg0;
+    uint32_t arg1;
+    const char *path;
+    const char *path2;
+    const uint8_t *data;
+    uint32_t data_len;
+} rpc_req;
+
+typedef rpc_resp_hdr rpc_resp;
+
+typedef void (*rpc_ls_fn)(const dir_entry_info *entry, void *arg);
+
+/*
+ * Write the default socket path of the daemon for disk_id into buf
+ * */
+void rpc_sock_path(int32_t disk_id, char *buf, uint32_t size);
+
+/*
+ * Connect to a daemon, NULL when none is listening so callers can mount locally instead
+ * */
+rpc_client *rpc_connect(const char *sock_path);
+
+/*
+ * rpc_connect to the default socket for disk_id
+ * */
+rpc_client *rpc_connect_disk(int32_t disk_id);
+
+void rpc_close(rpc_client *c);
+
+/*
+ * Pipelining, send any number of requests, then rpc_recv their responses in the same order
+ *  req->id 0 takes the next id from the client
+ * */
+RC rpc_send(rpc_client *c, rpc_req *req);
+
+/*
+ * Receive one response, up to cap bytes of its payload go to buf, the rest is dropped
+ *  returns ErrNoSpace if the payload did not fit
+ * */
+RC rpc_recv(rpc_client *c, rpc_resp *resp, uint8_t *buf, uint32_t cap);
+
+/*
+ * One request and its response, returns the request's rc
+ * */
+RC rpc_call(rpc_client *c, rpc_req *req, rpc_resp *resp, uint8_t *buf, uint32_t cap);
+
+RC rpc_stat(rpc_client *c, const char *path, f_stat *st);
+RC rpc_touch(rpc_client *c, const char *path);
+RC rpc_unlink(rpc_client *c, const char *path);
+RC rpc_mkdir(rpc_client *c, const char *path);
+RC rpc_rmdir(rpc_client *c, const char *path, uint32_t threads);
+RC rpc_rename(rpc_client *c, const char *old_path, const char *new_path);
+RC rpc_link(rpc_client *c, const char *existing_path, const char *new_path);
+RC rpc_cp(rpc_client *c, const char *src_path, const char *dst_path, uint32_t threads);
+
+/*
+ * Read up to len bytes at offset, *bytes is what came back, short at end of file
+ * */
+RC rpc_read(rpc_client *c, const char *path, uint32_t offset, uint8_t *buf, uint32_t len,
+            uint32_t *bytes);
+
+/*
+ * Write len bytes at offset (RPC_APPEND for end of file) to an existing file
+ * */
+RC rpc_write(rpc_client *c, const char *path, uint32_t offset, const uint8_t *buf, uint32_t len,
+             uint32_t *bytes);
+
+/*
+ * Call fn for every entry of directory path, with the inode fields of dir_next_batch
+ * */
+RC rpc_ls(rpc_client *c, const char *path, rpc_ls_fn fn, void *arg);
+
+/*
+ * fs_defrag on the daemon, st may be NULL
+ * */
+RC rpc_defrag(rpc_client *c, const char *path, defrag_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * simplefsd.c
+ * Mount a disk once and serve it to the my_* utilities over a Unix socket
+ *
+ * Usage:
+ *  ./build/simplefsd [disk_id] [block_size] <socket_path>
+ *
+ * Example:
+ *  ./build/simplefsd 0 4096 &
+ *  ./build/my_ls 0 4096 "/"    # Goes through the daemon, no mount
+ *
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+#include "disk.h"
+#include "fs.h"
+#include "rpc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define MAX_HELP_MSG 4096
+
+int main(int argn, char *argv[]) {
+    char buf[MAX_HELP_MSG];
+    sprintf(buf, "simplefsd: wrong args count [%d]\n\n"
+        "Usage:\n"
+        "  ./build/simplefsd [disk_id] [block_size] <socket_path>\n\n"
+        "Example:\n"
+        "  ./build/simplefsd 0 4096\n"
+        "  This will serve disk 0 on " RPC_SOCK_FMT " until SIGINT/SIGTERM\n", argn, 0);
+
+    int32_t block_size;
+    int32_t disk_id = argn > 1 ? atoi(argv[1]) : -1;
+    if ((argn != 3 && argn != 4) || // file name, disk id, block size, socket path
+        disk_id > 9 || disk_id < 0 ||
+        (block_size = atoi(argv[2])) == 0) { // Error
+        fprintf(stderr, "%s", buf);
+        exit(0);
+    }
+
+    char sock_path[108];
+    if (argn == 4) {
+        snprintf(sock_path, sizeof(sock_path), "%s", argv[3]);
+    } else {
+        rpc_sock_path(disk_id, sock_path, sizeof(sock_path));
+    }
+
+    // Mounting is not harmless, the failed start below would unmount and write back bitmaps
+    // over what the live daemon flushed, so back off before touching the disk
+    rpc_client *client = rpc_connect(sock_path);
+    if (client) {
+        rpc_close(client);
+        fprintf(stderr, "simplefsd: [error] a daemon already serves [%s]\n", sock_path);
+        exit(0);
+    }
+
+    // Block the stop signals before any thread starts, so only sigwait below sees them
+    sigset_t stop_set;
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_set, NULL);
+
+    disk *dd = (disk*)calloc(1, sizeof(disk));
+    filesystem *fs = (filesystem*)calloc(1, sizeof(filesystem));
+    if (dd == NULL || fs == NULL) {
+        fprintf(stderr, "simplefsd: [error] no enough memory for disk/filesystem allocation\n");
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    if (dattach(dd, block_size, disk_id) != OK) {
+        fprintf(stderr, "simplefsd: [error] failed to attach dd to disk with id [%d]\n", disk_id);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    if (fs_mount(dd, fs) != OK) {
+        fprintf(stderr, "simplefsd: [error] failed to mount fs to disk with id [%d]\n", disk_id);
+        ddetach(dd);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    rpc_server *srv = rpc_server_start(fs, sock_path);
+    if (!srv) {
+        fprintf(stderr, "simplefsd: [error] failed to listen on [%s]\n", sock_path);
+        fs_unmount(fs);
+        ddetach(dd);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+    printf("simplefsd: serving disk [%d] on [%s]\n", disk_id, sock_path);
+    fflush(stdout);
+
+    int sig;
+    sigwait(&stop_set, &sig);
+    printf("simplefsd: got signal [%d], shutting down\n", sig);
+
+    rpc_server_stop(srv);
+
+    if (fs_unmount(fs) != OK) {
+        fprintf(stderr, "simplefsd: [error] failed to unmount fs\n");
+    }
+    if (ddetach(dd) != OK) {
+        fprintf(stderr, "simplefsd: [error] failed to ddetach dd from disk with id [%d]\n", disk_id);
+    }
+    free(dd);
+    free(fs);
+
+    return 0;
+}
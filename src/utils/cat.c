@@ -14,6 +14,7 @@
 #include "disk.h"
 #include "fs.h"
 #include "fs_api.h"
+#include "rpc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,6 +42,32 @@ int main(int argn, char *argv[]) {
     }
 
     char *file_path = argv[3];
+    // A running simplefsd already has the disk mounted, go through it
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        uint32_t chunk = RPC_IO_CHUNK * 16;
+        uint8_t *data = (uint8_t *)malloc(chunk);
+        uint32_t pos = 0, got = 0;
+        RC rc = data ? OK : ErrNoMem;
+        uint8_t last_byte = '\n';
+        while (rc == OK && (rc = rpc_read(client, file_path, pos, data, chunk, &got)) == OK && got > 0) {
+            fwrite(data, 1, got, stdout);
+            last_byte = data[got-1];
+            pos += got;
+        }
+        free(data);
+        rpc_close(client);
+        if (rc != OK) {
+            fprintf(stderr, "cat: [error] failed to cat file [%s]\n", file_path);
+            exit(0);
+        }
+        if (last_byte != '\n')
+            printf("\n");
+        printf("==================================\n");
+        printf("cat: success to run [rpc_read]\n");
+        return 0;
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
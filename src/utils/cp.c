@@ -2,10 +2,11 @@
  * cp.c
  *
  * Usage:
- *  ./build/my_cp [disk_id] [block_size] [src_file_path] [dst_file_path]
+ *  ./build/my_cp [disk_id] [block_size] [src_file_path] [dst_file_path] <threads>
  *
  * Example:
  *  ./build/my_cp 0 4096 "/hello.txt" "/new_hello.txt"
+ *  ./build/my_cp 0 4096 "/dataset" "/dataset_copy" 8
  *
  * Copyright (C) Jie
  * 2025-12-03
@@ -14,6 +15,7 @@
 #include "disk.h"
 #include "fs.h"
 #include "fs_api.h"
+#include "rpc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,14 +28,16 @@ int main(int argn, char *argv[]) {
     char buf[MAX_HELP_MSG];
     sprintf(buf, "cp: wrong args count [%d]\n\n"
         "Usage:\n"
-        "  ./build/my_cp [disk_id] [block_size] [src_file_path] [dst_file_path]\n\n"
+        "  ./build/my_cp [disk_id] [block_size] [src_file_path] [dst_file_path] <threads>\n\n"
         "Example:\n"
         "  ./build/my_cp 0 4096 \"/hello.txt\" \"/new_hello.txt\"\n"
-        "  This will copy file to a new one\n", argn);
+        "  This will copy file to a new one\n"
+        "  ./build/my_cp 0 4096 \"/dataset\" \"/dataset_copy\" 8\n"
+        "  This will copy a directory tree with 8 threads\n", argn);
     
     int32_t block_size;
     int32_t disk_id   = atoi(argv[1]);
-    if (argn != 5 || // file name, block number, block size, source file path, destination file path
+    if ((argn != 5 && argn != 6) || // file name, block number, block size, source, destination, threads
         disk_id > 9 || disk_id < 0 ||
         (block_size = atoi(argv[2])) == 0) { // Error
         fprintf(stderr, "%s", buf);
@@ -42,6 +46,22 @@ int main(int argn, char *argv[]) {
 
     char *src_file_path = argv[3];
     char *dst_file_path = argv[4];
+    // A running simplefsd already has the disk mounted, go through it
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        uint32_t threads = argn == 6 ? (uint32_t)atoi(argv[5]) : 0;
+        if (rpc_cp(client, src_file_path, dst_file_path, threads) != OK) {
+            fprintf(stderr, "cp: [error] failed to cp file [%s] to [%s]\n",
+                    src_file_path, dst_file_path);
+            rpc_close(client);
+            exit(0);
+        }
+        printf("cp: success to run [rpc_cp]\n");
+        printf("cp: success to cp file [%s] to [%s]\n", src_file_path, dst_file_path);
+        rpc_close(client);
+        return 0;
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
@@ -84,14 +104,25 @@ int main(int argn, char *argv[]) {
         exit(0);
     }
 
-    if (fs_cp(fs, src_file_path, dst_file_path) != OK) {
+    uint32_t threads = argn == 6 ? (uint32_t)atoi(argv[5]) : 0;
+    cp_progress prog;
+    RC rc = threads ? fs_cp_tree(fs, src_file_path, dst_file_path, threads, &prog)
+                    : fs_cp(fs, src_file_path, dst_file_path);
+    if (rc != OK) {
         fprintf(stderr, "cp: [error] failed to cp file [%s] to [%s]\n",
                 src_file_path, dst_file_path);
         free(dd);
         free(fs);
         exit(0);
     }
-    printf("cp: success to run [fs_cp]\n");
+    if (threads) {
+        printf("cp: success to run [fs_cp_tree]\n");
+        printf("cp: copied %llu dirs, %llu files, %llu bytes\n",
+               (unsigned long long)prog.dirs, (unsigned long long)prog.files,
+               (unsigned long long)prog.bytes);
+    } else {
+        printf("cp: success to run [fs_cp]\n");
+    }
     printf("cp: success to cp file [%s] to [%s]\n",
             src_file_path, dst_file_path);
 
@@ -0,0 +1,136 @@
+/*
+ * defrag.c
+ *
+ * Usage:
+ *  ./build/my_defrag [disk_id] [block_size] [path]
+ *
+ * Example:
+ *  ./build/my_defrag 0 4096 "/"
+ *
+ * Copyright (C) Jie
+ * 2026-10-19
+ *
+ */
+#include "disk.h"
+#include "fs.h"
+#include "fs_api.h"
+#include "rpc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MAX_HELP_MSG 4096
+
+static void print_stats(const char *path, const defrag_stats *st) {
+    printf("defrag: [%s] %u file%s, %u moved, extents %u -> %u\n",
+           path, st->files, st->files == 1 ? "" : "s", st->moved,
+           st->extents_before, st->extents_after);
+}
+
+int main(int argn, char *argv[]) {
+    char buf[MAX_HELP_MSG];
+    sprintf(buf, "defrag: wrong args count [%d]\n\n"
+        "Usage:\n"
+        "  ./build/my_defrag [disk_id] [block_size] [path]\n\n"
+        "Example:\n"
+        "  ./build/my_defrag 0 4096 \"/\"\n"
+        "  This will move the blocks of every file under / into contiguous runs\n", argn);
+
+    int32_t block_size;
+    int32_t disk_id   = argn > 1 ? atoi(argv[1]) : -1;
+    if (argn != 4 || // file name, disk id, block size, path
+        disk_id > 9 || disk_id < 0 ||
+        (block_size = atoi(argv[2])) == 0) { // Error
+        fprintf(stderr, "%s", buf);
+        exit(0);
+    }
+
+    char *path = argv[3];
+    defrag_stats st;
+    memset(&st, 0, sizeof(defrag_stats));
+
+    // A running simplefsd already has the disk mounted, let it move the blocks
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        if (rpc_defrag(client, path, &st) != OK) {
+            fprintf(stderr, "defrag: [error] failed to defrag [%s]\n", path);
+            rpc_close(client);
+            exit(0);
+        }
+        print_stats(path, &st);
+        rpc_close(client);
+        return 0;
+    }
+
+    disk *dd;
+    filesystem *fs;
+    uint32_t size;
+
+    size = sizeof(disk);
+    dd = (disk*)malloc(size);
+    if (dd == NULL) {
+        fprintf(stderr, "defrag: [error] no enough memory for disk allocation\n");
+        exit(0);
+    }
+    memset(dd, 0, size);
+
+    size = sizeof(filesystem);
+    fs = (filesystem*)malloc(size);
+    if (fs == NULL) {
+        fprintf(stderr, "defrag: [error] no enough memory for filesystem allocation\n");
+        free(dd);
+        exit(0);
+    }
+    memset(fs, 0, size);
+
+    if (dattach(dd, block_size, disk_id) != OK) {
+        fprintf(stderr, "defrag: [error] failed to attach dd to disk with id [%d]\n", disk_id);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    if (fs_mount(dd, fs) != OK) {
+        fprintf(stderr, "defrag: [error] failed to mount fs to disk with id [%d]\n", disk_id);
+        ddetach(dd);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    frag_report rep;
+    if (fs_frag_report(fs, &rep) == OK) {
+        printf("Before:\n");
+        fs_frag_show(&rep);
+    }
+
+    if (fs_defrag(fs, path, &st) != OK) {
+        fprintf(stderr, "defrag: [error] failed to defrag [%s]\n", path);
+    }
+    print_stats(path, &st);
+
+    if (fs_frag_report(fs, &rep) == OK) {
+        printf("After:\n");
+        fs_frag_show(&rep);
+    }
+
+    if (fs_unmount(fs) != OK) {
+        fprintf(stderr, "defrag: [error] failed to unmount fs\n");
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    if (ddetach(dd) != OK) {
+        fprintf(stderr, "defrag: [error] failed to ddetach dd from disk with id [%d]\n", disk_id);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+    free(dd);
+    free(fs);
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * find.c
+ *
+ * Usage:
+ *  ./build/my_find [disk_id] [block_size] [dir_path] <name_pattern>
+ *
+ * Example:
+ *  ./build/my_find 0 4096 "/home"
+ *  ./build/my_find 0 4096 "/home" "*.log"
+ *
+ * Copyright (C) Jie
+ * 2026-10-18
+ *
+ */
+#include "disk.h"
+#include "fs.h"
+#include "fs_api.h"
+#include "path.h"
+#include "rpc.h"
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MAX_HELP_MSG 4096
+#define FIND_THREADS 4
+
+static int find_print(const char *path, const f_stat *st, void *arg) {
+    (void)arg;
+    printf("%c.   %-32d    %s\n", st->type == FTypeDirectory ? 'd' : 'f', st->size, path);
+    return 0;
+}
+
+// Subdirectories seen by one rpc_ls call, walked once it returns
+struct find_dirs {
+    const char *dir;
+    const char *pattern;
+    char (*names)[MAX_FILENAME_LEN];
+    uint32_t count;
+    uint32_t cap;
+    RC rc;
+};
+
+static void find_join(char *out, const char *dir, const char *name) {
+    snprintf(out, MAX_PATH_LEN, "%s%s%s", dir, dir[strlen(dir)-1] == '/' ? "" : "/", name);
+}
+
+static void find_remote_entry(const dir_entry_info *entry, void *arg) {
+    struct find_dirs *d = (struct find_dirs *)arg;
+    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+        return;
+
+    char path[MAX_PATH_LEN];
+    find_join(path, d->dir, entry->name);
+    if (!d->pattern || fnmatch(d->pattern, entry->name, 0) == 0)
+        printf("%c.   %-32d    %s\n", entry->type == FTypeDirectory ? 'd' : 'f', entry->size, path);
+
+    if (entry->type != FTypeDirectory || d->rc != OK)
+        return;
+    if (d->count == d->cap) {
+        uint32_t cap = d->cap ? d->cap * 2 : 16;
+        char (*names)[MAX_FILENAME_LEN] = realloc(d->names, cap * sizeof(*names));
+        if (!names) {
+            d->rc = ErrNoMem;
+            return;
+        }
+        d->names = names;
+        d->cap = cap;
+    }
+    snprintf(d->names[d->count++], MAX_FILENAME_LEN, "%s", entry->name);
+}
+
+// Same listing as fs_walk, one rpc_ls per directory through the daemon
+static RC find_remote(rpc_client *client, const char *dir, const char *pattern) {
+    struct find_dirs d = {dir, pattern, NULL, 0, 0, OK};
+    RC rc = rpc_ls(client, dir, find_remote_entry, &d);
+    if (rc == OK)
+        rc = d.rc;
+    for (uint32_t i=0; i<d.count && rc == OK; i++) {
+        char path[MAX_PATH_LEN];
+        find_join(path, dir, d.names[i]);
+        rc = find_remote(client, path, pattern);
+    }
+    free(d.names);
+    return rc;
+}
+
+int main(int argn, char *argv[]) {
+    char buf[MAX_HELP_MSG];
+    sprintf(buf, "find: wrong args count [%d]\n\n"
+        "Usage:\n"
+        "  ./build/my_find [disk_id] [block_size] [dir_path] <name_pattern>\n\n"
+        "Example:\n"
+        "  ./build/my_find 0 4096 \"/home\"\n"
+        "  This will list everything under /home recursively\n"
+        "  ./build/my_find 0 4096 \"/home\" \"*.log\"\n"
+        "  This will list entries under /home whose name matches *.log\n", argn);
+
+    int32_t block_size;
+    int32_t disk_id;
+    if ((argn != 4 && argn != 5) || // file name, block number, block size, dir path, pattern
+        (disk_id = atoi(argv[1])) > 9 || disk_id < 0 ||
+        (block_size = atoi(argv[2])) == 0) { // Error
+        fprintf(stderr, "%s", buf);
+        exit(0);
+    }
+
+    char *dir_path = argv[3];
+    walk_filter filter = {0};
+    if (argn == 5)
+        filter.name = argv[4];
+
+    // A running simplefsd already has the disk mounted, fs_unmount here would write back
+    // bitmaps older than the ones it flushed, so walk through it instead
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        printf("===============================================================\n");
+        printf("Type Size(bytes)\n");
+        if (find_remote(client, dir_path, filter.name) != OK) {
+            fprintf(stderr, "find: [error] failed to walk [%s]\n", dir_path);
+            rpc_close(client);
+            exit(0);
+        }
+        printf("===============================================================\n");
+        printf("find: success to run [rpc_ls]\n");
+        rpc_close(client);
+        return 0;
+    }
+
+    disk *dd;
+    filesystem *fs;
+    uint32_t size;
+
+    size = sizeof(disk);
+    dd = (disk*)malloc(size);
+    if (dd == NULL) {
+        fprintf(stderr, "find: [error] no enough memory for disk allocation\n");
+        exit(0);
+    }
+    memset(dd, 0, size);
+
+    size = sizeof(filesystem);
+    fs = (filesystem*)malloc(size);
+    if (fs == NULL) {
+        fprintf(stderr, "find: [error] no enough memory for filesystem allocation\n");
+        free(dd);
+        exit(0);
+    }
+    memset(fs, 0, size);
+
+    if (dattach(dd, block_size, disk_id) != OK) {
+        fprintf(stderr, "find: [error] failed to attach dd to disk with id [%d]\n", disk_id);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    if (fs_mount(dd, fs) != OK) {
+        fprintf(stderr, "find: [error] failed to mount fs to disk with id [%d]\n", disk_id);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    printf("===============================================================\n");
+    printf("Type Size(bytes)\n");
+    if (fs_walk(fs, dir_path, &filter, FIND_THREADS, find_print, NULL) != OK) {
+        fprintf(stderr, "find: [error] failed to walk [%s]\n", dir_path);
+        fs_unmount(fs);
+        ddetach(dd);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+    printf("===============================================================\n");
+    printf("find: success to run [fs_walk]\n");
+
+    if (fs_unmount(fs) != OK) {
+        fprintf(stderr, "find: [error] failed to unmount fs\n");
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+
+    if (ddetach(dd) != OK) {
+        fprintf(stderr, "find: [error] failed to ddetach dd from disk with id [%d]\n", disk_id);
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+    free(dd);
+    free(fs);
+
+    return 0;
+}
@@ -13,6 +13,8 @@
  */
 #include "disk.h"
 #include "fs.h"
+#include "fs_api.h"
+#include "rpc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,6 +41,15 @@ int main(int argn, char *argv[]) {
         exit(0);
     }
 
+    // fs_unmount writes back both bitmaps from this process, older than what a running
+    // simplefsd flushed, so never mount a disk the daemon serves
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        rpc_close(client);
+        fprintf(stderr, "fsinfo: [error] simplefsd serves disk [%d], stop it first\n", disk_id);
+        exit(0);
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
@@ -81,6 +92,16 @@ int main(int argn, char *argv[]) {
         exit(0);
     }
 
+    frag_report rep;
+    if (fs_frag_report(fs, &rep) != OK) {
+        fprintf(stderr, "fsinfo: [error] failed to scan files for fragmentation\n");
+        free(dd);
+        free(fs);
+        exit(0);
+    }
+    fs_frag_show(&rep);
+    printf("========================================\n");
+
     if (fs_unmount(fs) != OK) {
         fprintf(stderr, "fsinfo: [error] failed to unmount fs\n");
         free(dd);
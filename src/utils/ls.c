@@ -14,6 +14,7 @@
 #include "disk.h"
 #include "fs.h"
 #include "fs_api.h"
+#include "rpc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +23,13 @@
 
 #define MAX_HELP_MSG 4096
 
+// Same layout as fs_ls
+static void print_entry(const dir_entry_info *entry, void *arg) {
+    (void)arg;
+    char type_prefix = entry->type == FTypeDirectory ? 'd' : 'f';
+    printf("%c.   %-32d    %s \n", type_prefix, entry->size, entry->name);
+}
+
 int main(int argn, char *argv[]) {
     char buf[MAX_HELP_MSG];
     sprintf(buf, "ls: wrong args count [%d]\n\n"
@@ -41,6 +49,22 @@ int main(int argn, char *argv[]) {
     }
 
     char *dir_path = argv[3];
+    // A running simplefsd already has the disk mounted, go through it
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        printf("===============================================================\n");
+        printf("Type Size(bytes)\n");
+        if (rpc_ls(client, dir_path, print_entry, NULL) != OK) {
+            fprintf(stderr, "ls: [error] failed to list dir [%s]\n", dir_path);
+            rpc_close(client);
+            exit(0);
+        }
+        printf("===============================================================\n");
+        printf("ls: success to run [rpc_ls]\n");
+        rpc_close(client);
+        return 0;
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
@@ -2,10 +2,11 @@
  * rmdir.c
  *
  * Usage:
- *  ./build/my_rmdir [disk_id] [block_size] [dir_path]
+ *  ./build/my_rmdir [disk_id] [block_size] [dir_path] <threads>
  *
  * Example:
  *  ./build/my_rmdir 0 4096 "/home/jie"
+ *  ./build/my_rmdir 0 4096 "/home/jie" 8
  *
  * Copyright (C) Jie
  * 2025-12-03
@@ -14,6 +15,7 @@
 #include "disk.h"
 #include "fs.h"
 #include "fs_api.h"
+#include "rpc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,14 +28,16 @@ int main(int argn, char *argv[]) {
     char buf[MAX_HELP_MSG];
     sprintf(buf, "rmdir: wrong args count [%d]\n\n"
         "Usage:\n"
-        "  ./build/my_rmdir [disk_id] [block_size] [dir_path]\n\n"
+        "  ./build/my_rmdir [disk_id] [block_size] [dir_path] <threads>\n\n"
         "Example:\n"
         "  ./build/my_rmdir 0 4096 \"/home/jie\"\n"
-        "  This will remove directory recursively\n", argn);
+        "  This will remove directory recursively\n"
+        "  ./build/my_rmdir 0 4096 \"/home/jie\" 8\n"
+        "  This will remove directory with 8 threads\n", argn);
     
     int32_t block_size;
     int32_t disk_id   = atoi(argv[1]);
-    if (argn != 4 || // file name, block number, block size, dir path
+    if ((argn != 4 && argn != 5) || // file name, block number, block size, dir path, threads
         disk_id > 9 || disk_id < 0 ||
         (block_size = atoi(argv[2])) == 0) { // Error
         fprintf(stderr, "%s", buf);
@@ -41,6 +45,21 @@ int main(int argn, char *argv[]) {
     }
 
     char *dir_path = argv[3];
+    // A running simplefsd already has the disk mounted, go through it
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        uint32_t threads = argn == 5 ? (uint32_t)atoi(argv[4]) : 0;
+        if (rpc_rmdir(client, dir_path, threads) != OK) {
+            fprintf(stderr, "rmdir: [error] failed to remove dir [%s]\n", dir_path);
+            rpc_close(client);
+            exit(0);
+        }
+        printf("rmdir: success to run [rpc_rmdir]\n");
+        printf("rmdir: success to remove dir [%s]\n", dir_path);
+        rpc_close(client);
+        return 0;
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
@@ -76,13 +95,15 @@ int main(int argn, char *argv[]) {
         exit(0);
     }
 
-    if (fs_rmdir(fs, dir_path) != OK) {
+    uint32_t threads = argn == 5 ? (uint32_t)atoi(argv[4]) : 0;
+    RC rc = threads ? fs_rmdir_parallel(fs, dir_path, threads) : fs_rmdir(fs, dir_path);
+    if (rc != OK) {
         fprintf(stderr, "rmdir: [error] failed to remove dir [%s]\n", dir_path);
         free(dd);
         free(fs);
         exit(0);
     }
-    printf("rmdir: success to run [fs_rmdir]\n");
+    printf("rmdir: success to run [%s]\n", threads ? "fs_rmdir_parallel" : "fs_rmdir");
     printf("rmdir: success to remove dir [%s]\n", dir_path);
 
     if (fs_unmount(fs) != OK) {
@@ -14,6 +14,7 @@
 #include "disk.h"
 #include "fs.h"
 #include "fs_api.h"
+#include "rpc.h"
 #include "inode.h"
 
 #include <stdio.h>
@@ -43,6 +44,29 @@ int main(int argn, char *argv[]) {
     }
 
     char *path = argv[3];
+    // A running simplefsd already has the disk mounted, go through it
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        f_stat st;
+        memset(&st, 0, sizeof(f_stat));
+        if (rpc_stat(client, path, &st) != OK) {
+            fprintf(stderr, "stat: [error] failed to stat [%s]\n", path);
+            rpc_close(client);
+            exit(0);
+        }
+        printf("stat: success to run [rpc_stat]\n");
+        printf("stat info:\n");
+        printf("  path   : %s\n"
+               "  type   : %s\n"
+               "  size   : %d\n"
+               "  blocks : %d\n"
+               "  links  : %d\n",
+               path, st.type == FTypeDirectory ? "directory" : "file",
+               st.size, st.blocks, st.nlink);
+        rpc_close(client);
+        return 0;
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
@@ -100,8 +124,9 @@ int main(int argn, char *argv[]) {
     printf("  path   : %s\n"
            "  type   : %s\n"
            "  size   : %d\n"
-           "  blocks : %d\n",
-           path, file_type, stat.size, stat.blocks);
+           "  blocks : %d\n"
+           "  links  : %d\n",
+           path, file_type, stat.size, stat.blocks, stat.nlink);
 
     if (fs_unmount(fs) != OK) {
         fprintf(stderr, "stat: [error] failed to unmount fs\n");
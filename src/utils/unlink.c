@@ -14,6 +14,7 @@
 #include "disk.h"
 #include "fs.h"
 #include "fs_api.h"
+#include "rpc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,6 +42,20 @@ int main(int argn, char *argv[]) {
     }
 
     char *file_path = argv[3];
+    // A running simplefsd already has the disk mounted, go through it
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        if (rpc_unlink(client, file_path) != OK) {
+            fprintf(stderr, "unlink: [error] failed to remove file [%s]\n", file_path);
+            rpc_close(client);
+            exit(0);
+        }
+        printf("unlink: success to run [rpc_unlink]\n");
+        printf("unlink: success to remove %s\n", file_path);
+        rpc_close(client);
+        return 0;
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
@@ -14,6 +14,7 @@
 #include "disk.h"
 #include "fs.h"
 #include "fs_api.h"
+#include "rpc.h"
 #include "file.h"
 
 #include <stdio.h>
@@ -46,6 +47,22 @@ int main(int argn, char *argv[]) {
     char *file_path    = argv[3];
     char *file_content = argv[5];
     uint32_t bytes_written = 0;
+    // A running simplefsd already has the disk mounted, go through it
+    rpc_client *client = rpc_connect_disk(disk_id);
+    if (client) {
+        uint32_t at = offset == -1 ? RPC_APPEND : (uint32_t)offset;
+        if (rpc_write(client, file_path, at, (uint8_t*)file_content, strlen(file_content),
+                      &bytes_written) != OK || bytes_written == 0) {
+            fprintf(stderr, "write: [error] failed to write file [%s]\n", file_path);
+            rpc_close(client);
+            exit(0);
+        }
+        printf("write: success to run [rpc_write]\n");
+        printf("write: success to write %d bytes to [%s]\n", bytes_written, file_path);
+        rpc_close(client);
+        return 0;
+    }
+
     disk *dd;
     filesystem *fs;
     uint32_t size;
@@ -1,9 +1,25 @@
 #include <gtest/gtest.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <vector>
+#include <set>
+#include <string>
+#include <mutex>
 #include "disk.h"
 #include "fs.h"
 #include "path.h"
+#include "directory.h"
+#include "block.h"
+#include "flush.h"
+#include "file.h"
+#include "fs_api.h"
+#include "cwd.h"
+#include "pool.h"
+#include "aio.h"
+#include "fs_coro.hpp"
+#include "rpc.h"
+#include <poll.h>
 
 #define BLOCK_SIZE 4096
 #define DISK_ID 0
@@ -106,3 +122,1379 @@ TEST_F(FSFixture, test_bitmap) {
     
     bm_destroy(bm);
 }
+
+TEST_F(FSFixture, test_flusher_writeback) {
+    flusher_config cfg = {10, 0, 100, 0}; // Write back as soon as anything is dirty
+    ASSERT_EQ(OK, fs_flusher_start(fs, &cfg));
+
+    uint32_t block_number = bl_alloc(fs);
+    ASSERT_NE(0u, block_number);
+    for (int i=0; i<100 && fs->dirty_count; i++)
+        usleep(10000);
+    ASSERT_EQ(0u, fs->dirty_count);
+
+    uint8_t buf[BLOCK_SIZE];
+    uint32_t idx = block_number - 1;
+    uint32_t bits_per_block = BLOCK_SIZE * 8;
+    ASSERT_EQ(OK, dread(dd, buf, fs->block_bitmap_start + idx / bits_per_block));
+    ASSERT_TRUE((buf[(idx % bits_per_block) / 8] >> (idx % 8)) & 1);
+
+    ASSERT_EQ(OK, fs_flusher_stop(fs));
+    ASSERT_EQ(OK, bl_free(fs, block_number));
+    ASSERT_EQ(OK, fs_sync(fs));
+    ASSERT_EQ(0u, fs->dirty_count);
+}
+
+TEST_F(FSFixture, test_cp_multi_block) {
+    const uint32_t len = 20 * BLOCK_SIZE + 123; // Direct and indirect blocks
+    uint8_t *src = (uint8_t*)malloc(len);
+    uint8_t *dst = (uint8_t*)malloc(len);
+    for (uint32_t i=0; i<len; i++)
+        src[i] = (uint8_t)(i * 7 + 3);
+
+    ASSERT_EQ(OK, fs_touch(fs, "/cp_src"));
+    file_handle *fh = file_open(fs, "/cp_src", MY_O_WRONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_write(fh, src, len));
+    file_close(fh);
+
+    ASSERT_EQ(OK, fs_cp(fs, "/cp_src", "/cp_dst"));
+    fh = file_open(fs, "/cp_dst", MY_O_RDONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_size(fh));
+    ASSERT_EQ(len, file_read(fh, dst, len));
+    file_close(fh);
+    ASSERT_EQ(0, memcmp(src, dst, len));
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/cp_src"));
+    ASSERT_EQ(OK, fs_unlink(fs, "/cp_dst"));
+    free(src);
+    free(dst);
+}
+
+TEST_F(FSFixture, test_clone_copy_on_write) {
+    const uint32_t len = 3 * BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*)malloc(len);
+    uint8_t *out = (uint8_t*)malloc(len);
+    memset(buf, 'a', len);
+
+    ASSERT_EQ(OK, fs_touch(fs, "/clone_src"));
+    file_handle *fh = file_open(fs, "/clone_src", MY_O_WRONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_write(fh, buf, len));
+    file_close(fh);
+
+    ASSERT_EQ(OK, fs_clone(fs, "/clone_src", "/clone_dst"));
+    f_stat st;
+    ASSERT_EQ(OK, fs_stat(fs, "/clone_dst", &st));
+    ASSERT_EQ(len, st.size);
+    inode ino;
+    ASSERT_EQ(OK, ino_read(fs, st.inode_num, &ino));
+    ASSERT_TRUE(bl_is_shared(fs, ino.direct_blocks[1]));
+
+    // Modify the middle block of the clone only
+    fh = file_open(fs, "/clone_dst", MY_O_WRONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(OK, file_seek(fh, BLOCK_SIZE + 10, MY_SEEK_SET));
+    ASSERT_EQ(3u, file_write(fh, (uint8_t*)"xyz", 3));
+    file_close(fh);
+    ASSERT_EQ(OK, ino_read(fs, st.inode_num, &ino));
+    ASSERT_FALSE(bl_is_shared(fs, ino.direct_blocks[1]));
+    ASSERT_TRUE(bl_is_shared(fs, ino.direct_blocks[2]));
+
+    fh = file_open(fs, "/clone_src", MY_O_RDONLY);
+    ASSERT_EQ(len, file_read(fh, out, len));
+    file_close(fh);
+    ASSERT_EQ(0, memcmp(buf, out, len));
+
+    fh = file_open(fs, "/clone_dst", MY_O_RDONLY);
+    ASSERT_EQ(len, file_read(fh, out, len));
+    file_close(fh);
+    memcpy(buf + BLOCK_SIZE + 10, "xyz", 3);
+    ASSERT_EQ(0, memcmp(buf, out, len));
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/clone_src"));
+    ASSERT_EQ(OK, fs_unlink(fs, "/clone_dst"));
+    free(buf);
+    free(out);
+}
+
+TEST_F(FSFixture, test_truncate_punch_hole) {
+    const uint32_t len = 20 * BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*)malloc(len);
+    uint8_t *out = (uint8_t*)malloc(len);
+    memset(buf, 'b', len);
+
+    ASSERT_EQ(OK, fs_touch(fs, "/trunc"));
+    file_handle *fh = file_open(fs, "/trunc", MY_O_RDWR);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_write(fh, buf, len));
+
+    // Punch blocks 2..4 plus a partial head and tail
+    ASSERT_EQ(OK, file_punch_hole(fh, BLOCK_SIZE + 100, 4 * BLOCK_SIZE - 200));
+    ASSERT_EQ(len, file_size(fh));
+    ASSERT_EQ(0u, ino_get_block_at(fs, &fh->oi->cached_inode, 2));
+    ASSERT_NE(0u, ino_get_block_at(fs, &fh->oi->cached_inode, 1));
+    memset(buf + BLOCK_SIZE + 100, 0, 4 * BLOCK_SIZE - 200);
+
+    // Shrink below the indirect blocks, then grow back
+    ASSERT_EQ(OK, file_truncate(fh, 5 * BLOCK_SIZE + 7));
+    ASSERT_EQ(0u, fh->oi->cached_inode.single_indirect);
+    ASSERT_EQ(OK, file_truncate(fh, len));
+    memset(buf + 5 * BLOCK_SIZE + 7, 0, len - 5 * BLOCK_SIZE - 7);
+
+    ASSERT_EQ(OK, file_seek(fh, 0, MY_SEEK_SET));
+    ASSERT_EQ(len, file_read(fh, out, len));
+    ASSERT_EQ(0, memcmp(buf, out, len));
+    file_close(fh);
+
+    // O_TRUNC empties the file on open
+    fh = file_open(fs, "/trunc", MY_O_WRONLY | MY_O_TRUNC);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(0u, file_size(fh));
+    file_close(fh);
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/trunc"));
+    free(buf);
+    free(out);
+}
+
+TEST_F(FSFixture, test_fallocate_unwritten) {
+    const uint32_t len = 16 * BLOCK_SIZE;
+    uint8_t *out = (uint8_t*)malloc(len);
+    uint8_t zeros[BLOCK_SIZE] = {0};
+
+    ASSERT_EQ(OK, fs_touch(fs, "/falloc"));
+    file_handle *fh = file_open(fs, "/falloc", MY_O_RDWR);
+    ASSERT_NE(nullptr, fh);
+
+    ASSERT_EQ(OK, file_fallocate(fh, 0, len, MY_FALLOC_KEEP_SIZE));
+    ASSERT_EQ(0u, file_size(fh));
+    uint32_t entry = ino_get_block_entry(fs, &fh->oi->cached_inode, 13);
+    ASSERT_TRUE(entry & INO_BLOCK_UNWRITTEN);
+
+    ASSERT_EQ(OK, file_fallocate(fh, 0, len, 0));
+    ASSERT_EQ(len, file_size(fh));
+    ASSERT_EQ(len, file_read(fh, out, len));
+    for (uint32_t i=0; i<16; i++)
+        ASSERT_EQ(0, memcmp(zeros, out + i*BLOCK_SIZE, BLOCK_SIZE));
+
+    // Writing into a reserved block keeps its number and clears the flag
+    ASSERT_EQ(OK, file_seek(fh, 13 * BLOCK_SIZE + 5, MY_SEEK_SET));
+    ASSERT_EQ(3u, file_write(fh, (uint8_t*)"abc", 3));
+    ASSERT_EQ(entry & INO_BLOCK_MASK, ino_get_block_entry(fs, &fh->oi->cached_inode, 13));
+
+    ASSERT_EQ(OK, file_seek(fh, 13 * BLOCK_SIZE, MY_SEEK_SET));
+    ASSERT_EQ((uint32_t)BLOCK_SIZE, file_read(fh, out, BLOCK_SIZE));
+    ASSERT_EQ(0, memcmp(zeros, out, 5));
+    ASSERT_EQ(0, memcmp("abc", out + 5, 3));
+    ASSERT_EQ(0, memcmp(zeros, out + 8, BLOCK_SIZE - 8));
+    file_close(fh);
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/falloc"));
+    free(out);
+}
+
+TEST_F(FSFixture, test_seek_data_hole) {
+    ASSERT_EQ(OK, fs_touch(fs, "/sparse"));
+    file_handle *fh = file_open(fs, "/sparse", MY_O_RDWR);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(3u, file_write(fh, (uint8_t*)"abc", 3));
+    ASSERT_EQ(OK, file_seek(fh, 900 * BLOCK_SIZE, MY_SEEK_SET));
+    ASSERT_EQ(3u, file_write(fh, (uint8_t*)"xyz", 3));
+
+    ASSERT_EQ(OK, file_seek(fh, 1, MY_SEEK_HOLE));
+    ASSERT_EQ((uint32_t)BLOCK_SIZE, file_tell(fh));
+    ASSERT_EQ(OK, file_seek(fh, BLOCK_SIZE, MY_SEEK_DATA));
+    ASSERT_EQ(900u * BLOCK_SIZE, file_tell(fh));
+    ASSERT_EQ(OK, file_seek(fh, 900 * BLOCK_SIZE + 1, MY_SEEK_HOLE));
+    ASSERT_EQ(900u * BLOCK_SIZE + 3, file_tell(fh));
+    ASSERT_EQ(ErrNotFound, file_seek(fh, 900 * BLOCK_SIZE + 3, MY_SEEK_DATA));
+    file_close(fh);
+
+    // Copy keeps the holes
+    ASSERT_EQ(OK, fs_cp(fs, "/sparse", "/sparse_cp"));
+    f_stat st;
+    ASSERT_EQ(OK, fs_stat(fs, "/sparse_cp", &st));
+    ASSERT_EQ(900u * BLOCK_SIZE + 3, st.size);
+    inode ino;
+    ASSERT_EQ(OK, ino_read(fs, st.inode_num, &ino));
+    ASSERT_EQ(2u, ino_get_block_count(fs, &ino));
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/sparse"));
+    ASSERT_EQ(OK, fs_unlink(fs, "/sparse_cp"));
+}
+
+TEST_F(FSFixture, test_inline_data) {
+    uint8_t out[128];
+    const char *json = "{\"ok\":true}";
+    uint32_t len = strlen(json);
+
+    ASSERT_EQ(OK, fs_touch(fs, "/tiny"));
+    file_handle *fh = file_open(fs, "/tiny", MY_O_RDWR);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_write(fh, (uint8_t*)json, len));
+    file_close(fh);
+
+    f_stat st;
+    ASSERT_EQ(OK, fs_stat(fs, "/tiny", &st));
+    inode ino;
+    ASSERT_EQ(OK, ino_read(fs, st.inode_num, &ino));
+    ASSERT_TRUE(ino_is_inline(&ino));
+    ASSERT_EQ(0u, st.blocks);
+
+    // Copy of an inline file is inline too
+    ASSERT_EQ(OK, fs_cp(fs, "/tiny", "/tiny_cp"));
+    fh = file_open(fs, "/tiny_cp", MY_O_RDWR);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_read(fh, out, sizeof(out)));
+    ASSERT_EQ(0, memcmp(json, out, len));
+
+    // Growing past the inode moves the content to a block
+    uint8_t tail[INO_INLINE_SIZE];
+    memset(tail, 'z', sizeof(tail));
+    ASSERT_EQ((uint32_t)sizeof(tail), file_write(fh, tail, sizeof(tail)));
+    ASSERT_FALSE(ino_is_inline(&fh->oi->cached_inode));
+    ASSERT_EQ(OK, file_seek(fh, 0, MY_SEEK_SET));
+    ASSERT_EQ(len + sizeof(tail), file_read(fh, out, sizeof(out)));
+    ASSERT_EQ(0, memcmp(json, out, len));
+    ASSERT_EQ(0, memcmp(tail, out + len, sizeof(tail)));
+    file_close(fh);
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/tiny"));
+    ASSERT_EQ(OK, fs_unlink(fs, "/tiny_cp"));
+}
+
+TEST_F(FSFixture, test_mount_version) {
+    uint8_t buf[BLOCK_SIZE];
+    ASSERT_EQ(OK, dread(dd, buf, 1));
+    superblock_data *super_data = (superblock_data *)buf;
+    ASSERT_EQ((uint32_t)FsVersion, super_data->version);
+
+    // An image from before the layout change reads 0 here and is refused
+    super_data->version = 0;
+    ASSERT_EQ(OK, dwrite(dd, buf, 1));
+    filesystem old_fs;
+    ASSERT_EQ(ErrArg, fs_mount(dd, &old_fs));
+
+    super_data->version = FsVersion;
+    ASSERT_EQ(OK, dwrite(dd, buf, 1));
+}
+
+TEST_F(FSFixture, test_fd_table_grows) {
+    const int n = 3 * FILE_TABLE_INIT_SLOTS;
+    int32_t fds[n];
+
+    ASSERT_EQ(OK, fs_touch(fs, "/fds"));
+    uint32_t before = file_table_count();
+    for (int i=0; i<n; i++) {
+        fds[i] = file_open_fd(fs, "/fds", MY_O_RDONLY);
+        ASSERT_GE(fds[i], 0);
+        file_handle *fh = file_from_fd(fds[i]);
+        ASSERT_NE(nullptr, fh);
+        ASSERT_EQ(fds[i], fh->fd);
+        file_put(fh);
+    }
+    ASSERT_EQ(before + n, file_table_count());
+
+    // A closed descriptor is handed out again
+    int32_t reused = fds[n/2];
+    ASSERT_EQ(OK, file_close_fd(reused));
+    ASSERT_EQ(nullptr, file_from_fd(reused));
+    ASSERT_EQ(reused, file_open_fd(fs, "/fds", MY_O_RDONLY));
+
+    for (int i=0; i<n; i++)
+        ASSERT_EQ(OK, file_close_fd(fds[i]));
+    ASSERT_EQ(before, file_table_count());
+    ASSERT_EQ(ErrArg, file_close_fd(fds[0]));
+
+    // A borrowed handle outlives a close of its descriptor
+    int32_t fd = file_open_fd(fs, "/fds", MY_O_RDONLY);
+    file_handle *held = file_from_fd(fd);
+    ASSERT_NE(nullptr, held);
+    ASSERT_EQ(OK, file_close_fd(fd));
+    ASSERT_EQ(nullptr, file_from_fd(fd));
+    ASSERT_EQ(0u, file_size(held));
+    file_put(held);
+    ASSERT_EQ(before, file_table_count());
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/fds"));
+}
+
+TEST_F(FSFixture, test_shared_open_inode) {
+    const uint32_t len = 2 * BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*)malloc(len);
+    uint8_t *out = (uint8_t*)malloc(len);
+    memset(buf, 'q', len);
+
+    ASSERT_EQ(OK, fs_touch(fs, "/shared"));
+    uint32_t before = file_open_inode_count();
+    file_handle *w = file_open(fs, "/shared", MY_O_WRONLY);
+    file_handle *r = file_open(fs, "/shared", MY_O_RDONLY);
+    ASSERT_NE(nullptr, w);
+    ASSERT_NE(nullptr, r);
+    ASSERT_EQ(w->oi, r->oi);
+    ASSERT_EQ(before + 1, file_open_inode_count());
+
+    // A write through one handle is visible through the other, offsets stay apart
+    ASSERT_EQ(len, file_write(w, buf, len));
+    ASSERT_EQ(len, file_size(r));
+    ASSERT_EQ(0u, file_tell(r));
+    ASSERT_EQ(len, file_read(r, out, len));
+    ASSERT_EQ(0, memcmp(buf, out, len));
+
+    file_close(w);
+    file_close(r);
+    ASSERT_EQ(before, file_open_inode_count());
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/shared"));
+    free(buf);
+    free(out);
+}
+
+TEST_F(FSFixture, test_read_error_unlocks) {
+    std::vector<uint8_t> buf(2 * BLOCK_SIZE, 'e');
+    ASSERT_EQ(OK, fs_touch(fs, "/rderr"));
+    file_handle *w = file_open(fs, "/rderr", MY_O_WRONLY);
+    ASSERT_NE(nullptr, w);
+    ASSERT_EQ(buf.size(), file_write(w, buf.data(), buf.size()));
+    file_close(w);
+
+    // The first read loads the shared block map, the second handle starts at 0
+    file_handle *r = file_open(fs, "/rderr", MY_O_RDONLY);
+    ASSERT_NE(nullptr, r);
+    ASSERT_EQ(1u, file_read(r, buf.data(), 1));
+    uint32_t physical = r->oi->block_map[0] & INO_BLOCK_MASK;
+    ASSERT_NE(0u, physical);
+    file_handle *r2 = file_open(fs, "/rderr", MY_O_RDONLY);
+    ASSERT_NE(nullptr, r2);
+
+    // Shrink the disk under the data block so dread fails
+    uint32_t blocks = fs->dd->blocks;
+    fs->dd->blocks = physical - 1;
+    uint32_t got = file_read(r2, buf.data(), buf.size());
+    fs->dd->blocks = blocks;
+    ASSERT_EQ(0u, got);
+
+    // The failed read left the shared lock free, other handles still write
+    ASSERT_EQ(0, pthread_rwlock_trywrlock(&r->oi->rwlock));
+    pthread_rwlock_unlock(&r->oi->rwlock);
+    file_close(r2);
+    file_close(r);
+    w = file_open(fs, "/rderr", MY_O_WRONLY);
+    ASSERT_NE(nullptr, w);
+    ASSERT_EQ(buf.size(), file_write(w, buf.data(), buf.size()));
+    file_close(w);
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/rderr"));
+}
+
+TEST_F(FSFixture, test_path_resolve) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/pr/a/b"));
+    ASSERT_EQ(OK, fs_touch(fs, "/pr/a/b/f"));
+
+    inode ino;
+    uint32_t f = path_resolve(fs, "/pr/a/b/f", &ino);
+    ASSERT_NE(0u, f);
+    ASSERT_EQ(FTypeFile, ino.file_type);
+    ASSERT_EQ(f, path_resolve(fs, "//pr/./a/../a/b//f", NULL));
+    ASSERT_EQ(0u, path_resolve(fs, "/pr/a/missing/f", NULL));
+
+    // Parent resolution hands back the last component without copying it
+    inode parent;
+    path_component last;
+    uint32_t b = path_resolve_parent(fs, "/pr/a/b/f", &parent, &last);
+    ASSERT_EQ(path_resolve(fs, "/pr/a/b", NULL), b);
+    ASSERT_EQ(1u, last.len);
+    ASSERT_EQ(0, strncmp("f", last.name, last.len));
+    ASSERT_EQ(f, dir_lookup_n(fs, &parent, last.name, last.len));
+    ASSERT_EQ(0u, path_resolve_parent(fs, "/pr/a/..", &parent, &last));
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/pr/a/b/f"));
+    ASSERT_EQ(0u, dir_lookup_n(fs, &parent, "f", 1));
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, "/pr/a/b/f"));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/pr"));
+}
+
+TEST_F(FSFixture, test_dirfd_at) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/at/a/b"));
+    int32_t dfd = file_open_fd(fs, "/at/a/b/", MY_O_RDONLY | MY_O_DIRECTORY);
+    ASSERT_GE(dfd, 0);
+
+    // Names are resolved from the open directory, not from root or cwd
+    const int n = 64;
+    char name[32];
+    for (int i=0; i<n; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        ASSERT_EQ(OK, fs_touch_at(fs, dfd, name));
+    }
+    f_stat st, st_abs;
+    ASSERT_EQ(OK, fs_stat_at(fs, dfd, "f7", &st));
+    ASSERT_EQ(OK, fs_stat(fs, "/at/a/b/f7", &st_abs));
+    ASSERT_EQ(st_abs.inode_num, st.inode_num);
+    ASSERT_EQ(OK, fs_stat_at(fs, dfd, "../b/./f7", &st));
+    ASSERT_EQ(st_abs.inode_num, st.inode_num);
+    ASSERT_EQ(OK, fs_stat_at(fs, dfd, "/at/a/b/f7", &st));
+
+    file_handle *fh = file_open_at(fs, dfd, "f7", MY_O_RDWR);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(st_abs.inode_num, fh->inode_number);
+    file_close(fh);
+
+    // Only directories open with MY_O_DIRECTORY, read only, and only those work as dirfd
+    ASSERT_EQ(-1, file_open_fd(fs, "/at/a/b/f7", MY_O_RDONLY | MY_O_DIRECTORY));
+    ASSERT_EQ(-1, file_open_fd(fs, "/at/a", MY_O_RDWR | MY_O_DIRECTORY));
+    int32_t ffd = file_open_fd(fs, "/at/a/b/f7", MY_O_RDONLY);
+    ASSERT_GE(ffd, 0);
+    ASSERT_EQ(ErrArg, fs_touch_at(fs, ffd, "x"));
+    ASSERT_EQ(OK, file_close_fd(ffd));
+
+    for (int i=0; i<n; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        ASSERT_EQ(OK, fs_unlink_at(fs, dfd, name));
+    }
+    ASSERT_EQ(ErrNotFound, fs_stat_at(fs, dfd, "f7", &st));
+    ASSERT_EQ(OK, file_close_fd(dfd));
+    ASSERT_EQ(ErrArg, fs_stat_at(fs, dfd, "f7", &st));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/at"));
+}
+
+struct cwd_worker_arg {
+    filesystem *fs;
+    char dir[16];
+    RC rc;
+};
+
+static void *cwd_worker(void *p) {
+    cwd_worker_arg *arg = (cwd_worker_arg*)p;
+    arg->rc = cwd_thread_chdir_path(arg->fs, arg->dir);
+    for (int i=0; i<8 && arg->rc == OK; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", i);
+        arg->rc = fs_touch(arg->fs, name);
+    }
+    return NULL;
+}
+
+TEST_F(FSFixture, test_thread_cwd) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/tc/d0"));
+    ASSERT_EQ(OK, fs_mkdir(fs, "/tc/d1"));
+    ASSERT_EQ(OK, fs_mkdir(fs, "/tc/d2"));
+    // The global cwd is left alone, this thread moves through its own cwd
+    ASSERT_EQ(OK, cwd_thread_chdir_path(fs, "/tc"));
+    uint32_t tc = path_resolve(fs, "/tc", NULL);
+    ASSERT_EQ(tc, cwd_get_inode());
+    ASSERT_EQ(OK, fs_touch(fs, "g"));
+    ASSERT_EQ(OK, fs_exists(fs, "/tc/g"));
+
+    // Each thread moves only itself, relative names land in its own directory
+    const int n = 3;
+    pthread_t tids[n];
+    cwd_worker_arg args[n];
+    for (int i=0; i<n; i++) {
+        args[i].fs = fs;
+        snprintf(args[i].dir, sizeof(args[i].dir), "/tc/d%d", i);
+        ASSERT_EQ(0, pthread_create(&tids[i], NULL, cwd_worker, &args[i]));
+    }
+    for (int i=0; i<n; i++) {
+        pthread_join(tids[i], NULL);
+        ASSERT_EQ(OK, args[i].rc);
+    }
+    ASSERT_EQ(OK, fs_exists(fs, "/tc/d2/f7"));
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, "/tc/f0"));
+    ASSERT_EQ(tc, cwd_get_inode());
+
+    ASSERT_EQ(OK, cwd_thread_chdir_path(fs, "d1"));
+    ASSERT_EQ(path_resolve(fs, "/tc/d1", NULL), cwd_get_inode());
+    ASSERT_EQ(OK, fs_exists(fs, "f3"));
+    ASSERT_NE(OK, cwd_thread_chdir_path(fs, "f3"));
+    ASSERT_EQ(OK, cwd_thread_chdir_path(fs, ".."));
+    ASSERT_EQ(tc, cwd_get_inode());
+
+    cwd_thread_reset();
+    ASSERT_EQ(__atomic_load_n(&g_cwd.cwd_inode_num, __ATOMIC_ACQUIRE), cwd_get_inode());
+    ASSERT_EQ(OK, fs_rmdir(fs, "/tc"));
+}
+
+TEST_F(FSFixture, test_dir_iter_batch) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/it/sub"));
+    int32_t dfd = file_open_fd(fs, "/it", MY_O_RDONLY | MY_O_DIRECTORY);
+    ASSERT_GE(dfd, 0);
+    const int n = 100;
+    char name[32];
+    for (int i=0; i<n; i++) {
+        snprintf(name, sizeof(name), "e%d", i);
+        ASSERT_EQ(OK, fs_touch_at(fs, dfd, name));
+    }
+    // Leave holes in the directory blocks
+    for (int i=0; i<n; i+=10) {
+        snprintf(name, sizeof(name), "e%d", i);
+        ASSERT_EQ(OK, fs_unlink_at(fs, dfd, name));
+    }
+    file_handle *fh = file_open(fs, "/it/e5", MY_O_WRONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(5u, file_write(fh, (uint8_t*)"hello", 5));
+    file_close(fh);
+
+    inode dir;
+    ASSERT_NE(0u, path_resolve(fs, "/it", &dir));
+    dir_iter *it = dir_open(fs, &dir);
+    ASSERT_NE(nullptr, it);
+
+    std::vector<int> seen(n, 0);
+    int total = 0, dirs = 0;
+    dir_entry_info batch[7];
+    uint32_t count;
+    while (dir_next_batch(it, batch, 7, &count) == OK && count > 0) {
+        ASSERT_LE(count, 7u);
+        for (uint32_t i=0; i<count; i++) {
+            total++;
+            if (batch[i].type == FTypeDirectory) {
+                dirs++;
+                continue;
+            }
+            int k = atoi(batch[i].name + 1);
+            ASSERT_EQ(FTypeFile, batch[i].type);
+            ASSERT_EQ(k == 5 ? 5u : 0u, batch[i].size);
+            seen[k]++;
+        }
+    }
+    ASSERT_EQ(OK, dir_close(it));
+
+    ASSERT_EQ(3, dirs); // ".", ".." and "sub"
+    ASSERT_EQ(3 + n - n/10, total);
+    for (int i=0; i<n; i++)
+        ASSERT_EQ(i % 10 ? 1 : 0, seen[i]);
+
+    ASSERT_EQ(OK, file_close_fd(dfd));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/it"));
+}
+
+TEST_F(FSFixture, test_rename) {
+    const uint32_t len = 3 * BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*)malloc(len);
+    uint8_t *out = (uint8_t*)malloc(len);
+    memset(buf, 'r', len);
+
+    ASSERT_EQ(OK, fs_mkdir(fs, "/rn/src"));
+    ASSERT_EQ(OK, fs_mkdir(fs, "/rn/dst"));
+    ASSERT_EQ(OK, fs_touch(fs, "/rn/src/f"));
+    file_handle *fh = file_open(fs, "/rn/src/f", MY_O_WRONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_write(fh, buf, len));
+    file_close(fh);
+
+    // Same inode and blocks under the new name, nothing is allocated
+    f_stat before, after;
+    ASSERT_EQ(OK, fs_stat(fs, "/rn/src/f", &before));
+    ASSERT_EQ(OK, fs_rename(fs, "/rn/src/f", "/rn/dst/g"));
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, "/rn/src/f"));
+    ASSERT_EQ(OK, fs_stat(fs, "/rn/dst/g", &after));
+    ASSERT_EQ(before.inode_num, after.inode_num);
+    ASSERT_EQ(before.blocks, after.blocks);
+
+    // Replace an existing file in the same directory
+    ASSERT_EQ(OK, fs_touch(fs, "/rn/dst/h"));
+    ASSERT_EQ(OK, fs_rename(fs, "/rn/dst/g", "/rn/dst/h"));
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, "/rn/dst/g"));
+    fh = file_open(fs, "/rn/dst/h", MY_O_RDONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_read(fh, out, len));
+    ASSERT_EQ(0, memcmp(buf, out, len));
+    file_close(fh);
+
+    // Moving a directory updates its "..", and it can not move below itself
+    ASSERT_EQ(OK, fs_rename(fs, "/rn/src", "/rn/dst/moved"));
+    f_stat dst;
+    ASSERT_EQ(OK, fs_stat(fs, "/rn/dst", &dst));
+    ASSERT_EQ(OK, fs_stat(fs, "/rn/dst/moved/..", &after));
+    ASSERT_EQ(dst.inode_num, after.inode_num);
+    ASSERT_EQ(ErrArg, fs_rename(fs, "/rn/dst", "/rn/dst/moved/x"));
+    ASSERT_EQ(ErrDirentExists, fs_rename(fs, "/rn/dst/h", "/rn/dst/moved"));
+    ASSERT_EQ(ErrNotFound, fs_rename(fs, "/rn/nope", "/rn/x"));
+
+    ASSERT_EQ(OK, fs_rmdir(fs, "/rn"));
+    free(buf);
+    free(out);
+}
+
+TEST_F(FSFixture, test_hard_link) {
+    const uint32_t len = 2 * BLOCK_SIZE;
+    uint8_t *buf = (uint8_t*)malloc(len);
+    uint8_t *out = (uint8_t*)malloc(len);
+    memset(buf, 'l', len);
+
+    ASSERT_EQ(OK, fs_mkdir(fs, "/ln/d"));
+    ASSERT_EQ(OK, fs_touch(fs, "/ln/a"));
+    file_handle *fh = file_open(fs, "/ln/a", MY_O_WRONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_write(fh, buf, len));
+
+    f_stat sa, sb;
+    ASSERT_EQ(OK, fs_link(fs, "/ln/a", "/ln/d/b"));
+    ASSERT_EQ(OK, fs_stat(fs, "/ln/a", &sa));
+    ASSERT_EQ(OK, fs_stat(fs, "/ln/d/b", &sb));
+    ASSERT_EQ(sa.inode_num, sb.inode_num);
+    ASSERT_EQ(2u, sb.nlink);
+
+    // A write through a handle opened before the link keeps the count
+    ASSERT_EQ(OK, file_seek(fh, 0, MY_SEEK_SET));
+    ASSERT_EQ(len, file_write(fh, buf, len));
+    file_close(fh);
+    ASSERT_EQ(OK, fs_stat(fs, "/ln/a", &sa));
+    ASSERT_EQ(2u, sa.nlink);
+
+    ASSERT_EQ(ErrDirentExists, fs_link(fs, "/ln/a", "/ln/d/b"));
+    ASSERT_EQ(ErrArg, fs_link(fs, "/ln/d", "/ln/dd"));
+    ASSERT_EQ(OK, fs_stat(fs, "/ln/a", &sa));
+    ASSERT_EQ(2u, sa.nlink);
+
+    // Dropping one name leaves the data reachable through the other
+    ASSERT_EQ(OK, fs_unlink(fs, "/ln/a"));
+    ASSERT_EQ(OK, fs_stat(fs, "/ln/d/b", &sb));
+    ASSERT_EQ(1u, sb.nlink);
+    fh = file_open(fs, "/ln/d/b", MY_O_RDONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_read(fh, out, len));
+    ASSERT_EQ(0, memcmp(buf, out, len));
+    file_close(fh);
+
+    // rmdir drops a name too
+    ASSERT_EQ(OK, fs_link(fs, "/ln/d/b", "/ln/c"));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/ln/d"));
+    ASSERT_EQ(OK, fs_stat(fs, "/ln/c", &sb));
+    ASSERT_EQ(1u, sb.nlink);
+    ASSERT_EQ(sa.inode_num, sb.inode_num);
+
+    ASSERT_EQ(OK, fs_rmdir(fs, "/ln"));
+    free(buf);
+    free(out);
+}
+
+static uint32_t used_bits(bitmap *bm, uint32_t n) {
+    uint32_t used = 0;
+    for (uint32_t i=0; i<n; i++)
+        used += bm_getbit(bm, i);
+    return used;
+}
+
+static void pool_count_task(void *arg) {
+    __atomic_add_fetch((uint32_t*)arg, 1, __ATOMIC_RELAXED);
+}
+
+TEST_F(FSFixture, test_rmdir_parallel) {
+    // Pool runs every task exactly once
+    uint32_t ran = 0;
+    pool *p = pool_create(4);
+    ASSERT_NE(nullptr, p);
+    for (int i=0; i<1000; i++)
+        ASSERT_EQ(OK, pool_submit(p, pool_count_task, &ran));
+    pool_wait(p);
+    ASSERT_EQ(1000u, ran);
+    pool_destroy(p);
+
+    uint32_t blocks_before = used_bits(fs->block_bitmap, fs->blocks);
+    uint32_t inodes_before = used_bits(fs->inode_bitmap, fs->inodes);
+
+    uint8_t buf[3 * BLOCK_SIZE];
+    memset(buf, 'p', sizeof(buf));
+    char path[64];
+    ASSERT_EQ(OK, fs_mkdir(fs, "/pt"));
+    ASSERT_EQ(OK, fs_touch(fs, "/keep"));
+    for (int d=0; d<6; d++) {
+        snprintf(path, sizeof(path), "/pt/d%d/s", d);
+        ASSERT_EQ(OK, fs_mkdir(fs, path));
+        for (int f=0; f<20; f++) {
+            snprintf(path, sizeof(path), "/pt/d%d/%s/f%d", d, f % 2 ? "s" : ".", f);
+            ASSERT_EQ(OK, fs_touch(fs, path));
+            if (f % 5 == 0) {
+                file_handle *fh = file_open(fs, path, MY_O_WRONLY);
+                ASSERT_NE(nullptr, fh);
+                ASSERT_EQ(sizeof(buf), file_write(fh, buf, sizeof(buf)));
+                file_close(fh);
+            }
+        }
+    }
+    // A second name outside the tree keeps that file alive
+    ASSERT_EQ(OK, fs_link(fs, "/pt/d0/f0", "/keep0"));
+
+    ASSERT_EQ(OK, fs_rmdir_parallel(fs, "/pt", 4));
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, "/pt"));
+
+    f_stat st;
+    ASSERT_EQ(OK, fs_stat(fs, "/keep0", &st));
+    ASSERT_EQ(1u, st.nlink);
+    file_handle *fh = file_open(fs, "/keep0", MY_O_RDONLY);
+    ASSERT_NE(nullptr, fh);
+    uint8_t out[sizeof(buf)];
+    ASSERT_EQ(sizeof(buf), file_read(fh, out, sizeof(out)));
+    ASSERT_EQ(0, memcmp(buf, out, sizeof(buf)));
+    file_close(fh);
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/keep0"));
+    ASSERT_EQ(OK, fs_unlink(fs, "/keep"));
+    ASSERT_EQ(blocks_before, used_bits(fs->block_bitmap, fs->blocks));
+    ASSERT_EQ(inodes_before, used_bits(fs->inode_bitmap, fs->inodes));
+}
+
+struct walk_result {
+    std::mutex lock;
+    std::set<std::string> paths;
+    uint32_t calls = 0;
+    int stop_after = 0;
+};
+
+static int walk_collect(const char *path, const f_stat *st, void *arg) {
+    walk_result *r = (walk_result *)arg;
+    std::lock_guard<std::mutex> guard(r->lock);
+    r->paths.insert(path);
+    r->calls++;
+    return r->stop_after && (int)r->calls >= r->stop_after;
+}
+
+TEST_F(FSFixture, test_walk) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/w/a/b"));
+    ASSERT_EQ(OK, fs_mkdir(fs, "/w/c"));
+    const char *files[] = {"/w/a/x.log", "/w/a/b/y.log", "/w/a/b/empty.log", "/w/c/z.txt"};
+    for (const char *f : files)
+        ASSERT_EQ(OK, fs_touch(fs, f));
+    uint8_t buf[5000];
+    memset(buf, 'w', sizeof(buf));
+    file_handle *fh = file_open(fs, "/w/a/x.log", MY_O_WRONLY);
+    ASSERT_EQ(100u, file_write(fh, buf, 100));
+    file_close(fh);
+    fh = file_open(fs, "/w/a/b/y.log", MY_O_WRONLY);
+    ASSERT_EQ(sizeof(buf), file_write(fh, buf, sizeof(buf)));
+    file_close(fh);
+
+    // Entries carry their type, no inode read needed to tell them apart
+    inode w;
+    ASSERT_NE(0u, path_resolve(fs, "/w/a", &w));
+    dir_iter *it = dir_open(fs, &w);
+    ASSERT_NE(nullptr, it);
+    dir_entry_info entries[DIR_BATCH_ENTRIES];
+    uint32_t count;
+    ASSERT_EQ(OK, dir_next_names(it, entries, DIR_BATCH_ENTRIES, &count));
+    ASSERT_EQ(4u, count);
+    for (uint32_t i=0; i<count; i++)
+        ASSERT_EQ(strcmp(entries[i].name, "x.log") == 0 ? FTypeFile : FTypeDirectory,
+                  entries[i].type);
+    dir_close(it);
+
+    walk_result all;
+    ASSERT_EQ(OK, fs_walk(fs, "/w", NULL, 4, walk_collect, &all));
+    ASSERT_EQ(7u, all.calls);
+    ASSERT_EQ(1u, all.paths.count("/w/a/b/empty.log"));
+    ASSERT_EQ(1u, all.paths.count("/w/a/b"));
+
+    walk_filter logs = {"*.log", WALK_TYPE_FILE, 1, 0};
+    walk_result found;
+    ASSERT_EQ(OK, fs_walk(fs, "/w/", &logs, 4, walk_collect, &found));
+    ASSERT_EQ((std::set<std::string>{"/w/a/x.log", "/w/a/b/y.log"}), found.paths);
+
+    walk_filter small = {"*.log", WALK_TYPE_FILE, 1, 1000};
+    walk_result one;
+    ASSERT_EQ(OK, fs_walk(fs, "/w", &small, 2, walk_collect, &one));
+    ASSERT_EQ((std::set<std::string>{"/w/a/x.log"}), one.paths);
+
+    walk_filter dirs = {NULL, WALK_TYPE_DIR, 0, 0};
+    walk_result d;
+    ASSERT_EQ(OK, fs_walk(fs, "/w", &dirs, 3, walk_collect, &d));
+    ASSERT_EQ((std::set<std::string>{"/w/a", "/w/a/b", "/w/c"}), d.paths);
+
+    // The callback stops the walk
+    walk_result stopped;
+    stopped.stop_after = 1;
+    ASSERT_EQ(OK, fs_walk(fs, "/w", NULL, 1, walk_collect, &stopped));
+    ASSERT_EQ(1u, stopped.calls);
+
+    ASSERT_EQ(ErrPath, fs_walk(fs, "/w/c/z.txt", NULL, 1, walk_collect, &all));
+    ASSERT_EQ(OK, fs_rmdir_parallel(fs, "/w", 2));
+}
+
+static void fill_file(filesystem *fs, const char *path, uint32_t len, uint8_t seed) {
+    std::vector<uint8_t> buf(len);
+    for (uint32_t i=0; i<len; i++)
+        buf[i] = (uint8_t)(seed + i);
+    ASSERT_EQ(OK, fs_touch(fs, path));
+    file_handle *fh = file_open(fs, path, MY_O_WRONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_write(fh, buf.data(), len));
+    file_close(fh);
+}
+
+static void check_file(filesystem *fs, const char *path, uint32_t len, uint8_t seed) {
+    std::vector<uint8_t> buf(len + 1);
+    file_handle *fh = file_open(fs, path, MY_O_RDONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(len, file_size(fh));
+    ASSERT_EQ(len, file_read(fh, buf.data(), len));
+    file_close(fh);
+    for (uint32_t i=0; i<len; i++)
+        ASSERT_EQ((uint8_t)(seed + i), buf[i]) << path << " at " << i;
+}
+
+TEST_F(FSFixture, test_cp_tree) {
+    char path[64];
+    uint64_t bytes = 0;
+    for (int d=0; d<4; d++) {
+        snprintf(path, sizeof(path), "/ct/d%d/s", d);
+        ASSERT_EQ(OK, fs_mkdir(fs, path));
+        for (int f=0; f<6; f++) {
+            uint32_t len = f * 3000 + 10 * d; // Empty, inline and block backed files
+            snprintf(path, sizeof(path), "/ct/d%d/%sf%d", d, f % 2 ? "s/" : "", f);
+            fill_file(fs, path, len, (uint8_t)(d * 16 + f));
+            bytes += len;
+        }
+    }
+
+    cp_progress prog;
+    ASSERT_EQ(OK, fs_cp_tree(fs, "/ct", "/ct2", 4, &prog));
+    ASSERT_EQ(9u, prog.dirs);
+    ASSERT_EQ(24u, prog.files);
+    ASSERT_EQ(bytes, prog.bytes);
+    for (int d=0; d<4; d++) {
+        for (int f=0; f<6; f++) {
+            snprintf(path, sizeof(path), "/ct2/d%d/%sf%d", d, f % 2 ? "s/" : "", f);
+            check_file(fs, path, f * 3000 + 10 * d, (uint8_t)(d * 16 + f));
+        }
+    }
+
+    // Same shape on both sides
+    walk_result src, dst;
+    ASSERT_EQ(OK, fs_walk(fs, "/ct", NULL, 2, walk_collect, &src));
+    ASSERT_EQ(OK, fs_walk(fs, "/ct2", NULL, 2, walk_collect, &dst));
+    std::set<std::string> moved;
+    for (const std::string &p : dst.paths)
+        moved.insert("/ct" + p.substr(4));
+    ASSERT_EQ(src.paths, moved);
+
+    // The copies are independent
+    fill_file(fs, "/ct2/d0/f2x", 10, 1);
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, "/ct/d0/f2x"));
+
+    // fs_cp recurses, a copy into the source tree does not copy itself
+    ASSERT_EQ(OK, fs_cp(fs, "/ct/d1", "/ct/d1/s/again"));
+    check_file(fs, "/ct/d1/s/again/s/f3", 3 * 3000 + 10, 16 + 3);
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, "/ct/d1/s/again/s/again"));
+
+    ASSERT_NE(OK, fs_cp_tree(fs, "/ct", "/ct2", 2, NULL)); // Destination exists
+    ASSERT_EQ(OK, fs_rmdir(fs, "/ct"));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/ct2"));
+}
+
+static std::vector<aio_cqe> aio_run_all(aio_ring *r, const std::vector<aio_sqe> &sqes) {
+    std::vector<aio_cqe> done(sqes.size());
+    uint32_t sent = 0, got = 0;
+    while (got < sqes.size()) {
+        uint32_t n = 0;
+        if (sent < sqes.size()) {
+            EXPECT_EQ(OK, aio_submit(r, &sqes[sent], sqes.size() - sent, &n));
+        }
+        sent += n;
+        got += aio_reap(r, &done[got], sqes.size() - got, 1);
+    }
+    return done;
+}
+
+TEST_F(FSFixture, test_aio) {
+    const uint32_t files = 40;
+    aio_ring *r = aio_create(fs, 4, 16);
+    ASSERT_NE(nullptr, r);
+
+    // More requests than the ring holds, submit takes what fits
+    std::vector<std::string> names;
+    for (uint32_t i=0; i<files; i++)
+        names.push_back("/aio_f" + std::to_string(i));
+    std::vector<aio_sqe> sqes(files);
+    for (uint32_t i=0; i<files; i++)
+        sqes[i] = aio_sqe{AioTouch, i, names[i].c_str()};
+    uint32_t n;
+    ASSERT_EQ(OK, aio_submit(r, sqes.data(), files, &n));
+    ASSERT_EQ(16u, n);
+    aio_cqe first[16];
+    ASSERT_EQ(16u, aio_reap(r, first, 16, 16));
+    std::vector<aio_sqe> rest(sqes.begin() + 16, sqes.end());
+    std::vector<aio_cqe> done = aio_run_all(r, rest);
+    std::set<uint64_t> seen;
+    for (const aio_cqe &c : first) { ASSERT_EQ(OK, c.rc); seen.insert(c.user_data); }
+    for (const aio_cqe &c : done) { ASSERT_EQ(OK, c.rc); seen.insert(c.user_data); }
+    ASSERT_EQ(files, seen.size());
+
+    // Open, write, close, then read back through the ring
+    uint8_t data[files][100];
+    for (uint32_t i=0; i<files; i++) {
+        sqes[i] = aio_sqe{AioOpen, i, names[i].c_str()};
+        sqes[i].flags = MY_O_RDWR;
+        memset(data[i], 'a' + i % 26, sizeof(data[i]));
+    }
+    done = aio_run_all(r, sqes);
+    std::vector<int32_t> fds(files);
+    for (const aio_cqe &c : done) {
+        ASSERT_EQ(OK, c.rc);
+        fds[c.user_data] = c.res;
+    }
+    for (uint32_t i=0; i<files; i++) {
+        sqes[i] = aio_sqe{AioWrite, i};
+        sqes[i].fd = fds[i];
+        sqes[i].buf = data[i];
+        sqes[i].len = sizeof(data[i]);
+    }
+    for (const aio_cqe &c : aio_run_all(r, sqes))
+        ASSERT_EQ((int32_t)sizeof(data[0]), c.res);
+    for (uint32_t i=0; i<files; i++) {
+        file_handle *fh = file_from_fd(fds[i]);
+        ASSERT_EQ(OK, file_seek(fh, 0, MY_SEEK_SET));
+        file_put(fh);
+    }
+    uint8_t back[files][100];
+    for (uint32_t i=0; i<files; i++)
+        sqes[i].op = AioRead, sqes[i].buf = back[i];
+    for (const aio_cqe &c : aio_run_all(r, sqes))
+        ASSERT_EQ((int32_t)sizeof(back[0]), c.res);
+    ASSERT_EQ(0, memcmp(data, back, sizeof(data)));
+    for (uint32_t i=0; i<files; i++)
+        sqes[i].op = AioClose;
+    for (const aio_cqe &c : aio_run_all(r, sqes))
+        ASSERT_EQ(OK, c.rc);
+
+    // The event fd turns readable on completion and clears once reaped
+    f_stat st;
+    aio_sqe stat = {AioStat, 7, names[3].c_str()};
+    stat.st = &st;
+    ASSERT_EQ(OK, aio_submit(r, &stat, 1, &n));
+    struct pollfd pfd = {aio_event_fd(r), POLLIN, 0};
+    ASSERT_EQ(1, poll(&pfd, 1, 5000));
+    aio_cqe c;
+    ASSERT_EQ(1u, aio_reap(r, &c, 1, 1));
+    ASSERT_EQ(7u, c.user_data);
+    ASSERT_EQ(OK, c.rc);
+    ASSERT_EQ(100u, st.size);
+    ASSERT_EQ(0, poll(&pfd, 1, 0));
+    ASSERT_EQ(0u, aio_reap(r, &c, 1, 1)); // Nothing in flight, no wait
+
+    // Failures come back in the completion
+    aio_sqe bad[2] = {{AioOpen, 1, "/no/such/file"}, {AioMkdir, 2, "/aio_dir"}};
+    bad[0].flags = MY_O_RDONLY;
+    done = aio_run_all(r, std::vector<aio_sqe>(bad, bad + 2));
+    for (const aio_cqe &d : done)
+        ASSERT_EQ(d.user_data == 1 ? ErrPath : OK, d.rc);
+    ASSERT_EQ(OK, fs_exists(fs, "/aio_dir"));
+
+    for (uint32_t i=0; i<files; i++)
+        sqes[i] = aio_sqe{AioUnlink, i, names[i].c_str()};
+    for (const aio_cqe &d : aio_run_all(r, sqes))
+        ASSERT_EQ(OK, d.rc);
+    ASSERT_EQ(ErrNotFound, fs_exists(fs, names[0].c_str()));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/aio_dir"));
+    aio_destroy(r);
+}
+
+static fs_coro::task<int32_t> coro_copy(fs_coro::executor &ex, std::string src, std::string dst) {
+    f_stat st;
+    fs_coro::io_result r = co_await ex.stat(src.c_str(), &st);
+    if (!r.ok())
+        co_return -1;
+    co_await ex.touch(dst.c_str());
+    fs_coro::io_result in = co_await ex.open(src.c_str(), MY_O_RDONLY);
+    fs_coro::io_result out = co_await ex.open(dst.c_str(), MY_O_WRONLY);
+    std::vector<uint8_t> buf(st.size);
+    fs_coro::io_result n = co_await ex.read(in.res, buf.data(), st.size);
+    fs_coro::io_result w = co_await ex.write(out.res, buf.data(), n.res);
+    co_await ex.close(in.res);
+    co_await ex.close(out.res);
+    co_return w.res;
+}
+
+static fs_coro::task<> coro_copy_into(fs_coro::executor &ex, int i, int32_t *result) {
+    *result = co_await coro_copy(ex, "/co_src" + std::to_string(i), "/co_dst" + std::to_string(i));
+}
+
+static fs_coro::task<uint32_t> coro_lookup(fs_coro::executor &ex, inode *dir, const char *name) {
+    co_return co_await ex.lookup(dir, name);
+}
+
+static fs_coro::task<int> coro_throw(fs_coro::executor &ex) {
+    co_return co_await ex.call([]() -> int { throw std::runtime_error("worker"); });
+}
+
+TEST_F(FSFixture, test_coro) {
+    const int n = 50;
+    for (int i=0; i<n; i++) {
+        std::string src = "/co_src" + std::to_string(i);
+        fill_file(fs, src.c_str(), 100 + 97 * i, (uint8_t)i);
+    }
+
+    // Every handler is a coroutine on one thread, the calls run on the workers
+    fs_coro::executor ex(fs, 4, 16);
+    std::vector<int32_t> results(n, -2);
+    for (int i=0; i<n; i++)
+        ex.spawn(coro_copy_into(ex, i, &results[i]));
+    ex.run();
+    for (int i=0; i<n; i++) {
+        ASSERT_EQ(100 + 97 * i, results[i]);
+        std::string dst = "/co_dst" + std::to_string(i);
+        check_file(fs, dst.c_str(), 100 + 97 * i, (uint8_t)i);
+    }
+
+    ASSERT_EQ(-1, ex.block_on(coro_copy(ex, "/co_missing", "/co_x")));
+
+    inode root;
+    ASSERT_EQ(OK, ino_read(fs, 1, &root));
+    uint32_t expect = path_resolve(fs, "/co_src3", NULL);
+    ASSERT_NE(0u, expect);
+    ASSERT_EQ(expect, ex.block_on(coro_lookup(ex, &root, "co_src3")));
+    ASSERT_EQ(0u, ex.block_on(coro_lookup(ex, &root, "co_none")));
+
+    ASSERT_THROW(ex.block_on(coro_throw(ex)), std::runtime_error);
+
+    for (int i=0; i<n; i++) {
+        ASSERT_EQ(OK, fs_unlink(fs, ("/co_src" + std::to_string(i)).c_str()));
+        ASSERT_EQ(OK, fs_unlink(fs, ("/co_dst" + std::to_string(i)).c_str()));
+    }
+}
+
+static void rpc_count_entry(const dir_entry_info *entry, void *arg) {
+    std::set<std::string> *names = (std::set<std::string> *)arg;
+    names->insert(entry->name);
+}
+
+TEST_F(FSFixture, test_rpc) {
+    const char *sock = "/tmp/simplefs_test.sock";
+    ASSERT_EQ(nullptr, rpc_connect(sock));
+
+    rpc_server *srv = rpc_server_start(fs, sock);
+    ASSERT_NE(nullptr, srv);
+    rpc_client *c = rpc_connect(sock);
+    ASSERT_NE(nullptr, c);
+    // A second daemon on the same socket backs off instead of taking it over
+    ASSERT_EQ(nullptr, rpc_server_start(fs, sock));
+
+    ASSERT_EQ(OK, rpc_mkdir(c, "/rpc/sub"));
+    ASSERT_EQ(OK, rpc_touch(c, "/rpc/f"));
+    ASSERT_NE(OK, rpc_touch(c, "/rpc/f"));
+
+    // Bigger than one chunk, so it goes out as several pipelined writes
+    std::vector<uint8_t> data(3 * RPC_IO_CHUNK + 123);
+    for (size_t i=0; i<data.size(); i++)
+        data[i] = (uint8_t)(i * 7);
+    uint32_t bytes = 0;
+    ASSERT_EQ(OK, rpc_write(c, "/rpc/f", 0, data.data(), (uint32_t)data.size(), &bytes));
+    ASSERT_EQ(data.size(), bytes);
+    ASSERT_EQ(OK, rpc_write(c, "/rpc/f", RPC_APPEND, data.data(), 10, &bytes));
+    ASSERT_EQ(10u, bytes);
+
+    f_stat st;
+    ASSERT_EQ(OK, rpc_stat(c, "/rpc/f", &st));
+    ASSERT_EQ(data.size() + 10, st.size);
+    ASSERT_NE(OK, rpc_stat(c, "/rpc/none", &st));
+
+    std::vector<uint8_t> back(data.size() + 100);
+    ASSERT_EQ(OK, rpc_read(c, "/rpc/f", 0, back.data(), (uint32_t)back.size(), &bytes));
+    ASSERT_EQ(data.size() + 10, bytes);
+    ASSERT_EQ(0, memcmp(data.data(), back.data(), data.size()));
+    ASSERT_EQ(0, memcmp(data.data(), back.data() + data.size(), 10));
+
+    // Many requests before the first response, answered in order
+    const uint32_t n = 200;
+    for (uint32_t i=0; i<n; i++) {
+        rpc_req req;
+        memset(&req, 0, sizeof(req));
+        req.op = RpcStat;
+        req.path = i % 2 ? "/rpc/f" : "/rpc/none";
+        req.id = 1000 + i;
+        ASSERT_EQ(OK, rpc_send(c, &req));
+    }
+    for (uint32_t i=0; i<n; i++) {
+        rpc_resp resp;
+        ASSERT_EQ(OK, rpc_recv(c, &resp, (uint8_t *)&st, sizeof(st)));
+        ASSERT_EQ(1000 + i, resp.id);
+        ASSERT_EQ(i % 2 == 1, resp.rc == OK);
+    }
+
+    // A second client sees the first one's changes, the server serves both
+    rpc_client *c2 = rpc_connect(sock);
+    ASSERT_NE(nullptr, c2);
+    ASSERT_EQ(OK, rpc_link(c2, "/rpc/f", "/rpc/g"));
+    ASSERT_EQ(OK, rpc_rename(c, "/rpc/g", "/rpc/h"));
+    std::set<std::string> names;
+    ASSERT_EQ(OK, rpc_ls(c2, "/rpc", rpc_count_entry, &names));
+    ASSERT_EQ((std::set<std::string>{".", "..", "sub", "f", "h"}), names);
+    rpc_close(c2);
+
+    ASSERT_EQ(OK, rpc_cp(c, "/rpc", "/rpc_copy", 2));
+    ASSERT_EQ(OK, fs_stat(fs, "/rpc_copy/h", &st));
+    ASSERT_EQ(data.size() + 10, st.size);
+    ASSERT_EQ(OK, rpc_rmdir(c, "/rpc_copy", 0));
+    ASSERT_EQ(OK, rpc_rmdir(c, "/rpc", 2));
+    ASSERT_NE(OK, fs_exists(fs, "/rpc"));
+
+    rpc_close(c);
+    rpc_server_stop(srv);
+    ASSERT_NE(0, access(sock, F_OK));
+}
+
+TEST_F(FSFixture, test_batch_ops) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/batch"));
+    ASSERT_EQ(OK, fs_touch(fs, "/batch/pre"));
+
+    // More names than one directory block holds, plus a taken, a repeated and a bad name
+    const uint32_t n = 300;
+    std::vector<std::string> owned;
+    for (uint32_t i=0; i<n; i++)
+        owned.push_back("f" + std::to_string(i));
+    owned.push_back("pre");
+    owned.push_back("f7");
+    owned.push_back("bad/name");
+    std::vector<const char *> names;
+    for (auto &s : owned)
+        names.push_back(s.c_str());
+    uint32_t total = (uint32_t)names.size();
+
+    std::vector<RC> results(total);
+    ASSERT_EQ(ErrDirentExists, fs_batch_create(fs, "/batch", names.data(), total, results.data()));
+    for (uint32_t i=0; i<n; i++)
+        ASSERT_EQ(OK, results[i]);
+    ASSERT_EQ(ErrDirentExists, results[n]);
+    ASSERT_EQ(ErrDirentExists, results[n+1]);
+    ASSERT_EQ(ErrName, results[n+2]);
+
+    std::vector<f_stat> st(total);
+    ASSERT_EQ(ErrNotFound, fs_batch_stat(fs, "/batch", names.data(), total, st.data(), results.data()));
+    for (uint32_t i=0; i<n; i++) {
+        ASSERT_EQ(OK, results[i]);
+        ASSERT_EQ(FTypeFile, st[i].type);
+        ASSERT_EQ(0u, st[i].size);
+        ASSERT_EQ(1u, st[i].nlink);
+        if (i > 0) { // Taken from one run of the bitmap
+            ASSERT_EQ(st[i-1].inode_num + 1, st[i].inode_num);
+        }
+        f_stat one;
+        ASSERT_EQ(OK, fs_stat(fs, ("/batch/" + owned[i]).c_str(), &one));
+        ASSERT_EQ(st[i].inode_num, one.inode_num);
+    }
+    ASSERT_EQ(OK, results[n]); // "pre" was already there
+    ASSERT_EQ(ErrNotFound, results[n+2]);
+
+    // A second name keeps f3 alive through the batch unlink
+    ASSERT_EQ(OK, fs_link(fs, "/batch/f3", "/batch_f3"));
+    const char *extra[] = { "f1", "missing", "f1" };
+    ASSERT_EQ(ErrNotFound, fs_batch_unlink(fs, "/batch", extra, 3, results.data()));
+    ASSERT_EQ(OK, results[0]);
+    ASSERT_EQ(ErrNotFound, results[1]);
+    ASSERT_EQ(ErrNotFound, results[2]);
+    ASSERT_EQ(OK, fs_batch_unlink(fs, "/batch", names.data() + 2, n - 2, NULL));
+    ASSERT_EQ(OK, fs_unlink(fs, "/batch/f0"));
+    ASSERT_EQ(OK, fs_unlink(fs, "/batch/pre"));
+    ASSERT_NE(OK, fs_exists(fs, "/batch/f3"));
+
+    f_stat kept;
+    ASSERT_EQ(OK, fs_stat(fs, "/batch_f3", &kept));
+    ASSERT_EQ(st[3].inode_num, kept.inode_num);
+    ASSERT_EQ(1u, kept.nlink);
+    ASSERT_EQ(OK, fs_unlink(fs, "/batch_f3"));
+
+    // An entry written before types were recorded is still refused when it names a directory
+    ASSERT_EQ(OK, fs_mkdir(fs, "/batch/legacy"));
+    inode dir;
+    ASSERT_NE(0u, path_resolve(fs, "/batch", &dir));
+    std::vector<uint32_t> map(ino_get_max_block_offset(fs));
+    ASSERT_EQ(OK, ino_get_block_map(fs, &dir, map.data()));
+    std::vector<uint8_t> block(BLOCK_SIZE);
+    uint32_t stripped = 0;
+    for (uint32_t i=0; i<map.size() && !stripped; i++) {
+        uint32_t block_number = map[i] & INO_BLOCK_MASK;
+        if (block_number == 0)
+            continue;
+        ASSERT_EQ(OK, dread(dd, block.data(), block_number));
+        dirent *list = (dirent *)block.data();
+        for (uint32_t j=0; j<get_dirent_per_block(fs) && !stripped; j++) {
+            if (strcmp((const char *)list[j].name, "legacy") == 0) {
+                list[j].inode_num &= DIRENT_INO_MASK;
+                ASSERT_EQ(OK, dwrite(dd, block.data(), block_number));
+                stripped = 1;
+            }
+        }
+    }
+    ASSERT_EQ(1u, stripped);
+    const char *legacy[] = { "legacy" };
+    ASSERT_EQ(ErrArg, fs_batch_unlink(fs, "/batch", legacy, 1, results.data()));
+    ASSERT_EQ(ErrArg, results[0]);
+    ASSERT_EQ(OK, fs_exists(fs, "/batch/legacy"));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/batch/legacy"));
+
+    ASSERT_NE(0u, path_resolve(fs, "/batch", &dir));
+    ASSERT_TRUE(dir_is_empty(fs, &dir));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/batch"));
+}
+
+TEST_F(FSFixture, test_ino_placement) {
+    const char *dirs[] = { "/orl_a", "/orl_b", "/orl_c", "/orl_d" };
+    std::set<uint32_t> groups;
+    for (const char *d : dirs) {
+        ASSERT_EQ(OK, fs_mkdir(fs, d));
+        f_stat st;
+        ASSERT_EQ(OK, fs_stat(fs, d, &st));
+        groups.insert((st.inode_num - 1) / fs->ino_group_size);
+    }
+    // Top level directories are spread over the groups
+    ASSERT_EQ(4u, groups.size());
+
+    // Files land next to their directory, batched or not
+    for (const char *d : dirs) {
+        f_stat dir_st;
+        ASSERT_EQ(OK, fs_stat(fs, d, &dir_st));
+        uint32_t group = (dir_st.inode_num - 1) / fs->ino_group_size;
+        std::vector<std::string> names;
+        for (int i=0; i<8; i++) {
+            std::string path = std::string(d) + "/f" + std::to_string(i);
+            ASSERT_EQ(OK, fs_touch(fs, path.c_str()));
+            names.push_back("b" + std::to_string(i));
+        }
+        std::vector<const char *> ptrs;
+        for (auto &s : names)
+            ptrs.push_back(s.c_str());
+        ASSERT_EQ(OK, fs_batch_create(fs, d, ptrs.data(), (uint32_t)ptrs.size(), NULL));
+
+        for (int i=0; i<8; i++) {
+            f_stat st;
+            ASSERT_EQ(OK, fs_stat(fs, (std::string(d) + "/f" + std::to_string(i)).c_str(), &st));
+            ASSERT_EQ(group, (st.inode_num - 1) / fs->ino_group_size);
+            ASSERT_EQ(OK, fs_stat(fs, (std::string(d) + "/b" + std::to_string(i)).c_str(), &st));
+            ASSERT_EQ(group, (st.inode_num - 1) / fs->ino_group_size);
+        }
+    }
+
+    // Group counters agree with the bitmap
+    uint32_t free_total = 0, counted = 0;
+    for (uint32_t g=0; g<INO_GROUPS; g++)
+        counted += fs->ino_group_free[g];
+    for (uint32_t i=0; i<fs->inodes; i++)
+        free_total += bm_getbit(fs->inode_bitmap, i) == 0;
+    ASSERT_EQ(free_total, counted);
+
+    for (const char *d : dirs)
+        ASSERT_EQ(OK, fs_rmdir(fs, d));
+}
+
+TEST_F(FSFixture, test_block_goal) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/bg"));
+    ASSERT_EQ(OK, fs_touch(fs, "/bg/a"));
+    ASSERT_EQ(OK, fs_touch(fs, "/bg/b"));
+    file_handle *a = file_open(fs, "/bg/a", MY_O_WRONLY);
+    file_handle *b = file_open(fs, "/bg/b", MY_O_WRONLY);
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+
+    // Two files growing side by side, one block at a time, past the direct blocks
+    const uint32_t blocks = 24;
+    std::vector<uint8_t> buf(BLOCK_SIZE, 0x5a);
+    for (uint32_t i=0; i<blocks; i++) {
+        ASSERT_EQ(BLOCK_SIZE, file_write(a, buf.data(), BLOCK_SIZE));
+        ASSERT_EQ(BLOCK_SIZE, file_write(b, buf.data(), BLOCK_SIZE));
+    }
+    file_close(a);
+    file_close(b);
+
+    // Each file is a few long runs instead of every other block
+    for (const char *path : { "/bg/a", "/bg/b" }) {
+        f_stat st;
+        ASSERT_EQ(OK, fs_stat(fs, path, &st));
+        inode ino;
+        ASSERT_EQ(OK, ino_read(fs, st.inode_num, &ino));
+        std::vector<uint32_t> map(ino_get_max_block_offset(fs));
+        ASSERT_EQ(OK, ino_get_block_map(fs, &ino, map.data()));
+
+        uint32_t extents = 1;
+        for (uint32_t i=1; i<blocks; i++)
+            extents += map[i] != map[i-1] + 1;
+        ASSERT_LE(extents, 4u);
+        // The hint survives in the inode for the next append
+        ASSERT_EQ(map[blocks-1], ino.alloc_goal);
+    }
+
+    // A free goal is taken as is
+    uint32_t first = bl_alloc(fs);
+    ASSERT_NE(0u, first);
+    ASSERT_EQ(OK, bl_free(fs, first));
+    uint32_t goal = first + 1;
+    while (goal <= fs->blocks && bm_getbit(fs->block_bitmap, goal-1)) // 0-based bitmap index
+        goal++;
+    ASSERT_LE(goal, fs->blocks);
+    ASSERT_EQ(goal, bl_alloc_goal(fs, goal));
+    ASSERT_EQ(OK, bl_free(fs, goal));
+
+    ASSERT_EQ(OK, fs_unlink(fs, "/bg/a"));
+    ASSERT_EQ(OK, fs_unlink(fs, "/bg/b"));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/bg"));
+}
+
+TEST_F(FSFixture, test_defrag) {
+    ASSERT_EQ(OK, fs_mkdir(fs, "/df"));
+    ASSERT_EQ(OK, fs_touch(fs, "/df/a"));
+    f_stat st;
+    ASSERT_EQ(OK, fs_stat(fs, "/df/a", &st));
+
+    // Hand build a file whose blocks alternate with someone else's, past the direct blocks
+    const uint32_t blocks = 20;
+    std::vector<uint32_t> map(ino_get_max_block_offset(fs), 0);
+    std::vector<uint32_t> spacers;
+    std::vector<uint8_t> buf(BLOCK_SIZE);
+    for (uint32_t i=0; i<blocks; i++) {
+        map[i] = bl_alloc(fs);
+        spacers.push_back(bl_alloc(fs));
+        ASSERT_NE(0u, map[i]);
+        memset(buf.data(), (int)(i + 1), BLOCK_SIZE);
+        ASSERT_EQ(OK, dwrite(dd, buf.data(), map[i]));
+    }
+    inode ino;
+    ASSERT_EQ(OK, ino_read(fs, st.inode_num, &ino));
+    ASSERT_EQ(OK, ino_set_block_map(fs, &ino, map.data()));
+    ino.file_size = blocks * BLOCK_SIZE;
+    ASSERT_EQ(OK, ino_write(fs, st.inode_num, &ino));
+
+    frag_report rep_before, rep_after;
+    ASSERT_EQ(OK, fs_frag_report(fs, &rep_before));
+
+    // An open handle sees the moved blocks
+    file_handle *fh = file_open(fs, "/df/a", MY_O_RDONLY);
+    ASSERT_NE(nullptr, fh);
+    ASSERT_EQ(BLOCK_SIZE, file_read(fh, buf.data(), BLOCK_SIZE));
+
+    uint32_t free_before = 0, free_after = 0;
+    for (uint32_t i=0; i<fs->blocks; i++)
+        free_before += bm_getbit(fs->block_bitmap, i) == 0;
+
+    uint32_t before, after;
+    ASSERT_EQ(OK, fs_defrag_file(fs, "/df/a", &before, &after));
+    ASSERT_EQ(blocks, before);
+    ASSERT_EQ(1u, after);
+
+    for (uint32_t i=0; i<fs->blocks; i++)
+        free_after += bm_getbit(fs->block_bitmap, i) == 0;
+    ASSERT_EQ(free_before, free_after);
+
+    for (uint32_t i=1; i<blocks; i++) {
+        ASSERT_EQ(BLOCK_SIZE, file_read(fh, buf.data(), BLOCK_SIZE));
+        ASSERT_EQ((uint8_t)(i + 1), buf[0]);
+        ASSERT_EQ((uint8_t)(i + 1), buf[BLOCK_SIZE-1]);
+    }
+    file_close(fh);
+
+    // The file moved from the 17-32 bucket to the 1 bucket
+    ASSERT_EQ(OK, fs_frag_report(fs, &rep_after));
+    ASSERT_EQ(rep_before.hist[5] - 1, rep_after.hist[5]);
+    ASSERT_EQ(rep_before.hist[0] + 1, rep_after.hist[0]);
+    ASSERT_EQ(rep_before.extents - (blocks - 1), rep_after.extents);
+
+    // Already contiguous, nothing to do, and the tree form goes through every file
+    defrag_stats ds;
+    ASSERT_EQ(OK, fs_defrag(fs, "/df", &ds));
+    ASSERT_EQ(1u, ds.files);
+    ASSERT_EQ(0u, ds.moved);
+    ASSERT_EQ(ErrArg, fs_defrag_file(fs, "/df", NULL, NULL));
+
+    ASSERT_EQ(OK, bl_free_batch(fs, spacers.data(), (uint32_t)spacers.size()));
+    ASSERT_EQ(OK, fs_unlink(fs, "/df/a"));
+    ASSERT_EQ(OK, fs_rmdir(fs, "/df"));
+}